@@ -0,0 +1,723 @@
+/*
+ * QEMU block driver for virtual Xbox DVD images (shadows a local directory)
+ *
+ * Presents a host directory, such as an extracted game, as a read-only
+ * XDVDFS disc in the layout of an XISO image. The volume descriptor and all
+ * directories are built in memory when the image is opened, file contents
+ * are read from the host files as the guest asks for them.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <dirent.h>
+#include "qapi/error.h"
+#include "block/block_int.h"
+#include "qemu/module.h"
+#include "qemu/option.h"
+#include "qemu/bswap.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qapi/qmp/qdict.h"
+
+/* #define DEBUG */
+
+#ifdef DEBUG
+#define DPRINTF(fmt, ...) fprintf(stderr, "xdvdfs: " fmt, ## __VA_ARGS__)
+#else
+#define DPRINTF(fmt, ...) do { } while (0)
+#endif
+
+#define XDVDFS_SECTOR_SIZE 2048
+
+/* Sector of the volume descriptor, the sectors before it are left empty */
+#define XDVDFS_VOLUME_SECTOR 32
+
+#define XDVDFS_MAGIC "MICROSOFT*XBOX*MEDIA"
+
+#define XDVDFS_ATTR_DIRECTORY 0x10
+#define XDVDFS_ATTR_ARCHIVE   0x20
+
+#define XDVDFS_MAX_NAME_LEN 255
+
+/* Host files kept open at the same time */
+#define XDVDFS_OPEN_FILES 8
+
+/* 100ns intervals between 1601-01-01 and 1970-01-01 */
+#define FILETIME_UNIX_EPOCH 116444736000000000ULL
+
+typedef struct QEMU_PACKED XDVDFSVolume {
+    char     magic[20];
+    uint32_t root_sector;
+    uint32_t root_size;
+    uint64_t timestamp;
+    uint8_t  reserved[1992];
+    char     magic_end[20];
+} XDVDFSVolume;
+
+QEMU_BUILD_BUG_ON(sizeof(XDVDFSVolume) != XDVDFS_SECTOR_SIZE);
+
+/*
+ * Directories are binary trees of these entries, sorted by case-insensitive
+ * name. Each entry is followed by its name and padded to 4 bytes, and no
+ * entry crosses a sector boundary.
+ */
+typedef struct QEMU_PACKED XDVDFSDirent {
+    uint16_t left;          /* offset of the left subtree in dwords, or 0 */
+    uint16_t right;         /* offset of the right subtree in dwords, or 0 */
+    uint32_t sector;
+    uint32_t size;
+    uint8_t  attributes;
+    uint8_t  name_len;
+} XDVDFSDirent;
+
+typedef struct XDVDFSNode {
+    char      *name;
+    char      *path;
+    bool      is_dir;
+    uint32_t  size;         /* file size, or size of the directory table */
+    uint32_t  sector;
+    uint32_t  offset;       /* offset of the entry in its parent directory */
+    GPtrArray *children;    /* directories only, sorted by name */
+} XDVDFSNode;
+
+typedef struct XDVDFSFile {
+    uint64_t offset;        /* position in the image */
+    uint32_t size;
+    char     *path;
+    int      fd;
+} XDVDFSFile;
+
+typedef struct BDRVXDVDFSState {
+    CoMutex    lock;
+
+    /* Everything before the first file, up to and including directories */
+    uint8_t    *meta;
+    uint64_t   meta_size;
+
+    /* Files with contents, in image order */
+    XDVDFSFile *files;
+    uint32_t   num_files;
+
+    XDVDFSFile *open_files[XDVDFS_OPEN_FILES];
+    unsigned int next_open_file;
+} BDRVXDVDFSState;
+
+static QemuOptsList runtime_opts = {
+    .name = "xdvdfs",
+    .head = QTAILQ_HEAD_INITIALIZER(runtime_opts.head),
+    .desc = {
+        {
+            .name = "dir",
+            .type = QEMU_OPT_STRING,
+            .help = "Host directory to map to the xdvdfs device",
+        },
+        { /* end of list */ }
+    },
+};
+
+/*******************************************************************************
+ * Directory scan
+ ******************************************************************************/
+
+static int xdvdfs_compare_names(const char *a, const char *b)
+{
+    while (*a && g_ascii_toupper(*a) == g_ascii_toupper(*b)) {
+        a++;
+        b++;
+    }
+    return (unsigned char)g_ascii_toupper(*a)
+           - (unsigned char)g_ascii_toupper(*b);
+}
+
+static gint xdvdfs_compare_nodes(gconstpointer a, gconstpointer b)
+{
+    const XDVDFSNode *na = *(XDVDFSNode * const *)a;
+    const XDVDFSNode *nb = *(XDVDFSNode * const *)b;
+
+    return xdvdfs_compare_names(na->name, nb->name);
+}
+
+static void xdvdfs_free_node(XDVDFSNode *node)
+{
+    if (node->children) {
+        g_ptr_array_free(node->children, true);
+    }
+    g_free(node->name);
+    g_free(node->path);
+    g_free(node);
+}
+
+static XDVDFSNode *xdvdfs_new_node(const char *name, const char *path,
+                                   bool is_dir)
+{
+    XDVDFSNode *node = g_new0(XDVDFSNode, 1);
+
+    node->name = g_strdup(name);
+    node->path = g_strdup(path);
+    node->is_dir = is_dir;
+    if (is_dir) {
+        node->children = g_ptr_array_new_with_free_func(
+                             (GDestroyNotify)xdvdfs_free_node);
+    }
+    return node;
+}
+
+static int xdvdfs_scan_dir(XDVDFSNode *dir, Error **errp)
+{
+    struct dirent *entry;
+    DIR *d;
+    unsigned int i;
+    int ret = 0;
+
+    d = opendir(dir->path);
+    if (!d) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not open directory '%s'",
+                         dir->path);
+        return ret;
+    }
+
+    while ((entry = readdir(d))) {
+        XDVDFSNode *node;
+        struct stat st;
+        char *path;
+
+        if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+            continue;
+        }
+
+        path = g_build_filename(dir->path, entry->d_name, NULL);
+        if (stat(path, &st) < 0) {
+            ret = -errno;
+            error_setg_errno(errp, -ret, "Could not stat '%s'", path);
+            g_free(path);
+            break;
+        }
+
+        if (strlen(entry->d_name) > XDVDFS_MAX_NAME_LEN) {
+            error_setg(errp, "File name of '%s' is too long", path);
+            ret = -ENAMETOOLONG;
+            g_free(path);
+            break;
+        }
+
+        if (S_ISDIR(st.st_mode)) {
+            node = xdvdfs_new_node(entry->d_name, path, true);
+            g_ptr_array_add(dir->children, node);
+            ret = xdvdfs_scan_dir(node, errp);
+        } else if (S_ISREG(st.st_mode)) {
+            if (st.st_size > UINT32_MAX) {
+                error_setg(errp, "'%s' is too large for an XDVDFS image",
+                           path);
+                ret = -EFBIG;
+            } else {
+                node = xdvdfs_new_node(entry->d_name, path, false);
+                node->size = st.st_size;
+                g_ptr_array_add(dir->children, node);
+            }
+        } else {
+            warn_report("xdvdfs: skipping '%s', not a file or directory",
+                        path);
+        }
+
+        g_free(path);
+        if (ret < 0) {
+            break;
+        }
+    }
+    closedir(d);
+
+    if (ret < 0) {
+        return ret;
+    }
+
+    g_ptr_array_sort(dir->children, xdvdfs_compare_nodes);
+    for (i = 1; i < dir->children->len; i++) {
+        XDVDFSNode *a = g_ptr_array_index(dir->children, i - 1);
+        XDVDFSNode *b = g_ptr_array_index(dir->children, i);
+        if (!xdvdfs_compare_names(a->name, b->name)) {
+            error_setg(errp, "'%s' and '%s' only differ in case",
+                       a->path, b->path);
+            return -EINVAL;
+        }
+    }
+
+    return 0;
+}
+
+/*******************************************************************************
+ * Image layout
+ ******************************************************************************/
+
+static uint32_t xdvdfs_dirent_size(XDVDFSNode *node)
+{
+    return ROUND_UP(sizeof(XDVDFSDirent) + strlen(node->name), 4);
+}
+
+/*
+ * Place the entries of children[lo, hi) as a balanced tree, root first, as
+ * the guest starts each lookup at the first entry of a directory.
+ */
+static void xdvdfs_place_entries(GPtrArray *children, int lo, int hi,
+                                 uint32_t *pos)
+{
+    XDVDFSNode *node;
+    uint32_t size;
+    int mid;
+
+    if (lo >= hi) {
+        return;
+    }
+
+    mid = (lo + hi) / 2;
+    node = g_ptr_array_index(children, mid);
+    size = xdvdfs_dirent_size(node);
+    if (*pos % XDVDFS_SECTOR_SIZE + size > XDVDFS_SECTOR_SIZE) {
+        *pos = ROUND_UP(*pos, XDVDFS_SECTOR_SIZE);
+    }
+    node->offset = *pos;
+    *pos += size;
+
+    xdvdfs_place_entries(children, lo, mid, pos);
+    xdvdfs_place_entries(children, mid + 1, hi, pos);
+}
+
+/*
+ * Assign sectors to this directory and the ones below it
+ */
+static int xdvdfs_layout_dirs(XDVDFSNode *dir, uint64_t *next_sector,
+                              Error **errp)
+{
+    uint32_t pos = 0;
+    unsigned int i;
+    int ret;
+
+    xdvdfs_place_entries(dir->children, 0, dir->children->len, &pos);
+    if (pos / 4 > UINT16_MAX) {
+        error_setg(errp, "Directory '%s' has too many entries", dir->path);
+        return -EFBIG;
+    }
+
+    /* Empty directories have no table */
+    dir->size = ROUND_UP(pos, XDVDFS_SECTOR_SIZE);
+    dir->sector = dir->size ? *next_sector : 0;
+    *next_sector += dir->size / XDVDFS_SECTOR_SIZE;
+
+    for (i = 0; i < dir->children->len; i++) {
+        XDVDFSNode *node = g_ptr_array_index(dir->children, i);
+        if (node->is_dir) {
+            ret = xdvdfs_layout_dirs(node, next_sector, errp);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Assign sectors to the files below this directory, handing their paths
+ * over to the file table
+ */
+static void xdvdfs_layout_files(BDRVXDVDFSState *s, XDVDFSNode *dir,
+                                uint64_t *next_sector)
+{
+    unsigned int i;
+
+    for (i = 0; i < dir->children->len; i++) {
+        XDVDFSNode *node = g_ptr_array_index(dir->children, i);
+        XDVDFSFile *file;
+
+        if (node->is_dir) {
+            continue;
+        }
+        if (node->size == 0) {
+            node->sector = 0;
+            continue;
+        }
+
+        node->sector = *next_sector;
+        *next_sector += DIV_ROUND_UP(node->size, XDVDFS_SECTOR_SIZE);
+
+        s->files = g_renew(XDVDFSFile, s->files, s->num_files + 1);
+        file = &s->files[s->num_files++];
+        file->offset = (uint64_t)node->sector * XDVDFS_SECTOR_SIZE;
+        file->size = node->size;
+        file->path = node->path;
+        file->fd = -1;
+        node->path = NULL;
+    }
+
+    for (i = 0; i < dir->children->len; i++) {
+        XDVDFSNode *node = g_ptr_array_index(dir->children, i);
+        if (node->is_dir) {
+            xdvdfs_layout_files(s, node, next_sector);
+        }
+    }
+}
+
+/*
+ * Write the entries of children[lo, hi) to the directory table, returns the
+ * dword offset of the subtree root
+ */
+static uint16_t xdvdfs_write_entries(uint8_t *table, GPtrArray *children,
+                                     int lo, int hi)
+{
+    XDVDFSNode *node;
+    XDVDFSDirent dirent;
+    int mid;
+
+    if (lo >= hi) {
+        return 0;
+    }
+
+    mid = (lo + hi) / 2;
+    node = g_ptr_array_index(children, mid);
+
+    dirent.left = cpu_to_le16(xdvdfs_write_entries(table, children, lo, mid));
+    dirent.right = cpu_to_le16(xdvdfs_write_entries(table, children,
+                                                    mid + 1, hi));
+    dirent.sector = cpu_to_le32(node->sector);
+    dirent.size = cpu_to_le32(node->size);
+    dirent.attributes = node->is_dir ? XDVDFS_ATTR_DIRECTORY
+                                     : XDVDFS_ATTR_ARCHIVE;
+    dirent.name_len = strlen(node->name);
+    memcpy(&table[node->offset], &dirent, sizeof(dirent));
+    memcpy(&table[node->offset + sizeof(dirent)], node->name,
+           dirent.name_len);
+
+    return node->offset / 4;
+}
+
+static void xdvdfs_write_dirs(BDRVXDVDFSState *s, XDVDFSNode *dir)
+{
+    unsigned int i;
+
+    if (dir->size) {
+        uint8_t *table = &s->meta[(uint64_t)dir->sector * XDVDFS_SECTOR_SIZE];
+
+        /* Unused space in directory tables is filled with 0xff */
+        memset(table, 0xff, dir->size);
+        xdvdfs_write_entries(table, dir->children, 0, dir->children->len);
+    }
+
+    for (i = 0; i < dir->children->len; i++) {
+        XDVDFSNode *node = g_ptr_array_index(dir->children, i);
+        if (node->is_dir) {
+            xdvdfs_write_dirs(s, node);
+        }
+    }
+}
+
+static int xdvdfs_build_image(BlockDriverState *bs, const char *dirname,
+                              Error **errp)
+{
+    BDRVXDVDFSState *s = bs->opaque;
+    XDVDFSVolume *volume;
+    XDVDFSNode *root;
+    uint64_t next_sector;
+    struct stat st;
+    int ret;
+
+    if (stat(dirname, &st) < 0) {
+        ret = -errno;
+        error_setg_errno(errp, -ret, "Could not stat '%s'", dirname);
+        return ret;
+    }
+    if (!S_ISDIR(st.st_mode)) {
+        error_setg(errp, "'%s' is not a directory", dirname);
+        return -ENOTDIR;
+    }
+
+    root = xdvdfs_new_node("", dirname, true);
+    ret = xdvdfs_scan_dir(root, errp);
+    if (ret < 0) {
+        goto out;
+    }
+
+    next_sector = XDVDFS_VOLUME_SECTOR + 1;
+    ret = xdvdfs_layout_dirs(root, &next_sector, errp);
+    if (ret < 0) {
+        goto out;
+    }
+    s->meta_size = next_sector * XDVDFS_SECTOR_SIZE;
+
+    xdvdfs_layout_files(s, root, &next_sector);
+    if (next_sector > UINT32_MAX) {
+        error_setg(errp, "'%s' is too large for an XDVDFS image", dirname);
+        ret = -EFBIG;
+        goto out;
+    }
+
+    s->meta = g_malloc0(s->meta_size);
+    volume = (XDVDFSVolume *)&s->meta[XDVDFS_VOLUME_SECTOR
+                                      * XDVDFS_SECTOR_SIZE];
+    memcpy(volume->magic, XDVDFS_MAGIC, sizeof(volume->magic));
+    memcpy(volume->magic_end, XDVDFS_MAGIC, sizeof(volume->magic_end));
+    volume->root_sector = cpu_to_le32(root->sector);
+    volume->root_size = cpu_to_le32(root->size);
+    volume->timestamp = cpu_to_le64(st.st_mtime * 10000000ULL
+                                    + FILETIME_UNIX_EPOCH);
+    xdvdfs_write_dirs(s, root);
+
+    bs->total_sectors = next_sector * (XDVDFS_SECTOR_SIZE / BDRV_SECTOR_SIZE);
+
+    DPRINTF("%s: %" PRIu32 " files, %" PRIu64 " bytes of directories, "
+            "%" PRIu64 " sectors\n", dirname, s->num_files, s->meta_size,
+            next_sector);
+
+out:
+    xdvdfs_free_node(root);
+    return ret;
+}
+
+/*******************************************************************************
+ * Block driver
+ ******************************************************************************/
+
+static void xdvdfs_parse_filename(const char *filename, QDict *options,
+                                  Error **errp)
+{
+    if (!strstart(filename, "xdvdfs:", &filename)) {
+        error_setg(errp, "File name string must start with 'xdvdfs:'");
+        return;
+    }
+
+    qdict_put_str(options, "dir", filename);
+}
+
+static void xdvdfs_close(BlockDriverState *bs)
+{
+    BDRVXDVDFSState *s = bs->opaque;
+    uint32_t i;
+
+    for (i = 0; i < s->num_files; i++) {
+        if (s->files[i].fd >= 0) {
+            qemu_close(s->files[i].fd);
+        }
+        g_free(s->files[i].path);
+    }
+    g_free(s->files);
+    g_free(s->meta);
+}
+
+static int xdvdfs_open(BlockDriverState *bs, QDict *options, int flags,
+                       Error **errp)
+{
+    BDRVXDVDFSState *s = bs->opaque;
+    const char *dirname;
+    QemuOpts *opts;
+    Error *local_err = NULL;
+    int ret;
+
+    opts = qemu_opts_create(&runtime_opts, NULL, 0, &error_abort);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    dirname = qemu_opt_get(opts, "dir");
+    if (!dirname) {
+        error_setg(errp, "xdvdfs block driver requires a 'dir' option");
+        ret = -EINVAL;
+        goto fail;
+    }
+
+    ret = bdrv_apply_auto_read_only(bs, "xdvdfs images are read-only", errp);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = xdvdfs_build_image(bs, dirname, errp);
+    if (ret < 0) {
+        xdvdfs_close(bs);
+        goto fail;
+    }
+
+    qemu_co_mutex_init(&s->lock);
+
+fail:
+    qemu_opts_del(opts);
+    return ret;
+}
+
+static void xdvdfs_refresh_limits(BlockDriverState *bs, Error **errp)
+{
+    bs->bl.request_alignment = BDRV_SECTOR_SIZE; /* No sub-sector I/O */
+}
+
+/*
+ * Find the last file starting at or before offset
+ */
+static XDVDFSFile *xdvdfs_find_file(BDRVXDVDFSState *s, uint64_t offset)
+{
+    uint32_t lo = 0, hi = s->num_files;
+
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (s->files[mid].offset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo ? &s->files[lo - 1] : NULL;
+}
+
+static int xdvdfs_file_fd(BDRVXDVDFSState *s, XDVDFSFile *file)
+{
+    XDVDFSFile **slot;
+
+    if (file->fd >= 0) {
+        return file->fd;
+    }
+
+    /* Close the least recently opened file to make room */
+    slot = &s->open_files[s->next_open_file];
+    if (*slot) {
+        qemu_close((*slot)->fd);
+        (*slot)->fd = -1;
+    }
+
+    file->fd = qemu_open(file->path, O_RDONLY | O_BINARY);
+    if (file->fd < 0) {
+        *slot = NULL;
+        return -errno;
+    }
+
+    *slot = file;
+    s->next_open_file = (s->next_open_file + 1) % XDVDFS_OPEN_FILES;
+    return file->fd;
+}
+
+static int xdvdfs_read_file(BDRVXDVDFSState *s, XDVDFSFile *file,
+                            uint64_t offset, uint8_t *buf, uint64_t bytes)
+{
+    int fd = xdvdfs_file_fd(s, file);
+
+    if (fd < 0) {
+        error_report("xdvdfs: could not open '%s': %s", file->path,
+                     strerror(-fd));
+        return fd;
+    }
+
+    /* Serialized by s->lock, so seeking is fine and works on Win32 too */
+    if (lseek(fd, offset, SEEK_SET) != offset) {
+        return -errno;
+    }
+
+    while (bytes > 0) {
+        ssize_t len = read(fd, buf, bytes);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -errno;
+        }
+        if (len == 0) {
+            /* The file shrank since the image was opened */
+            memset(buf, 0, bytes);
+            break;
+        }
+        buf += len;
+        bytes -= len;
+    }
+
+    return 0;
+}
+
+static int xdvdfs_read(BDRVXDVDFSState *s, uint64_t offset, uint8_t *buf,
+                       uint64_t bytes)
+{
+    while (bytes > 0) {
+        uint64_t len;
+        int ret;
+
+        if (offset < s->meta_size) {
+            len = MIN(bytes, s->meta_size - offset);
+            memcpy(buf, &s->meta[offset], len);
+        } else {
+            XDVDFSFile *file = xdvdfs_find_file(s, offset);
+
+            if (file && offset < file->offset + file->size) {
+                len = MIN(bytes, file->offset + file->size - offset);
+                ret = xdvdfs_read_file(s, file, offset - file->offset,
+                                       buf, len);
+                if (ret < 0) {
+                    return ret;
+                }
+            } else {
+                /* Padding up to the next file */
+                XDVDFSFile *next = file ? file + 1 : s->files;
+                len = bytes;
+                if (next < s->files + s->num_files) {
+                    len = MIN(len, next->offset - offset);
+                }
+                memset(buf, 0, len);
+            }
+        }
+
+        buf += len;
+        offset += len;
+        bytes -= len;
+    }
+
+    return 0;
+}
+
+static int coroutine_fn
+xdvdfs_co_preadv(BlockDriverState *bs, uint64_t offset, uint64_t bytes,
+                 QEMUIOVector *qiov, int flags)
+{
+    BDRVXDVDFSState *s = bs->opaque;
+    void *buf;
+    int ret;
+
+    buf = g_try_malloc(bytes);
+    if (bytes && buf == NULL) {
+        return -ENOMEM;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+    ret = xdvdfs_read(s, offset, buf, bytes);
+    qemu_co_mutex_unlock(&s->lock);
+
+    qemu_iovec_from_buf(qiov, 0, buf, bytes);
+    g_free(buf);
+
+    return ret;
+}
+
+static const char *const xdvdfs_strong_runtime_opts[] = {
+    "dir",
+
+    NULL
+};
+
+static BlockDriver bdrv_xdvdfs = {
+    .format_name            = "xdvdfs",
+    .protocol_name          = "xdvdfs",
+    .instance_size          = sizeof(BDRVXDVDFSState),
+
+    .bdrv_parse_filename    = xdvdfs_parse_filename,
+    .bdrv_file_open         = xdvdfs_open,
+    .bdrv_refresh_limits    = xdvdfs_refresh_limits,
+    .bdrv_close             = xdvdfs_close,
+
+    .bdrv_co_preadv         = xdvdfs_co_preadv,
+
+    .strong_runtime_opts    = xdvdfs_strong_runtime_opts,
+};
+
+static void bdrv_xdvdfs_init(void)
+{
+    bdrv_register(&bdrv_xdvdfs);
+}
+
+block_init(bdrv_xdvdfs_init);
@@ -389,6 +389,22 @@ STEXI
 @item info usbhost
 @findex info usbhost
 Show host USB devices.
+ETEXI
+
+    {
+        .name       = "mcpx-apu",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show MCPX APU load of the last frame",
+        .cmd        = hmp_info_mcpx_apu,
+    },
+
+STEXI
+@item info mcpx-apu
+@findex info mcpx-apu
+Show the MCPX APU load of the last frame: active voices, decoded samples,
+GP and EP DSP instructions, cycles and DMA traffic, how far the setup engine
+lags the virtual clock and the host output buffer fill level.
 ETEXI
 
     {
@@ -34,6 +34,403 @@
 
 static void ide_atapi_cmd_read_dma_cb(void *opaque, int ret);
 
+/*
+ * ATAPI readahead
+ *
+ * Data reads of the drive go through a small cache of sector segments.
+ * Once the guest reads sequentially, the segments following its position
+ * are fetched in the background, so streaming reads of small chunks are
+ * served from memory rather than waiting on the block layer each time.
+ * Completion of a read can also be held back to model the seek time and
+ * read rate of a real drive.
+ */
+
+/* Sectors in a segment, the most a single data read asks for */
+#define ATAPI_RA_SEGMENT_SECTORS (IDE_DMA_BUF_SECTORS / 4)
+
+typedef struct ATAPIReadaheadAIOCB {
+    BlockAIOCB common;
+    ATAPIReadahead *ra;
+    int lba;
+    int nb_sectors;
+    QEMUIOVector *qiov;
+    int64_t deadline;
+    bool done;
+    int ret;
+} ATAPIReadaheadAIOCB;
+
+typedef struct ATAPIReadaheadSegment {
+    ATAPIReadahead *ra;
+    int lba;                /* first sector, -1 if unused */
+    int nb_sectors;
+    bool loading;
+    bool demand;            /* loaded for the pending read, not ahead of it */
+    uint64_t generation;
+    uint64_t last_used;
+    uint8_t *buf;
+    QEMUIOVector qiov;
+} ATAPIReadaheadSegment;
+
+struct ATAPIReadahead {
+    IDEState *s;
+    ATAPIReadaheadSegment *segments;
+    unsigned int num_segments;
+    uint64_t generation;    /* bumped when the medium changes */
+    uint64_t use_count;
+    int next_lba;           /* sector after the previous read */
+
+    /* The drive has one read in progress at most */
+    ATAPIReadaheadAIOCB *pending;
+    QEMUTimer *timer;
+
+    uint32_t seek_latency_us;
+    uint32_t read_rate_kib;
+};
+
+static void atapi_ra_cancel_async(BlockAIOCB *acb);
+
+static const AIOCBInfo atapi_ra_aiocb_info = {
+    .aiocb_size         = sizeof(ATAPIReadaheadAIOCB),
+    .cancel_async       = atapi_ra_cancel_async,
+};
+
+static void atapi_ra_serve(ATAPIReadahead *ra);
+
+/*
+ * Segment holding a sector, loaded or still loading
+ */
+static ATAPIReadaheadSegment *atapi_ra_find(ATAPIReadahead *ra, int lba)
+{
+    unsigned int i;
+
+    for (i = 0; i < ra->num_segments; i++) {
+        ATAPIReadaheadSegment *seg = &ra->segments[i];
+        if (seg->lba != -1 && lba >= seg->lba &&
+            lba < seg->lba + seg->nb_sectors) {
+            return seg;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Least recently used segment that is not loading and not needed by the
+ * pending read
+ */
+static ATAPIReadaheadSegment *atapi_ra_get_segment(ATAPIReadahead *ra)
+{
+    ATAPIReadaheadAIOCB *acb = ra->pending;
+    ATAPIReadaheadSegment *best = NULL;
+    unsigned int i;
+
+    for (i = 0; i < ra->num_segments; i++) {
+        ATAPIReadaheadSegment *seg = &ra->segments[i];
+        if (seg->loading) {
+            continue;
+        }
+        if (seg->lba == -1) {
+            return seg;
+        }
+        if (acb && seg->lba < acb->lba + acb->nb_sectors &&
+            acb->lba < seg->lba + seg->nb_sectors) {
+            continue;
+        }
+        if (!best || seg->last_used < best->last_used) {
+            best = seg;
+        }
+    }
+    return best;
+}
+
+static void atapi_ra_load_cb(void *opaque, int ret)
+{
+    ATAPIReadaheadSegment *seg = opaque;
+    ATAPIReadahead *ra = seg->ra;
+    ATAPIReadaheadAIOCB *acb = ra->pending;
+
+    seg->loading = false;
+    if (ret < 0 || seg->generation != ra->generation) {
+        seg->lba = -1;
+    }
+
+    if (acb && !acb->done) {
+        if (ret < 0 && seg->demand) {
+            acb->ret = ret;
+            acb->done = true;
+            timer_mod(ra->timer, 0);
+        } else {
+            atapi_ra_serve(ra);
+        }
+    }
+}
+
+static void atapi_ra_load(ATAPIReadahead *ra, ATAPIReadaheadSegment *seg,
+                          int lba, int nb_sectors, bool demand)
+{
+    trace_ide_atapi_readahead_load(ra->s, lba, nb_sectors, demand);
+
+    seg->lba = lba;
+    seg->nb_sectors = nb_sectors;
+    seg->loading = true;
+    seg->demand = demand;
+    seg->generation = ra->generation;
+    seg->last_used = ++ra->use_count;
+    qemu_iovec_init_buf(&seg->qiov, seg->buf,
+                        nb_sectors * ATAPI_SECTOR_SIZE);
+    blk_aio_preadv(ra->s->blk, (int64_t)lba << ATAPI_SECTOR_BITS,
+                   &seg->qiov, 0, atapi_ra_load_cb, seg);
+}
+
+/*
+ * Keep the segments following a sequential read loaded
+ */
+static void atapi_ra_prefetch(ATAPIReadahead *ra, int lba)
+{
+    int last = ra->s->nb_sectors >> 2;
+    unsigned int i;
+
+    /* One segment is left for reads that miss */
+    for (i = 1; i < ra->num_segments && lba < last; i++) {
+        ATAPIReadaheadSegment *seg = atapi_ra_find(ra, lba);
+        int n;
+
+        if (seg) {
+            lba = seg->lba + seg->nb_sectors;
+            continue;
+        }
+
+        seg = atapi_ra_get_segment(ra);
+        if (!seg) {
+            return;
+        }
+        n = MIN(ATAPI_RA_SEGMENT_SECTORS, last - lba);
+        atapi_ra_load(ra, seg, lba, n, false);
+        lba += n;
+    }
+}
+
+static void atapi_ra_complete(void *opaque)
+{
+    ATAPIReadahead *ra = opaque;
+    ATAPIReadaheadAIOCB *acb = ra->pending;
+
+    ra->pending = NULL;
+    blk_dec_in_flight(ra->s->blk);
+    acb->common.cb(acb->common.opaque, acb->ret);
+    qemu_aio_unref(acb);
+}
+
+/* Loads in flight are left to fill the cache */
+static void atapi_ra_cancel_async(BlockAIOCB *blockacb)
+{
+    ATAPIReadaheadAIOCB *acb = container_of(blockacb, ATAPIReadaheadAIOCB,
+                                            common);
+    ATAPIReadahead *ra = acb->ra;
+
+    if (ra->pending == acb) {
+        acb->ret = -ECANCELED;
+        acb->done = true;
+        timer_mod(ra->timer, 0);
+    }
+}
+
+/*
+ * Copy the pending read out of the cache once all of it is loaded,
+ * otherwise get the first sectors it misses loaded
+ */
+static void atapi_ra_serve(ATAPIReadahead *ra)
+{
+    ATAPIReadaheadAIOCB *acb = ra->pending;
+    ATAPIReadaheadSegment *seg;
+    int end = acb->lba + acb->nb_sectors;
+    size_t offset = 0;
+    int lba = acb->lba;
+
+    while (lba < end) {
+        seg = atapi_ra_find(ra, lba);
+        if (!seg) {
+            break;
+        }
+        if (seg->loading) {
+            /* Continued from atapi_ra_load_cb */
+            return;
+        }
+        lba = seg->lba + seg->nb_sectors;
+    }
+
+    if (lba < end) {
+        seg = atapi_ra_get_segment(ra);
+        if (seg) {
+            atapi_ra_load(ra, seg, lba, end - lba, true);
+        }
+        /* Otherwise retried when one of the loads in flight completes */
+        return;
+    }
+
+    for (lba = acb->lba; lba < end; ) {
+        int n;
+
+        seg = atapi_ra_find(ra, lba);
+        n = MIN(end, seg->lba + seg->nb_sectors) - lba;
+        qemu_iovec_from_buf(acb->qiov, offset,
+                            seg->buf + (lba - seg->lba) * ATAPI_SECTOR_SIZE,
+                            n * ATAPI_SECTOR_SIZE);
+        seg->last_used = ++ra->use_count;
+        offset += n * ATAPI_SECTOR_SIZE;
+        lba += n;
+    }
+
+    acb->ret = 0;
+    acb->done = true;
+    timer_mod(ra->timer, acb->deadline);
+}
+
+/*
+ * Start a read of nb_sectors from lba, completed through cb. Reads go
+ * straight to the block layer when readahead is disabled.
+ */
+static BlockAIOCB *atapi_readv(IDEState *s, int lba, QEMUIOVector *qiov,
+                               int nb_sectors, BlockCompletionFunc *cb,
+                               void *opaque)
+{
+    ATAPIReadahead *ra = s->readahead;
+    ATAPIReadaheadAIOCB *acb;
+    bool sequential;
+
+    if (!ra) {
+        return ide_buffered_readv(s, (int64_t)lba << 2, qiov, nb_sectors * 4,
+                                  cb, opaque);
+    }
+
+    assert(!ra->pending);
+    assert(nb_sectors <= ATAPI_RA_SEGMENT_SECTORS);
+
+    sequential = lba == ra->next_lba;
+    ra->next_lba = lba + nb_sectors;
+    trace_ide_atapi_readahead_read(s, lba, nb_sectors, sequential);
+
+    acb = blk_aio_get(&atapi_ra_aiocb_info, s->blk, cb, opaque);
+    acb->ra = ra;
+    acb->lba = lba;
+    acb->nb_sectors = nb_sectors;
+    acb->qiov = qiov;
+    acb->done = false;
+    acb->ret = 0;
+
+    /*
+     * Modelled drive timing. This runs on the realtime clock so that
+     * draining the drive never waits on a stopped VM.
+     */
+    acb->deadline = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    if (!sequential) {
+        acb->deadline += ra->seek_latency_us * SCALE_US;
+    }
+    if (ra->read_rate_kib) {
+        acb->deadline += (int64_t)nb_sectors * ATAPI_SECTOR_SIZE
+                         * NANOSECONDS_PER_SECOND
+                         / (ra->read_rate_kib * 1024LL);
+    }
+
+    ra->pending = acb;
+    blk_inc_in_flight(s->blk);
+
+    atapi_ra_serve(ra);
+    if (sequential) {
+        atapi_ra_prefetch(ra, lba + nb_sectors);
+    }
+
+    return &acb->common;
+}
+
+void ide_atapi_readahead_init(IDEState *s, uint32_t size_kib,
+                              uint32_t seek_latency_us,
+                              uint32_t read_rate_kib)
+{
+    size_t segment_size = ATAPI_RA_SEGMENT_SECTORS * ATAPI_SECTOR_SIZE;
+    ATAPIReadahead *ra;
+    unsigned int i;
+
+    if (!size_kib && !seek_latency_us && !read_rate_kib) {
+        return;
+    }
+
+    ra = g_new0(ATAPIReadahead, 1);
+    ra->s = s;
+    ra->next_lba = -1;
+    ra->seek_latency_us = seek_latency_us;
+    ra->read_rate_kib = read_rate_kib;
+
+    /* Without readahead a single segment is used to delay reads */
+    ra->num_segments = size_kib ? MAX(2, size_kib * 1024ULL / segment_size)
+                                : 1;
+    ra->segments = g_new0(ATAPIReadaheadSegment, ra->num_segments);
+    for (i = 0; i < ra->num_segments; i++) {
+        ra->segments[i].ra = ra;
+        ra->segments[i].lba = -1;
+        ra->segments[i].buf = blk_blockalign(s->blk, segment_size);
+    }
+
+    ra->timer = aio_timer_new(blk_get_aio_context(s->blk), QEMU_CLOCK_REALTIME,
+                              SCALE_NS, atapi_ra_complete, ra);
+    s->readahead = ra;
+}
+
+/*
+ * Complete the pending DMA read with -ECANCELED right away, like
+ * ide_cancel_dma_sync does for buffered requests, so that stopping the
+ * DMA never waits for the backend or the modelled drive timing
+ */
+void ide_atapi_readahead_cancel_dma(IDEState *s)
+{
+    ATAPIReadahead *ra = s->readahead;
+
+    if (!ra || !ra->pending || s->bus->dma->aiocb != &ra->pending->common) {
+        return;
+    }
+
+    timer_del(ra->timer);
+    ra->pending->ret = -ECANCELED;
+    ra->pending->done = true;
+    atapi_ra_complete(ra);
+}
+
+void ide_atapi_readahead_invalidate(IDEState *s)
+{
+    ATAPIReadahead *ra = s->readahead;
+    unsigned int i;
+
+    if (!ra) {
+        return;
+    }
+
+    /* Loads in flight are dropped when they complete */
+    ra->generation++;
+    ra->next_lba = -1;
+    for (i = 0; i < ra->num_segments; i++) {
+        ra->segments[i].lba = -1;
+    }
+}
+
+void ide_atapi_readahead_exit(IDEState *s)
+{
+    ATAPIReadahead *ra = s->readahead;
+    unsigned int i;
+
+    if (!ra) {
+        return;
+    }
+
+    blk_drain(s->blk);
+    timer_del(ra->timer);
+    timer_free(ra->timer);
+    for (i = 0; i < ra->num_segments; i++) {
+        qemu_vfree(ra->segments[i].buf);
+    }
+    g_free(ra->segments);
+    g_free(ra);
+    s->readahead = NULL;
+}
+
 static void padstr8(uint8_t *buf, int buf_size, const char *src)
 {
     int i;
@@ -189,8 +586,7 @@ static int cd_read_sector(IDEState *s)
     block_acct_start(blk_get_stats(s->blk), &s->acct,
                      ATAPI_SECTOR_SIZE, BLOCK_ACCT_READ);
 
-    ide_buffered_readv(s, (int64_t)s->lba << 2, &s->qiov, 4,
-                       cd_read_sector_cb, s);
+    atapi_readv(s, s->lba, &s->qiov, 1, cd_read_sector_cb, s);
 
     s->status |= BUSY_STAT;
     return 0;
@@ -423,9 +819,8 @@ static void ide_atapi_cmd_read_dma_cb(void *opaque, int ret)
     qemu_iovec_init_buf(&s->bus->dma->qiov, s->io_buffer + data_offset,
                         n * ATAPI_SECTOR_SIZE);
 
-    s->bus->dma->aiocb = ide_buffered_readv(s, (int64_t)s->lba << 2,
-                                            &s->bus->dma->qiov, n * 4,
-                                            ide_atapi_cmd_read_dma_cb, s);
+    s->bus->dma->aiocb = atapi_readv(s, s->lba, &s->bus->dma->qiov, n,
+                                     ide_atapi_cmd_read_dma_cb, s);
     return;
 
 eot:
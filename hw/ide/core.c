@@ -701,6 +701,9 @@ void ide_cancel_dma_sync(IDEState *s)
         req->orphaned = true;
     }
 
+    /* Reads of the ATAPI readahead cache are completed the same way */
+    ide_atapi_readahead_cancel_dma(s);
+
     /*
      * We can't cancel Scatter Gather DMA in the middle of the
      * operation or a partial (not full) DMA transfer would reach
@@ -1159,6 +1162,7 @@ static void ide_cd_change_cb(void *opaque, bool load, Error **errp)
     s->tray_open = !load;
     blk_get_geometry(s->blk, &nb_sectors);
     s->nb_sectors = nb_sectors;
+    ide_atapi_readahead_invalidate(s);
 
     /*
      * First indicate to the guest that a CD has been removed.  That's
@@ -2707,6 +2711,7 @@ void ide_init2(IDEBus *bus, qemu_irq irq)
 
 void ide_exit(IDEState *s)
 {
+    ide_atapi_readahead_exit(s);
     timer_del(s->sector_write_timer);
     timer_free(s->sector_write_timer);
     qemu_vfree(s->smart_selftest_data);
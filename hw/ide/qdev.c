@@ -215,6 +215,11 @@ static void ide_dev_initfn(IDEDevice *dev, IDEDriveKind kind, Error **errp)
         dev->serial = g_strdup(s->drive_serial_str);
     }
 
+    if (kind == IDE_CD) {
+        ide_atapi_readahead_init(s, dev->readahead, dev->seek_latency_us,
+                                 dev->read_rate_kib);
+    }
+
     add_boot_device_path(dev->conf.bootindex, &dev->qdev,
                          dev->unit ? "/disk@1" : "/disk@0");
 }
@@ -320,6 +325,9 @@ static const TypeInfo ide_hd_info = {
 
 static Property ide_cd_properties[] = {
     DEFINE_IDE_DEV_PROPERTIES(),
+    DEFINE_PROP_UINT32("readahead", IDEDrive, dev.readahead, 0),
+    DEFINE_PROP_UINT32("seek-latency-us", IDEDrive, dev.seek_latency_us, 0),
+    DEFINE_PROP_UINT32("read-rate-kib", IDEDrive, dev.read_rate_kib, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
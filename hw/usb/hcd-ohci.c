@@ -44,6 +44,12 @@
 
 #define ED_LINK_LIMIT 32
 
+/*
+ * Frames without progress after which the controller counts as idle, one
+ * pass over all the interrupt lists of the HCCA
+ */
+#define OHCI_IDLE_FRAMES 32
+
 static int64_t usb_frame_time;
 static int64_t usb_bit_time;
 
@@ -63,6 +69,14 @@ typedef struct {
     QEMUTimer *eof_timer;
     int64_t sof_time;
 
+    /*
+     * An idle controller runs idle_coalesce frames per timer tick, 0 or 1
+     * to run every frame on time
+     */
+    uint32_t idle_coalesce;
+    uint32_t idle_frames;
+    bool frame_progress;
+
     /* OHCI state */
     /* Control partition */
     uint32_t ctl, status;
@@ -123,6 +137,7 @@ struct ohci_hcca {
 #define ED_WBACK_SIZE   4
 
 static void ohci_bus_stop(OHCIState *ohci);
+static void ohci_wake(OHCIState *ohci);
 static void ohci_async_cancel_device(OHCIState *ohci, USBDevice *dev);
 
 /* Bitfields for the first word of an Endpoint Desciptor.  */
@@ -330,6 +345,8 @@ static void ohci_attach(USBPort *port1)
     OHCIPort *port = &s->rhport[port1->index];
     uint32_t old_state = port->ctrl;
 
+    ohci_wake(s);
+
     /* set connect status */
     port->ctrl |= OHCI_PORT_CCS | OHCI_PORT_CSC;
 
@@ -382,6 +399,8 @@ static void ohci_wakeup(USBPort *port1)
     OHCIState *s = port1->opaque;
     OHCIPort *port = &s->rhport[port1->index];
     uint32_t intr = 0;
+
+    ohci_wake(s);
     if (port->ctrl & OHCI_PORT_PSS) {
         trace_usb_ohci_port_wakeup(port1->index);
         port->ctrl |= OHCI_PORT_PSSC;
@@ -697,6 +716,7 @@ static void ohci_async_complete_packet(USBPort *port, USBPacket *packet)
     OHCIState *ohci = container_of(packet, OHCIState, usb_packet);
 
     trace_usb_ohci_async_complete();
+    ohci_wake(ohci);
     ohci->async_complete = true;
     ohci_process_lists(ohci, 1);
 }
@@ -722,6 +742,9 @@ static int ohci_service_iso_td(OHCIState *ohci, struct ohci_ed *ed,
     uint32_t start_offset, next_offset, end_offset = 0;
     uint32_t start_addr, end_addr;
 
+    /* Isochronous transfers move on with every frame */
+    ohci->frame_progress = true;
+
     addr = ed->head & OHCI_DPTR_MASK;
 
     if (ohci_read_iso_td(ohci, addr, &iso_td)) {
@@ -1092,6 +1115,9 @@ static int ohci_service_td(OHCIState *ohci, struct ohci_ed *ed)
             return 1;
         }
     }
+    if (ohci->usb_packet.status != USB_RET_NAK) {
+        ohci->frame_progress = true;
+    }
     if (ohci->usb_packet.status == USB_RET_SUCCESS) {
         ret = ohci->usb_packet.actual_length;
     } else {
@@ -1257,16 +1283,22 @@ static int ohci_service_ed_list(OHCIState *ohci, uint32_t head, int completion)
     return active;
 }
 
-/* set a timer for EOF */
+static bool ohci_coalescing(OHCIState *ohci)
+{
+    return ohci->idle_coalesce > 1 && ohci->idle_frames >= OHCI_IDLE_FRAMES;
+}
+
+/* set a timer for EOF, a few frames later when idle */
 static void ohci_eof_timer(OHCIState *ohci)
 {
-    timer_mod(ohci->eof_timer, ohci->sof_time + usb_frame_time);
+    int64_t frames = ohci_coalescing(ohci) ? ohci->idle_coalesce : 1;
+
+    timer_mod(ohci->eof_timer, ohci->sof_time + frames * usb_frame_time);
 }
-/* Set a timer for EOF and generate a SOF event */
+/* Generate a SOF event */
 static void ohci_sof(OHCIState *ohci)
 {
     ohci->sof_time += usb_frame_time;
-    ohci_eof_timer(ohci);
     ohci_set_interrupt(ohci, OHCI_INTR_SF);
 }
 
@@ -1291,16 +1323,15 @@ static void ohci_process_lists(OHCIState *ohci, int completion)
     }
 }
 
-/* Do frame processing on frame boundary */
-static void ohci_frame_boundary(void *opaque)
+/* Do frame processing on frame boundary, returns false if the HC died */
+static bool ohci_frame(OHCIState *ohci)
 {
-    OHCIState *ohci = opaque;
     struct ohci_hcca hcca;
 
     if (ohci_read_hcca(ohci, ohci->hcca, &hcca)) {
         trace_usb_ohci_hcca_read_error(ohci->hcca);
         ohci_die(ohci);
-        return;
+        return false;
     }
 
     /* Process all the lists at the end of the frame */
@@ -1324,7 +1355,7 @@ static void ohci_frame_boundary(void *opaque)
 
     /* Stop if UnrecoverableError happened or ohci_sof will crash */
     if (ohci->intr_status & OHCI_INTR_UE) {
-        return;
+        return false;
     }
 
     /* Frame boundary, so do EOF stuf here */
@@ -1354,6 +1385,81 @@ static void ohci_frame_boundary(void *opaque)
     /* Writeback HCCA */
     if (ohci_put_hcca(ohci, ohci->hcca, &hcca)) {
         ohci_die(ohci);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * A frame is idle when nothing but NAKs came back from the devices and the
+ * guest has no reason to look at the controller. SOF interrupts are wanted
+ * on every frame, so they keep it busy.
+ */
+static bool ohci_frame_idle(OHCIState *ohci)
+{
+    return !ohci->frame_progress && !ohci->done && !ohci->async_td &&
+           (ohci->intr & (OHCI_INTR_MIE | OHCI_INTR_SF)) !=
+           (OHCI_INTR_MIE | OHCI_INTR_SF);
+}
+
+/* Run the frames that are due and set the timer for the next one */
+static void ohci_run_frames(OHCIState *ohci)
+{
+    int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    uint32_t frames = MAX(ohci->idle_coalesce, 1);
+
+    do {
+        ohci->frame_progress = false;
+        if (!ohci_frame(ohci)) {
+            return;
+        }
+        if (!ohci_frame_idle(ohci)) {
+            ohci->idle_frames = 0;
+        } else if (ohci->idle_frames < OHCI_IDLE_FRAMES &&
+                   ++ohci->idle_frames == OHCI_IDLE_FRAMES &&
+                   ohci->idle_coalesce > 1) {
+            trace_usb_ohci_idle(ohci->name);
+        }
+    } while (--frames && ohci->sof_time + usb_frame_time <= now);
+
+    ohci_eof_timer(ohci);
+}
+
+static void ohci_frame_boundary(void *opaque)
+{
+    OHCIState *ohci = opaque;
+
+    ohci_run_frames(ohci);
+}
+
+/*
+ * Run the frames an idle controller has put off, so that the frame counter
+ * is current
+ */
+static void ohci_catch_up(OHCIState *ohci)
+{
+    if (ohci_coalescing(ohci) && timer_pending(ohci->eof_timer) &&
+        qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) >=
+        ohci->sof_time + usb_frame_time) {
+        /* Not pending while the frames run, so this does not recurse */
+        timer_del(ohci->eof_timer);
+        ohci_run_frames(ohci);
+    }
+}
+
+/* Go back to running every frame on time, for guest or device activity */
+static void ohci_wake(OHCIState *ohci)
+{
+    if (!ohci_coalescing(ohci)) {
+        ohci->idle_frames = 0;
+        return;
+    }
+
+    trace_usb_ohci_wake(ohci->name);
+    ohci_catch_up(ohci);
+    ohci->idle_frames = 0;
+    if (timer_pending(ohci->eof_timer)) {
+        ohci_eof_timer(ohci);
     }
 }
 
@@ -1370,6 +1476,7 @@ static int ohci_bus_start(OHCIState *ohci)
      */
 
     ohci->sof_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    ohci->idle_frames = 0;
     ohci_eof_timer(ohci);
 
     return 1;
@@ -1648,10 +1755,12 @@ static uint64_t ohci_mem_read(void *opaque,
             break;
 
         case 14: /* HcFmRemaining */
+            ohci_catch_up(ohci);
             retval = ohci_get_frame_remaining(ohci);
             break;
 
         case 15: /* HcFmNumber */
+            ohci_catch_up(ohci);
             retval = ohci->frame_number;
             break;
 
@@ -1714,6 +1823,8 @@ static void ohci_mem_write(void *opaque,
         return;
     }
 
+    ohci_wake(ohci);
+
     if (addr >= 0x54 && addr < 0x54 + ohci->num_ports * 4) {
         /* HcRhPortStatus */
         ohci_port_set_status(ohci, (addr - 0x54) >> 2, val);
@@ -1853,7 +1964,16 @@ static USBPortOps ohci_port_ops = {
     .complete = ohci_async_complete_packet,
 };
 
+static void ohci_wakeup_endpoint(USBBus *bus, USBEndpoint *ep,
+                                 unsigned int stream)
+{
+    OHCIState *ohci = container_of(bus, OHCIState, bus);
+
+    ohci_wake(ohci);
+}
+
 static USBBusOps ohci_bus_ops = {
+    .wakeup_endpoint = ohci_wakeup_endpoint,
 };
 
 static void usb_ohci_init(OHCIState *ohci, DeviceState *dev,
@@ -2048,6 +2168,8 @@ static Property ohci_pci_properties[] = {
     DEFINE_PROP_STRING("masterbus", OHCIPCIState, masterbus),
     DEFINE_PROP_UINT32("num-ports", OHCIPCIState, num_ports, 3),
     DEFINE_PROP_UINT32("firstport", OHCIPCIState, firstport, 0),
+    DEFINE_PROP_UINT32("idle-coalesce-frames", OHCIPCIState,
+                       state.idle_coalesce, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -188,6 +188,61 @@ type_init(chihiro_register_types)
 #define COMMUNICATION_SECTORS    0x10000
 #define SECTOR_SIZE              512
 
+/*
+ * Initialize a board memory region with the contents of a file, or with
+ * zeroes if there is none. On POSIX hosts the file is mapped copy-on-write
+ * instead of read in, so its pages are only loaded when first touched and
+ * are shared through the page cache with other instances using the same
+ * image until they are written. The rest of the region reads as zero.
+ */
+static void chihiro_init_file_ram(MemoryRegion *mr, const char *name,
+                                  uint64_t size, const char *filename)
+{
+    int64_t file_size;
+    int fd;
+
+    if (!filename) {
+        memory_region_init_ram(mr, NULL, name, size, &error_fatal);
+        return;
+    }
+
+    fd = qemu_open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0) {
+        error_report("chihiro: could not open '%s': %s",
+                     filename, strerror(errno));
+        exit(1);
+    }
+    file_size = lseek(fd, 0, SEEK_END);
+    if (file_size < 0 || file_size > size) {
+        error_report("chihiro: '%s' does not fit in %s", filename, name);
+        exit(1);
+    }
+
+#ifndef _WIN32
+    size_t map_size = HOST_PAGE_ALIGN(size);
+    void *ptr = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED ||
+        (file_size && mmap(ptr, file_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+        error_report("chihiro: could not map '%s': %s",
+                     filename, strerror(errno));
+        exit(1);
+    }
+    memory_region_init_ram_ptr(mr, NULL, name, size, ptr);
+    vmstate_register_ram_global(mr);
+#else
+    memory_region_init_ram(mr, NULL, name, size, &error_fatal);
+    if (lseek(fd, 0, SEEK_SET) != 0 ||
+        read(fd, memory_region_get_ram_ptr(mr), file_size) != file_size) {
+        error_report("chihiro: could not read '%s'", filename);
+        exit(1);
+    }
+#endif
+
+    qemu_close(fd);
+}
+
 static void chihiro_ide_interface_init(const char *rom_file,
                                        const char *filesystem_file)
 {
@@ -202,17 +257,25 @@ static void chihiro_ide_interface_init(const char *rom_file,
     memory_region_init(interface, NULL, "chihiro.interface",
                        (uint64_t)0x10000000 * SECTOR_SIZE);
 
+    if (!rom_file || (*rom_file == '\x00')) {
+        rom_file = "fpr21042_m29w160et.bin";
+    }
+    char *rom_filename = qemu_find_file(QEMU_FILE_TYPE_BIOS, rom_file);
     rom = g_malloc(sizeof(*rom));
-    memory_region_init_ram(rom, NULL, "chihiro.interface.rom",
-                           ROM_SECTORS * SECTOR_SIZE, &error_fatal);
+    chihiro_init_file_ram(rom, "chihiro.interface.rom",
+                          ROM_SECTORS * SECTOR_SIZE, rom_filename);
+    g_free(rom_filename);
     memory_region_add_subregion(interface,
                                 (uint64_t)ROM_START * SECTOR_SIZE, rom);
 
 
     /* limited by the size of the board ram, which we emulate as 128M for now */
     filesystem = g_malloc(sizeof(*filesystem));
-    memory_region_init_ram(filesystem, NULL, "chihiro.interface.filesystem",
-                           128 * 1024 * 1024, &error_fatal);
+    if (filesystem_file && (*filesystem_file == '\x00')) {
+        filesystem_file = NULL;
+    }
+    chihiro_init_file_ram(filesystem, "chihiro.interface.filesystem",
+                          128 * 1024 * 1024, filesystem_file);
     memory_region_add_subregion(interface,
                                 (uint64_t)FILESYSTEM_START * SECTOR_SIZE,
                                 filesystem);
@@ -222,37 +285,6 @@ static void chihiro_ide_interface_init(const char *rom_file,
     interface_space = g_malloc(sizeof(*interface_space));
     address_space_init(interface_space, interface, "chihiro-interface");
 
-    /* read files */
-    int rc, fd = -1;
-
-    if (!rom_file || (*rom_file == '\x00')) {
-        rom_file = "fpr21042_m29w160et.bin";
-    }
-    char *rom_filename = qemu_find_file(QEMU_FILE_TYPE_BIOS, rom_file);
-    if (rom_filename) {
-        int rom_size = get_image_size(rom_filename);
-        assert(rom_size < memory_region_size(rom));
-
-        fd = open(rom_filename, O_RDONLY | O_BINARY);
-        assert(fd != -1);
-        rc = read(fd, memory_region_get_ram_ptr(rom), rom_size);
-        assert(rc == rom_size);
-        close(fd);
-    }
-
-    if (filesystem_file && (*filesystem_file != '\x00')) {
-        assert(access(filesystem_file, R_OK) == 0);
-
-        int filesystem_size = get_image_size(filesystem_file);
-        assert(filesystem_size < memory_region_size(filesystem));
-
-        fd = open(filesystem_file, O_RDONLY | O_BINARY);
-        assert(fd != -1);
-        rc = read(fd, memory_region_get_ram_ptr(rom), filesystem_size);
-        assert(rc == filesystem_size);
-        close(fd);
-    }
-
 #if 0 // FIXME
     /* create the device */
     DriveInfo *dinfo;
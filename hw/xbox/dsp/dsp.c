@@ -43,12 +43,18 @@
 #define INTERRUPT_START_FRAME (1 << 1)
 #define INTERRUPT_DMA_EOL (1 << 7)
 
-#define DPRINTF(s, ...) printf(s, ## __VA_ARGS__)
+// #define DEBUG
+#ifdef DEBUG
+# define DPRINTF(s, ...) printf(s, ## __VA_ARGS__)
+#else
+# define DPRINTF(s, ...) do { } while (0)
+#endif
 
 struct DSPState {
     dsp_core_t core;
     DSPDMAState dma;
     int save_cycles;
+    uint64_t cycle_count;
 
     uint32_t interrupts;
 };
@@ -86,6 +92,7 @@ void dsp_reset(DSPState* dsp)
 
 void dsp_destroy(DSPState* dsp)
 {
+    dsp56k_destroy_cpu(&dsp->core);
     free(dsp);
 }
 
@@ -170,17 +177,33 @@ void dsp_run(DSPState* dsp, int cycles)
     //  printf("--> %d\n", dsp->core.save_cycles);
     while (dsp->save_cycles > 0)
     {
-        dsp56k_execute_instruction(&dsp->core);
-        dsp->save_cycles -= dsp->core.instr_cycle;
+        int cycles_taken = dsp56k_execute_block(&dsp->core,
+                                                dsp->save_cycles);
+        dsp->save_cycles -= cycles_taken;
+        dsp->cycle_count += cycles_taken;
     }
 
 } 
 
+/* Totals since the DSP was created, for profiling */
+void dsp_get_counters(DSPState* dsp, uint64_t *instructions, uint64_t *cycles)
+{
+    *instructions = dsp->core.inst_count;
+    *cycles = dsp->cycle_count;
+}
+
+/* Check every replayed block against the interpreter, for testing */
+void dsp_set_block_verify(DSPState* dsp, bool enable)
+{
+    dsp56k_set_block_verify(&dsp->core, enable);
+}
+
 void dsp_bootstrap(DSPState* dsp)
 {
     // scratch memory is dma'd in to pram by the bootrom
     dsp->dma.scratch_rw(dsp->dma.rw_opaque,
         (uint8_t*)dsp->core.pram, 0, 0x800*4, false);
+    dsp56k_invalidate_opcache(&dsp->core);
 }
 
 void dsp_start_frame(DSPState* dsp)
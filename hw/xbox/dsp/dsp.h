@@ -48,6 +48,8 @@ void dsp_run(DSPState* dsp, int cycles);
 
 void dsp_bootstrap(DSPState* dsp);
 void dsp_start_frame(DSPState* dsp);
+void dsp_get_counters(DSPState* dsp, uint64_t *instructions, uint64_t *cycles);
+void dsp_set_block_verify(DSPState* dsp, bool enable);
 
 
 /* Dsp Debugger commands */
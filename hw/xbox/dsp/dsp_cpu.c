@@ -60,6 +60,9 @@ static uint32_t read_memory_p(dsp_core_t* dsp, uint32_t address);
 static uint32_t read_memory_disasm(dsp_core_t* dsp, int space, uint32_t address);
 
 static void write_memory_raw(dsp_core_t* dsp, int space, uint32_t address, uint32_t value);
+
+static void dsp_block_invalidate(dsp_core_t* dsp, uint32_t address);
+static void dsp_block_invalidate_all(dsp_core_t* dsp);
 static void write_memory_disasm(dsp_core_t* dsp, int space, uint32_t address, uint32_t value);
 
 static void dsp_write_reg(dsp_core_t* dsp, uint32_t numreg, uint32_t value); 
@@ -384,6 +387,10 @@ void dsp56k_reset_cpu(dsp_core_t* dsp)
 
     /* Memory */
     memset(dsp->periph, 0, sizeof(dsp->periph));
+    if (!dsp->blocks) {
+        dsp->blocks = g_new0(dsp_block_t *, DSP_PRAM_SIZE);
+    }
+    dsp56k_invalidate_opcache(dsp);
     memset(dsp->stack, 0, sizeof(dsp->stack));
     memset(dsp->registers, 0, sizeof(dsp->registers));
     
@@ -422,6 +429,15 @@ void dsp56k_reset_cpu(dsp_core_t* dsp)
     dsp->disasm_prev_inst_pc = 0xFFFFFFFF;
 }
 
+void dsp56k_destroy_cpu(dsp_core_t* dsp)
+{
+    dsp_block_invalidate_all(dsp);
+    g_free(dsp->blocks);
+    dsp->blocks = NULL;
+    g_free(dsp->block_verify);
+    dsp->block_verify = NULL;
+}
+
 static OpcodeEntry lookup_opcode(uint32_t op) {
     OpcodeEntry r = {0};
     int i;
@@ -439,6 +455,22 @@ static OpcodeEntry lookup_opcode(uint32_t op) {
     return r;
 }
 
+void dsp56k_invalidate_opcache(dsp_core_t* dsp)
+{
+    memset(dsp->pram_opcache, 0, sizeof(dsp->pram_opcache));
+    dsp_block_invalidate_all(dsp);
+}
+
+/* Resolve the emulation function of an instruction, NULL if undefined */
+static emu_func_t decode_instruction(uint32_t inst)
+{
+    if (inst < 0x100000) {
+        return lookup_opcode(inst).emu_func;
+    } else {
+        return opcodes_parmove[(inst>>20) & BITMASK(4)];
+    }
+}
+
 static uint16_t disasm_instruction(dsp_core_t* dsp, dsp_trace_disasm_t mode)
 {
     dsp->disasm_mode = mode;
@@ -638,7 +670,15 @@ void dsp56k_execute_instruction(dsp_core_t* dsp)
     dsp->disasm_memory_ptr = 0;
 
     /* Decode and execute current instruction */
-    dsp->cur_inst = read_memory_p(dsp, dsp->pc);
+    assert(dsp->pc < DSP_PRAM_SIZE);
+    emu_func_t emu_func = dsp->pram_opcache[dsp->pc];
+    if (emu_func) {
+        dsp->cur_inst = ldl_le_p(&dsp->pram[dsp->pc]);
+    } else {
+        dsp->cur_inst = read_memory_p(dsp, dsp->pc);
+        emu_func = decode_instruction(dsp->cur_inst);
+        dsp->pram_opcache[dsp->pc] = emu_func;
+    }
     
     /* Initialize instruction size and cycle counter */
     dsp->cur_inst_len = 1;
@@ -660,17 +700,12 @@ void dsp56k_execute_instruction(dsp_core_t* dsp)
         }
     }
             
-    if (dsp->cur_inst < 0x100000) {
-        const OpcodeEntry op = lookup_opcode(dsp->cur_inst);
-        if (op.emu_func) {
-            op.emu_func(dsp);
-        } else {
-            printf("%x - %s\n", dsp->cur_inst, op.name);
-            emu_undefined(dsp);
-        }
+    if (emu_func) {
+        emu_func(dsp);
     } else {
-        /* Do parallel move read */
-        opcodes_parmove[(dsp->cur_inst>>20) & BITMASK(4)](dsp);
+        const OpcodeEntry op = lookup_opcode(dsp->cur_inst);
+        printf("%x - %s\n", dsp->cur_inst, op.name);
+        emu_undefined(dsp);
     }
 
     /* Disasm current instruction ? (trace mode only) */
@@ -704,6 +739,8 @@ void dsp56k_execute_instruction(dsp_core_t* dsp)
     /* Process Interrupts */
     dsp_postexecute_interrupts(dsp);
 
+    dsp->inst_count++;
+
 #ifdef DSP_COUNT_IPS
     ++dsp->num_inst;
     if ((dsp->num_inst & 63) == 0) {
@@ -718,6 +755,330 @@ void dsp56k_execute_instruction(dsp_core_t* dsp)
 #endif
 }
 
+/**********************************
+ *  Block execution
+ **********************************/
+
+/* Straight-line runs of instructions are recorded the first time they are
+ * interpreted. A recorded block is then replayed by calling the emulation
+ * functions back to back. When the PC moves to another instruction of the
+ * block, as at the end of a DO loop iteration, a REP or a branch back to the
+ * start of the block, the replay carries on from that instruction. The block
+ * is only left when the PC goes elsewhere, an interrupt becomes pending or
+ * the cycle budget is used up. Interrupt processing runs once per block,
+ * which behaves the same as the interpreter because no interrupt can be
+ * pending inside a block. */
+
+struct dsp_block_s {
+    uint32_t length;
+    uint32_t words;     /* P memory words covered, for invalidation */
+    /* Instruction starting at each word of the block, -1 for none */
+    int8_t index[DSP_BLOCK_MAX_INSTS * 2];
+    struct {
+        emu_func_t emu_func;
+        uint32_t inst;
+    } insts[DSP_BLOCK_MAX_INSTS];
+};
+
+static void dsp_block_invalidate(dsp_core_t* dsp, uint32_t address)
+{
+    uint32_t start;
+
+    if (!dsp->blocks) {
+        return;
+    }
+
+    start = address >= DSP_BLOCK_MAX_INSTS * 2
+                ? address - DSP_BLOCK_MAX_INSTS * 2 : 0;
+    for (; start <= address; start++) {
+        dsp_block_t *block = dsp->blocks[start];
+        if (block && address < start + block->words) {
+            g_free(block);
+            dsp->blocks[start] = NULL;
+        }
+    }
+}
+
+static void dsp_block_invalidate_all(dsp_core_t* dsp)
+{
+    int i;
+
+    if (!dsp->blocks) {
+        return;
+    }
+
+    for (i=0; i<DSP_PRAM_SIZE; i++) {
+        g_free(dsp->blocks[i]);
+        dsp->blocks[i] = NULL;
+    }
+}
+
+static bool dsp_block_can_continue(dsp_core_t* dsp)
+{
+    return dsp->interrupt_state == DSP_INTERRUPT_NONE
+        && dsp->interrupt_counter == 0
+        && !(dsp->registers[DSP_REG_SR] & (1<<DSP_SR_T));
+}
+
+/* Interpret from the current PC while recording a new block, for at most
+ * budget cycles */
+static int dsp_block_record(dsp_core_t* dsp, int budget)
+{
+    uint32_t start_pc = dsp->pc;
+    uint32_t pcs[DSP_BLOCK_MAX_INSTS];
+    int cycles = 0;
+    bool complete = false;
+    dsp_block_t *block = g_new0(dsp_block_t, 1);
+
+    memset(block->index, -1, sizeof(block->index));
+
+    while (block->length < DSP_BLOCK_MAX_INSTS && cycles < budget) {
+        uint32_t pc = dsp->pc;
+
+        dsp56k_execute_instruction(dsp);
+        cycles += dsp->instr_cycle;
+
+        emu_func_t emu_func = dsp->pram_opcache[pc];
+        if (!emu_func) {
+            /* Undefined instruction, or it overwrote itself */
+            complete = true;
+            break;
+        }
+
+        pcs[block->length] = pc;
+        block->index[pc - start_pc] = block->length;
+        block->insts[block->length].emu_func = emu_func;
+        block->insts[block->length].inst = dsp->cur_inst;
+        block->length++;
+        block->words = pc + 2 - start_pc;
+
+        if (dsp->cur_inst_len == 0
+            || dsp->pc != pc + dsp->cur_inst_len
+            || !dsp_block_can_continue(dsp)) {
+            complete = true;
+            break;
+        }
+    }
+    complete |= block->length == DSP_BLOCK_MAX_INSTS;
+
+    /* Drop it if the code was modified while it was being recorded, and
+     * when it was cut short by the budget */
+    int i;
+    bool valid = complete && block->length > 0;
+    for (i=0; i<block->length; i++) {
+        if (dsp->pram_opcache[pcs[i]] != block->insts[i].emu_func) {
+            valid = false;
+        }
+    }
+
+    if (valid && dsp->blocks[start_pc] == NULL) {
+        dsp->blocks[start_pc] = block;
+    } else {
+        g_free(block);
+    }
+
+    return cycles;
+}
+
+static int dsp_block_replay(dsp_core_t* dsp, dsp_block_t *block,
+                            int budget, int *executed)
+{
+    uint32_t start_pc = dsp->pc;
+    int cycles = 0;
+    int n = 0;
+    int i = 0;
+
+    while (cycles < budget) {
+        dsp->cur_inst = block->insts[i].inst;
+        dsp->cur_inst_len = 1;
+        dsp->instr_cycle = 2;
+
+        block->insts[i].emu_func(dsp);
+        dsp_postexecute_update_pc(dsp);
+        cycles += dsp->instr_cycle;
+        n++;
+
+        /* The instruction may have overwritten the block */
+        if (dsp->blocks[start_pc] != block
+            || !dsp_block_can_continue(dsp)) {
+            break;
+        }
+
+        /* Carry on with the instruction the PC moved to, which need not
+         * be the next one when looping */
+        uint32_t offset = dsp->pc - start_pc;
+        if (offset >= block->words || block->index[offset] < 0) {
+            break;
+        }
+        i = block->index[offset];
+    }
+
+    dsp_postexecute_interrupts(dsp);
+
+    dsp->inst_count += n;
+    *executed = n;
+    return cycles;
+}
+
+/* Differential testing: every block is replayed on the real core while its
+ * peripheral accesses are logged, then interpreted on a copy of the core
+ * with the logged reads fed back, and the results are compared. Peripheral
+ * writes that have side effects on DSP memory (DMA) are not replayed, so
+ * memory is only compared for blocks without peripheral writes. */
+
+#define DSP_BLOCK_VERIFY_LOG_SIZE (DSP_BLOCK_MAX_INSTS * 4)
+
+struct dsp_block_verify_s {
+    /* Copy of the core the block is interpreted on */
+    dsp_core_t core;
+
+    uint32_t (*read_peripheral)(dsp_core_t* core, uint32_t address);
+    void (*write_peripheral)(dsp_core_t* core, uint32_t address, uint32_t value);
+
+    struct {
+        uint32_t address;
+        uint32_t value;
+        bool write;
+    } log[DSP_BLOCK_VERIFY_LOG_SIZE];
+    int log_len, log_pos;
+    bool log_has_writes;
+};
+
+void dsp56k_set_block_verify(dsp_core_t* dsp, bool enable)
+{
+    if (enable && !dsp->block_verify) {
+        dsp->block_verify = g_new0(dsp_block_verify_t, 1);
+    } else if (!enable) {
+        g_free(dsp->block_verify);
+        dsp->block_verify = NULL;
+    }
+}
+
+static uint32_t verify_record_read(dsp_core_t* core, uint32_t address)
+{
+    dsp_block_verify_t *v = core->block_verify;
+    uint32_t value = v->read_peripheral(core, address);
+    assert(v->log_len < DSP_BLOCK_VERIFY_LOG_SIZE);
+    v->log[v->log_len].address = address;
+    v->log[v->log_len].value = value;
+    v->log[v->log_len].write = false;
+    v->log_len++;
+    return value;
+}
+
+static void verify_record_write(dsp_core_t* core, uint32_t address, uint32_t value)
+{
+    dsp_block_verify_t *v = core->block_verify;
+    assert(v->log_len < DSP_BLOCK_VERIFY_LOG_SIZE);
+    v->log[v->log_len].address = address;
+    v->log[v->log_len].value = value;
+    v->log[v->log_len].write = true;
+    v->log_len++;
+    v->log_has_writes = true;
+    v->write_peripheral(core, address, value);
+}
+
+static uint32_t verify_replay_read(dsp_core_t* core, uint32_t address)
+{
+    dsp_block_verify_t *v = core->block_verify;
+    assert(v->log_pos < v->log_len);
+    assert(!v->log[v->log_pos].write);
+    assert(v->log[v->log_pos].address == address);
+    return v->log[v->log_pos++].value;
+}
+
+static void verify_replay_write(dsp_core_t* core, uint32_t address, uint32_t value)
+{
+    dsp_block_verify_t *v = core->block_verify;
+    assert(v->log_pos < v->log_len);
+    assert(v->log[v->log_pos].write);
+    assert(v->log[v->log_pos].address == address);
+    assert(v->log[v->log_pos].value == value);
+    v->log_pos++;
+}
+
+static int dsp_block_replay_verified(dsp_core_t* dsp, dsp_block_t *block,
+                                     int budget)
+{
+    dsp_block_verify_t *v = dsp->block_verify;
+    dsp_core_t *ref = &v->core;
+    uint32_t start_pc = dsp->pc;
+    /* The block may be freed by the replay if it overwrites itself */
+    uint32_t length = block->length;
+    int executed, cycles, i;
+
+    /* The copy shares v through its block_verify pointer */
+    memcpy(ref, dsp, sizeof(dsp_core_t));
+    ref->blocks = NULL;
+
+    v->log_len = 0;
+    v->log_pos = 0;
+    v->log_has_writes = false;
+    v->read_peripheral = dsp->read_peripheral;
+    v->write_peripheral = dsp->write_peripheral;
+    dsp->read_peripheral = verify_record_read;
+    dsp->write_peripheral = verify_record_write;
+
+    cycles = dsp_block_replay(dsp, block, budget, &executed);
+
+    dsp->read_peripheral = v->read_peripheral;
+    dsp->write_peripheral = v->write_peripheral;
+
+    ref->read_peripheral = verify_replay_read;
+    ref->write_peripheral = verify_replay_write;
+    for (i=0; i<executed; i++) {
+        dsp56k_execute_instruction(ref);
+    }
+
+    bool match = ref->pc == dsp->pc
+        && memcmp(ref->registers, dsp->registers,
+                  sizeof(dsp->registers)) == 0
+        && memcmp(ref->stack, dsp->stack, sizeof(dsp->stack)) == 0
+        && ref->loop_rep == dsp->loop_rep
+        && ref->interrupt_counter == dsp->interrupt_counter;
+    if (match && !v->log_has_writes) {
+        match = memcmp(ref->xram, dsp->xram, sizeof(dsp->xram)) == 0
+            && memcmp(ref->yram, dsp->yram, sizeof(dsp->yram)) == 0
+            && memcmp(ref->pram, dsp->pram, sizeof(dsp->pram)) == 0
+            && memcmp(ref->mixbuffer, dsp->mixbuffer,
+                      sizeof(dsp->mixbuffer)) == 0;
+    }
+    if (!match) {
+        fprintf(stderr, "dsp: block at p:%04x (%d of %d instructions) "
+                "diverged from interpreter: pc %04x, expected %04x\n",
+                start_pc, executed, length,
+                dsp->pc, ref->pc);
+        assert(false);
+    }
+
+    return cycles;
+}
+
+/* Execute one block (or a single instruction when blocks can't be used),
+ * stopping once budget cycles are used up. Returns the number of cycles
+ * taken */
+int dsp56k_execute_block(dsp_core_t* dsp, int budget)
+{
+    if (TRACE_DSP_DISASM || !dsp->blocks || dsp->executing_for_disasm
+        || !dsp_block_can_continue(dsp)) {
+        dsp56k_execute_instruction(dsp);
+        return dsp->instr_cycle;
+    }
+
+    assert(dsp->pc < DSP_PRAM_SIZE);
+    dsp_block_t *block = dsp->blocks[dsp->pc];
+    if (!block) {
+        return dsp_block_record(dsp, budget);
+    }
+
+    if (dsp->block_verify) {
+        return dsp_block_replay_verified(dsp, block, budget);
+    }
+
+    int executed;
+    return dsp_block_replay(dsp, block, budget, &executed);
+}
+
 /**********************************
  *  Update the PC
 **********************************/
@@ -1000,6 +1361,29 @@ void dsp56k_write_memory(dsp_core_t* dsp, int space, uint32_t address, uint32_t
         write_memory_raw(dsp, space, address, value);
 }
 
+/* Host pointer to count words of X or Y RAM, for bulk transfers. Returns NULL
+ * if the range is not plain RAM, or if writes have to be traced */
+uint32_t* dsp56k_get_memory_ptr(dsp_core_t* dsp, int space, uint32_t address, uint32_t count)
+{
+    if (TRACE_DSP_DISASM_MEM) {
+        return NULL;
+    }
+
+    if (space == DSP_SPACE_X) {
+        if (address >= DSP_MIXBUFFER_BASE
+            && address + count <= DSP_MIXBUFFER_BASE+DSP_MIXBUFFER_SIZE) {
+            return &dsp->mixbuffer[address-DSP_MIXBUFFER_BASE];
+        } else if (address + count <= DSP_XRAM_SIZE) {
+            return &dsp->xram[address];
+        }
+    } else if (space == DSP_SPACE_Y) {
+        if (address + count <= DSP_YRAM_SIZE) {
+            return &dsp->yram[address];
+        }
+    }
+    return NULL;
+}
+
 static void write_memory_raw(dsp_core_t* dsp, int space, uint32_t address, uint32_t value)
 {
     assert((value & 0xFF000000) == 0);
@@ -1022,6 +1406,8 @@ static void write_memory_raw(dsp_core_t* dsp, int space, uint32_t address, uint3
     } else if (space == DSP_SPACE_P) {
         assert(address < DSP_PRAM_SIZE);
         stl_le_p(&dsp->pram[address], value);
+        dsp->pram_opcache[address] = NULL;
+        dsp_block_invalidate(dsp, address);
     } else {
         assert(false);
     }
@@ -153,6 +153,14 @@ typedef struct dsp_interrupt_s {
 
 typedef struct dsp_core_s dsp_core_t;
 
+typedef void (*emu_func_t)(dsp_core_t* dsp);
+
+/* Maximum number of instructions in a recorded block */
+#define DSP_BLOCK_MAX_INSTS 32
+
+typedef struct dsp_block_s dsp_block_t;
+typedef struct dsp_block_verify_s dsp_block_verify_t;
+
 struct dsp_core_s {
     /* DSP instruction Cycle counter */
     uint16_t instr_cycle;
@@ -168,6 +176,17 @@ struct dsp_core_s {
     uint32_t yram[DSP_YRAM_SIZE];
     uint32_t pram[DSP_PRAM_SIZE];
 
+    /* Emulation function of each decoded P memory word, NULL if the word
+     * has not been decoded yet or was written since */
+    emu_func_t pram_opcache[DSP_PRAM_SIZE];
+
+    /* Recorded blocks, indexed by start address */
+    dsp_block_t **blocks;
+
+    /* State for checking replayed blocks against the interpreter, NULL
+     * unless enabled with dsp56k_set_block_verify */
+    dsp_block_verify_t *block_verify;
+
     uint32_t mixbuffer[DSP_MIXBUFFER_SIZE];
 
     /* peripheral space, x:0xffff80-0xffffff */
@@ -199,6 +218,9 @@ struct dsp_core_s {
 #endif
     uint32_t num_inst;
 
+    /* Instructions executed since creation, for profiling */
+    uint64_t inst_count;
+
     /* Length of current instruction */
     uint32_t cur_inst_len; /* =0:jump, >0:increment */
     /* Current instruction */
@@ -245,10 +267,15 @@ struct dsp_core_s {
 /* Functions */
 void dsp56k_reset_cpu(dsp_core_t* dsp);		/* Set dsp_core to use */
 void dsp56k_execute_instruction(dsp_core_t* dsp);	/* Execute 1 instruction */
+void dsp56k_invalidate_opcache(dsp_core_t* dsp);	/* Call after writing P memory directly */
+int dsp56k_execute_block(dsp_core_t* dsp, int budget);	/* Execute a block, returns cycles taken */
+void dsp56k_set_block_verify(dsp_core_t* dsp, bool enable);	/* Check every replayed block against the interpreter */
+void dsp56k_destroy_cpu(dsp_core_t* dsp);
 uint16_t dsp56k_execute_one_disasm_instruction(dsp_core_t* dsp, FILE *out, uint32_t pc);	/* Execute 1 instruction in disasm mode */
 
 uint32_t dsp56k_read_memory(dsp_core_t* dsp, int space, uint32_t address);
 void dsp56k_write_memory(dsp_core_t* dsp, int space, uint32_t address, uint32_t value);
+uint32_t* dsp56k_get_memory_ptr(dsp_core_t* dsp, int space, uint32_t address, uint32_t count);	/* X/Y RAM only, NULL otherwise */
 
 /* Interrupt relative functions */
 void dsp56k_add_interrupt(dsp_core_t* dsp, uint16_t inter);
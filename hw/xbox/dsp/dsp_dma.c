@@ -20,6 +20,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include <assert.h>
 
 #include "dsp_dma.h"
@@ -86,6 +87,57 @@ const char *format_names[] = {
 };
 #endif
 
+/* Convert DSP words to the buffer format of a block */
+static void dsp_dma_pack(uint8_t* dst, const uint32_t* src, uint32_t count,
+                         unsigned int item_size)
+{
+    uint32_t i;
+
+    switch(item_size) {
+    case 2: {
+        uint16_t* dst16 = (uint16_t*)dst;
+        for (i=0; i<count; i++) {
+            dst16[i] = src[i];
+        }
+        break;
+    }
+    case 4:
+        /* DSP words are always 24 bit, so this is just a copy */
+        memcpy(dst, src, count * 4);
+        break;
+    default:
+        assert(false);
+        break;
+    }
+}
+
+/* Convert a block's buffer format to DSP words */
+static void dsp_dma_unpack(uint32_t* dst, const uint8_t* src, uint32_t count,
+                           unsigned int item_size, uint32_t item_mask)
+{
+    uint32_t i;
+
+    switch(item_size) {
+    case 2: {
+        const uint16_t* src16 = (const uint16_t*)src;
+        for (i=0; i<count; i++) {
+            dst[i] = src16[i];
+        }
+        break;
+    }
+    case 4: {
+        const uint32_t* src32 = (const uint32_t*)src;
+        for (i=0; i<count; i++) {
+            dst[i] = src32[i] & item_mask;
+        }
+        break;
+    }
+    default:
+        assert(false);
+        break;
+    }
+}
+
 static void dsp_dma_run(DSPDMAState *s)
 {
     if (!(s->control & DMA_CONTROL_RUNNING)
@@ -222,23 +274,22 @@ static void dsp_dma_run(DSPDMAState *s)
 
 
         size_t transfer_size = count * item_size;
-        uint8_t* scratch_buf = calloc(count, item_size);
+        uint8_t* scratch_buf = (uint8_t*)s->staging;
+        assert(count <= DSP_DMA_MAX_TRANSFER_WORDS);
+
+        /* X and Y RAM are accessed directly, anything else word by word */
+        uint32_t* mem_ptr = dsp56k_get_memory_ptr(s->core,
+            mem_space, mem_address, count);
 
         if (direction) {
-            int i;
-            for (i=0; i<count; i++) {
-                uint32_t v = dsp56k_read_memory(s->core,
-                    mem_space, mem_address+i);
-                switch(item_size) {
-                case 2:
-                    *(uint16_t*)(scratch_buf + i*2) = v;
-                    break;
-                case 4:
-                    *(uint32_t*)(scratch_buf + i*4) = v;
-                    break;
-                default:
-                    assert(false);
-                    break;
+            if (mem_ptr) {
+                dsp_dma_pack(scratch_buf, mem_ptr, count, item_size);
+            } else {
+                int i;
+                for (i=0; i<count; i++) {
+                    uint32_t v = dsp56k_read_memory(s->core,
+                        mem_space, mem_address+i);
+                    dsp_dma_pack(scratch_buf + i*item_size, &v, 1, item_size);
                 }
             }
 
@@ -272,27 +323,21 @@ static void dsp_dma_run(DSPDMAState *s)
             s->scratch_rw(s->rw_opaque,
                 scratch_buf, scratch_addr, transfer_size, 0);
 
-            int i;
-            for (i=0; i<count; i++) {
-                uint32_t v;
-                switch(item_size) {
-                case 2:
-                    v = *(uint16_t*)(scratch_buf + i*2);
-                    break;
-                case 4:
-                    v = (*(uint32_t*)(scratch_buf + i*4)) & item_mask;
-                    break;
-                default:
-                    assert(false);
-                    break;
+            if (mem_ptr) {
+                dsp_dma_unpack(mem_ptr, scratch_buf, count,
+                               item_size, item_mask);
+            } else {
+                int i;
+                for (i=0; i<count; i++) {
+                    uint32_t v;
+                    dsp_dma_unpack(&v, scratch_buf + i*item_size, 1,
+                                   item_size, item_mask);
+                    // DPRINTF("... %06x\n", v);
+                    dsp56k_write_memory(s->core, mem_space, mem_address+i, v);
                 }
-                // DPRINTF("... %06x\n", v);
-                dsp56k_write_memory(s->core, mem_space, mem_address+i, v);
             }
         }
 
-        free(scratch_buf);
-
     }
 }
 
@@ -33,6 +33,9 @@ typedef enum DSPDMARegister {
     DMA_NEXT_BLOCK,
 } DSPDMARegister;
 
+/* A block never covers more than the X memory window */
+#define DSP_DMA_MAX_TRANSFER_WORDS 0x1800
+
 typedef struct DSPDMAState {
     dsp_core_t* core;
 
@@ -47,6 +50,10 @@ typedef struct DSPDMAState {
 
     bool error;
     bool eol;
+
+    /* Bounce buffer between DSP memory and the scratch or FIFO buffers,
+     * large enough for any block */
+    uint32_t staging[DSP_DMA_MAX_TRANSFER_WORDS];
 } DSPDMAState;
 
 uint32_t dsp_dma_read(DSPDMAState *s, DSPDMARegister reg);
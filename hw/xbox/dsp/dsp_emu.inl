@@ -22,9 +22,6 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 */
 
-typedef void (*emu_func_t)(dsp_core_t* dsp);
-
-
 static void emu_undefined(dsp_core_t* dsp)
 {
     if (!dsp->executing_for_disasm) {
@@ -0,0 +1,43 @@
+/*
+ * MCPX DSP memory images
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DSP_IMAGE_H
+#define DSP_IMAGE_H
+
+#include <stdint.h>
+
+#include "dsp_cpu.h"
+
+/* "DSPIMG1" when stored little endian */
+#define DSP_IMAGE_MAGIC 0x0031474d49505344ULL
+
+/*
+ * A DSP as it was right after bootstrap. In the file, the header is
+ * followed by scratch_size bytes of scratch memory, then by the mixbuffer
+ * contents at the start of each of the num_frames frames. All values are
+ * in host byte order.
+ */
+typedef struct DSPImageHeader {
+    uint64_t magic;
+    uint32_t num_frames;
+    uint32_t scratch_size;
+    uint32_t pram[DSP_PRAM_SIZE];
+    uint32_t xram[DSP_XRAM_SIZE];
+    uint32_t yram[DSP_YRAM_SIZE];
+} DSPImageHeader;
+
+#endif
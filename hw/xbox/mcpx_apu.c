@@ -23,12 +23,42 @@
 #include "hw/i386/pc.h"
 #include "hw/pci/pci.h"
 #include "cpu.h"
+#include "qemu/main-loop.h"
+#include "qemu/log.h"
+#include "qemu/rcu.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
+#include "qemu/bitmap.h"
+#include "audio/audio.h"
+#include "monitor/monitor.h"
 #include "hw/xbox/dsp/dsp.h"
+#include "hw/xbox/dsp/dsp_image.h"
+#include "trace.h"
 #include <math.h>
 
 #define NUM_SAMPLES_PER_FRAME 32
 #define NUM_MIXBINS 32
 
+/* The SE processes one frame of NUM_SAMPLES_PER_FRAME samples at 48 kHz */
+#define SE_FRAME_RATE 1500
+/* Frames processed between interrupt updates when catching up */
+#define SE_FRAMES_PER_BATCH 16
+/* When further behind than this, frames are dropped instead */
+#define SE_MAX_FRAMES_BEHIND 150
+
+/* Host output ring, in stereo frames at 48 kHz. Must be a power of 2 */
+#define OUT_RING_FRAMES 4096
+/* Fill level the drift compensation steers towards (20 ms) */
+#define OUT_TARGET_FILL 960
+/* Maximum deviation from the nominal rate used to correct drift */
+#define OUT_MAX_DRIFT 0.005f
+
+/* GP and EP DSPs are clocked at 160 MHz */
+#define DSP_CLOCK_FREQ 160000000
+#define DSP_CYCLES_PER_FRAME (DSP_CLOCK_FREQ / SE_FRAME_RATE)
+/* A frame is run in slices, the DSP lock is released in between for MMIO */
+#define DSP_SLICES_PER_FRAME 8
+
 #include "hw/xbox/mcpx_apu.h"
 
 #define NV_PAPU_ISTS                                     0x00001000
@@ -310,6 +340,138 @@ static const struct {
 
 /* More debug functionality */
 #define GENERATE_MIXBIN_BEEP      0
+/* Write an image of each DSP at bootstrap, followed by the mixbuffer input
+ * of this many frames, to mcpx-{gp,ep}-image.bin for tests/benchmark-dsp */
+#define CAPTURE_DSP_FRAMES        0
+
+/* Decoded ADPCM blocks kept per voice */
+#define VP_ADPCM_BLOCK_SAMPLES 65
+#define VP_ADPCM_RING_BLOCKS 4
+/* SGE entries resolved per frame */
+#define VP_SGE_CACHE_SIZE 64
+/* Voices per unit of work handed to the voice processing workers */
+#define VP_CHUNK_VOICES 8
+#define VP_MAX_WORKERS 7
+/* Decoded samples are counted per NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE, with
+ * ADPCM after the PCM formats */
+#define VP_FORMAT_ADPCM 4
+#define VP_NUM_FORMATS 5
+
+/* Host side state of a voice, on top of what is kept in guest memory */
+typedef struct VPVoiceCache {
+    uint32_t handle;
+    uint32_t ba;
+    uint32_t fmt;
+    float frac;     /* Position between CBO and the next sample */
+    struct {
+        uint32_t block;
+        int16_t samples[2][VP_ADPCM_BLOCK_SAMPLES];
+    } adpcm[VP_ADPCM_RING_BLOCKS];
+} VPVoiceCache;
+
+/* State private to each thread processing voices */
+typedef struct VPContext {
+    struct {
+        uint32_t page;
+        uint32_t frame;
+        uint8_t *ptr;
+    } sge_cache[VP_SGE_CACHE_SIZE];
+    unsigned int samples_decoded[VP_NUM_FORMATS];
+} VPContext;
+
+typedef struct VPWorker {
+    QemuThread thread;
+    QemuSemaphore start;
+    VPContext ctx;
+    struct MCPXAPUState *d;
+} VPWorker;
+
+/* Host pointers to the pages of a scratch or FIFO buffer, each SGE entry is
+ * looked up at most once per DSP frame */
+typedef struct MCPXAPUSGEPage {
+    uint64_t frame;
+    uint8_t *ptr;
+} MCPXAPUSGEPage;
+
+/* Entries beyond this are looked up on every access. 16 MB of pages is
+ * more than the scratch and FIFO buffers of any title */
+#define MCPX_SGE_CACHE_ENTRIES 4096
+
+typedef struct MCPXAPUSGETable {
+    hwaddr base;
+    unsigned int max_sge;
+    unsigned int num_pages;
+    MCPXAPUSGEPage *pages;      /* First num_pages entries of max_sge + 1 */
+} MCPXAPUSGETable;
+
+/* A DSP FIFO as set up in the APU registers */
+typedef struct MCPXAPUFIFO {
+    uint32_t base;
+    uint32_t end;
+    uint32_t cur;
+    bool moved;     /* cur was advanced by the DSP */
+} MCPXAPUFIFO;
+
+/* APU registers that set up the DMA of a DSP */
+typedef struct MCPXAPUDSPRegs {
+    hwaddr saddr;
+    hwaddr smaxsge;
+    hwaddr faddr;
+    hwaddr fmaxsge;
+    hwaddr ofbase;
+    hwaddr ofend;
+    hwaddr ofcur;
+    hwaddr ifbase;
+    hwaddr ifend;
+    hwaddr ifcur;
+} MCPXAPUDSPRegs;
+
+/* GP or EP, each running its frames on its own thread */
+typedef struct MCPXAPUDSP {
+    const char *name;
+    MemoryRegion mmio;
+    DSPState *dsp;
+    uint32_t regs[0x10000];
+
+    /* Protects the core and regs, held by the thread while running a slice
+     * of a frame */
+    QemuMutex lock;
+    QemuThread thread;
+    QemuSemaphore start;
+    QemuSemaphore done;
+    bool busy;      /* Started and not waited for yet, SE thread only */
+    struct MCPXAPUState *d;
+
+    /* Protected by lock. SGE entries resolved during an older frame are
+     * looked up again */
+    uint64_t frame;
+    MCPXAPUSGETable scratch_sge;
+    MCPXAPUSGETable fifo_sge;
+
+    /* Protected by lock. The APU registers a frame works with, copied in
+     * by the SE thread before the frame is started, so the DSP thread never
+     * touches d->regs. FIFO positions are copied back once it is done */
+    const MCPXAPUDSPRegs *apu_regs;
+    hwaddr scratch_base;
+    unsigned int scratch_max_sge;
+    hwaddr fifo_base;
+    unsigned int fifo_max_sge;
+    MCPXAPUFIFO out_fifos[GP_OUTPUT_FIFO_COUNT];
+    MCPXAPUFIFO in_fifos[GP_INPUT_FIFO_COUNT];
+
+    /* Image being written with CAPTURE_DSP_FRAMES, protected by lock */
+    FILE *capture;
+    uint32_t capture_frames;
+
+    /* Load of the last frame, protected by lock */
+    uint64_t dma_bytes;     /* Moved by DMA during the current frame */
+    struct {
+        uint64_t instructions;
+        uint64_t cycles;
+        uint64_t dma_bytes;
+        int64_t run_ns;
+    } stats;
+} MCPXAPUDSP;
 
 typedef struct MCPXAPUState {
     PCIDevice dev;
@@ -319,29 +481,84 @@ typedef struct MCPXAPUState {
 
     MemoryRegion mmio;
 
+    /* Voice lock, protects all state shared between MMIO and the SE thread */
+    QemuMutex lock;
+    bool exiting;
+
     /* Setup Engine */
     struct {
-        QEMUTimer *frame_timer;
+        QemuThread thread;
+        QemuSemaphore wake;
+        bool running;
+        int64_t start_time;
+        uint64_t frames;
+        bool irq_pending;
+
+        /* How far the SE lags the virtual clock */
+        uint64_t frames_behind;
+        uint64_t frames_behind_max;
+        uint64_t frames_dropped;
     } se;
 
+    /* Host audio output */
+    struct {
+        QEMUSoundCard card;
+        SWVoiceOut *voice;
+
+        /* What each DSP wrote to its output FIFO 0 during the current frame,
+         * as interleaved stereo */
+        int32_t gp_frame[NUM_SAMPLES_PER_FRAME * 2];
+        int32_t ep_frame[NUM_SAMPLES_PER_FRAME * 2];
+        unsigned int gp_count;
+        unsigned int ep_count;
+
+        /* Written by the SE thread, read by the audio callback */
+        int16_t ring[OUT_RING_FRAMES][2];
+        uint32_t write_pos;
+        uint32_t read_pos;
+
+        /* Audio callback state, buf[buf_pos..buf_len) was resampled but
+         * not yet accepted by the voice */
+        int16_t buf[256][2];
+        unsigned int buf_pos;
+        unsigned int buf_len;
+        bool primed;
+        float fill_avg;
+        float frac;
+        unsigned int underruns;
+        unsigned int overruns;
+    } out;
+
     /* Voice Processor */
     struct {
         MemoryRegion mmio;
+        VPVoiceCache voices[MCPX_HW_MAX_VOICES];
+        uint32_t frame;
+
+        /* Active voices of the current frame, in list order */
+        GArray *active_voices;
+
+        /* Partial mixbins, one per chunk of VP_CHUNK_VOICES voices */
+        float (*chunk_mixbins)[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME];
+        unsigned int chunk_capacity;
+        unsigned int num_chunks;
+        int next_chunk;
+
+        VPContext ctx;
+        VPWorker workers[VP_MAX_WORKERS];
+        unsigned int num_workers;
+        QemuSemaphore work_done;
+
+        /* Load of the last frame */
+        unsigned int list_voices[ARRAY_SIZE(voice_list_regs)];
+        unsigned int samples_decoded[VP_NUM_FORMATS];
     } vp;
 
     /* Global Processor */
-    struct {
-        MemoryRegion mmio;
-        DSPState *dsp;
-        uint32_t regs[0x10000];
-    } gp;
+    MCPXAPUDSP gp;
 
     /* Encode Processor */
-    struct {
-        MemoryRegion mmio;
-        DSPState *dsp;
-        uint32_t regs[0x10000];
-    } ep;
+    MCPXAPUDSP ep;
 
     uint32_t inbuf_sge_handle; //FIXME: Where is this stored?
     uint32_t outbuf_sge_handle; //FIXME: Where is this stored?
@@ -379,6 +596,13 @@ static void voice_set_mask(MCPXAPUState *d,
 
 static void update_irq(MCPXAPUState *d)
 {
+    /* The interrupt line can only be changed while holding the BQL, the SE
+     * thread picks this up once it is able to take it */
+    if (!qemu_mutex_iothread_locked()) {
+        d->se.irq_pending = true;
+        return;
+    }
+
     if ((d->regs[NV_PAPU_IEN] & NV_PAPU_ISTS_GINTSTS)
         && ((d->regs[NV_PAPU_ISTS] & ~NV_PAPU_ISTS_GINTSTS)
               & d->regs[NV_PAPU_IEN])) {
@@ -398,6 +622,8 @@ static uint64_t mcpx_apu_read(void *opaque,
 {
     MCPXAPUState *d = opaque;
 
+    qemu_mutex_lock(&d->lock);
+
     uint64_t r = 0;
     switch (addr) {
     case NV_PAPU_XGSCNT:
@@ -410,6 +636,8 @@ static uint64_t mcpx_apu_read(void *opaque,
         break;
     }
 
+    qemu_mutex_unlock(&d->lock);
+
     MCPX_DPRINTF("mcpx apu: read [0x%llx] -> 0x%llx\n", addr, r);
     return r;
 }
@@ -421,6 +649,8 @@ static void mcpx_apu_write(void *opaque, hwaddr addr,
 
     MCPX_DPRINTF("mcpx apu: [0x%llx] = 0x%llx\n", addr, val);
 
+    qemu_mutex_lock(&d->lock);
+
     switch (addr) {
     case NV_PAPU_ISTS:
         /* the bits of the interrupts to clear are wrtten */
@@ -430,11 +660,13 @@ static void mcpx_apu_write(void *opaque, hwaddr addr,
     case NV_PAPU_SECTL:
         if (((val & NV_PAPU_SECTL_XCNTMODE) >> 3)
               == NV_PAPU_SECTL_XCNTMODE_OFF) {
-            timer_del(d->se.frame_timer);
-        } else {
-            timer_mod(d->se.frame_timer,
-                qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 10);
+            d->se.running = false;
+        } else if (!d->se.running) {
+            d->se.running = true;
+            d->se.start_time = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            d->se.frames = 0;
         }
+        qemu_sem_post(&d->se.wake);
         d->regs[addr] = val;
         break;
     case NV_PAPU_FEMEMDATA:
@@ -450,6 +682,8 @@ static void mcpx_apu_write(void *opaque, hwaddr addr,
         }
         break;
     }
+
+    qemu_mutex_unlock(&d->lock);
 }
 
 static const MemoryRegionOps mcpx_apu_mmio_ops = {
@@ -765,7 +999,9 @@ static void vp_write(void *opaque, hwaddr addr,
     case NV1BA0_PIO_SET_CURRENT_OUTBUF_SGE:
     case NV1BA0_PIO_SET_CURRENT_OUTBUF_SGE_OFFSET:
         /* TODO: these should instead be queueing up fe commands */
+        qemu_mutex_lock(&d->lock);
         fe_method(d, addr, val);
+        qemu_mutex_unlock(&d->lock);
         break;
     default:
         break;
@@ -777,36 +1013,88 @@ static const MemoryRegionOps vp_ops = {
     .write = vp_write,
 };
 
-static void scatter_gather_rw(MCPXAPUState *d,
+/* Host pointer to the page of an SGE entry, NULL if it is not in RAM */
+static uint8_t *sge_lookup(MCPXAPUState *d, hwaddr sge_base,
+                           unsigned int page_entry)
+{
+    uint32_t prd_address = ldl_le_phys(&address_space_memory,
+                                       sge_base + page_entry * 8 + 0);
+    /* uint32_t prd_control = ldl_le_phys(&address_space_memory,
+                                        sge_base + page_entry * 8 + 4); */
+
+    if ((uint64_t)prd_address + TARGET_PAGE_SIZE
+            > memory_region_size(d->ram)) {
+        qemu_log_mask(LOG_GUEST_ERROR, "mcpx_apu: SGE entry %u points "
+                      "outside of RAM (0x%" PRIx32 ")\n",
+                      page_entry, prd_address);
+        return NULL;
+    }
+    return d->ram_ptr + prd_address;
+}
+
+/* Host pointer to a page of a DSP's scratch or FIFO buffer, NULL if the
+ * entry is out of range */
+static uint8_t *sge_table_map(MCPXAPUDSP *p, MCPXAPUSGETable *t,
+                              hwaddr sge_base, unsigned int max_sge,
+                              unsigned int page_entry)
+{
+    if (page_entry > max_sge) {
+        qemu_log_mask(LOG_GUEST_ERROR, "mcpx_apu: %s DMA to SGE entry %u "
+                      "beyond max %u\n", p->name, page_entry, max_sge);
+        return NULL;
+    }
+
+    if (t->pages == NULL || t->base != sge_base || t->max_sge != max_sge) {
+        g_free(t->pages);
+        t->base = sge_base;
+        t->max_sge = max_sge;
+        t->num_pages = MIN(max_sge, MCPX_SGE_CACHE_ENTRIES - 1) + 1;
+        t->pages = g_new0(MCPXAPUSGEPage, t->num_pages);
+    }
+
+    if (page_entry >= t->num_pages) {
+        return sge_lookup(p->d, sge_base, page_entry);
+    }
+
+    MCPXAPUSGEPage *page = &t->pages[page_entry];
+    if (page->frame != p->frame) {
+        page->ptr = sge_lookup(p->d, sge_base, page_entry);
+        page->frame = p->frame;
+    }
+
+    return page->ptr;
+}
+
+static void scatter_gather_rw(MCPXAPUDSP *p, MCPXAPUSGETable *t,
                               hwaddr sge_base, unsigned int max_sge,
                               uint8_t *ptr, uint32_t addr, size_t len,
                               bool dir)
 {
+    MCPXAPUState *d = p->d;
     unsigned int page_entry = addr / TARGET_PAGE_SIZE;
     unsigned int offset_in_page = addr % TARGET_PAGE_SIZE;
     unsigned int bytes_to_copy = TARGET_PAGE_SIZE - offset_in_page;
 
-    while (len > 0) {
-        assert(page_entry <= max_sge);
-
-        uint32_t prd_address = ldl_le_phys(&address_space_memory,
-                                           sge_base + page_entry * 8 + 0);
-        /* uint32_t prd_control = ldl_le_phys(&address_space_memory,
-                                            sge_base + page_entry * 8 + 4); */
+    p->dma_bytes += len;
 
-        hwaddr paddr = prd_address + offset_in_page;
+    while (len > 0) {
+        uint8_t *page = sge_table_map(p, t, sge_base, max_sge, page_entry);
 
         if (bytes_to_copy > len) {
             bytes_to_copy = len;
         }
 
-        assert(paddr + bytes_to_copy < memory_region_size(d->ram));
-
-        if (dir) {
-            memcpy(&d->ram_ptr[paddr], ptr, bytes_to_copy);
-            memory_region_set_dirty(d->ram, paddr, bytes_to_copy);
+        if (page == NULL) {
+            /* Writes are dropped, reads see zeroes */
+            if (!dir) {
+                memset(ptr, 0, bytes_to_copy);
+            }
+        } else if (dir) {
+            memcpy(page + offset_in_page, ptr, bytes_to_copy);
+            memory_region_set_dirty(d->ram, page + offset_in_page - d->ram_ptr,
+                                    bytes_to_copy);
         } else {
-            memcpy(ptr, &d->ram_ptr[paddr], bytes_to_copy);
+            memcpy(ptr, page + offset_in_page, bytes_to_copy);
         }
 
         ptr += bytes_to_copy;
@@ -826,7 +1114,8 @@ static void gp_scratch_rw(void *opaque,
                           bool dir)
 {
     MCPXAPUState *d = opaque;
-    scatter_gather_rw(d, d->regs[NV_PAPU_GPSADDR], d->regs[NV_PAPU_GPSMAXSGE],
+    scatter_gather_rw(&d->gp, &d->gp.scratch_sge,
+                      d->gp.scratch_base, d->gp.scratch_max_sge,
                       ptr, addr, len, dir);
 }
 
@@ -837,11 +1126,13 @@ static void ep_scratch_rw(void *opaque,
                           bool dir)
 {
     MCPXAPUState *d = opaque;
-    scatter_gather_rw(d, d->regs[NV_PAPU_EPSADDR], d->regs[NV_PAPU_EPSMAXSGE],
+    scatter_gather_rw(&d->ep, &d->ep.scratch_sge,
+                      d->ep.scratch_base, d->ep.scratch_max_sge,
                       ptr, addr, len, dir);
 }
 
-static uint32_t circular_scatter_gather_rw(MCPXAPUState *d,
+static uint32_t circular_scatter_gather_rw(MCPXAPUDSP *p,
+                                           MCPXAPUSGETable *t,
                                            hwaddr sge_base,
                                            unsigned int max_sge,
                                            uint8_t *ptr,
@@ -861,7 +1152,8 @@ static uint32_t circular_scatter_gather_rw(MCPXAPUState *d,
             dir ? "write" : "read", base, end, cur, bytes_to_copy, len);
 
         assert((cur >= base) && ((cur + bytes_to_copy) <= end));
-        scatter_gather_rw(d, sge_base, max_sge, ptr, cur, bytes_to_copy, dir);
+        scatter_gather_rw(p, t, sge_base, max_sge, ptr, cur, bytes_to_copy,
+                          dir);
 
         ptr += bytes_to_copy;
         len -= bytes_to_copy;
@@ -877,43 +1169,162 @@ static uint32_t circular_scatter_gather_rw(MCPXAPUState *d,
     return cur;
 }
 
+/* Collect output FIFO samples, assuming 24 bit samples in 32 bit words */
+static void out_capture_fifo(int32_t *frame, unsigned int *count,
+                             const uint8_t *ptr, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i + 4 <= len && *count < NUM_SAMPLES_PER_FRAME * 2; i += 4) {
+        frame[(*count)++] = (int32_t)(ldl_he_p(ptr + i) << 8) >> 8;
+    }
+}
+
+/* Queue the frame's output for the host, preferring the EP unless it is
+ * idle. Called from the SE thread at the end of each frame */
+static void out_push_frame(MCPXAPUState *d)
+{
+    const int32_t *frame = d->out.ep_count ? d->out.ep_frame
+                                           : d->out.gp_frame;
+    unsigned int count = d->out.ep_count ? d->out.ep_count
+                                         : d->out.gp_count;
+    uint32_t read_pos = atomic_load_acquire(&d->out.read_pos);
+    uint32_t write_pos = d->out.write_pos;
+    unsigned int i;
+
+    for (i = 0; i + 1 < count; i += 2) {
+        if (write_pos - read_pos >= OUT_RING_FRAMES) {
+            d->out.overruns++;
+            trace_mcpx_apu_out_overrun(count / 2 - i / 2);
+            break;
+        }
+        int16_t *dst = d->out.ring[write_pos & (OUT_RING_FRAMES - 1)];
+        dst[0] = frame[i] >> 8;
+        dst[1] = frame[i + 1] >> 8;
+        write_pos++;
+    }
+    atomic_store_release(&d->out.write_pos, write_pos);
+
+    d->out.gp_count = 0;
+    d->out.ep_count = 0;
+}
+
+/* Stereo frames queued for the host */
+static uint32_t out_fill_level(MCPXAPUState *d)
+{
+    return atomic_load_acquire(&d->out.write_pos)
+           - atomic_load_acquire(&d->out.read_pos);
+}
+
+/* Resample the ring into buf, consuming slightly faster or slower than
+ * 48 kHz to keep the fill level around OUT_TARGET_FILL. This absorbs the
+ * drift between the virtual clock the SE runs on and the host device */
+static void out_resample(MCPXAPUState *d, int16_t (*buf)[2], int frames)
+{
+    uint32_t write_pos = atomic_load_acquire(&d->out.write_pos);
+    uint32_t read_pos = d->out.read_pos;
+    uint32_t fill = write_pos - read_pos;
+    int i = 0;
+
+    if (!d->out.primed && fill >= OUT_TARGET_FILL) {
+        d->out.primed = true;
+        d->out.fill_avg = fill;
+        d->out.frac = 0.0f;
+    }
+
+    if (d->out.primed) {
+        d->out.fill_avg += (fill - d->out.fill_avg) * 0.05f;
+        float error = (d->out.fill_avg - OUT_TARGET_FILL) / OUT_TARGET_FILL;
+        float step = 1.0f + MIN(MAX(error * 0.01f, -OUT_MAX_DRIFT),
+                                OUT_MAX_DRIFT);
+
+        for (; i < frames; i++) {
+            if (fill < 2) {
+                /* Underrun, wait until the target is reached again */
+                d->out.underruns++;
+                trace_mcpx_apu_out_underrun(frames - i);
+                d->out.primed = false;
+                break;
+            }
+            int16_t *a = d->out.ring[read_pos & (OUT_RING_FRAMES - 1)];
+            int16_t *b = d->out.ring[(read_pos + 1) & (OUT_RING_FRAMES - 1)];
+            float frac = d->out.frac;
+            buf[i][0] = a[0] + (b[0] - a[0]) * frac;
+            buf[i][1] = a[1] + (b[1] - a[1]) * frac;
+
+            d->out.frac += step;
+            unsigned int advance = (unsigned int)d->out.frac;
+            d->out.frac -= advance;
+            read_pos += advance;
+            fill -= advance;
+        }
+        atomic_store_release(&d->out.read_pos, read_pos);
+    }
+
+    memset(buf[i], 0, (frames - i) * sizeof(buf[0]));
+}
+
+static void out_callback(void *opaque, int free_bytes)
+{
+    MCPXAPUState *d = opaque;
+    const size_t frame_size = sizeof(d->out.buf[0]);
+
+    while (free_bytes >= frame_size) {
+        /* Only resample once the previous batch was written out, the read
+         * position has already moved past it */
+        if (d->out.buf_pos == d->out.buf_len) {
+            d->out.buf_pos = 0;
+            d->out.buf_len = MIN(free_bytes / frame_size,
+                                 ARRAY_SIZE(d->out.buf));
+            out_resample(d, d->out.buf, d->out.buf_len);
+        }
+        int written = AUD_write(d->out.voice, d->out.buf[d->out.buf_pos],
+                                (d->out.buf_len - d->out.buf_pos)
+                                * frame_size);
+        if (written <= 0) {
+            break;
+        }
+        d->out.buf_pos += written / frame_size;
+        free_bytes -= written;
+    }
+}
+
+static void apu_dsp_fifo_rw(MCPXAPUDSP *p, MCPXAPUFIFO *f,
+                            uint8_t *ptr, size_t len, bool dir)
+{
+    uint32_t cur = f->cur;
+
+    /* DSP hangs if current >= end; but forces current >= base */
+    assert(cur < f->end);
+    if (cur < f->base) {
+        cur = f->base;
+    }
+
+    f->cur = circular_scatter_gather_rw(p, &p->fifo_sge,
+        p->fifo_base, p->fifo_max_sge,
+        ptr, f->base, f->end, cur, len, dir);
+    f->moved = true;
+}
+
 static void gp_fifo_rw(void *opaque, uint8_t *ptr,
                        unsigned int index, size_t len,
                        bool dir)
 {
     MCPXAPUState *d = opaque;
-    uint32_t base;
-    uint32_t end;
-    hwaddr cur_reg;
+    MCPXAPUFIFO *f;
     if (dir) {
         assert(index < GP_OUTPUT_FIFO_COUNT);
-        base = GET_MASK(d->regs[NV_PAPU_GPOFBASE0 + 0x10 * index],
-                        NV_PAPU_GPOFBASE0_VALUE);
-        end = GET_MASK(d->regs[NV_PAPU_GPOFEND0 + 0x10 * index],
-                       NV_PAPU_GPOFEND0_VALUE);
-        cur_reg = NV_PAPU_GPOFCUR0 + 0x10 * index;
+        f = &d->gp.out_fifos[index];
     } else {
         assert(index < GP_INPUT_FIFO_COUNT);
-        base = GET_MASK(d->regs[NV_PAPU_GPIFBASE0 + 0x10 * index],
-                        NV_PAPU_GPOFBASE0_VALUE);
-        end = GET_MASK(d->regs[NV_PAPU_GPIFEND0 + 0x10 * index],
-                       NV_PAPU_GPOFEND0_VALUE);
-        cur_reg = NV_PAPU_GPIFCUR0 + 0x10 * index;
+        f = &d->gp.in_fifos[index];
     }
 
-    uint32_t cur = GET_MASK(d->regs[cur_reg], NV_PAPU_GPOFCUR0_VALUE);
-
-    /* DSP hangs if current >= end; but forces current >= base */
-    assert(cur < end);
-    if (cur < base) {
-        cur = base;
+    if (dir && index == 0) {
+        out_capture_fifo(d->out.gp_frame, &d->out.gp_count, ptr, len);
     }
 
-    cur = circular_scatter_gather_rw(d,
-        d->regs[NV_PAPU_GPFADDR], d->regs[NV_PAPU_GPFMAXSGE],
-        ptr, base, end, cur, len, dir);
-
-    SET_MASK(d->regs[cur_reg], NV_PAPU_GPOFCUR0_VALUE, cur);
+    apu_dsp_fifo_rw(&d->gp, f, ptr, len, dir);
 }
 
 static void ep_fifo_rw(void *opaque, uint8_t *ptr,
@@ -921,48 +1332,202 @@ static void ep_fifo_rw(void *opaque, uint8_t *ptr,
                        bool dir)
 {
     MCPXAPUState *d = opaque;
-    uint32_t base;
-    uint32_t end;
-    hwaddr cur_reg;
+    MCPXAPUFIFO *f;
     if (dir) {
         assert(index < EP_OUTPUT_FIFO_COUNT);
-        base = GET_MASK(d->regs[NV_PAPU_EPOFBASE0 + 0x10 * index],
-                        NV_PAPU_GPOFBASE0_VALUE);
-        end = GET_MASK(d->regs[NV_PAPU_EPOFEND0 + 0x10 * index],
-                       NV_PAPU_GPOFEND0_VALUE);
-        cur_reg = NV_PAPU_EPOFCUR0 + 0x10 * index;
+        f = &d->ep.out_fifos[index];
     } else {
         assert(index < EP_INPUT_FIFO_COUNT);
-        base = GET_MASK(d->regs[NV_PAPU_EPIFBASE0 + 0x10 * index],
-                        NV_PAPU_GPOFBASE0_VALUE);
-        end = GET_MASK(d->regs[NV_PAPU_EPIFEND0 + 0x10 * index],
-                       NV_PAPU_GPOFEND0_VALUE);
-        cur_reg = NV_PAPU_EPIFCUR0 + 0x10 * index;
+        f = &d->ep.in_fifos[index];
     }
 
-    uint32_t cur = GET_MASK(d->regs[cur_reg], NV_PAPU_GPOFCUR0_VALUE);
+    if (dir && index == 0) {
+        out_capture_fifo(d->out.ep_frame, &d->out.ep_count, ptr, len);
+    }
 
-    /* DSP hangs if current >= end; but forces current >= base */
-    assert(cur < end);
-    if (cur < base) {
-        cur = base;
+    apu_dsp_fifo_rw(&d->ep, f, ptr, len, dir);
+}
+
+static const MCPXAPUDSPRegs gp_apu_regs = {
+    .saddr = NV_PAPU_GPSADDR,
+    .smaxsge = NV_PAPU_GPSMAXSGE,
+    .faddr = NV_PAPU_GPFADDR,
+    .fmaxsge = NV_PAPU_GPFMAXSGE,
+    .ofbase = NV_PAPU_GPOFBASE0,
+    .ofend = NV_PAPU_GPOFEND0,
+    .ofcur = NV_PAPU_GPOFCUR0,
+    .ifbase = NV_PAPU_GPIFBASE0,
+    .ifend = NV_PAPU_GPIFEND0,
+    .ifcur = NV_PAPU_GPIFCUR0,
+};
+
+static const MCPXAPUDSPRegs ep_apu_regs = {
+    .saddr = NV_PAPU_EPSADDR,
+    .smaxsge = NV_PAPU_EPSMAXSGE,
+    .faddr = NV_PAPU_EPFADDR,
+    .fmaxsge = NV_PAPU_EPFMAXSGE,
+    .ofbase = NV_PAPU_EPOFBASE0,
+    .ofend = NV_PAPU_EPOFEND0,
+    .ofcur = NV_PAPU_EPOFCUR0,
+    .ifbase = NV_PAPU_EPIFBASE0,
+    .ifend = NV_PAPU_EPIFEND0,
+    .ifcur = NV_PAPU_EPIFCUR0,
+};
+
+static void apu_dsp_load_scratch_regs(MCPXAPUState *d, MCPXAPUDSP *p)
+{
+    p->scratch_base = d->regs[p->apu_regs->saddr];
+    p->scratch_max_sge = d->regs[p->apu_regs->smaxsge];
+}
+
+static void apu_dsp_load_fifo(MCPXAPUState *d, MCPXAPUFIFO *f,
+                              hwaddr base_reg, hwaddr end_reg, hwaddr cur_reg)
+{
+    f->base = GET_MASK(d->regs[base_reg], NV_PAPU_GPOFBASE0_VALUE);
+    f->end = GET_MASK(d->regs[end_reg], NV_PAPU_GPOFEND0_VALUE);
+    f->cur = GET_MASK(d->regs[cur_reg], NV_PAPU_GPOFCUR0_VALUE);
+    f->moved = false;
+}
+
+/* Copy in the DMA setup for the next frame, called by the SE thread with
+ * the voice lock and p->lock held */
+static void apu_dsp_load_regs(MCPXAPUState *d, MCPXAPUDSP *p)
+{
+    const MCPXAPUDSPRegs *r = p->apu_regs;
+    unsigned int i;
+
+    apu_dsp_load_scratch_regs(d, p);
+    p->fifo_base = d->regs[r->faddr];
+    p->fifo_max_sge = d->regs[r->fmaxsge];
+    for (i = 0; i < ARRAY_SIZE(p->out_fifos); i++) {
+        apu_dsp_load_fifo(d, &p->out_fifos[i], r->ofbase + 0x10 * i,
+                          r->ofend + 0x10 * i, r->ofcur + 0x10 * i);
+    }
+    for (i = 0; i < ARRAY_SIZE(p->in_fifos); i++) {
+        apu_dsp_load_fifo(d, &p->in_fifos[i], r->ifbase + 0x10 * i,
+                          r->ifend + 0x10 * i, r->ifcur + 0x10 * i);
+    }
+}
+
+/* Copy back the FIFO positions the last frame advanced, called by the SE
+ * thread with the voice lock held after waiting for the frame */
+static void apu_dsp_store_regs(MCPXAPUState *d, MCPXAPUDSP *p)
+{
+    const MCPXAPUDSPRegs *r = p->apu_regs;
+    unsigned int i;
+
+    qemu_mutex_lock(&p->lock);
+    for (i = 0; i < ARRAY_SIZE(p->out_fifos); i++) {
+        if (p->out_fifos[i].moved) {
+            SET_MASK(d->regs[r->ofcur + 0x10 * i], NV_PAPU_GPOFCUR0_VALUE,
+                     p->out_fifos[i].cur);
+            p->out_fifos[i].moved = false;
+        }
+    }
+    for (i = 0; i < ARRAY_SIZE(p->in_fifos); i++) {
+        if (p->in_fifos[i].moved) {
+            SET_MASK(d->regs[r->ifcur + 0x10 * i], NV_PAPU_GPOFCUR0_VALUE,
+                     p->in_fifos[i].cur);
+            p->in_fifos[i].moved = false;
+        }
+    }
+    qemu_mutex_unlock(&p->lock);
+}
+
+#if CAPTURE_DSP_FRAMES
+static void apu_dsp_capture_finish(MCPXAPUDSP *p)
+{
+    if (!p->capture) {
+        return;
+    }
+    fseek(p->capture, offsetof(DSPImageHeader, num_frames), SEEK_SET);
+    fwrite(&p->capture_frames, sizeof(p->capture_frames), 1, p->capture);
+    fclose(p->capture);
+    p->capture = NULL;
+}
+
+/* Start a new image of a DSP that was just bootstrapped */
+static void apu_dsp_capture_start(MCPXAPUDSP *p)
+{
+    hwaddr sge_base = p->scratch_base;
+    unsigned int max_sge = p->scratch_max_sge;
+    DSPImageHeader *header = g_new0(DSPImageHeader, 1);
+    uint8_t *scratch;
+    unsigned int i;
+
+    apu_dsp_capture_finish(p);
+
+    char *path = g_strdup_printf("mcpx-%s-image.bin", p->name);
+    p->capture = fopen(path, "wb");
+    p->capture_frames = 0;
+    g_free(path);
+    if (!p->capture) {
+        g_free(header);
+        return;
     }
 
-    cur = circular_scatter_gather_rw(d,
-        d->regs[NV_PAPU_EPFADDR], d->regs[NV_PAPU_EPFMAXSGE],
-        ptr, base, end, cur, len, dir);
+    header->magic = DSP_IMAGE_MAGIC;
+    header->scratch_size = (max_sge + 1) * TARGET_PAGE_SIZE;
+    for (i = 0; i < DSP_PRAM_SIZE; i++) {
+        header->pram[i] = dsp_read_memory(p->dsp, 'P', i);
+    }
+    for (i = 0; i < DSP_XRAM_SIZE; i++) {
+        header->xram[i] = dsp_read_memory(p->dsp, 'X', i);
+    }
+    for (i = 0; i < DSP_YRAM_SIZE; i++) {
+        header->yram[i] = dsp_read_memory(p->dsp, 'Y', i);
+    }
+    fwrite(header, sizeof(*header), 1, p->capture);
 
-    SET_MASK(d->regs[cur_reg], NV_PAPU_GPOFCUR0_VALUE, cur);
+    scratch = g_malloc(header->scratch_size);
+    scatter_gather_rw(p, &p->scratch_sge, sge_base, max_sge,
+                      scratch, 0, header->scratch_size, false);
+    fwrite(scratch, header->scratch_size, 1, p->capture);
+
+    g_free(scratch);
+    g_free(header);
 }
 
-static void proc_rst_write(DSPState *dsp, uint32_t oldval, uint32_t val)
+/* Append the mixbuffer input of the frame about to run */
+static void apu_dsp_capture_frame(MCPXAPUDSP *p)
 {
+    uint32_t mixbuffer[DSP_MIXBUFFER_SIZE];
+    unsigned int i;
+
+    if (!p->capture) {
+        return;
+    }
+
+    for (i = 0; i < DSP_MIXBUFFER_SIZE; i++) {
+        mixbuffer[i] = dsp_read_memory(p->dsp, 'X', DSP_MIXBUFFER_BASE + i);
+    }
+    fwrite(mixbuffer, sizeof(mixbuffer), 1, p->capture);
+
+    if (++p->capture_frames == CAPTURE_DSP_FRAMES) {
+        apu_dsp_capture_finish(p);
+    }
+}
+#endif
+
+static void proc_rst_write(MCPXAPUDSP *p, uint32_t oldval, uint32_t val)
+{
+    DSPState *dsp = p->dsp;
+
+    /* The bootstrap DMA must not use SGE entries from before the reset */
+    p->frame++;
+
     if (!(val & NV_PAPU_GPRST_GPRST) || !(val & NV_PAPU_GPRST_GPDSPRST)) {
         dsp_reset(dsp);
     } else if (
         (!(oldval & NV_PAPU_GPRST_GPRST) || !(oldval & NV_PAPU_GPRST_GPDSPRST))
         && ((val & NV_PAPU_GPRST_GPRST) && (val & NV_PAPU_GPRST_GPDSPRST))) {
+        /* The SGE registers are only written by MMIO, under the BQL that is
+         * held here as well */
+        apu_dsp_load_scratch_regs(p->d, p);
         dsp_bootstrap(dsp);
+#if CAPTURE_DSP_FRAMES
+        apu_dsp_capture_start(p);
+#endif
     }
 }
 
@@ -976,6 +1541,8 @@ static uint64_t gp_read(void *opaque,
     assert(size == 4);
     assert(addr % 4 == 0);
 
+    qemu_mutex_lock(&d->gp.lock);
+
     uint64_t r = 0;
     switch (addr) {
     case NV_PAPU_GPXMEM ... NV_PAPU_GPXMEM + 0x1000 * 4 - 1: {
@@ -1002,6 +1569,9 @@ static uint64_t gp_read(void *opaque,
         r = d->gp.regs[addr];
         break;
     }
+
+    qemu_mutex_unlock(&d->gp.lock);
+
     MCPX_DPRINTF("mcpx apu GP: read [0x%llx] -> 0x%llx\n", addr, r);
     return r;
 }
@@ -1016,6 +1586,8 @@ static void gp_write(void *opaque, hwaddr addr,
 
     MCPX_DPRINTF("mcpx apu GP: [0x%llx] = 0x%llx\n", addr, val);
 
+    qemu_mutex_lock(&d->gp.lock);
+
     switch (addr) {
     case NV_PAPU_GPXMEM ... NV_PAPU_GPXMEM + 0x1000 * 4 - 1: {
         uint32_t xaddr = (addr - NV_PAPU_GPXMEM) / 4;
@@ -1038,13 +1610,15 @@ static void gp_write(void *opaque, hwaddr addr,
         break;
     }
     case NV_PAPU_GPRST:
-        proc_rst_write(d->gp.dsp, d->gp.regs[NV_PAPU_GPRST], val);
+        proc_rst_write(&d->gp, d->gp.regs[NV_PAPU_GPRST], val);
         d->gp.regs[NV_PAPU_GPRST] = val;
         break;
     default:
         d->gp.regs[addr] = val;
         break;
     }
+
+    qemu_mutex_unlock(&d->gp.lock);
 }
 
 static const MemoryRegionOps gp_ops = {
@@ -1062,6 +1636,8 @@ static uint64_t ep_read(void *opaque,
     assert(size == 4);
     assert(addr % 4 == 0);
 
+    qemu_mutex_lock(&d->ep.lock);
+
     uint64_t r = 0;
     switch (addr) {
     case NV_PAPU_EPXMEM ... NV_PAPU_EPXMEM + 0xC00 * 4 - 1: {
@@ -1083,6 +1659,9 @@ static uint64_t ep_read(void *opaque,
         r = d->ep.regs[addr];
         break;
     }
+
+    qemu_mutex_unlock(&d->ep.lock);
+
     MCPX_DPRINTF("mcpx apu EP: read [0x%llx] -> 0x%llx\n", addr, r);
     return r;
 }
@@ -1097,6 +1676,8 @@ static void ep_write(void *opaque, hwaddr addr,
 
     MCPX_DPRINTF("mcpx apu EP: [0x%llx] = 0x%llx\n", addr, val);
 
+    qemu_mutex_lock(&d->ep.lock);
+
     switch (addr) {
     case NV_PAPU_EPXMEM ... NV_PAPU_EPXMEM + 0xC00 * 4 - 1: {
         uint32_t xaddr = (addr - NV_PAPU_EPXMEM) / 4;
@@ -1114,13 +1695,15 @@ static void ep_write(void *opaque, hwaddr addr,
         break;
     }
     case NV_PAPU_EPRST:
-        proc_rst_write(d->ep.dsp, d->ep.regs[NV_PAPU_EPRST], val);
+        proc_rst_write(&d->ep, d->ep.regs[NV_PAPU_EPRST], val);
         d->ep.regs[NV_PAPU_EPRST] = val;
         break;
     default:
         d->ep.regs[addr] = val;
         break;
     }
+
+    qemu_mutex_unlock(&d->ep.lock);
 }
 
 static const MemoryRegionOps ep_ops = {
@@ -1128,42 +1711,194 @@ static const MemoryRegionOps ep_ops = {
     .write = ep_write,
 };
 
-#if 0
 #include "adpcm_block.h"
 
-static hwaddr get_data_ptr(hwaddr sge_base, unsigned int max_sge, uint32_t addr) {
-    unsigned int entry = addr / TARGET_PAGE_SIZE;
-    assert(entry <= max_sge);
-    uint32_t prd_address = ldl_le_phys(&address_space_memory, sge_base + entry*4*2);
-    // uint32_t prd_control = ldl_le_phys(&address_space_memory, sge_base + entry*4*2 + 4);
-    MCPX_DPRINTF("Addr: 0x%08X, control: 0x%08X\n", prd_address, prd_control);
+/* Vectors used by the voice processor mixing kernels */
+typedef float vp_vec __attribute__((vector_size(16)));
+#define VP_VEC_LEN (sizeof(vp_vec) / sizeof(float))
+
+typedef struct VPVoiceFormat {
+    uint32_t ba;
+    unsigned int channels;
+    unsigned int sample_size;
+    unsigned int container_size;
+    unsigned int block_size;    /* Bytes per sample frame or ADPCM block */
+    bool adpcm;
+} VPVoiceFormat;
+
+static inline uint32_t voice_reg_get(const uint32_t *regs,
+                                     hwaddr offset, uint32_t mask)
+{
+    return (regs[offset / 4] & mask) >> ctz32(mask);
+}
+
+static inline void voice_reg_set(uint32_t *regs,
+                                 hwaddr offset, uint32_t mask, uint32_t val)
+{
+    regs[offset / 4] = (regs[offset / 4] & ~mask)
+                       | ((val << ctz32(mask)) & mask);
+}
+
+/* Host pointer to a page of voice data. The SGE entry is only looked up
+ * once per frame */
+static uint8_t *vp_map_page(MCPXAPUState *d, VPContext *ctx, uint32_t page)
+{
+    unsigned int slot = page % VP_SGE_CACHE_SIZE;
+
+    if (ctx->sge_cache[slot].frame == d->vp.frame
+        && ctx->sge_cache[slot].page == page) {
+        return ctx->sge_cache[slot].ptr;
+    }
+
+    uint32_t prd_address = ldl_le_phys(&address_space_memory,
+                                       d->regs[NV_PAPU_VPSGEADDR] + page * 8);
+    uint8_t *ptr = NULL;
+    if ((uint64_t)prd_address + TARGET_PAGE_SIZE
+          <= memory_region_size(d->ram)) {
+        ptr = d->ram_ptr + prd_address;
+    }
+
+    ctx->sge_cache[slot].page = page;
+    ctx->sge_cache[slot].frame = d->vp.frame;
+    ctx->sge_cache[slot].ptr = ptr;
+    return ptr;
+}
+
+static void vp_read_bytes(MCPXAPUState *d, VPContext *ctx, uint32_t addr,
+                          void *buf, size_t len)
+{
+    uint8_t *dst = buf;
+
+    while (len > 0) {
+        uint32_t offset = addr % TARGET_PAGE_SIZE;
+        size_t n = MIN(len, TARGET_PAGE_SIZE - offset);
+        uint8_t *page = vp_map_page(d, ctx, addr / TARGET_PAGE_SIZE);
+        if (page) {
+            memcpy(dst, page + offset, n);
+        } else {
+            memset(dst, 0, n);
+        }
+        dst += n;
+        addr += n;
+        len -= n;
+    }
+}
+
+/* Fetch one sample frame of a voice, scaled to 24 bits. ADPCM blocks are
+ * decoded as a whole the first time one of their samples is needed */
+static void vp_fetch_sample(MCPXAPUState *d, VPContext *ctx, VPVoiceCache *vc,
+                            const VPVoiceFormat *fmt, uint32_t index,
+                            float out[2])
+{
+    unsigned int channel;
+
+    if (fmt->adpcm) {
+        uint32_t block = index / VP_ADPCM_BLOCK_SAMPLES;
+        unsigned int pos = index % VP_ADPCM_BLOCK_SAMPLES;
+        unsigned int slot = block % VP_ADPCM_RING_BLOCKS;
+
+        if (vc->adpcm[slot].block != block) {
+            uint32_t data[72 / 4];
+            vp_read_bytes(d, ctx, fmt->ba + block * fmt->block_size,
+                          data, fmt->block_size);
+            if (fmt->channels == 2) {
+                adpcm_decode_stereo_block(vc->adpcm[slot].samples[0],
+                                          vc->adpcm[slot].samples[1],
+                                          (uint8_t *)data, 0,
+                                          VP_ADPCM_BLOCK_SAMPLES - 1);
+            } else {
+                adpcm_decode_mono_block(vc->adpcm[slot].samples[0],
+                                        (uint8_t *)data, 0,
+                                        VP_ADPCM_BLOCK_SAMPLES - 1);
+            }
+            vc->adpcm[slot].block = block;
+            ctx->samples_decoded[VP_FORMAT_ADPCM] += VP_ADPCM_BLOCK_SAMPLES;
+        }
+
+        out[0] = vc->adpcm[slot].samples[0][pos] * 0x100;
+        out[1] = vc->adpcm[slot].samples[fmt->channels - 1][pos] * 0x100;
+        return;
+    }
+
+    uint8_t buf[8] = { 0 };
+    vp_read_bytes(d, ctx, fmt->ba + index * fmt->block_size,
+                  buf, MIN(fmt->block_size, sizeof(buf)));
+    ctx->samples_decoded[fmt->sample_size]++;
+
+    for (channel = 0; channel < fmt->channels; channel++) {
+        const uint8_t *p = &buf[channel * fmt->container_size];
+        switch (fmt->sample_size) {
+        case NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_U8:
+            out[channel] = (p[0] - 0x80) * 0x10000;
+            break;
+        case NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S16:
+            out[channel] = (int16_t)lduw_le_p(p) * 0x100;
+            break;
+        case NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S24:
+            out[channel] = (int32_t)(ldl_le_p(p) << 8) >> 8;
+            break;
+        case NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S32:
+            out[channel] = (int32_t)ldl_le_p(p) >> 8;
+            break;
+        }
+    }
+    if (fmt->channels == 1) {
+        out[1] = out[0];
+    }
+}
+
+/* Linear interpolation between a and b, for a whole frame */
+static void vp_interpolate(float *out, const float *a, const float *b,
+                           const float *t)
+{
+    unsigned int i;
+    for (i = 0; i < NUM_SAMPLES_PER_FRAME; i += VP_VEC_LEN) {
+        vp_vec va, vb, vt;
+        memcpy(&va, &a[i], sizeof(va));
+        memcpy(&vb, &b[i], sizeof(vb));
+        memcpy(&vt, &t[i], sizeof(vt));
+        va += (vb - va) * vt;
+        memcpy(&out[i], &va, sizeof(va));
+    }
+}
 
-    return prd_address + addr % TARGET_PAGE_SIZE;
+/* Accumulate a frame of samples into a mixbin */
+static void vp_mix(float *mixbin, const float *samples, float gain)
+{
+    vp_vec vg = { gain, gain, gain, gain };
+    unsigned int i;
+    for (i = 0; i < NUM_SAMPLES_PER_FRAME; i += VP_VEC_LEN) {
+        vp_vec vm, vs;
+        memcpy(&vm, &mixbin[i], sizeof(vm));
+        memcpy(&vs, &samples[i], sizeof(vs));
+        vm += vs * vg;
+        memcpy(&mixbin[i], &vm, sizeof(vm));
+    }
 }
 
-static float step_envelope(MCPXAPUState *d, unsigned int v, uint32_t reg_0, uint32_t reg_a, uint32_t rr_reg, uint32_t rr_mask, uint32_t lvl_reg, uint32_t lvl_mask, uint32_t count_mask, uint32_t cur_mask) {
-    uint8_t cur = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask);
+static float step_envelope(uint32_t *regs, uint32_t reg_0, uint32_t reg_a, uint32_t rr_reg, uint32_t rr_mask, uint32_t lvl_reg, uint32_t lvl_mask, uint32_t count_mask, uint32_t cur_mask) {
+    uint8_t cur = voice_reg_get(regs, NV_PAVS_VOICE_PAR_STATE, cur_mask);
     switch(cur) {
     case 0: // Off
-        voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, 0);
-        voice_set_mask(d, v, lvl_reg, lvl_mask, 0xFF);
+        voice_reg_set(regs, NV_PAVS_VOICE_CUR_ECNT, count_mask, 0);
+        voice_reg_set(regs, lvl_reg, lvl_mask, 0xFF);
         return 1.0f;
     case 1: { // Delay
-        uint16_t count = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask);
-        voice_set_mask(d, v, lvl_reg, lvl_mask, 0x00); // FIXME: Confirm this?
+        uint16_t count = voice_reg_get(regs, NV_PAVS_VOICE_CUR_ECNT, count_mask);
+        voice_reg_set(regs, lvl_reg, lvl_mask, 0x00); // FIXME: Confirm this?
         if (count == 0) {
                 cur++;
-                voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
+                voice_reg_set(regs, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
                 count = 0;
         } else {
                 count--;
         }
-        voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
+        voice_reg_set(regs, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
         break;
     }
     case 2: { // Attack
-        uint16_t count = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask);
-        uint16_t attack_rate = voice_get_mask(d, v, reg_0, NV_PAVS_VOICE_CFG_ENV0_EA_ATTACKRATE);
+        uint16_t count = voice_reg_get(regs, NV_PAVS_VOICE_CUR_ECNT, count_mask);
+        uint16_t attack_rate = voice_reg_get(regs, reg_0, NV_PAVS_VOICE_CFG_ENV0_EA_ATTACKRATE);
         float value;
         if (attack_rate == 0) {
                 //FIXME: [division by zero]
@@ -1178,37 +1913,37 @@ static float step_envelope(MCPXAPUState *d, unsigned int v, uint32_t reg_0, uint
                         value = 255.0f;
                 }
         }
-        voice_set_mask(d, v, lvl_reg, lvl_mask, value);
+        voice_reg_set(regs, lvl_reg, lvl_mask, value);
         //FIXME: Comparison could also be the other way around?! Test please.
         if (count == (attack_rate * 16)) {
                 cur++;
-                voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
-                uint16_t hold_time = voice_get_mask(d, v, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_HOLDTIME);
+                voice_reg_set(regs, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
+                uint16_t hold_time = voice_reg_get(regs, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_HOLDTIME);
                 count = hold_time * 16; //FIXME: Skip next phase if count is 0? [other instances too]
         } else {
                 count++;
         }
-        voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
+        voice_reg_set(regs, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
         return value / 255.0f;
     }
     case 3: { // Hold
-        uint16_t count = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask);
-        voice_set_mask(d, v, lvl_reg, lvl_mask, 0xFF);
+        uint16_t count = voice_reg_get(regs, NV_PAVS_VOICE_CUR_ECNT, count_mask);
+        voice_reg_set(regs, lvl_reg, lvl_mask, 0xFF);
         if (count == 0) {
                 cur++;
-                voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
-                uint16_t decay_rate = voice_get_mask(d, v, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_DECAYRATE);
+                voice_reg_set(regs, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
+                uint16_t decay_rate = voice_reg_get(regs, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_DECAYRATE);
                 count = decay_rate * 16;
         } else {
                 count--;
         }
-        voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
+        voice_reg_set(regs, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
         return 1.0f;
     }
     case 4: { // Decay
-        uint16_t count = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask);
-        uint16_t decay_rate = voice_get_mask(d, v, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_DECAYRATE);
-        uint8_t sustain_level = voice_get_mask(d, v, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_SUSTAINLEVEL);
+        uint16_t count = voice_reg_get(regs, NV_PAVS_VOICE_CUR_ECNT, count_mask);
+        uint16_t decay_rate = voice_reg_get(regs, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_DECAYRATE);
+        uint8_t sustain_level = voice_reg_get(regs, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_SUSTAINLEVEL);
         float value;
         if (decay_rate == 0) {
                 //FIXME: [division by zero]
@@ -1221,270 +1956,510 @@ static float step_envelope(MCPXAPUState *d, unsigned int v, uint32_t reg_0, uint
         if (value <= (sustain_level + 0.2f) || (value > 255.0f)) {
                 //FIXME: Should we still update lvl?
                 cur++;
-                voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
+                voice_reg_set(regs, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
         } else {
                 count--;
-                voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
-                voice_set_mask(d, v, lvl_reg, lvl_mask, value);
+                voice_reg_set(regs, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
+                voice_reg_set(regs, lvl_reg, lvl_mask, value);
         }
         return value / 255.0f;
     }
     case 5: { // Sustain
-        uint8_t sustain_level = voice_get_mask(d, v, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_SUSTAINLEVEL);
-        voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, 0x00); // FIXME: is this only set to 0 once or forced to zero?
-        voice_set_mask(d, v, lvl_reg, lvl_mask, sustain_level);
+        uint8_t sustain_level = voice_reg_get(regs, reg_a, NV_PAVS_VOICE_CFG_ENVA_EA_SUSTAINLEVEL);
+        voice_reg_set(regs, NV_PAVS_VOICE_CUR_ECNT, count_mask, 0x00); // FIXME: is this only set to 0 once or forced to zero?
+        voice_reg_set(regs, lvl_reg, lvl_mask, sustain_level);
         return sustain_level / 255.0f;
     }
     case 6: { // Release
-        uint16_t release_rate = voice_get_mask(d, v, rr_reg, rr_mask);
-        uint16_t count = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask);
+        uint16_t release_rate = voice_reg_get(regs, rr_reg, rr_mask);
+        uint16_t count = voice_reg_get(regs, NV_PAVS_VOICE_CUR_ECNT, count_mask);
         count--;
-        voice_set_mask(d, v, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
-        uint8_t lvl = voice_get_mask(d, v, lvl_reg, lvl_mask);
-        float value = count * lvl / (release_rate * 16);
+        voice_reg_set(regs, NV_PAVS_VOICE_CUR_ECNT, count_mask, count);
+        uint8_t lvl = voice_reg_get(regs, lvl_reg, lvl_mask);
+        float value = 0.0f;
+        if (release_rate != 0) {
+            value = count * lvl / (release_rate * 16);
+        }
         if (count == 0) {
             //FIXME: What to do now?!
-#if 0 // Hack so we don't assert
-            cur++; // FIXME: Does this happen?!
-            voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask, cur);
-#else
-            voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, cur_mask, 0x0); // Is this correct? FIXME: Turn off voice?
-#endif
+            voice_reg_set(regs, NV_PAVS_VOICE_PAR_STATE, cur_mask, 0x0); // Is this correct? FIXME: Turn off voice?
         }
         return value / 255.0f;
     }
     case 7: // Force release
-        assert(false); //FIXME: This mode is not understood yet
-        return 1.0f;
+        //FIXME: This mode is not understood yet
+        return 0.0f;
     default:
         fprintf(stderr, "Unknown envelope state 0x%x\n", cur);
-        assert(false);
+        return 0.0f;
     }
 
     return 0;
 }
-#endif
 
-static void process_voice(MCPXAPUState *d,
-                          int32_t mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME],
+static void process_voice(MCPXAPUState *d, VPContext *ctx,
+                          float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME],
                           uint32_t voice)
 {
-#if 0
-    uint32_t v = voice;
-    int32_t samples[2][0x20] = {0};
-
-    float ea_value = step_envelope(d, v, NV_PAVS_VOICE_CFG_ENV0, NV_PAVS_VOICE_CFG_ENVA, NV_PAVS_VOICE_TAR_LFO_ENV, NV_PAVS_VOICE_TAR_LFO_ENV_EA_RELEASERATE, NV_PAVS_VOICE_PAR_OFFSET, NV_PAVS_VOICE_PAR_OFFSET_EALVL, NV_PAVS_VOICE_CUR_ECNT_EACOUNT, NV_PAVS_VOICE_PAR_STATE_EACUR);
-    float ef_value = step_envelope(d, v, NV_PAVS_VOICE_CFG_ENV1, NV_PAVS_VOICE_CFG_ENVF, NV_PAVS_VOICE_CFG_MISC, NV_PAVS_VOICE_CFG_MISC_EF_RELEASERATE, NV_PAVS_VOICE_PAR_NEXT, NV_PAVS_VOICE_PAR_NEXT_EFLVL, NV_PAVS_VOICE_CUR_ECNT_EFCOUNT, NV_PAVS_VOICE_PAR_STATE_EFCUR);
-    assert(ea_value >= 0.0f);
-    assert(ea_value <= 1.0f);
-    assert(ef_value >= 0.0f);
-    assert(ef_value <= 1.0f);
-
-    int16_t p = voice_get_mask(d, v, NV_PAVS_VOICE_TAR_PITCH_LINK, NV_PAVS_VOICE_TAR_PITCH_LINK_PITCH);
-    int8_t pm = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_ENV0, NV_PAVS_VOICE_CFG_ENV0_EF_PITCHSCALE);
-    float rate = powf(2.0f, (p + pm * 32 * ef_value) / 4096.0f);
-    MCPX_DPRINTF("Got %f\n", rate * 48000.0f);
+    hwaddr voice_addr = d->regs[NV_PAPU_VPVADDR] + voice * NV_PAVS_SIZE;
+    uint32_t regs[NV_PAVS_SIZE / 4];
+    uint32_t old_regs[NV_PAVS_SIZE / 4];
+    unsigned int i, j;
+
+    assert(voice < MCPX_HW_MAX_VOICES);
+    if (voice_addr + NV_PAVS_SIZE > memory_region_size(d->ram)) {
+        return;
+    }
 
-    float overdrive = 1.0f; //FIXME: This is just a hack because our APU runs too rarely
+    /* Work on a copy of the voice, only changed words are written back */
+    for (i = 0; i < ARRAY_SIZE(regs); i++) {
+        regs[i] = ldl_le_p(d->ram_ptr + voice_addr + i * 4);
+    }
+    memcpy(old_regs, regs, sizeof(regs));
 
-    //NV_PAVS_VOICE_PAR_OFFSET_CBO
-    bool stereo = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_STEREO);
-    unsigned int channels = stereo ? 2 : 1;
-    unsigned int sample_size = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE);
+    float ea_value = step_envelope(regs, NV_PAVS_VOICE_CFG_ENV0, NV_PAVS_VOICE_CFG_ENVA, NV_PAVS_VOICE_TAR_LFO_ENV, NV_PAVS_VOICE_TAR_LFO_ENV_EA_RELEASERATE, NV_PAVS_VOICE_PAR_OFFSET, NV_PAVS_VOICE_PAR_OFFSET_EALVL, NV_PAVS_VOICE_CUR_ECNT_EACOUNT, NV_PAVS_VOICE_PAR_STATE_EACUR);
+    float ef_value = step_envelope(regs, NV_PAVS_VOICE_CFG_ENV1, NV_PAVS_VOICE_CFG_ENVF, NV_PAVS_VOICE_CFG_MISC, NV_PAVS_VOICE_CFG_MISC_EF_RELEASERATE, NV_PAVS_VOICE_PAR_NEXT, NV_PAVS_VOICE_PAR_NEXT_EFLVL, NV_PAVS_VOICE_CUR_ECNT_EFCOUNT, NV_PAVS_VOICE_PAR_STATE_EFCUR);
+
+    int16_t p = voice_reg_get(regs, NV_PAVS_VOICE_TAR_PITCH_LINK, NV_PAVS_VOICE_TAR_PITCH_LINK_PITCH);
+    int8_t pm = voice_reg_get(regs, NV_PAVS_VOICE_CFG_ENV0, NV_PAVS_VOICE_CFG_ENV0_EF_PITCHSCALE);
+    float rate = powf(2.0f, (p + pm * 32 * ef_value) / 4096.0f);
 
     // B8, B16, ADPCM, B32
-    unsigned int container_sizes[4] = { 1, 2, 0, 4 };
-    unsigned int container_size_index = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE);
-    //FIXME: Move down, but currently debug code depends on this
-    unsigned int container_size = container_sizes[container_size_index];
-
-    bool stream = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_DATA_TYPE);
-    assert(!stream);
-    bool paused = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_STATE, NV_PAVS_VOICE_PAR_STATE_PAUSED);
-    bool loop = voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_LOOP);
-    uint32_t ebo = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_NEXT, NV_PAVS_VOICE_PAR_NEXT_EBO);
-    uint32_t cbo = voice_get_mask(d, v, NV_PAVS_VOICE_PAR_OFFSET, NV_PAVS_VOICE_PAR_OFFSET_CBO);
-    uint32_t lbo = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_PSH_SAMPLE, NV_PAVS_VOICE_CUR_PSH_SAMPLE_LBO);
-    uint32_t ba = voice_get_mask(d, v, NV_PAVS_VOICE_CUR_PSL_START, NV_PAVS_VOICE_CUR_PSL_START_BA);
-    unsigned int samples_per_block = 1 + voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_SAMPLES_PER_BLOCK);
+    static const unsigned int container_sizes[4] = { 1, 2, 0, 4 };
+    uint32_t cfg_fmt = regs[NV_PAVS_VOICE_CFG_FMT / 4];
+    unsigned int container_size_index = voice_reg_get(regs, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE);
+    unsigned int samples_per_block = 1 + voice_reg_get(regs, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_SAMPLES_PER_BLOCK);
+    VPVoiceFormat fmt = {
+        .ba = voice_reg_get(regs, NV_PAVS_VOICE_CUR_PSL_START, NV_PAVS_VOICE_CUR_PSL_START_BA),
+        .channels = voice_reg_get(regs, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_STEREO) ? 2 : 1,
+        .sample_size = voice_reg_get(regs, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE),
+        .container_size = container_sizes[container_size_index],
+        .adpcm = container_size_index == NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_ADPCM,
+    };
+    if (fmt.adpcm) {
+        /* 65 samples in 36 bytes per channel */
+        fmt.block_size = 36 * fmt.channels;
+    } else {
+        fmt.block_size = fmt.container_size * samples_per_block;
+    }
+
+    bool stream = voice_reg_get(regs, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_DATA_TYPE);
+    bool paused = voice_reg_get(regs, NV_PAVS_VOICE_PAR_STATE, NV_PAVS_VOICE_PAR_STATE_PAUSED);
+    bool loop = voice_reg_get(regs, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_LOOP);
+    uint32_t ebo = voice_reg_get(regs, NV_PAVS_VOICE_PAR_NEXT, NV_PAVS_VOICE_PAR_NEXT_EBO);
+    uint32_t cbo = voice_reg_get(regs, NV_PAVS_VOICE_PAR_OFFSET, NV_PAVS_VOICE_PAR_OFFSET_CBO);
+    uint32_t lbo = voice_reg_get(regs, NV_PAVS_VOICE_CUR_PSH_SAMPLE, NV_PAVS_VOICE_CUR_PSH_SAMPLE_LBO);
+
+    /* Drop decoded state when the voice was (re)started or reconfigured */
+    VPVoiceCache *vc = &d->vp.voices[voice];
+    if (voice_reg_get(regs, NV_PAVS_VOICE_PAR_STATE, NV_PAVS_VOICE_PAR_STATE_NEW_VOICE)
+        || vc->handle != voice || vc->ba != fmt.ba || vc->fmt != cfg_fmt) {
+        vc->handle = voice;
+        vc->ba = fmt.ba;
+        vc->fmt = cfg_fmt;
+        vc->frac = 0.0f;
+        for (i = 0; i < VP_ADPCM_RING_BLOCKS; i++) {
+            vc->adpcm[i].block = UINT32_MAX;
+        }
+    }
 
     // This is probably cleared when the first sample is played
     //FIXME: How will this behave if CBO > EBO on first play?
     //FIXME: How will this behave if paused?
-    voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, NV_PAVS_VOICE_PAR_STATE_NEW_VOICE, 0);
+    voice_reg_set(regs, NV_PAVS_VOICE_PAR_STATE, NV_PAVS_VOICE_PAR_STATE_NEW_VOICE, 0);
+
+    if (stream) {
+        //FIXME: Stream voices read from the input buffer SGEs
+        MCPX_DPRINTF("voice %d: stream voices are not supported\n", voice);
+    } else if (!paused) {
+        float a[2][NUM_SAMPLES_PER_FRAME], b[2][NUM_SAMPLES_PER_FRAME];
+        float t[NUM_SAMPLES_PER_FRAME];
+        float samples[2][NUM_SAMPLES_PER_FRAME];
+        float sa[2], sb[2];
+        uint32_t prev_cbo = 0, prev_next = 0;
+        float frac = vc->frac;
+
+        /* Gather the two source samples around every output position */
+        for (i = 0; i < NUM_SAMPLES_PER_FRAME; i++) {
+            if (cbo > ebo) {
+                if (!loop || lbo > ebo) {
+                    // Set to safe state
+                    cbo = ebo; //FIXME: Will the hw do this?
+                    //FIXME: Not sure if this happens.. needs a hwtest.
+                    // Some RE also suggests that the voices will automaticly be removed from the list (!!!)
+                    voice_reg_set(regs, NV_PAVS_VOICE_PAR_STATE, NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE, 0);
+                    break;
+                }
+                cbo = lbo + (cbo - ebo - 1) % (ebo - lbo + 1);
+            }
 
-    for(unsigned int i = 0; i < 0x20; i++) {
+            uint32_t next = cbo + 1;
+            if (next > ebo) {
+                next = loop ? lbo : ebo;
+            }
 
-        uint32_t sample_pos = (uint32_t)(i * rate * overdrive);
+            if (i > 0 && cbo == prev_cbo) {
+                /* Still between the same two samples */
+            } else if (i > 0 && cbo == prev_next) {
+                /* Advanced by one sample, reuse the previous right side */
+                sa[0] = sb[0];
+                sa[1] = sb[1];
+                vp_fetch_sample(d, ctx, vc, &fmt, next, sb);
+            } else {
+                vp_fetch_sample(d, ctx, vc, &fmt, cbo, sa);
+                vp_fetch_sample(d, ctx, vc, &fmt, next, sb);
+            }
+            prev_cbo = cbo;
+            prev_next = next;
+
+            a[0][i] = sa[0];
+            a[1][i] = sa[1];
+            b[0][i] = sb[0];
+            b[1][i] = sb[1];
+            t[i] = frac;
+
+            frac += rate;
+            uint32_t advance = (uint32_t)frac;
+            frac -= advance;
+            cbo += advance;
+        }
+        vc->frac = frac;
 
-        if ((cbo + sample_pos) > ebo) {
-          if (!loop) {
-            // Set to safe state
-            cbo = ebo; //FIXME: Will the hw do this?
-            //FIXME: Not sure if this happens.. needs a hwtest.
-            // Some RE also suggests that the voices will automaticly be removed from the list (!!!)
-            voice_set_mask(d, v, NV_PAVS_VOICE_PAR_STATE, NV_PAVS_VOICE_PAR_STATE_ACTIVE_VOICE, 0);
-            break;
-          }
-          // Now go to loop start
-          //FIXME: Make sure this logic still works for very high sample_pos greater than ebo
-          cbo += sample_pos;
-          cbo %= ebo + 1;
-          cbo += lbo;
-          cbo -= sample_pos;
+        /* Silence the rest of the frame if the voice ended */
+        for (; i < NUM_SAMPLES_PER_FRAME; i++) {
+            a[0][i] = a[1][i] = 0.0f;
+            b[0][i] = b[1][i] = 0.0f;
+            t[i] = 0.0f;
         }
 
-        sample_pos += cbo;
-        assert(sample_pos <= ebo);
-
-        if (container_size_index == NV_PAVS_VOICE_CFG_FMT_CONTAINER_SIZE_ADPCM) {
-            //FIXME: Not sure how this behaves otherwise
-            assert(sample_size == NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S24);
-
-            unsigned int block_index = sample_pos / 65;
-            unsigned int block_position = sample_pos % 65;
-
-            MCPX_DPRINTF("ADPCM: %d + %d\n", block_index, block_position);
-
-            //FIXME: Remove this from the loop which collects required samples
-            //       We can always just grab one or two blocks to get all required samples
-            if (stereo) {
-                assert(samples_per_block == 2);
-                // There are 65 samples per 72 byte block
-                uint32_t block[72/4];
-                uint32_t linear_addr = ba + block_index * 72;
-                // FIXME: Only load block data which will be used
-                for(unsigned int word_index = 0; word_index < 18; word_index++) {
-                    hwaddr addr = get_data_ptr(d->regs[NV_PAPU_VPSGEADDR], 0xFFFFFFFF, linear_addr);
-                    block[word_index] = ldl_le_phys(&address_space_memory, addr);
-                    linear_addr += 4;
-                }
-                //FIXME: Used wrong sample format in my own decoder.. stupid me lol
-                int16_t tmp[2];
-                adpcm_decode_stereo_block(&tmp[0], &tmp[1], (uint8_t*)block, block_position, block_position);
-                samples[0][i] = tmp[0];
-                samples[1][i] = tmp[1];
-            } else {
-                assert(samples_per_block == 1);
-                // There are 65 samples per 36 byte block
-                uint32_t block[36/4];
-                uint32_t linear_addr = ba + block_index * 36;
-                for(unsigned int word_index = 0; word_index < 9; word_index++) {
-                    hwaddr addr = get_data_ptr(d->regs[NV_PAPU_VPSGEADDR], 0xFFFFFFFF, linear_addr);
-                    block[word_index] = ldl_le_phys(&address_space_memory, addr);
-                    linear_addr += 4;
-                }
-                //FIXME: Used wrong sample format in my own decoder.. stupid me lol
-                int16_t tmp;
-                adpcm_decode_mono_block(&tmp, (uint8_t*)block, block_position, block_position);
-                samples[0][i] = tmp;
+        voice_reg_set(regs, NV_PAVS_VOICE_PAR_OFFSET, NV_PAVS_VOICE_PAR_OFFSET_CBO, cbo);
+
+        vp_interpolate(samples[0], a[0], b[0], t);
+        if (fmt.channels == 2) {
+            vp_interpolate(samples[1], a[1], b[1], t);
+        }
+
+        //FIXME: Decode voice volume and bins
+        unsigned int bin[8] = {
+          voice_reg_get(regs, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V0BIN),
+          voice_reg_get(regs, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V1BIN),
+          voice_reg_get(regs, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V2BIN),
+          voice_reg_get(regs, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V3BIN),
+          voice_reg_get(regs, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V4BIN),
+          voice_reg_get(regs, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V5BIN),
+          voice_reg_get(regs, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_V6BIN),
+          voice_reg_get(regs, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_V7BIN)
+        };
+        uint16_t vol[8] = {
+          voice_reg_get(regs, NV_PAVS_VOICE_TAR_VOLA, NV_PAVS_VOICE_TAR_VOLA_VOLUME0),
+          voice_reg_get(regs, NV_PAVS_VOICE_TAR_VOLA, NV_PAVS_VOICE_TAR_VOLA_VOLUME1),
+          voice_reg_get(regs, NV_PAVS_VOICE_TAR_VOLB, NV_PAVS_VOICE_TAR_VOLB_VOLUME2),
+          voice_reg_get(regs, NV_PAVS_VOICE_TAR_VOLB, NV_PAVS_VOICE_TAR_VOLB_VOLUME3),
+          voice_reg_get(regs, NV_PAVS_VOICE_TAR_VOLC, NV_PAVS_VOICE_TAR_VOLC_VOLUME4),
+          voice_reg_get(regs, NV_PAVS_VOICE_TAR_VOLC, NV_PAVS_VOICE_TAR_VOLC_VOLUME5),
+          (voice_reg_get(regs, NV_PAVS_VOICE_TAR_VOLC, NV_PAVS_VOICE_TAR_VOLC_VOLUME6_B11_8) << 8) |
+          (voice_reg_get(regs, NV_PAVS_VOICE_TAR_VOLB, NV_PAVS_VOICE_TAR_VOLB_VOLUME6_B7_4) << 4) |
+          voice_reg_get(regs, NV_PAVS_VOICE_TAR_VOLA, NV_PAVS_VOICE_TAR_VOLA_VOLUME6_B3_0),
+          (voice_reg_get(regs, NV_PAVS_VOICE_TAR_VOLC, NV_PAVS_VOICE_TAR_VOLC_VOLUME7_B11_8) << 8) |
+          (voice_reg_get(regs, NV_PAVS_VOICE_TAR_VOLB, NV_PAVS_VOICE_TAR_VOLB_VOLUME7_B7_4) << 4) |
+          voice_reg_get(regs, NV_PAVS_VOICE_TAR_VOLA, NV_PAVS_VOICE_TAR_VOLA_VOLUME7_B3_0),
+        };
+
+        //FIXME: If phase negations means to flip the signal upside down
+        //       we should modify volume of bin6 and bin7 here.
+
+        // Mix samples into voice bins, with the amplitude envelope folded
+        // into the gain
+        for (j = 0; j < 8; j++) {
+            //FIXME: how is the volume added?
+            //FIXME: What happens to the other channel? Is this behaviour correct?
+            float gain = (0xFFF - vol[j]) / (float)0xFFF * ea_value;
+            if (gain != 0.0f) {
+                vp_mix(mixbins[bin[j]], samples[j % fmt.channels], gain);
             }
+        }
+    }
 
-        } else {
-            unsigned int block_size = container_size;
-            block_size *= samples_per_block;
+    for (i = 0; i < ARRAY_SIZE(regs); i++) {
+        if (regs[i] != old_regs[i]) {
+            stl_le_p(d->ram_ptr + voice_addr + i * 4, regs[i]);
+        }
+    }
+    memory_region_set_dirty(d->ram, voice_addr, NV_PAVS_SIZE);
+}
 
-            uint32_t linear_addr = ba + sample_pos * block_size;
-            hwaddr addr = get_data_ptr(d->regs[NV_PAPU_VPSGEADDR], 0xFFFFFFFF, linear_addr);
-            //FIXME: Handle reading accross pages?!
+/* Process chunks of the active voices until none are left. Each chunk mixes
+ * into its own partial mixbins */
+static void vp_process_chunks(MCPXAPUState *d, VPContext *ctx)
+{
+    for (;;) {
+        unsigned int chunk = atomic_fetch_inc(&d->vp.next_chunk);
+        if (chunk >= d->vp.num_chunks) {
+            break;
+        }
 
-            MCPX_DPRINTF("Sampling from 0x%08X\n", addr);
+        unsigned int first = chunk * VP_CHUNK_VOICES;
+        unsigned int last = MIN(first + VP_CHUNK_VOICES,
+                                d->vp.active_voices->len);
+        unsigned int i;
 
-            // Get samples for this voice
-            for(unsigned int channel = 0; channel < channels; channel++) {
-                switch(sample_size) {
-                case NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_U8:
-                    samples[channel][i] = ldub_phys(&address_space_memory, addr);
-                    break;
-                case NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S16:
-                    samples[channel][i] = (int16_t)lduw_le_phys(&address_space_memory, addr);
-                    break;
-                case NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S24:
-                    samples[channel][i] = (int32_t)(ldl_le_phys(&address_space_memory, addr) << 8) >> 8;
-                    break;
-                case NV_PAVS_VOICE_CFG_FMT_SAMPLE_SIZE_S32:
-                    samples[channel][i] = (int32_t)ldl_le_phys(&address_space_memory, addr);
-                    break;
-                }
-             
-                // Advance cursor to second channel for stereo
-                addr += container_size;
-            }
+        memset(d->vp.chunk_mixbins[chunk], 0,
+               sizeof(d->vp.chunk_mixbins[chunk]));
+        for (i = first; i < last; i++) {
+            process_voice(d, ctx, d->vp.chunk_mixbins[chunk],
+                          g_array_index(d->vp.active_voices, uint32_t, i));
         }
     }
+}
 
-    //FIXME: Decode voice volume and bins
-    int bin[8] = {
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V0BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V1BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V2BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V3BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V4BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_VBIN, NV_PAVS_VOICE_CFG_VBIN_V5BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_V6BIN),
-      voice_get_mask(d, v, NV_PAVS_VOICE_CFG_FMT, NV_PAVS_VOICE_CFG_FMT_V7BIN)
-    };
-    uint16_t vol[8] = {
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA, NV_PAVS_VOICE_TAR_VOLA_VOLUME0),
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA, NV_PAVS_VOICE_TAR_VOLA_VOLUME1),
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB, NV_PAVS_VOICE_TAR_VOLB_VOLUME2),
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB, NV_PAVS_VOICE_TAR_VOLB_VOLUME3),
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC, NV_PAVS_VOICE_TAR_VOLC_VOLUME4),
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC, NV_PAVS_VOICE_TAR_VOLC_VOLUME5),
-      (voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC, NV_PAVS_VOICE_TAR_VOLC_VOLUME6_B11_8) << 8) |
-      (voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB, NV_PAVS_VOICE_TAR_VOLB_VOLUME6_B7_4) << 4) |
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA, NV_PAVS_VOICE_TAR_VOLA_VOLUME6_B3_0),
-      (voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLC, NV_PAVS_VOICE_TAR_VOLC_VOLUME7_B11_8) << 8) |
-      (voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLB, NV_PAVS_VOICE_TAR_VOLB_VOLUME7_B7_4) << 4) |
-      voice_get_mask(d, v, NV_PAVS_VOICE_TAR_VOLA, NV_PAVS_VOICE_TAR_VOLA_VOLUME7_B3_0),
-    };
+static void *vp_worker_thread(void *opaque)
+{
+    VPWorker *w = opaque;
+    MCPXAPUState *d = w->d;
 
-    if (paused) {
-      assert(sizeof(samples) == 0x20 * 4 * 2);
-      memset(samples, 0x00, sizeof(samples));
-    } else {
-      cbo += 0x20 * rate * overdrive;
-      voice_set_mask(d, v, NV_PAVS_VOICE_PAR_OFFSET, NV_PAVS_VOICE_PAR_OFFSET_CBO, cbo);
+    rcu_register_thread();
+
+    for (;;) {
+        qemu_sem_wait(&w->start);
+        if (atomic_read(&d->exiting)) {
+            break;
+        }
+        vp_process_chunks(d, &w->ctx);
+        qemu_sem_post(&d->vp.work_done);
     }
 
-    // Apply the amplitude envelope
-    //FIXME: Figure out when exactly and how exactly this is actually done
-    for(unsigned int j = 0; j < channels; j++) {
-        for(unsigned int i = 0; i < 0x20; i++) {
-            samples[j][i] *= ea_value;
+    rcu_unregister_thread();
+    return NULL;
+}
+
+/* Process all active voices, sharing the chunks between the SE thread and
+ * the workers. Partial mixbins are summed in chunk order, so the result
+ * does not depend on which thread processed which chunk */
+static void vp_process_voices(
+    MCPXAPUState *d, float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME])
+{
+    unsigned int num_chunks = DIV_ROUND_UP(d->vp.active_voices->len,
+                                           VP_CHUNK_VOICES);
+    unsigned int num_workers = MIN(d->vp.num_workers,
+                                   num_chunks ? num_chunks - 1 : 0);
+    unsigned int i, chunk, mixbin;
+
+    if (num_chunks > d->vp.chunk_capacity) {
+        g_free(d->vp.chunk_mixbins);
+        d->vp.chunk_mixbins = g_malloc_n(num_chunks,
+                                         sizeof(*d->vp.chunk_mixbins));
+        d->vp.chunk_capacity = num_chunks;
+    }
+    d->vp.num_chunks = num_chunks;
+    atomic_set(&d->vp.next_chunk, 0);
+
+    for (i = 0; i < num_workers; i++) {
+        qemu_sem_post(&d->vp.workers[i].start);
+    }
+    vp_process_chunks(d, &d->vp.ctx);
+    for (i = 0; i < num_workers; i++) {
+        qemu_sem_wait(&d->vp.work_done);
+    }
+
+    for (chunk = 0; chunk < num_chunks; chunk++) {
+        for (mixbin = 0; mixbin < NUM_MIXBINS; mixbin++) {
+            vp_mix(mixbins[mixbin], d->vp.chunk_mixbins[chunk][mixbin], 1.0f);
         }
     }
 
-    //FIXME: If phase negations means to flip the signal upside down
-    //       we should modify volume of bin6 and bin7 here.
+    /* Gather the decode counters of every thread that took part */
+    memcpy(d->vp.samples_decoded, d->vp.ctx.samples_decoded,
+           sizeof(d->vp.samples_decoded));
+    memset(d->vp.ctx.samples_decoded, 0, sizeof(d->vp.ctx.samples_decoded));
+    for (i = 0; i < num_workers; i++) {
+        VPContext *ctx = &d->vp.workers[i].ctx;
+        unsigned int format;
+        for (format = 0; format < VP_NUM_FORMATS; format++) {
+            d->vp.samples_decoded[format] += ctx->samples_decoded[format];
+        }
+        memset(ctx->samples_decoded, 0, sizeof(ctx->samples_decoded));
+    }
+}
 
-    // Mix samples into voice bins
-    for(unsigned int j = 0; j < 8; j++) {
-        MCPX_DPRINTF("Adding voice 0x%04X to bin %d [Rate %.2f, Volume 0x%03X] sample %d at %d [%.2fs]\n", v, bin[j], rate, vol[j], samples[0], cbo, cbo / (rate * 48000.0f));
-        for(unsigned int i = 0; i < 0x20; i++) {
-            //FIXME: how is the volume added?
-            //FIXME: What happens to the other channel? Is this behaviour correct?
-            mixbins[bin[j]][i] += (0xFFF - vol[j]) * samples[j % channels][i] / 0xFFF;
+static void vp_init_workers(MCPXAPUState *d)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int i;
+
+    d->vp.active_voices = g_array_new(false, false, sizeof(uint32_t));
+    qemu_sem_init(&d->vp.work_done, 0);
+
+    /* The SE thread takes part in voice processing too */
+    d->vp.num_workers = cpus > 1 ? MIN(cpus - 1, VP_MAX_WORKERS) : 0;
+    for (i = 0; i < d->vp.num_workers; i++) {
+        VPWorker *w = &d->vp.workers[i];
+        w->d = d;
+        qemu_sem_init(&w->start, 0);
+        qemu_thread_create(&w->thread, "mcpx.vp_worker", vp_worker_thread,
+                           w, QEMU_THREAD_JOINABLE);
+    }
+}
+
+static void vp_destroy_workers(MCPXAPUState *d)
+{
+    unsigned int i;
+
+    for (i = 0; i < d->vp.num_workers; i++) {
+        qemu_sem_post(&d->vp.workers[i].start);
+    }
+    for (i = 0; i < d->vp.num_workers; i++) {
+        qemu_thread_join(&d->vp.workers[i].thread);
+        qemu_sem_destroy(&d->vp.workers[i].start);
+    }
+    qemu_sem_destroy(&d->vp.work_done);
+    g_array_free(d->vp.active_voices, true);
+    g_free(d->vp.chunk_mixbins);
+}
+
+static bool apu_dsp_running(MCPXAPUDSP *p)
+{
+    return (p->regs[NV_PAPU_GPRST] & NV_PAPU_GPRST_GPRST)
+           && (p->regs[NV_PAPU_GPRST] & NV_PAPU_GPRST_GPDSPRST);
+}
+
+static void *apu_dsp_thread(void *opaque)
+{
+    MCPXAPUDSP *p = opaque;
+
+    rcu_register_thread();
+
+    for (;;) {
+        qemu_sem_wait(&p->start);
+        if (atomic_read(&p->d->exiting)) {
+            break;
         }
+
+        qemu_mutex_lock(&p->lock);
+        p->frame++;
+        if (apu_dsp_running(p)) {
+            uint64_t instructions, cycles;
+            int64_t start = get_clock();
+            int slice;
+
+            dsp_get_counters(p->dsp, &instructions, &cycles);
+            p->dma_bytes = 0;
+
+#if CAPTURE_DSP_FRAMES
+            apu_dsp_capture_frame(p);
+#endif
+
+            dsp_start_frame(p->dsp);
+            for (slice = 0; slice < DSP_SLICES_PER_FRAME; slice++) {
+                if (slice > 0) {
+                    qemu_mutex_unlock(&p->lock);
+                    qemu_mutex_lock(&p->lock);
+                    if (!apu_dsp_running(p)) {
+                        /* Held in reset meanwhile */
+                        break;
+                    }
+                }
+                int end = DSP_CYCLES_PER_FRAME * (slice + 1)
+                          / DSP_SLICES_PER_FRAME;
+                dsp_run(p->dsp,
+                        end - DSP_CYCLES_PER_FRAME * slice
+                              / DSP_SLICES_PER_FRAME);
+            }
+
+            dsp_get_counters(p->dsp, &p->stats.instructions, &p->stats.cycles);
+            p->stats.instructions -= instructions;
+            p->stats.cycles -= cycles;
+            p->stats.dma_bytes = p->dma_bytes;
+            p->stats.run_ns = get_clock() - start;
+            trace_mcpx_apu_dsp_frame(p->name, p->stats.instructions,
+                                     p->stats.cycles, p->stats.dma_bytes,
+                                     p->stats.run_ns);
+        } else {
+            memset(&p->stats, 0, sizeof(p->stats));
+        }
+        qemu_mutex_unlock(&p->lock);
+
+        qemu_sem_post(&p->done);
+    }
+
+    rcu_unregister_thread();
+    return NULL;
+}
+
+static void apu_dsp_kick(MCPXAPUDSP *p)
+{
+    assert(!p->busy);
+    p->busy = true;
+    qemu_sem_post(&p->start);
+}
+
+static void apu_dsp_wait(MCPXAPUDSP *p)
+{
+    if (p->busy) {
+        qemu_sem_wait(&p->done);
+        p->busy = false;
     }
+}
+
+static void apu_dsp_init(MCPXAPUState *d, MCPXAPUDSP *p, const char *name,
+                         const MCPXAPUDSPRegs *apu_regs,
+                         dsp_scratch_rw_func scratch_rw,
+                         dsp_fifo_rw_func fifo_rw)
+{
+    char *thread_name = g_strdup_printf("mcpx.%s_thread", name);
+
+    QEMU_BUILD_BUG_ON(EP_OUTPUT_FIFO_COUNT != GP_OUTPUT_FIFO_COUNT);
+    QEMU_BUILD_BUG_ON(EP_INPUT_FIFO_COUNT != GP_INPUT_FIFO_COUNT);
+
+    p->name = name;
+    p->d = d;
+    p->apu_regs = apu_regs;
+    p->frame = 1;
+    p->dsp = dsp_init(d, scratch_rw, fifo_rw);
+    qemu_mutex_init(&p->lock);
+    qemu_sem_init(&p->start, 0);
+    qemu_sem_init(&p->done, 0);
+    qemu_thread_create(&p->thread, thread_name, apu_dsp_thread,
+                       p, QEMU_THREAD_JOINABLE);
+    g_free(thread_name);
+}
+
+static void apu_dsp_destroy(MCPXAPUDSP *p)
+{
+    qemu_sem_post(&p->start);
+    qemu_thread_join(&p->thread);
+    qemu_sem_destroy(&p->start);
+    qemu_sem_destroy(&p->done);
+    qemu_mutex_destroy(&p->lock);
+#if CAPTURE_DSP_FRAMES
+    apu_dsp_capture_finish(p);
 #endif
+    dsp_destroy(p->dsp);
+    g_free(p->scratch_sge.pages);
+    g_free(p->fifo_sge.pages);
 }
 
-/* This routine must run at 1500 Hz */
-/* TODO: this should be on a thread so it waits on the voice lock */
-static void se_frame(void *opaque)
+/* Process a single frame, called with the voice lock held */
+static void se_frame(MCPXAPUState *d)
 {
-    MCPXAPUState *d = opaque;
     int mixbin;
     int sample;
 
-    timer_mod(d->se.frame_timer, qemu_clock_get_ms(QEMU_CLOCK_VIRTUAL) + 10);
     MCPX_DPRINTF("mcpx frame ping\n");
 
-    /* Buffer for all mixbins for this frame */
-    int32_t mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME] = { 0 };
+    /* SGE entries may have changed since the last frame */
+    d->vp.frame++;
 
-    /* Process all voices, mixing each into the affected MIXBINs */
+    /* Buffer for all mixbins for this frame */
+    float mixbins[NUM_MIXBINS][NUM_SAMPLES_PER_FRAME] = { { 0 } };
+
+    /*
+     * Collect the active voices, notifying the FE of idle ones. The lists
+     * live in guest memory, so each voice is taken at most once; otherwise a
+     * voice linked twice would be processed by two workers at the same time.
+     */
+    DECLARE_BITMAP(seen, MCPX_HW_MAX_VOICES);
+    bitmap_zero(seen, MCPX_HW_MAX_VOICES);
+    g_array_set_size(d->vp.active_voices, 0);
     int list;
     for (list = 0; list < 3; list++) {
         hwaddr top, current, next;
@@ -1493,8 +2468,21 @@ static void se_frame(void *opaque)
         next = voice_list_regs[list].next;
 
         d->regs[current] = d->regs[top];
+        d->vp.list_voices[list] = 0;
         MCPX_DPRINTF("list %d current voice %d\n", list, d->regs[current]);
         while (d->regs[current] != 0xFFFF) {
+            if (d->regs[current] >= MCPX_HW_MAX_VOICES) {
+                qemu_log_mask(LOG_GUEST_ERROR, "mcpx_apu: list %d links "
+                              "invalid voice %u\n", list, d->regs[current]);
+                break;
+            }
+            if (test_bit(d->regs[current], seen)) {
+                qemu_log_mask(LOG_GUEST_ERROR, "mcpx_apu: list %d links "
+                              "voice %u twice\n", list, d->regs[current]);
+                break;
+            }
+            set_bit(d->regs[current], seen);
+
             d->regs[next] = voice_get_mask(d, d->regs[current],
                 NV_PAVS_VOICE_TAR_PITCH_LINK,
                 NV_PAVS_VOICE_TAR_PITCH_LINK_NEXT_VOICE_HANDLE);
@@ -1504,13 +2492,20 @@ static void se_frame(void *opaque)
                 MCPX_DPRINTF("voice %d not active...!\n", d->regs[current]);
                 fe_method(d, SE2FE_IDLE_VOICE, d->regs[current]);
             } else {
-                process_voice(d, mixbins, d->regs[current]);
+                g_array_append_val(d->vp.active_voices, d->regs[current]);
+                d->vp.list_voices[list]++;
             }
             MCPX_DPRINTF("next voice %d\n", d->regs[next]);
             d->regs[current] = d->regs[next];
         }
     }
 
+    /* Process all voices, mixing each into the affected MIXBINs */
+    vp_process_voices(d, mixbins);
+
+    trace_mcpx_apu_frame(d->se.frames, d->vp.active_voices->len,
+                         d->se.frames_behind, out_fill_level(d));
+
 #if GENERATE_MIXBIN_BEEP
     /* Inject some audio to the mixbin for debugging.
      * Signal is 1500 Hz sine wave, phase shifted by mixbin number. */
@@ -1526,30 +2521,111 @@ static void se_frame(void *opaque)
     }
 #endif
 
+    /* GP frame N-1 and EP frame N-2 have to be done before moving on */
+    apu_dsp_wait(&d->gp);
+    apu_dsp_wait(&d->ep);
+    apu_dsp_store_regs(d, &d->gp);
+    apu_dsp_store_regs(d, &d->ep);
+
+    out_push_frame(d);
+
+    /* EP works on what the GP wrote to the FIFOs in the previous frame,
+     * while the GP processes this one */
+    qemu_mutex_lock(&d->ep.lock);
+    apu_dsp_load_regs(d, &d->ep);
+    qemu_mutex_unlock(&d->ep.lock);
+    apu_dsp_kick(&d->ep);
+
     /* Write VP results to the GP DSP MIXBUF */
+    qemu_mutex_lock(&d->gp.lock);
+    apu_dsp_load_regs(d, &d->gp);
     for (mixbin = 0; mixbin < NUM_MIXBINS; mixbin++) {
         for (sample = 0; sample < NUM_SAMPLES_PER_FRAME; sample++) {
+            int32_t v = MIN(MAX(mixbins[mixbin][sample], -0x800000),
+                            0x7FFFFF);
             dsp_write_memory(d->gp.dsp,
                              'X', GP_DSP_MIXBUF_BASE + mixbin * 0x20 + sample,
-                             mixbins[mixbin][sample] & 0xFFFFFF);
+                             v & 0xFFFFFF);
         }
     }
+    qemu_mutex_unlock(&d->gp.lock);
 
-    /* Kickoff DSP processing */
-    if ((d->gp.regs[NV_PAPU_GPRST] & NV_PAPU_GPRST_GPRST)
-        && (d->gp.regs[NV_PAPU_GPRST] & NV_PAPU_GPRST_GPDSPRST)) {
-        dsp_start_frame(d->gp.dsp);
+    apu_dsp_kick(&d->gp);
+}
 
-        // hax
-        dsp_run(d->gp.dsp, 1000);
-    }
-    if ((d->ep.regs[NV_PAPU_EPRST] & NV_PAPU_GPRST_GPRST)
-        && (d->ep.regs[NV_PAPU_EPRST] & NV_PAPU_GPRST_GPDSPRST)) {
-        dsp_start_frame(d->ep.dsp);
+/* Runs as many frames as needed to keep up with the virtual clock at
+ * SE_FRAME_RATE, dropping the voice lock between batches so MMIO can get in */
+static void *se_thread(void *opaque)
+{
+    MCPXAPUState *d = opaque;
 
-        // hax
-        // dsp_run(d->ep.dsp, 1000);
+    rcu_register_thread();
+
+    qemu_mutex_lock(&d->lock);
+    while (!d->exiting) {
+        int64_t now = qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+        uint64_t due = 0;
+        int i;
+
+        if (d->se.running && now > d->se.start_time) {
+            due = muldiv64(now - d->se.start_time, SE_FRAME_RATE,
+                           NANOSECONDS_PER_SECOND);
+        }
+
+        d->se.frames_behind = due > d->se.frames ? due - d->se.frames : 0;
+        d->se.frames_behind_max = MAX(d->se.frames_behind_max,
+                                      d->se.frames_behind);
+
+        if (!d->se.running || due <= d->se.frames) {
+            int timeout = 100;
+            if (d->se.running) {
+                int64_t next = d->se.start_time
+                    + muldiv64(d->se.frames + 1, NANOSECONDS_PER_SECOND,
+                               SE_FRAME_RATE);
+                timeout = MAX(1, (next - now + SCALE_MS - 1) / SCALE_MS);
+            }
+            qemu_mutex_unlock(&d->lock);
+            qemu_sem_timedwait(&d->se.wake, timeout);
+            qemu_mutex_lock(&d->lock);
+            continue;
+        }
+
+        if (due - d->se.frames > SE_MAX_FRAMES_BEHIND) {
+            MCPX_DPRINTF("mcpx dropping %" PRIu64 " frames\n",
+                         due - d->se.frames - 1);
+            trace_mcpx_apu_frames_dropped(due - d->se.frames - 1);
+            d->se.frames_dropped += due - d->se.frames - 1;
+            d->se.frames = due - 1;
+        }
+
+        for (i = 0; i < SE_FRAMES_PER_BATCH && d->se.frames < due; i++) {
+            if (i > 0) {
+                /* Let MMIO in between frames */
+                qemu_mutex_unlock(&d->lock);
+                qemu_mutex_lock(&d->lock);
+                if (d->exiting || !d->se.running) {
+                    break;
+                }
+            }
+            se_frame(d);
+            d->se.frames++;
+        }
+
+        qemu_mutex_unlock(&d->lock);
+        if (d->se.irq_pending) {
+            qemu_mutex_lock_iothread();
+            qemu_mutex_lock(&d->lock);
+            d->se.irq_pending = false;
+            update_irq(d);
+            qemu_mutex_unlock(&d->lock);
+            qemu_mutex_unlock_iothread();
+        }
+        qemu_mutex_lock(&d->lock);
     }
+    qemu_mutex_unlock(&d->lock);
+
+    rcu_unregister_thread();
+    return NULL;
 }
 
 static void mcpx_apu_realize(PCIDevice *dev, Error **errp)
@@ -1576,9 +2652,60 @@ static void mcpx_apu_realize(PCIDevice *dev, Error **errp)
     pci_register_bar(&d->dev, 0, PCI_BASE_ADDRESS_SPACE_MEMORY, &d->mmio);
 
 
-    d->se.frame_timer = timer_new_ms(QEMU_CLOCK_VIRTUAL, se_frame, d);
-    d->gp.dsp = dsp_init(d, gp_scratch_rw, gp_fifo_rw);
-    d->ep.dsp = dsp_init(d, ep_scratch_rw, ep_fifo_rw);
+    int i;
+    for (i = 0; i < MCPX_HW_MAX_VOICES; i++) {
+        d->vp.voices[i].handle = UINT32_MAX;
+    }
+
+    apu_dsp_init(d, &d->gp, "gp", &gp_apu_regs, gp_scratch_rw, gp_fifo_rw);
+    apu_dsp_init(d, &d->ep, "ep", &ep_apu_regs, ep_scratch_rw, ep_fifo_rw);
+
+    struct audsettings as = {
+        .freq = 48000,
+        .nchannels = 2,
+        .fmt = AUDIO_FORMAT_S16,
+        .endianness = AUDIO_HOST_ENDIANNESS,
+    };
+    AUD_register_card("mcpx-apu", &d->out.card);
+    d->out.voice = AUD_open_out(&d->out.card, NULL, "mcpx-apu.out", d,
+                                out_callback, &as);
+    if (d->out.voice) {
+        AUD_set_active_out(d->out.voice, 1);
+    }
+
+    vp_init_workers(d);
+
+    qemu_mutex_init(&d->lock);
+    qemu_sem_init(&d->se.wake, 0);
+    qemu_thread_create(&d->se.thread, "mcpx.apu_thread", se_thread,
+                       d, QEMU_THREAD_JOINABLE);
+}
+
+static void mcpx_apu_exitfn(PCIDevice *dev)
+{
+    MCPXAPUState *d = MCPX_APU_DEVICE(dev);
+
+    qemu_mutex_lock(&d->lock);
+    d->exiting = true;
+    qemu_mutex_unlock(&d->lock);
+
+    /* The SE thread may be waiting for the BQL to raise an interrupt */
+    qemu_sem_post(&d->se.wake);
+    qemu_mutex_unlock_iothread();
+    qemu_thread_join(&d->se.thread);
+    qemu_mutex_lock_iothread();
+    qemu_sem_destroy(&d->se.wake);
+    qemu_mutex_destroy(&d->lock);
+
+    vp_destroy_workers(d);
+
+    if (d->out.voice) {
+        AUD_close_out(&d->out.card, d->out.voice);
+    }
+    AUD_remove_card(&d->out.card);
+
+    apu_dsp_destroy(&d->gp);
+    apu_dsp_destroy(&d->ep);
 }
 
 static void mcpx_apu_class_init(ObjectClass *klass, void *data)
@@ -1591,6 +2718,7 @@ static void mcpx_apu_class_init(ObjectClass *klass, void *data)
     k->revision = 210;
     k->class_id = PCI_CLASS_MULTIMEDIA_AUDIO;
     k->realize = mcpx_apu_realize;
+    k->exit = mcpx_apu_exitfn;
 
     dc->desc = "MCPX Audio Processing Unit";
 }
@@ -1621,3 +2749,58 @@ void mcpx_apu_init(PCIBus *bus, int devfn, MemoryRegion *ram)
     d->ram = ram;
     d->ram_ptr = memory_region_get_ram_ptr(d->ram);
 }
+
+static void apu_dsp_print_stats(Monitor *mon, MCPXAPUDSP *p)
+{
+    qemu_mutex_lock(&p->lock);
+    monitor_printf(mon, "%s: %" PRIu64 " instructions, %" PRIu64 " cycles, "
+                   "%" PRIu64 " DMA bytes, %" PRId64 " us per frame\n",
+                   p->name, p->stats.instructions, p->stats.cycles,
+                   p->stats.dma_bytes, p->stats.run_ns / SCALE_US);
+    qemu_mutex_unlock(&p->lock);
+}
+
+void hmp_info_mcpx_apu(Monitor *mon, const QDict *qdict)
+{
+    static const char *list_names[] = { "2D", "3D", "MP" };
+    static const char *format_names[VP_NUM_FORMATS] = {
+        "U8", "S16", "S24", "S32", "ADPCM",
+    };
+    Object *obj = object_resolve_path_type("", "mcpx-apu", NULL);
+    MCPXAPUState *d;
+    unsigned int i;
+
+    if (!obj) {
+        monitor_printf(mon, "No MCPX APU present\n");
+        return;
+    }
+    d = MCPX_APU_DEVICE(obj);
+
+    qemu_mutex_lock(&d->lock);
+    monitor_printf(mon, "se: %s, frame %" PRIu64 ", %" PRIu64 " frames behind "
+                   "(max %" PRIu64 "), %" PRIu64 " dropped\n",
+                   d->se.running ? "running" : "stopped", d->se.frames,
+                   d->se.frames_behind, d->se.frames_behind_max,
+                   d->se.frames_dropped);
+    monitor_printf(mon, "vp: active voices");
+    for (i = 0; i < ARRAY_SIZE(list_names); i++) {
+        monitor_printf(mon, " %s %u", list_names[i], d->vp.list_voices[i]);
+    }
+    monitor_printf(mon, ", samples decoded");
+    for (i = 0; i < VP_NUM_FORMATS; i++) {
+        monitor_printf(mon, " %s %u", format_names[i],
+                       d->vp.samples_decoded[i]);
+    }
+    monitor_printf(mon, "\n");
+    qemu_mutex_unlock(&d->lock);
+
+    apu_dsp_print_stats(mon, &d->gp);
+    apu_dsp_print_stats(mon, &d->ep);
+
+    monitor_printf(mon, "out: %s, %u of %u frames queued (target %u), "
+                   "%u underruns, %u overruns\n",
+                   d->out.voice ? "open" : "no host voice",
+                   out_fill_level(d), OUT_RING_FRAMES, OUT_TARGET_FILL,
+                   atomic_read(&d->out.underruns),
+                   atomic_read(&d->out.overruns));
+}
@@ -21,5 +21,6 @@
 #define HW_MCPX_APU_H
 
 void mcpx_apu_init(PCIBus *bus, int devfn, MemoryRegion *ram);
+void hmp_info_mcpx_apu(Monitor *mon, const QDict *qdict);
 
 #endif
@@ -0,0 +1,179 @@
+/*
+ * QEMU Geforce NV2A shader string builder
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "qemu/osdep.h"
+#include "qemu/units.h"
+
+#include "mstring.h"
+
+#define MSTRING_ARENA_BLOCK_SIZE (256 * KiB)
+#define MSTRING_DEFAULT_CAPACITY 64
+
+typedef struct MStringArenaBlock {
+    struct MStringArenaBlock *next;
+    size_t size;
+    size_t used;
+    char data[];
+} MStringArenaBlock;
+
+/* Most recent block first */
+static __thread MStringArenaBlock *arena;
+
+static void *arena_alloc(size_t size)
+{
+    size = ROUND_UP(size, sizeof(void *));
+
+    if (!arena || arena->used + size > arena->size) {
+        size_t block_size = MAX(size, MSTRING_ARENA_BLOCK_SIZE);
+        MStringArenaBlock *block = g_malloc(sizeof(MStringArenaBlock)
+                                            + block_size);
+        block->next = arena;
+        block->size = block_size;
+        block->used = 0;
+        arena = block;
+    }
+
+    void *ptr = &arena->data[arena->used];
+    arena->used += size;
+    return ptr;
+}
+
+void mstring_arena_reset(void)
+{
+    if (!arena) {
+        return;
+    }
+
+    /* Keep the most recent block around for the next generation */
+    MStringArenaBlock *block = arena->next;
+    while (block) {
+        MStringArenaBlock *next = block->next;
+        g_free(block);
+        block = next;
+    }
+    arena->next = NULL;
+    arena->used = 0;
+}
+
+static void mstring_reserve(MString *mstring, size_t extra)
+{
+    size_t required = mstring->length + extra + 1;
+    if (required <= mstring->capacity) {
+        return;
+    }
+
+    size_t capacity = MAX(required, mstring->capacity * 2);
+    capacity = ROUND_UP(capacity, sizeof(void *));
+
+    /* Extend in place if this string is the last arena allocation */
+    if (arena && mstring->str + mstring->capacity == &arena->data[arena->used]
+        && arena->used + (capacity - mstring->capacity) <= arena->size) {
+        arena->used += capacity - mstring->capacity;
+        mstring->capacity = capacity;
+        return;
+    }
+
+    char *str = arena_alloc(capacity);
+    memcpy(str, mstring->str, mstring->length + 1);
+    mstring->str = str;
+    mstring->capacity = capacity;
+}
+
+MString *mstring_new_sized(size_t capacity)
+{
+    MString *mstring = arena_alloc(sizeof(MString));
+    mstring->capacity = ROUND_UP(MAX(capacity, 1), sizeof(void *));
+    mstring->str = arena_alloc(mstring->capacity);
+    mstring->str[0] = '\0';
+    mstring->length = 0;
+    return mstring;
+}
+
+MString *mstring_new(void)
+{
+    return mstring_new_sized(MSTRING_DEFAULT_CAPACITY);
+}
+
+MString *mstring_from_str(const char *str)
+{
+    size_t length = strlen(str);
+    MString *mstring = mstring_new_sized(length + 1);
+    memcpy(mstring->str, str, length + 1);
+    mstring->length = length;
+    return mstring;
+}
+
+MString *mstring_from_fmt(const char *fmt, ...)
+{
+    MString *mstring = mstring_new();
+    va_list ap;
+    va_start(ap, fmt);
+    mstring_append_va(mstring, fmt, ap);
+    va_end(ap);
+
+    return mstring;
+}
+
+void mstring_append(MString *mstring, const char *str)
+{
+    size_t length = strlen(str);
+    mstring_reserve(mstring, length);
+    memcpy(mstring->str + mstring->length, str, length + 1);
+    mstring->length += length;
+}
+
+void mstring_append_chr(MString *mstring, char c)
+{
+    mstring_reserve(mstring, 1);
+    mstring->str[mstring->length++] = c;
+    mstring->str[mstring->length] = '\0';
+}
+
+void mstring_append_int(MString *mstring, int64_t value)
+{
+    mstring_append_fmt(mstring, "%" PRId64, value);
+}
+
+void mstring_append_fmt(MString *mstring, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    mstring_append_va(mstring, fmt, ap);
+    va_end(ap);
+}
+
+void mstring_append_va(MString *mstring, const char *fmt, va_list va)
+{
+    /* Format straight into the free space at the end of the string and only
+     * retry if it did not fit */
+    size_t available = mstring->capacity - mstring->length;
+
+    va_list ap;
+    va_copy(ap, va);
+    int len = vsnprintf(mstring->str + mstring->length, available, fmt, ap);
+    va_end(ap);
+    assert(len >= 0);
+
+    if ((size_t)len >= available) {
+        mstring_reserve(mstring, len);
+        va_copy(ap, va);
+        vsnprintf(mstring->str + mstring->length, len + 1, fmt, ap);
+        va_end(ap);
+    }
+
+    mstring->length += len;
+}
@@ -0,0 +1,57 @@
+/*
+ * QEMU Geforce NV2A shader string builder
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HW_NV2A_MSTRING_H
+#define HW_NV2A_MSTRING_H
+
+/*
+ * Growable strings for GLSL generation, bump allocated from a per-thread
+ * arena. Strings are never freed individually: everything allocated since
+ * the last call to mstring_arena_reset() is released at once by the next
+ * call. A string that is the most recent arena allocation grows in place.
+ */
+
+typedef struct MString {
+    char *str;
+    size_t length;
+    size_t capacity;
+} MString;
+
+void mstring_arena_reset(void);
+
+MString *mstring_new(void);
+MString *mstring_new_sized(size_t capacity);
+MString *mstring_from_str(const char *str);
+MString *mstring_from_fmt(const char *fmt, ...);
+
+void mstring_append(MString *mstring, const char *str);
+void mstring_append_chr(MString *mstring, char c);
+void mstring_append_int(MString *mstring, int64_t value);
+void mstring_append_fmt(MString *mstring, const char *fmt, ...);
+void mstring_append_va(MString *mstring, const char *fmt, va_list va);
+
+static inline const char *mstring_get_str(const MString *mstring)
+{
+    return mstring->str;
+}
+
+static inline size_t mstring_get_length(const MString *mstring)
+{
+    return mstring->length;
+}
+
+#endif
@@ -482,6 +482,7 @@ static void nv2a_realize(PCIDevice *dev, Error **errp)
     qemu_mutex_init(&d->pfifo.lock);
     qemu_cond_init(&d->pfifo.puller_cond);
     qemu_cond_init(&d->pfifo.pusher_cond);
+    qemu_sem_init(&d->pfifo.poll_sem, 0);
 
     d->pfifo.regs[NV_PFIFO_CACHE1_STATUS] |= NV_PFIFO_CACHE1_STATUS_LOW_MARK;
 }
@@ -497,6 +498,7 @@ static void nv2a_exitfn(PCIDevice *dev)
     qemu_cond_broadcast(&d->pfifo.pusher_cond);
     qemu_thread_join(&d->pfifo.puller_thread);
     qemu_thread_join(&d->pfifo.pusher_thread);
+    qemu_sem_destroy(&d->pfifo.poll_sem);
 
     pgraph_destroy(&d->pgraph);
 }
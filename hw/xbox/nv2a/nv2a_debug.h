@@ -28,6 +28,10 @@
 # define NV2A_DPRINTF(format, ...)       do { } while (0)
 #endif
 
+/* Append every newly generated ShaderState to this file, for use as a corpus
+ * by tests/benchmark-nv2a-shaders */
+// #define DEBUG_NV2A_SHADER_CAPTURE "nv2a-shaders.bin"
+
 // #define DEBUG_NV2A_GL
 #ifdef DEBUG_NV2A_GL
 
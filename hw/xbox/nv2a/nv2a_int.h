@@ -132,12 +132,75 @@ typedef struct TextureShape {
     unsigned int pitch;
 } TextureShape;
 
+/* 6 cube faces of up to 16 levels */
+#define NV2A_MAX_TEXTURE_REGIONS (6 * 16)
+
+typedef struct TexturePoolKey {
+    GLenum gl_target;
+    GLenum gl_internal_format;
+    GLenum gl_format, gl_type;
+    unsigned int width, height, depth;
+    unsigned int levels;
+} TexturePoolKey;
+
+/* Texture objects with immutable storage that are no longer bound to any
+ * cached texture, ready to be reused for a texture of the same shape */
+typedef struct TexturePool {
+    GHashTable *free_textures; /* TexturePoolKey -> GQueue of GLuint */
+    unsigned int num_free;
+    bool has_texture_storage;
+
+    /* Storage of texture cache entries that were evicted, by guest address
+     * and shape, so a texture that was modified since can be updated in
+     * place. Live cache entries keep their storage */
+    GHashTable *retired; /* TextureKey -> same TextureKey */
+    unsigned int num_retired;
+} TexturePool;
+
 typedef struct TextureBinding {
     GLenum gl_target;
     GLuint gl_texture;
     unsigned int refcnt;
+    bool upload_pending;
+
+    TexturePool *pool;
+    TexturePoolKey pool_key;
+
+    /* Hashes of the guest data last uploaded to each face/level, so only
+     * what changed is uploaded again when the storage is reused in place */
+    bool contents_valid;
+    uint64_t palette_hash;
+    uint64_t region_hash[NV2A_MAX_TEXTURE_REGIONS];
 } TextureBinding;
 
+/* A texture miss whose contents still need to be decoded and uploaded */
+typedef struct TextureUpload {
+    unsigned int unit;
+    TextureShape state;
+    const uint8_t *texture_data;
+    const uint8_t *palette_data;
+    uint64_t palette_hash;
+    TextureBinding *binding;
+} TextureUpload;
+
+/* One mip level (of one cube face) of a TextureUpload, decoded by the
+ * texture decode pool into the staging buffer */
+typedef struct TextureUploadRegion {
+    const TextureUpload *upload;
+    const uint8_t *data;
+    uint8_t *staging;
+    size_t staging_offset;
+    size_t staging_length;
+
+    GLenum gl_target;
+    unsigned int level;
+    unsigned int width, height, depth;
+    unsigned int row_length;
+} TextureUploadRegion;
+
+#define NV2A_MAX_TEXTURE_UPLOAD_REGIONS \
+    (NV2A_MAX_TEXTURES * NV2A_MAX_TEXTURE_REGIONS)
+
 typedef struct TextureKey {
     struct lru_node node;
     TextureShape state;
@@ -194,8 +257,20 @@ typedef struct PGRAPHState {
     struct TextureKey *texture_cache_entries;
     bool texture_dirty[NV2A_MAX_TEXTURES];
     TextureBinding *texture_binding[NV2A_MAX_TEXTURES];
+    TexturePool texture_pool;
+
+    TextureUpload texture_uploads[NV2A_MAX_TEXTURES];
+    unsigned int texture_upload_count;
+    TextureUploadRegion texture_upload_regions[NV2A_MAX_TEXTURE_UPLOAD_REGIONS];
+    unsigned int texture_upload_region_count;
+    GLuint gl_texture_staging_buffer;
+    GThreadPool *texture_decode_pool;
+    QemuMutex texture_decode_lock;
+    QemuCond texture_decode_cond;
+    unsigned int texture_decode_pending;
 
     GHashTable *shader_cache;
+    ShaderObjectCache shader_object_cache;
     ShaderBinding *shader_binding;
 
     bool texture_matrix_enable[NV2A_MAX_TEXTURES];
@@ -299,6 +374,16 @@ typedef struct NV2AState {
         QemuCond puller_cond;
         QemuThread pusher_thread;
         QemuCond pusher_cond;
+
+        /* Bumped whenever the pusher or puller make progress */
+        uint64_t progress;
+
+        /* Guest busy-wait detection, see pfifo_poll_wait() */
+        hwaddr poll_addr;
+        uint64_t poll_progress;
+        unsigned int poll_count;
+        bool poll_waiting;
+        QemuSemaphore poll_sem;
     } pfifo;
 
     struct {
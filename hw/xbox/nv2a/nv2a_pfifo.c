@@ -28,6 +28,8 @@ typedef struct RAMHTEntry {
 } RAMHTEntry;
 
 static void pfifo_run_pusher(NV2AState *d);
+static void pfifo_signal_progress(NV2AState *d);
+static void pfifo_poll_wait(NV2AState *d, unsigned int block, hwaddr addr);
 static uint32_t ramht_hash(NV2AState *d, uint32_t handle);
 static RAMHTEntry ramht_lookup(NV2AState *d, uint32_t handle);
 
@@ -124,6 +126,7 @@ static void pfifo_run_puller(NV2AState *d)
         if (new_get == put) {
             // set low mark
             *status |= NV_PFIFO_CACHE1_STATUS_LOW_MARK;
+            pfifo_signal_progress(d);
         }
         if (*status & NV_PFIFO_CACHE1_STATUS_HIGH_MARK) {
             // unset high mark
@@ -270,6 +273,8 @@ static void pfifo_run_pusher(NV2AState *d)
     hwaddr dma_len;
     uint8_t *dma = nv_dma_map(d, dma_instance, &dma_len);
 
+    uint32_t dma_get_start = *dma_get;
+
     while (true) {
         uint32_t dma_get_v = *dma_get;
         uint32_t dma_put_v = *dma_put;
@@ -298,7 +303,7 @@ static void pfifo_run_pusher(NV2AState *d)
 
         if (method_count) {
             /* full */
-            if (*status & NV_PFIFO_CACHE1_STATUS_HIGH_MARK) return;
+            if (*status & NV_PFIFO_CACHE1_STATUS_HIGH_MARK) break;
 
 
             /* data word of methods command */
@@ -423,6 +428,10 @@ static void pfifo_run_pusher(NV2AState *d)
     // NV2A_DPRINTF("DMA pusher done: max 0x%" HWADDR_PRIx ", 0x%" HWADDR_PRIx " - 0x%" HWADDR_PRIx "\n",
     //      dma_len, control->dma_get, control->dma_put);
 
+    if (*dma_get != dma_get_start) {
+        pfifo_signal_progress(d);
+    }
+
     uint32_t error = GET_MASK(*dma_state, NV_PFIFO_CACHE1_DMA_STATE_ERROR);
     if (error) {
         NV2A_DPRINTF("pb error: %d\n", error);
@@ -453,6 +462,73 @@ static void* pfifo_pusher_thread(void *arg)
     return NULL;
 }
 
+/* Called with pfifo.lock held */
+static void pfifo_signal_progress(NV2AState *d)
+{
+    d->pfifo.progress++;
+    if (d->pfifo.poll_waiting) {
+        d->pfifo.poll_waiting = false;
+        qemu_sem_post(&d->pfifo.poll_sem);
+    }
+}
+
+/* Number of back-to-back reads of a register without FIFO progress before
+ * the guest is considered to be busy-waiting */
+#define PFIFO_POLL_THRESHOLD 32
+/* Upper bound on how long a polling vCPU is parked */
+#define PFIFO_POLL_TIMEOUT_MS 1
+
+/* The Xbox driver busy-waits on NV_USER and PTIMER registers until the GPU
+ * has caught up. Once it keeps re-reading the same register while the FIFO
+ * makes no progress, park the vCPU until the pusher or puller advance
+ * instead of letting it spin on the BQL and pfifo.lock.
+ *
+ * Called with pfifo.lock held. */
+static void pfifo_poll_wait(NV2AState *d, unsigned int block, hwaddr addr)
+{
+    addr |= (hwaddr)block << 32;
+
+    if (addr != d->pfifo.poll_addr
+        || d->pfifo.progress != d->pfifo.poll_progress) {
+        d->pfifo.poll_addr = addr;
+        d->pfifo.poll_progress = d->pfifo.progress;
+        d->pfifo.poll_count = 0;
+        return;
+    }
+
+    if (++d->pfifo.poll_count < PFIFO_POLL_THRESHOLD) {
+        return;
+    }
+    d->pfifo.poll_count = 0;
+
+    /* Nothing left to wait for */
+    uint32_t dma_get = d->pfifo.regs[NV_PFIFO_CACHE1_DMA_GET];
+    uint32_t dma_put = d->pfifo.regs[NV_PFIFO_CACHE1_DMA_PUT];
+    if (dma_get == dma_put
+        && (d->pfifo.regs[NV_PFIFO_CACHE1_STATUS]
+                & NV_PFIFO_CACHE1_STATUS_LOW_MARK)) {
+        return;
+    }
+
+    d->pfifo.poll_waiting = true;
+    qemu_mutex_unlock(&d->pfifo.lock);
+
+    /* The puller may need the BQL to make progress */
+    bool iothread_locked = qemu_mutex_iothread_locked();
+    if (iothread_locked) {
+        qemu_mutex_unlock_iothread();
+    }
+
+    qemu_sem_timedwait(&d->pfifo.poll_sem, PFIFO_POLL_TIMEOUT_MS);
+
+    if (iothread_locked) {
+        qemu_mutex_lock_iothread();
+    }
+
+    qemu_mutex_lock(&d->pfifo.lock);
+    d->pfifo.poll_waiting = false;
+}
+
 static uint32_t ramht_hash(NV2AState *d, uint32_t handle)
 {
     unsigned int ramht_size =
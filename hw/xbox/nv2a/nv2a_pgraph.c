@@ -283,13 +283,30 @@ static float convert_f16_to_float(uint16_t f16);
 static float convert_f24_to_float(uint32_t f24);
 static uint8_t cliptobyte(int x);
 static void convert_yuy2_to_rgb(const uint8_t *line, unsigned int ix, uint8_t *r, uint8_t *g, uint8_t* b);
-static uint8_t* convert_texture_data(const TextureShape s, const uint8_t *data, const uint8_t *palette_data, unsigned int width, unsigned int height, unsigned int depth, unsigned int row_pitch, unsigned int slice_pitch);
-static void upload_gl_texture(GLenum gl_target, const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
-static TextureBinding* generate_texture(const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
+static unsigned int converted_bytes_per_pixel(unsigned int color_format);
+static void convert_texture_data(const TextureShape s, const uint8_t *data, const uint8_t *palette_data, unsigned int width, unsigned int height, unsigned int depth, unsigned int row_pitch, unsigned int slice_pitch, uint8_t *converted_data);
+static TextureUploadRegion* pgraph_add_texture_upload_region(PGRAPHState *pg, const TextureUpload *upload, GLenum gl_target, unsigned int index, unsigned int level, const uint8_t *data, size_t length, unsigned int width, unsigned int height, unsigned int depth, size_t staging_length, size_t *staging_size);
+static void pgraph_plan_texture_upload(PGRAPHState *pg, const TextureUpload *upload, size_t *staging_size);
+static void texture_upload_region_decode(const TextureUploadRegion *r);
+static void texture_decode_worker(gpointer data, gpointer user_data);
+static void texture_upload_region_upload(const TextureUploadRegion *r);
+static void pgraph_upload_textures(PGRAPHState *pg);
+static void texture_pool_init(TexturePool *pool);
+static void texture_pool_destroy(TexturePool *pool);
+static void texture_pool_allocate(TexturePool *pool, const TexturePoolKey *key);
+static GLuint texture_pool_acquire(TexturePool *pool, const TexturePoolKey *key);
+static void texture_pool_release(TexturePool *pool, const TexturePoolKey *key, GLuint gl_texture);
+static TextureBinding* generate_texture(TexturePool *pool, const TextureShape s, const uint8_t *texture_data, const uint8_t *palette_data);
+static TextureBinding* pgraph_take_texture_in_place(PGRAPHState *pg, TextureKey *key);
 static void texture_binding_destroy(gpointer data);
+static void texture_retired_destroy(gpointer data);
 static struct lru_node *texture_cache_entry_init(struct lru_node *obj, void *key);
 static struct lru_node *texture_cache_entry_deinit(struct lru_node *obj);
 static int texture_cache_entry_compare(struct lru_node *obj, void *key);
+static guint texture_address_hash(gconstpointer key);
+static gboolean texture_address_equal(gconstpointer a, gconstpointer b);
+static guint texture_pool_key_hash(gconstpointer key);
+static gboolean texture_pool_key_equal(gconstpointer a, gconstpointer b);
 static guint shader_hash(gconstpointer key);
 static gboolean shader_equal(gconstpointer a, gconstpointer b);
 static unsigned int kelvin_map_stencil_op(uint32_t parameter);
@@ -2746,6 +2763,7 @@ static void pgraph_init(NV2AState *d)
     //glPolygonMode( GL_FRONT_AND_BACK, GL_LINE );
 
     // Initialize texture cache
+    texture_pool_init(&pg->texture_pool);
     const size_t texture_cache_size = 512;
     lru_init(&pg->texture_cache,
         &texture_cache_entry_init,
@@ -2757,7 +2775,16 @@ static void pgraph_init(NV2AState *d)
         lru_add_free(&pg->texture_cache, &pg->texture_cache_entries[i].node);
     }
 
+    glGenBuffers(1, &pg->gl_texture_staging_buffer);
+    qemu_mutex_init(&pg->texture_decode_lock);
+    qemu_cond_init(&pg->texture_decode_cond);
+    pg->texture_decode_pool = g_thread_pool_new(texture_decode_worker, pg,
+                                                MIN(g_get_num_processors(),
+                                                    NV2A_MAX_TEXTURES),
+                                                TRUE, NULL);
+
     pg->shader_cache = g_hash_table_new(shader_hash, shader_equal);
+    shader_object_cache_init(&pg->shader_object_cache);
 
 
     for (i=0; i<NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
@@ -2804,6 +2831,12 @@ static void pgraph_destroy(PGRAPHState *pg)
     // Clear out texture cache
     lru_flush(&pg->texture_cache);
     free(pg->texture_cache_entries);
+    texture_pool_destroy(&pg->texture_pool);
+
+    g_thread_pool_free(pg->texture_decode_pool, FALSE, TRUE);
+    qemu_mutex_destroy(&pg->texture_decode_lock);
+    qemu_cond_destroy(&pg->texture_decode_cond);
+    glDeleteBuffers(1, &pg->gl_texture_staging_buffer);
 
     glo_set_current(NULL);
 
@@ -3194,7 +3227,16 @@ static void pgraph_bind_shaders(PGRAPHState *pg)
     if (cached_shader) {
         pg->shader_binding = cached_shader;
     } else {
-        pg->shader_binding = generate_shaders(state);
+        pg->shader_binding = generate_shaders(&pg->shader_object_cache,
+                                              state);
+
+#ifdef DEBUG_NV2A_SHADER_CAPTURE
+        FILE *capture = fopen(DEBUG_NV2A_SHADER_CAPTURE, "ab");
+        if (capture) {
+            fwrite(&state, sizeof(state), 1, capture);
+            fclose(capture);
+        }
+#endif
 
         /* cache it */
         ShaderState *cache_state = (ShaderState *)g_malloc(sizeof(*cache_state));
@@ -3835,16 +3877,36 @@ static void pgraph_bind_textures(NV2AState *d)
 
         struct lru_node *found = lru_lookup(&pg->texture_cache, texture_hash, &key);
         TextureKey *key_out = container_of(found, struct TextureKey, node);
-        assert((key_out != NULL) && (key_out->binding != NULL));
+        assert(key_out != NULL);
+        if (key_out->binding == NULL) {
+            key_out->binding = pgraph_take_texture_in_place(pg, key_out);
+            if (key_out->binding == NULL) {
+                key_out->binding = generate_texture(&pg->texture_pool, state,
+                                                    texture_data,
+                                                    palette_data);
+            }
+        }
         TextureBinding *binding = key_out->binding;
         binding->refcnt++;
 #else
-        TextureBinding *binding = generate_texture(state,
+        TextureBinding *binding = generate_texture(&pg->texture_pool, state,
                                                    texture_data, palette_data);
 #endif
 
         glBindTexture(binding->gl_target, binding->gl_texture);
 
+        if (binding->upload_pending) {
+            assert(pg->texture_upload_count < NV2A_MAX_TEXTURES);
+            pg->texture_uploads[pg->texture_upload_count++] = (TextureUpload){
+                .unit = i,
+                .state = state,
+                .texture_data = texture_data,
+                .palette_data = palette_data,
+                .palette_hash = fnv_hash(palette_data, palette_length),
+                .binding = binding,
+            };
+            binding->upload_pending = false;
+        }
 
         if (f.linear) {
             /* somtimes games try to set mipmap min filters on linear textures.
@@ -3900,6 +3962,9 @@ static void pgraph_bind_textures(NV2AState *d)
         pg->texture_binding[i] = binding;
         pg->texture_dirty[i] = false;
     }
+
+    pgraph_upload_textures(pg);
+
     NV2A_GL_DGROUP_END();
 }
 
@@ -4144,18 +4209,33 @@ static void convert_yuy2_to_rgb(const uint8_t *line, unsigned int ix,
     *b = cliptobyte((298 * c + 516 * d + 128) >> 8);
 }
 
-static uint8_t* convert_texture_data(const TextureShape s,
-                                     const uint8_t *data,
-                                     const uint8_t *palette_data,
-                                     unsigned int width,
-                                     unsigned int height,
-                                     unsigned int depth,
-                                     unsigned int row_pitch,
-                                     unsigned int slice_pitch)
+/* Bytes per pixel of the data convert_texture_data() produces for a format,
+ * or 0 if the format is uploaded to GL as-is */
+static unsigned int converted_bytes_per_pixel(unsigned int color_format)
+{
+    switch (color_format) {
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8:
+    case NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8:
+        return 4;
+    case NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R6G5B5:
+        return 3;
+    default:
+        return 0;
+    }
+}
+
+static void convert_texture_data(const TextureShape s,
+                                 const uint8_t *data,
+                                 const uint8_t *palette_data,
+                                 unsigned int width,
+                                 unsigned int height,
+                                 unsigned int depth,
+                                 unsigned int row_pitch,
+                                 unsigned int slice_pitch,
+                                 uint8_t *converted_data)
 {
     if (s.color_format == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_I8_A8R8G8B8) {
         assert(depth == 1); /* FIXME */
-        uint8_t* converted_data = (uint8_t*)g_malloc(width * height * 4);
         int x, y;
         for (y = 0; y < height; y++) {
             for (x = 0; x < width; x++) {
@@ -4164,11 +4244,9 @@ static uint8_t* convert_texture_data(const TextureShape s,
                 *(uint32_t*)(converted_data + y * width * 4 + x * 4) = color;
             }
         }
-        return converted_data;
     } else if (s.color_format
                    == NV097_SET_TEXTURE_FORMAT_COLOR_LC_IMAGE_CR8YB8CB8YA8) {
         assert(depth == 1); /* FIXME */
-        uint8_t* converted_data = (uint8_t*)g_malloc(width * height * 4);
         int x, y;
         for (y = 0; y < height; y++) {
             const uint8_t* line = &data[y * s.width * 2];
@@ -4179,11 +4257,9 @@ static uint8_t* convert_texture_data(const TextureShape s,
                 pixel[3] = 255;
           }
         }
-        return converted_data;
     } else if (s.color_format
                    == NV097_SET_TEXTURE_FORMAT_COLOR_SZ_R6G5B5) {
         assert(depth == 1); /* FIXME */
-        uint8_t *converted_data = (uint8_t*)g_malloc(width * height * 3);
         int x, y;
         for (y = 0; y < height; y++) {
             for (x = 0; x < width; x++) {
@@ -4198,163 +4274,486 @@ static uint8_t* convert_texture_data(const TextureShape s,
                 pixel[2] = (rgb655 & 0x001F) * 0xFF / 0x1F - 0x80;
             }
         }
-        return converted_data;
     } else {
+        assert(false);
+    }
+}
+
+/* Queue one face/level of a texture for upload, unless the guest data is
+ * unchanged since it was last uploaded into the same storage */
+static TextureUploadRegion* pgraph_add_texture_upload_region(
+    PGRAPHState *pg, const TextureUpload *upload, GLenum gl_target,
+    unsigned int index, unsigned int level, const uint8_t *data,
+    size_t length, unsigned int width, unsigned int height,
+    unsigned int depth, size_t staging_length, size_t *staging_size)
+{
+    TextureBinding *binding = upload->binding;
+    uint64_t hash = XXH64(data, length, 0);
+
+    assert(index < NV2A_MAX_TEXTURE_REGIONS);
+    if (binding->contents_valid
+        && binding->palette_hash == upload->palette_hash
+        && binding->region_hash[index] == hash) {
         return NULL;
     }
+    binding->region_hash[index] = hash;
+
+    assert(pg->texture_upload_region_count < NV2A_MAX_TEXTURE_UPLOAD_REGIONS);
+    TextureUploadRegion *r =
+        &pg->texture_upload_regions[pg->texture_upload_region_count++];
+
+    r->upload = upload;
+    r->data = data;
+    r->staging = NULL;
+    r->staging_offset = *staging_size;
+    r->staging_length = staging_length;
+    r->gl_target = gl_target;
+    r->level = level;
+    r->width = width;
+    r->height = height;
+    r->depth = depth;
+    r->row_length = 0;
+
+    *staging_size += ROUND_UP(staging_length, 16);
+
+    return r;
 }
 
-static void upload_gl_texture(GLenum gl_target,
-                              const TextureShape s,
-                              const uint8_t *texture_data,
-                              const uint8_t *palette_data)
+/* Split a texture into the levels and faces that need to be uploaded, and
+ * lay them out in the staging buffer */
+static void pgraph_plan_texture_upload(PGRAPHState *pg,
+                                       const TextureUpload *upload,
+                                       size_t *staging_size)
 {
-    ColorFormatInfo f = kelvin_color_format_map[s.color_format];
+    const TextureShape *s = &upload->state;
+    ColorFormatInfo f = kelvin_color_format_map[s->color_format];
+    unsigned int converted_bpp = converted_bytes_per_pixel(s->color_format);
+    GLenum gl_target = upload->binding->gl_target;
+    int level;
 
-    switch(gl_target) {
+    switch (gl_target) {
     case GL_TEXTURE_1D:
         assert(false);
         break;
     case GL_TEXTURE_RECTANGLE: {
         /* Can't handle strides unaligned to pixels */
-        assert(s.pitch % f.bytes_per_pixel == 0);
-        glPixelStorei(GL_UNPACK_ROW_LENGTH,
-                      s.pitch / f.bytes_per_pixel);
-
-        uint8_t *converted = convert_texture_data(s, texture_data,
-                                                  palette_data,
-                                                  s.width, s.height, 1,
-                                                  s.pitch, 0);
-
-        glTexImage2D(gl_target, 0, f.gl_internal_format,
-                     s.width, s.height, 0,
-                     f.gl_format, f.gl_type,
-                     converted ? converted : texture_data);
-
-        if (converted) {
-          g_free(converted);
-        }
+        assert(s->pitch % f.bytes_per_pixel == 0);
 
-        glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+        size_t length = (s->height - 1) * s->pitch
+                            + s->width * f.bytes_per_pixel;
+        size_t staging_length = length;
+        if (converted_bpp) {
+            staging_length = s->width * s->height * converted_bpp;
+        }
+        TextureUploadRegion *r =
+            pgraph_add_texture_upload_region(pg, upload, gl_target, 0, 0,
+                                             upload->texture_data, length,
+                                             s->width, s->height, 1,
+                                             staging_length, staging_size);
+        if (r && !converted_bpp) {
+            r->row_length = s->pitch / f.bytes_per_pixel;
+        }
         break;
     }
     case GL_TEXTURE_2D:
-    case GL_TEXTURE_CUBE_MAP_POSITIVE_X:
-    case GL_TEXTURE_CUBE_MAP_NEGATIVE_X:
-    case GL_TEXTURE_CUBE_MAP_POSITIVE_Y:
-    case GL_TEXTURE_CUBE_MAP_NEGATIVE_Y:
-    case GL_TEXTURE_CUBE_MAP_POSITIVE_Z:
-    case GL_TEXTURE_CUBE_MAP_NEGATIVE_Z: {
+    case GL_TEXTURE_CUBE_MAP: {
+        unsigned int faces = 1;
+        size_t face_length = 0;
+        if (gl_target == GL_TEXTURE_CUBE_MAP) {
+            unsigned int w = s->width, h = s->height;
+            for (level = 0; level < s->levels; level++) {
+                /* FIXME: This is wrong for compressed textures and textures with 1x? non-square mipmaps */
+                face_length += w * h * f.bytes_per_pixel;
+                w /= 2;
+                h /= 2;
+            }
+            faces = 6;
+        }
 
-        unsigned int width = s.width, height = s.height;
+        int face;
+        for (face = 0; face < faces; face++) {
+            GLenum face_target = (gl_target == GL_TEXTURE_CUBE_MAP)
+                                     ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face
+                                     : gl_target;
+            const uint8_t *data = upload->texture_data + face * face_length;
+            unsigned int width = s->width, height = s->height;
 
-        int level;
-        for (level = 0; level < s.levels; level++) {
-            if (f.gl_format == 0) { /* compressed */
-
-                width = MAX(width, 4); height = MAX(height, 4);
+            for (level = 0; level < s->levels; level++) {
+                size_t length;
+                width = MAX(width, 1); height = MAX(height, 1);
+                if (f.gl_format == 0) { /* compressed */
+                    unsigned int block_size;
+                    if (f.gl_internal_format
+                            == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
+                        block_size = 8;
+                    } else {
+                        block_size = 16;
+                    }
 
-                unsigned int block_size;
-                if (f.gl_internal_format == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) {
-                    block_size = 8;
+                    /* Levels below 4x4 still take a whole block, but the
+                     * upload must not exceed the level's real size */
+                    length = MAX(width, 4)/4 * MAX(height, 4)/4 * block_size;
+                    pgraph_add_texture_upload_region(pg, upload, face_target,
+                                                     face * s->levels + level,
+                                                     level, data, length,
+                                                     width, height, 1,
+                                                     length, staging_size);
                 } else {
-                    block_size = 16;
+                    length = width * height * f.bytes_per_pixel;
+                    size_t staging_length = converted_bpp
+                                                ? width * height * converted_bpp
+                                                : length;
+                    pgraph_add_texture_upload_region(pg, upload, face_target,
+                                                     face * s->levels + level,
+                                                     level, data, length,
+                                                     width, height, 1,
+                                                     staging_length,
+                                                     staging_size);
                 }
+                data += length;
 
-                glCompressedTexImage2D(gl_target, level, f.gl_internal_format,
-                                       width, height, 0,
-                                       width/4 * height/4 * block_size,
-                                       texture_data);
+                width /= 2;
+                height /= 2;
+            }
+        }
+        break;
+    }
+    case GL_TEXTURE_3D: {
+        unsigned int width = s->width, height = s->height, depth = s->depth;
+        const uint8_t *data = upload->texture_data;
 
-                texture_data += width/4 * height/4 * block_size;
-            } else {
+        assert(f.gl_format != 0); /* FIXME: compressed not supported yet */
+        assert(f.linear == false);
 
-                width = MAX(width, 1); height = MAX(height, 1);
+        for (level = 0; level < s->levels; level++) {
+            width = MAX(width, 1); height = MAX(height, 1);
+            depth = MAX(depth, 1);
+
+            size_t length = width * height * depth * f.bytes_per_pixel;
+            size_t staging_length = converted_bpp
+                                        ? width * height * depth * converted_bpp
+                                        : length;
+            pgraph_add_texture_upload_region(pg, upload, gl_target, level,
+                                             level, data, length,
+                                             width, height, depth,
+                                             staging_length, staging_size);
+            data += length;
+
+            width /= 2;
+            height /= 2;
+            depth /= 2;
+        }
+        break;
+    }
+    default:
+        assert(false);
+        break;
+    }
 
-                unsigned int pitch = width * f.bytes_per_pixel;
-                uint8_t *unswizzled = (uint8_t*)g_malloc(height * pitch);
-                unswizzle_rect(texture_data, width, height,
-                               unswizzled, pitch, f.bytes_per_pixel);
+    upload->binding->contents_valid = true;
+    upload->binding->palette_hash = upload->palette_hash;
+}
+
+/* Unswizzle and convert one region of guest texture data into the staging
+ * buffer. Runs on the texture decode pool, so it must not touch GL. */
+static void texture_upload_region_decode(const TextureUploadRegion *r)
+{
+    const TextureShape *s = &r->upload->state;
+    ColorFormatInfo f = kelvin_color_format_map[s->color_format];
+    bool convert = converted_bytes_per_pixel(s->color_format) != 0;
+    uint8_t *dest = r->staging + r->staging_offset;
+
+    if (f.linear) {
+        if (convert) {
+            convert_texture_data(*s, r->data, r->upload->palette_data,
+                                 r->width, r->height, 1, s->pitch, 0, dest);
+        } else {
+            memcpy(dest, r->data, r->staging_length);
+        }
+        return;
+    }
 
-                uint8_t *converted = convert_texture_data(s, unswizzled,
-                                                          palette_data,
-                                                          width, height, 1,
-                                                          pitch, 0);
+    if (f.gl_format == 0) {
+        /* compressed textures are uploaded as-is */
+        memcpy(dest, r->data, r->staging_length);
+        return;
+    }
 
-                glTexImage2D(gl_target, level, f.gl_internal_format,
-                             width, height, 0,
-                             f.gl_format, f.gl_type,
-                             converted ? converted : unswizzled);
+    unsigned int row_pitch = r->width * f.bytes_per_pixel;
+    unsigned int slice_pitch = row_pitch * r->height;
+    uint8_t *unswizzled = convert ? g_malloc(slice_pitch * r->depth) : dest;
 
-                if (converted) {
-                    g_free(converted);
-                }
-                g_free(unswizzled);
+    if (r->gl_target == GL_TEXTURE_3D) {
+        unswizzle_box(r->data, r->width, r->height, r->depth, unswizzled,
+                      row_pitch, slice_pitch, f.bytes_per_pixel);
+    } else {
+        unswizzle_rect(r->data, r->width, r->height,
+                       unswizzled, row_pitch, f.bytes_per_pixel);
+    }
 
-                texture_data += width * height * f.bytes_per_pixel;
-            }
+    if (convert) {
+        convert_texture_data(*s, unswizzled, r->upload->palette_data,
+                             r->width, r->height, r->depth,
+                             row_pitch, slice_pitch, dest);
+        g_free(unswizzled);
+    }
+}
 
-            width /= 2;
-            height /= 2;
+static void texture_decode_worker(gpointer data, gpointer user_data)
+{
+    PGRAPHState *pg = (PGRAPHState *)user_data;
+
+    texture_upload_region_decode((TextureUploadRegion *)data);
+
+    qemu_mutex_lock(&pg->texture_decode_lock);
+    if (--pg->texture_decode_pending == 0) {
+        qemu_cond_signal(&pg->texture_decode_cond);
+    }
+    qemu_mutex_unlock(&pg->texture_decode_lock);
+}
+
+static void texture_upload_region_upload(const TextureUploadRegion *r)
+{
+    const TextureShape *s = &r->upload->state;
+    ColorFormatInfo f = kelvin_color_format_map[s->color_format];
+    const GLvoid *offset = (const GLvoid *)r->staging_offset;
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, r->row_length);
+
+    if (r->gl_target == GL_TEXTURE_3D) {
+        glTexSubImage3D(r->gl_target, r->level, 0, 0, 0,
+                        r->width, r->height, r->depth,
+                        f.gl_format, f.gl_type, offset);
+    } else if (f.gl_format == 0) {
+        glCompressedTexSubImage2D(r->gl_target, r->level, 0, 0,
+                                  r->width, r->height, f.gl_internal_format,
+                                  r->staging_length, offset);
+    } else {
+        glTexSubImage2D(r->gl_target, r->level, 0, 0,
+                        r->width, r->height,
+                        f.gl_format, f.gl_type, offset);
+    }
+
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+/* Decode all texture misses of this draw in parallel into a mapped pixel
+ * unpack buffer, then upload them from there */
+static void pgraph_upload_textures(PGRAPHState *pg)
+{
+    int i;
+
+    if (pg->texture_upload_count == 0) {
+        return;
+    }
+
+    NV2A_GL_DGROUP_BEGIN("%s", __func__);
+
+    size_t staging_size = 0;
+    pg->texture_upload_region_count = 0;
+    for (i = 0; i < pg->texture_upload_count; i++) {
+        pgraph_plan_texture_upload(pg, &pg->texture_uploads[i],
+                                   &staging_size);
+    }
+
+    if (pg->texture_upload_region_count == 0) {
+        /* Everything was already up to date */
+        pg->texture_upload_count = 0;
+        NV2A_GL_DGROUP_END();
+        return;
+    }
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pg->gl_texture_staging_buffer);
+    glBufferData(GL_PIXEL_UNPACK_BUFFER, staging_size, NULL, GL_STREAM_DRAW);
+    uint8_t *staging = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER,
+                                        0, staging_size,
+                                        GL_MAP_WRITE_BIT
+                                        | GL_MAP_INVALIDATE_BUFFER_BIT);
+    assert(staging != NULL);
+
+    for (i = 0; i < pg->texture_upload_region_count; i++) {
+        pg->texture_upload_regions[i].staging = staging;
+    }
+
+    if (pg->texture_upload_region_count == 1) {
+        texture_upload_region_decode(&pg->texture_upload_regions[0]);
+    } else {
+        pg->texture_decode_pending = pg->texture_upload_region_count;
+        for (i = 0; i < pg->texture_upload_region_count; i++) {
+            g_thread_pool_push(pg->texture_decode_pool,
+                               &pg->texture_upload_regions[i], NULL);
         }
 
-        break;
+        qemu_mutex_lock(&pg->texture_decode_lock);
+        while (pg->texture_decode_pending > 0) {
+            qemu_cond_wait(&pg->texture_decode_cond,
+                           &pg->texture_decode_lock);
+        }
+        qemu_mutex_unlock(&pg->texture_decode_lock);
     }
-    case GL_TEXTURE_3D: {
 
-        unsigned int width = s.width, height = s.height, depth = s.depth;
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
 
-        assert(f.gl_format != 0); /* FIXME: compressed not supported yet */
-        assert(f.linear == false);
+    for (i = 0; i < pg->texture_upload_region_count; i++) {
+        const TextureUploadRegion *r = &pg->texture_upload_regions[i];
+        const TextureBinding *binding = r->upload->binding;
+        glActiveTexture(GL_TEXTURE0 + r->upload->unit);
+        glBindTexture(binding->gl_target, binding->gl_texture);
+        texture_upload_region_upload(r);
+    }
 
-        int level;
-        for (level = 0; level < s.levels; level++) {
-
-            unsigned int row_pitch = width * f.bytes_per_pixel;
-            unsigned int slice_pitch = row_pitch * height;
-            uint8_t *unswizzled = (uint8_t*)g_malloc(slice_pitch * depth);
-            unswizzle_box(texture_data, width, height, depth, unswizzled,
-                           row_pitch, slice_pitch, f.bytes_per_pixel);
-
-            uint8_t *converted = convert_texture_data(s, unswizzled,
-                                                      palette_data,
-                                                      width, height, depth,
-                                                      row_pitch, slice_pitch);
-
-            glTexImage3D(gl_target, level, f.gl_internal_format,
-                         width, height, depth, 0,
-                         f.gl_format, f.gl_type,
-                         converted ? converted : unswizzled);
-
-            if (converted) {
-                g_free(converted);
-            }
-            g_free(unswizzled);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+    pg->texture_upload_count = 0;
+    pg->texture_upload_region_count = 0;
+
+    NV2A_GL_DGROUP_END();
+}
 
-            texture_data += width * height * depth * f.bytes_per_pixel;
+#define TEXTURE_POOL_MAX_FREE 64
+#define TEXTURE_POOL_MAX_RETIRED 64
+
+static void texture_pool_init(TexturePool *pool)
+{
+    pool->free_textures = g_hash_table_new_full(texture_pool_key_hash,
+                                                texture_pool_key_equal,
+                                                g_free, NULL);
+    pool->num_free = 0;
+    pool->has_texture_storage = glo_check_extension("GL_ARB_texture_storage");
+    pool->retired = g_hash_table_new_full(texture_address_hash,
+                                          texture_address_equal,
+                                          NULL, texture_retired_destroy);
+    pool->num_retired = 0;
+}
+
+static void texture_pool_destroy(TexturePool *pool)
+{
+    GHashTableIter iter;
+    gpointer value;
+
+    /* Retired storage goes back to the free textures first */
+    g_hash_table_destroy(pool->retired);
+    pool->num_retired = 0;
+
+    g_hash_table_iter_init(&iter, pool->free_textures);
+    while (g_hash_table_iter_next(&iter, NULL, &value)) {
+        GQueue *queue = (GQueue *)value;
+        while (!g_queue_is_empty(queue)) {
+            GLuint gl_texture = GPOINTER_TO_UINT(g_queue_pop_head(queue));
+            glDeleteTextures(1, &gl_texture);
+        }
+        g_queue_free(queue);
+    }
+    g_hash_table_destroy(pool->free_textures);
+    pool->num_free = 0;
+}
+
+static void texture_pool_allocate(TexturePool *pool, const TexturePoolKey *key)
+{
+    if (pool->has_texture_storage) {
+        switch (key->gl_target) {
+        case GL_TEXTURE_3D:
+            glTexStorage3D(key->gl_target, key->levels,
+                           key->gl_internal_format,
+                           key->width, key->height, key->depth);
+            break;
+        case GL_TEXTURE_RECTANGLE:
+        case GL_TEXTURE_2D:
+        case GL_TEXTURE_CUBE_MAP:
+            glTexStorage2D(key->gl_target, key->levels,
+                           key->gl_internal_format,
+                           key->width, key->height);
+            break;
+        default:
+            assert(false);
+            break;
+        }
+        return;
+    }
 
+    /* Without ARB_texture_storage, allocate every level up front so that
+     * all uploads can go through glTexSubImage */
+    int face, faces = (key->gl_target == GL_TEXTURE_CUBE_MAP) ? 6 : 1;
+    for (face = 0; face < faces; face++) {
+        GLenum target = (key->gl_target == GL_TEXTURE_CUBE_MAP)
+                            ? GL_TEXTURE_CUBE_MAP_POSITIVE_X + face
+                            : key->gl_target;
+        unsigned int width = key->width, height = key->height;
+        unsigned int depth = key->depth;
+        int level;
+        for (level = 0; level < key->levels; level++) {
+            width = MAX(width, 1); height = MAX(height, 1);
+            depth = MAX(depth, 1);
+            if (target == GL_TEXTURE_3D) {
+                glTexImage3D(target, level, key->gl_internal_format,
+                             width, height, depth, 0,
+                             key->gl_format, key->gl_type, NULL);
+            } else if (key->gl_format == 0) {
+                unsigned int block_size =
+                    (key->gl_internal_format
+                         == GL_COMPRESSED_RGBA_S3TC_DXT1_EXT) ? 8 : 16;
+                glCompressedTexImage2D(target, level, key->gl_internal_format,
+                                       width, height, 0,
+                                       MAX(width, 4)/4 * MAX(height, 4)/4
+                                           * block_size,
+                                       NULL);
+            } else {
+                glTexImage2D(target, level, key->gl_internal_format,
+                             width, height, 0,
+                             key->gl_format, key->gl_type, NULL);
+            }
             width /= 2;
             height /= 2;
             depth /= 2;
         }
-        break;
     }
-    default:
-        assert(false);
-        break;
+}
+
+/* Get a texture object with storage for key, bound to key->gl_target on the
+ * active texture unit */
+static GLuint texture_pool_acquire(TexturePool *pool, const TexturePoolKey *key)
+{
+    GLuint gl_texture;
+
+    GQueue *queue = g_hash_table_lookup(pool->free_textures, key);
+    if (queue != NULL && !g_queue_is_empty(queue)) {
+        gl_texture = GPOINTER_TO_UINT(g_queue_pop_head(queue));
+        pool->num_free--;
+        glBindTexture(key->gl_target, gl_texture);
+        return gl_texture;
     }
+
+    glGenTextures(1, &gl_texture);
+    glBindTexture(key->gl_target, gl_texture);
+    texture_pool_allocate(pool, key);
+    return gl_texture;
 }
 
-static TextureBinding* generate_texture(const TextureShape s,
+static void texture_pool_release(TexturePool *pool, const TexturePoolKey *key,
+                                 GLuint gl_texture)
+{
+    if (pool->num_free >= TEXTURE_POOL_MAX_FREE) {
+        glDeleteTextures(1, &gl_texture);
+        return;
+    }
+
+    GQueue *queue = g_hash_table_lookup(pool->free_textures, key);
+    if (queue == NULL) {
+        queue = g_queue_new();
+        g_hash_table_insert(pool->free_textures,
+                            g_memdup(key, sizeof(TexturePoolKey)), queue);
+    }
+    g_queue_push_tail(queue, GUINT_TO_POINTER(gl_texture));
+    pool->num_free++;
+}
+
+static TextureBinding* generate_texture(TexturePool *pool,
+                                        const TextureShape s,
                                         const uint8_t *texture_data,
                                         const uint8_t *palette_data)
 {
     ColorFormatInfo f = kelvin_color_format_map[s.color_format];
 
-    /* Create a new opengl texture */
-    GLuint gl_texture;
-    glGenTextures(1, &gl_texture);
-
     GLenum gl_target;
     if (s.cubemap) {
         assert(f.linear == false);
@@ -4384,7 +4783,17 @@ static TextureBinding* generate_texture(const TextureShape s,
         }
     }
 
-    glBindTexture(gl_target, gl_texture);
+    TexturePoolKey pool_key = {
+        .gl_target = gl_target,
+        .gl_internal_format = f.gl_internal_format,
+        .gl_format = f.gl_format,
+        .gl_type = f.gl_type,
+        .width = s.width,
+        .height = s.height,
+        .depth = (gl_target == GL_TEXTURE_3D) ? s.depth : 1,
+        .levels = f.linear ? 1 : s.levels,
+    };
+    GLuint gl_texture = texture_pool_acquire(pool, &pool_key);
 
     NV2A_GL_DLABEL(GL_TEXTURE, gl_texture,
                    "format: 0x%02X%s, %d dimensions%s, width: %d, height: %d, depth: %d",
@@ -4392,33 +4801,7 @@ static TextureBinding* generate_texture(const TextureShape s,
                    s.dimensionality, s.cubemap ? " (Cubemap)" : "",
                    s.width, s.height, s.depth);
 
-    if (gl_target == GL_TEXTURE_CUBE_MAP) {
-
-        size_t length = 0;
-        unsigned int w = s.width, h = s.height;
-        int level;
-        for (level = 0; level < s.levels; level++) {
-            /* FIXME: This is wrong for compressed textures and textures with 1x? non-square mipmaps */
-            length += w * h * f.bytes_per_pixel;
-            w /= 2;
-            h /= 2;
-        }
-
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_X,
-                          s, texture_data + 0 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_X,
-                          s, texture_data + 1 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_Y,
-                          s, texture_data + 2 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_Y,
-                          s, texture_data + 3 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_POSITIVE_Z,
-                          s, texture_data + 4 * length, palette_data);
-        upload_gl_texture(GL_TEXTURE_CUBE_MAP_NEGATIVE_Z,
-                          s, texture_data + 5 * length, palette_data);
-    } else {
-        upload_gl_texture(gl_target, s, texture_data, palette_data);
-    }
+    /* The contents are decoded and uploaded by pgraph_upload_textures */
 
     /* Linear textures don't support mipmapping */
     if (!f.linear) {
@@ -4428,26 +4811,92 @@ static TextureBinding* generate_texture(const TextureShape s,
             s.levels - 1);
     }
 
+    /* Pooled textures keep the parameters of their previous user */
+    static const GLint default_swizzle_mask[] = {
+        GL_RED, GL_GREEN, GL_BLUE, GL_ALPHA
+    };
+    static const GLfloat default_border_color[] = { 0, 0, 0, 0 };
     if (f.gl_swizzle_mask[0] != 0 || f.gl_swizzle_mask[1] != 0
         || f.gl_swizzle_mask[2] != 0 || f.gl_swizzle_mask[3] != 0) {
         glTexParameteriv(gl_target, GL_TEXTURE_SWIZZLE_RGBA,
                          (const GLint *)f.gl_swizzle_mask);
+    } else {
+        glTexParameteriv(gl_target, GL_TEXTURE_SWIZZLE_RGBA,
+                         default_swizzle_mask);
     }
+    glTexParameterfv(gl_target, GL_TEXTURE_BORDER_COLOR,
+                     default_border_color);
 
     TextureBinding* ret = (TextureBinding *)g_malloc(sizeof(TextureBinding));
     ret->gl_target = gl_target;
     ret->gl_texture = gl_texture;
     ret->refcnt = 1;
+    ret->upload_pending = true;
+    ret->pool = pool;
+    ret->pool_key = pool_key;
+    ret->contents_valid = false;
     return ret;
 }
 
+/* If a texture at the same guest address and with the same shape was
+ * evicted from the cache, take over its storage so only the modified levels
+ * have to be uploaded again */
+static TextureBinding* pgraph_take_texture_in_place(PGRAPHState *pg,
+                                                   TextureKey *key)
+{
+    TexturePool *pool = &pg->texture_pool;
+    TextureKey *retired = g_hash_table_lookup(pool->retired, key);
+    if (retired == NULL) {
+        return NULL;
+    }
+
+    TextureBinding *binding = retired->binding;
+    g_hash_table_steal(pool->retired, retired);
+    pool->num_retired--;
+    g_free(retired);
+
+    binding->upload_pending = true;
+    return binding;
+}
+
+/* Keep the storage of an evicted cache entry around for its address */
+static bool texture_pool_retire(TexturePool *pool, TextureKey *key)
+{
+    TextureBinding *binding = key->binding;
+
+    /* Still bound to a texture unit, or never uploaded */
+    if (binding->refcnt != 1 || !binding->contents_valid) {
+        return false;
+    }
+
+    TextureKey *old = g_hash_table_lookup(pool->retired, key);
+    if (old == NULL) {
+        if (pool->num_retired >= TEXTURE_POOL_MAX_RETIRED) {
+            return false;
+        }
+        pool->num_retired++;
+    }
+
+    TextureKey *retired = g_memdup(key, sizeof(TextureKey));
+    g_hash_table_replace(pool->retired, retired, retired);
+    return true;
+}
+
+static void texture_retired_destroy(gpointer data)
+{
+    TextureKey *retired = (TextureKey *)data;
+    texture_binding_destroy(retired->binding);
+    g_free(retired);
+}
+
 static void texture_binding_destroy(gpointer data)
 {
     TextureBinding *binding = (TextureBinding *)data;
     assert(binding->refcnt > 0);
     binding->refcnt--;
     if (binding->refcnt == 0) {
-        glDeleteTextures(1, &binding->gl_texture);
+        texture_pool_release(binding->pool, &binding->pool_key,
+                             binding->gl_texture);
         g_free(binding);
     }
 }
@@ -4458,16 +4907,20 @@ static struct lru_node *texture_cache_entry_init(struct lru_node *obj, void *key
     struct TextureKey *k_out = container_of(obj, struct TextureKey, node);
     struct TextureKey *k_in = (struct TextureKey *)key;
     memcpy(k_out, k_in, sizeof(struct TextureKey));
-    k_out->binding = generate_texture(k_in->state,
-                                      k_in->texture_data,
-                                      k_in->palette_data);
+    /* The texture is created (or taken over) by pgraph_bind_textures */
+    k_out->binding = NULL;
     return obj;
 }
 
 static struct lru_node *texture_cache_entry_deinit(struct lru_node *obj)
 {
     struct TextureKey *a = container_of(obj, struct TextureKey, node);
-    texture_binding_destroy(a->binding);
+    if (a->binding) {
+        if (!texture_pool_retire(a->binding->pool, a)) {
+            texture_binding_destroy(a->binding);
+        }
+        a->binding = NULL;
+    }
     return obj;
 }
 
@@ -4478,6 +4931,30 @@ static int texture_cache_entry_compare(struct lru_node *obj, void *key)
     return memcmp(&a->state, &b->state, sizeof(a->state));
 }
 
+/* hash and equality for texture address to cache entry map */
+static guint texture_address_hash(gconstpointer key)
+{
+    const TextureKey *k = (const TextureKey *)key;
+    return fnv_hash((const uint8_t *)&k->state, sizeof(k->state))
+           ^ g_direct_hash(k->texture_data);
+}
+static gboolean texture_address_equal(gconstpointer a, gconstpointer b)
+{
+    const TextureKey *ak = (const TextureKey *)a, *bk = (const TextureKey *)b;
+    return ak->texture_data == bk->texture_data
+           && memcmp(&ak->state, &bk->state, sizeof(ak->state)) == 0;
+}
+
+/* hash and equality for texture pool */
+static guint texture_pool_key_hash(gconstpointer key)
+{
+    return fnv_hash((const uint8_t *)key, sizeof(TexturePoolKey));
+}
+static gboolean texture_pool_key_equal(gconstpointer a, gconstpointer b)
+{
+    return memcmp(a, b, sizeof(TexturePoolKey)) == 0;
+}
+
 /* hash and equality for shader cache hash table */
 static guint shader_hash(gconstpointer key)
 {
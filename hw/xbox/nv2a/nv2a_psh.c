@@ -33,7 +33,7 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-#include "qapi/qmp/qstring.h"
+#include "mstring.h"
 
 #include "nv2a_shaders_common.h"
 #include "nv2a_psh.h"
@@ -199,8 +199,8 @@ struct PixelShader {
 
     //uint32_t dot_mapping, input_texture;
 
-    QString *varE, *varF;
-    QString *code;
+    MString *varE, *varF;
+    MString *code;
     int cur_stage;
 
     int num_var_refs;
@@ -228,63 +228,63 @@ static void add_const_ref(struct PixelShader *ps, const char *var)
 }
 
 // Get the code for a variable used in the program
-static QString* get_var(struct PixelShader *ps, int reg, bool is_dest)
+static MString* get_var(struct PixelShader *ps, int reg, bool is_dest)
 {
     switch (reg) {
     case PS_REGISTER_DISCARD:
         if (is_dest) {
-            return qstring_from_str("");
+            return mstring_from_str("");
         } else {
-            return qstring_from_str("vec4(0.0)");
+            return mstring_from_str("vec4(0.0)");
         }
         break;
     case PS_REGISTER_C0:
         if (ps->flags & PS_COMBINERCOUNT_UNIQUE_C0 || ps->cur_stage == 8) {
-            QString *reg = qstring_from_fmt("c0_%d", ps->cur_stage);
-            add_const_ref(ps, qstring_get_str(reg));
+            MString *reg = mstring_from_fmt("c0_%d", ps->cur_stage);
+            add_const_ref(ps, mstring_get_str(reg));
             return reg;
         } else {  // Same c0
             add_const_ref(ps, "c0_0");
-            return qstring_from_str("c0_0");
+            return mstring_from_str("c0_0");
         }
         break;
     case PS_REGISTER_C1:
         if (ps->flags & PS_COMBINERCOUNT_UNIQUE_C1 || ps->cur_stage == 8) {
-            QString *reg = qstring_from_fmt("c1_%d", ps->cur_stage);
-            add_const_ref(ps, qstring_get_str(reg));
+            MString *reg = mstring_from_fmt("c1_%d", ps->cur_stage);
+            add_const_ref(ps, mstring_get_str(reg));
             return reg;
         } else {  // Same c1
             add_const_ref(ps, "c1_0");
-            return qstring_from_str("c1_0");
+            return mstring_from_str("c1_0");
         }
         break;
     case PS_REGISTER_FOG:
-        return qstring_from_str("pFog");
+        return mstring_from_str("pFog");
     case PS_REGISTER_V0:
-        return qstring_from_str("v0");
+        return mstring_from_str("v0");
     case PS_REGISTER_V1:
-        return qstring_from_str("v1");
+        return mstring_from_str("v1");
     case PS_REGISTER_T0:
-        return qstring_from_str("t0");
+        return mstring_from_str("t0");
     case PS_REGISTER_T1:
-        return qstring_from_str("t1");
+        return mstring_from_str("t1");
     case PS_REGISTER_T2:
-        return qstring_from_str("t2");
+        return mstring_from_str("t2");
     case PS_REGISTER_T3:
-        return qstring_from_str("t3");
+        return mstring_from_str("t3");
     case PS_REGISTER_R0:
         add_var_ref(ps, "r0");
-        return qstring_from_str("r0");
+        return mstring_from_str("r0");
     case PS_REGISTER_R1:
         add_var_ref(ps, "r1");
-        return qstring_from_str("r1");
+        return mstring_from_str("r1");
     case PS_REGISTER_V1R0_SUM:
         add_var_ref(ps, "r0");
-        return qstring_from_str("vec4(v1.rgb + r0.rgb, 0.0)");
+        return mstring_from_str("vec4(v1.rgb + r0.rgb, 0.0)");
     case PS_REGISTER_EF_PROD:
-        return qstring_from_fmt("vec4(%s * %s, 0.0)",
-                                qstring_get_str(ps->varE),
-                                qstring_get_str(ps->varF));
+        return mstring_from_fmt("vec4(%s * %s, 0.0)",
+                                mstring_get_str(ps->varE),
+                                mstring_get_str(ps->varF));
     default:
         assert(false);
         break;
@@ -292,17 +292,17 @@ static QString* get_var(struct PixelShader *ps, int reg, bool is_dest)
 }
 
 // Get input variable code
-static QString* get_input_var(struct PixelShader *ps, struct InputInfo in, bool is_alpha)
+static MString* get_input_var(struct PixelShader *ps, struct InputInfo in, bool is_alpha)
 {
-    QString *reg = get_var(ps, in.reg, false);
+    MString *reg = get_var(ps, in.reg, false);
 
     if (!is_alpha) {
         switch (in.chan) {
         case PS_CHANNEL_RGB:
-            qstring_append(reg, ".rgb");
+            mstring_append(reg, ".rgb");
             break;
         case PS_CHANNEL_ALPHA:
-            qstring_append(reg, ".aaa");
+            mstring_append(reg, ".aaa");
             break;
         default:
             assert(false);
@@ -311,10 +311,10 @@ static QString* get_input_var(struct PixelShader *ps, struct InputInfo in, bool
     } else {
         switch (in.chan) {
         case PS_CHANNEL_BLUE:
-            qstring_append(reg, ".b");
+            mstring_append(reg, ".b");
             break;
         case PS_CHANNEL_ALPHA:
-            qstring_append(reg, ".a");
+            mstring_append(reg, ".a");
             break;
         default:
             assert(false);
@@ -322,65 +322,62 @@ static QString* get_input_var(struct PixelShader *ps, struct InputInfo in, bool
         }
     }
 
-    QString *res;
+    MString *res;
     switch (in.mod) {
     case PS_INPUTMAPPING_UNSIGNED_IDENTITY:
-        res = qstring_from_fmt("max(%s, 0.0)", qstring_get_str(reg));
+        res = mstring_from_fmt("max(%s, 0.0)", mstring_get_str(reg));
         break;
     case PS_INPUTMAPPING_UNSIGNED_INVERT:
-        res = qstring_from_fmt("(1.0 - clamp(%s, 0.0, 1.0))", qstring_get_str(reg));
+        res = mstring_from_fmt("(1.0 - clamp(%s, 0.0, 1.0))", mstring_get_str(reg));
         break;
     case PS_INPUTMAPPING_EXPAND_NORMAL:
-        res = qstring_from_fmt("(2.0 * max(%s, 0.0) - 1.0)", qstring_get_str(reg));
+        res = mstring_from_fmt("(2.0 * max(%s, 0.0) - 1.0)", mstring_get_str(reg));
         break;
     case PS_INPUTMAPPING_EXPAND_NEGATE:
-        res = qstring_from_fmt("(-2.0 * max(%s, 0.0) + 1.0)", qstring_get_str(reg));
+        res = mstring_from_fmt("(-2.0 * max(%s, 0.0) + 1.0)", mstring_get_str(reg));
         break;
     case PS_INPUTMAPPING_HALFBIAS_NORMAL:
-        res = qstring_from_fmt("(max(%s, 0.0) - 0.5)", qstring_get_str(reg));
+        res = mstring_from_fmt("(max(%s, 0.0) - 0.5)", mstring_get_str(reg));
         break;
     case PS_INPUTMAPPING_HALFBIAS_NEGATE:
-        res = qstring_from_fmt("(-max(%s, 0.0) + 0.5)", qstring_get_str(reg));
+        res = mstring_from_fmt("(-max(%s, 0.0) + 0.5)", mstring_get_str(reg));
         break;
     case PS_INPUTMAPPING_SIGNED_IDENTITY:
-        qobject_ref(reg);
         res = reg;
         break;
     case PS_INPUTMAPPING_SIGNED_NEGATE:
-        res = qstring_from_fmt("-%s", qstring_get_str(reg));
+        res = mstring_from_fmt("-%s", mstring_get_str(reg));
         break;
     default:
         assert(false);
         break;
     }
 
-    qobject_unref(reg);
     return res;
 }
 
 // Get code for the output mapping of a stage
-static QString* get_output(QString *reg, int mapping)
+static MString* get_output(MString *reg, int mapping)
 {
-    QString *res;
+    MString *res;
     switch (mapping) {
     case PS_COMBINEROUTPUT_IDENTITY:
-        qobject_ref(reg);
         res = reg;
         break;
     case PS_COMBINEROUTPUT_BIAS:
-        res = qstring_from_fmt("(%s - 0.5)", qstring_get_str(reg));
+        res = mstring_from_fmt("(%s - 0.5)", mstring_get_str(reg));
         break;
     case PS_COMBINEROUTPUT_SHIFTLEFT_1:
-        res = qstring_from_fmt("(%s * 2.0)", qstring_get_str(reg));
+        res = mstring_from_fmt("(%s * 2.0)", mstring_get_str(reg));
         break;
     case PS_COMBINEROUTPUT_SHIFTLEFT_1_BIAS:
-        res = qstring_from_fmt("((%s - 0.5) * 2.0)", qstring_get_str(reg));
+        res = mstring_from_fmt("((%s - 0.5) * 2.0)", mstring_get_str(reg));
         break;
     case PS_COMBINEROUTPUT_SHIFTLEFT_2:
-        res = qstring_from_fmt("(%s * 4.0)", qstring_get_str(reg));
+        res = mstring_from_fmt("(%s * 4.0)", mstring_get_str(reg));
         break;
     case PS_COMBINEROUTPUT_SHIFTRIGHT_1:
-        res = qstring_from_fmt("(%s / 2.0)", qstring_get_str(reg));
+        res = mstring_from_fmt("(%s / 2.0)", mstring_get_str(reg));
         break;
     default:
         assert(false);
@@ -394,94 +391,76 @@ static void add_stage_code(struct PixelShader *ps,
                            struct InputVarInfo input, struct OutputInfo output,
                            const char *write_mask, bool is_alpha)
 {
-    QString *a = get_input_var(ps, input.a, is_alpha);
-    QString *b = get_input_var(ps, input.b, is_alpha);
-    QString *c = get_input_var(ps, input.c, is_alpha);
-    QString *d = get_input_var(ps, input.d, is_alpha);
+    MString *a = get_input_var(ps, input.a, is_alpha);
+    MString *b = get_input_var(ps, input.b, is_alpha);
+    MString *c = get_input_var(ps, input.c, is_alpha);
+    MString *d = get_input_var(ps, input.d, is_alpha);
 
     const char *caster = "";
     if (strlen(write_mask) == 3) {
         caster = "vec3";
     }
 
-    QString *ab;
+    MString *ab;
     if (output.ab_op == PS_COMBINEROUTPUT_AB_DOT_PRODUCT) {
-        ab = qstring_from_fmt("dot(%s, %s)",
-                              qstring_get_str(a), qstring_get_str(b));
+        ab = mstring_from_fmt("dot(%s, %s)",
+                              mstring_get_str(a), mstring_get_str(b));
     } else {
-        ab = qstring_from_fmt("(%s * %s)",
-                              qstring_get_str(a), qstring_get_str(b));
+        ab = mstring_from_fmt("(%s * %s)",
+                              mstring_get_str(a), mstring_get_str(b));
     }
 
-    QString *cd;
+    MString *cd;
     if (output.cd_op == PS_COMBINEROUTPUT_CD_DOT_PRODUCT) {
-        cd = qstring_from_fmt("dot(%s, %s)",
-                              qstring_get_str(c), qstring_get_str(d));
+        cd = mstring_from_fmt("dot(%s, %s)",
+                              mstring_get_str(c), mstring_get_str(d));
     } else {
-        cd = qstring_from_fmt("(%s * %s)",
-                              qstring_get_str(c), qstring_get_str(d));
+        cd = mstring_from_fmt("(%s * %s)",
+                              mstring_get_str(c), mstring_get_str(d));
     }
 
-    QString *ab_mapping = get_output(ab, output.mapping);
-    QString *cd_mapping = get_output(cd, output.mapping);
-    QString *ab_dest = get_var(ps, output.ab, true);
-    QString *cd_dest = get_var(ps, output.cd, true);
-    QString *sum_dest = get_var(ps, output.muxsum, true);
+    MString *ab_mapping = get_output(ab, output.mapping);
+    MString *cd_mapping = get_output(cd, output.mapping);
+    MString *ab_dest = get_var(ps, output.ab, true);
+    MString *cd_dest = get_var(ps, output.cd, true);
+    MString *sum_dest = get_var(ps, output.muxsum, true);
 
-    if (qstring_get_length(ab_dest)) {
-        qstring_append_fmt(ps->code, "%s.%s = clamp(%s(%s), -1.0, 1.0);\n",
-                           qstring_get_str(ab_dest), write_mask, caster, qstring_get_str(ab_mapping));
+    if (mstring_get_length(ab_dest)) {
+        mstring_append_fmt(ps->code, "%s.%s = clamp(%s(%s), -1.0, 1.0);\n",
+                           mstring_get_str(ab_dest), write_mask, caster, mstring_get_str(ab_mapping));
     } else {
-        qobject_unref(ab_dest);
-        qobject_ref(ab_mapping);
         ab_dest = ab_mapping;
     }
 
-    if (qstring_get_length(cd_dest)) {
-        qstring_append_fmt(ps->code, "%s.%s = clamp(%s(%s), -1.0, 1.0);\n",
-                           qstring_get_str(cd_dest), write_mask, caster, qstring_get_str(cd_mapping));
+    if (mstring_get_length(cd_dest)) {
+        mstring_append_fmt(ps->code, "%s.%s = clamp(%s(%s), -1.0, 1.0);\n",
+                           mstring_get_str(cd_dest), write_mask, caster, mstring_get_str(cd_mapping));
     } else {
-        qobject_unref(cd_dest);
-        qobject_ref(cd_mapping);
         cd_dest = cd_mapping;
     }
 
     if (!is_alpha && output.flags & PS_COMBINEROUTPUT_AB_BLUE_TO_ALPHA) {
-        qstring_append_fmt(ps->code, "%s.a = %s.b;\n",
-                           qstring_get_str(ab_dest), qstring_get_str(ab_dest));
+        mstring_append_fmt(ps->code, "%s.a = %s.b;\n",
+                           mstring_get_str(ab_dest), mstring_get_str(ab_dest));
     }
     if (!is_alpha && output.flags & PS_COMBINEROUTPUT_CD_BLUE_TO_ALPHA) {
-        qstring_append_fmt(ps->code, "%s.a = %s.b;\n",
-                           qstring_get_str(cd_dest), qstring_get_str(cd_dest));
+        mstring_append_fmt(ps->code, "%s.a = %s.b;\n",
+                           mstring_get_str(cd_dest), mstring_get_str(cd_dest));
     }
 
-    QString *sum;
+    MString *sum;
     if (output.muxsum_op == PS_COMBINEROUTPUT_AB_CD_SUM) {
-        sum = qstring_from_fmt("(%s + %s)", qstring_get_str(ab), qstring_get_str(cd));
+        sum = mstring_from_fmt("(%s + %s)", mstring_get_str(ab), mstring_get_str(cd));
     } else {
-        sum = qstring_from_fmt("((r0.a >= 0.5) ? %s : %s)",
-                               qstring_get_str(cd), qstring_get_str(ab));
+        sum = mstring_from_fmt("((r0.a >= 0.5) ? %s : %s)",
+                               mstring_get_str(cd), mstring_get_str(ab));
     }
 
-    QString *sum_mapping = get_output(sum, output.mapping);
-    if (qstring_get_length(sum_dest)) {
-        qstring_append_fmt(ps->code, "%s.%s = clamp(%s(%s), -1.0, 1.0);\n",
-                           qstring_get_str(sum_dest), write_mask, caster, qstring_get_str(sum_mapping));
+    MString *sum_mapping = get_output(sum, output.mapping);
+    if (mstring_get_length(sum_dest)) {
+        mstring_append_fmt(ps->code, "%s.%s = clamp(%s(%s), -1.0, 1.0);\n",
+                           mstring_get_str(sum_dest), write_mask, caster, mstring_get_str(sum_mapping));
     }
-
-    qobject_unref(a);
-    qobject_unref(b);
-    qobject_unref(c);
-    qobject_unref(d);
-    qobject_unref(ab);
-    qobject_unref(cd);
-    qobject_unref(ab_mapping);
-    qobject_unref(cd_mapping);
-    qobject_unref(ab_dest);
-    qobject_unref(cd_dest);
-    qobject_unref(sum_dest);
-    qobject_unref(sum);
-    qobject_unref(sum_mapping);
 }
 
 // Add code for the final combiner stage
@@ -490,95 +469,87 @@ static void add_final_stage_code(struct PixelShader *ps, struct FCInputInfo fina
     ps->varE = get_input_var(ps, final.e, false);
     ps->varF = get_input_var(ps, final.f, false);
 
-    QString *a = get_input_var(ps, final.a, false);
-    QString *b = get_input_var(ps, final.b, false);
-    QString *c = get_input_var(ps, final.c, false);
-    QString *d = get_input_var(ps, final.d, false);
-    QString *g = get_input_var(ps, final.g, true);
-
-    qstring_append_fmt(ps->code, "fragColor.rgb = %s + mix(vec3(%s), vec3(%s), vec3(%s));\n",
-                       qstring_get_str(d), qstring_get_str(c),
-                       qstring_get_str(b), qstring_get_str(a));
-    qstring_append_fmt(ps->code, "fragColor.a = %s;\n", qstring_get_str(g));
-
-    qobject_unref(a);
-    qobject_unref(b);
-    qobject_unref(c);
-    qobject_unref(d);
-    qobject_unref(g);
-
-    qobject_unref(ps->varE);
-    qobject_unref(ps->varF);
+    MString *a = get_input_var(ps, final.a, false);
+    MString *b = get_input_var(ps, final.b, false);
+    MString *c = get_input_var(ps, final.c, false);
+    MString *d = get_input_var(ps, final.d, false);
+    MString *g = get_input_var(ps, final.g, true);
+
+    mstring_append_fmt(ps->code, "fragColor.rgb = %s + mix(vec3(%s), vec3(%s), vec3(%s));\n",
+                       mstring_get_str(d), mstring_get_str(c),
+                       mstring_get_str(b), mstring_get_str(a));
+    mstring_append_fmt(ps->code, "fragColor.a = %s;\n", mstring_get_str(g));
+
     ps->varE = ps->varF = NULL;
 }
 
 
 
-static QString* psh_convert(struct PixelShader *ps)
+static MString* psh_convert(struct PixelShader *ps)
 {
     int i;
 
-    QString *preflight = qstring_new();
-    qstring_append(preflight, STRUCT_VERTEX_DATA);
-    qstring_append(preflight, "noperspective in VertexData g_vtx;\n");
-    qstring_append(preflight, "#define vtx g_vtx\n");
-    qstring_append(preflight, "\n");
-    qstring_append(preflight, "out vec4 fragColor;\n");
-    qstring_append(preflight, "\n");
-    qstring_append(preflight, "uniform vec4 fogColor;\n");
+    MString *preflight = mstring_new();
+    mstring_append(preflight, STRUCT_VERTEX_DATA);
+    mstring_append(preflight, "noperspective in VertexData g_vtx;\n");
+    mstring_append(preflight, "#define vtx g_vtx\n");
+    mstring_append(preflight, "\n");
+    mstring_append(preflight, "out vec4 fragColor;\n");
+    mstring_append(preflight, "\n");
+    mstring_append(preflight, "uniform vec4 fogColor;\n");
 
     /* Window Clipping */
-    QString *clip = qstring_new();
+    MString *clip = mstring_new();
     if (ps->state.window_clip_count != 0) {
-        qstring_append_fmt(preflight, "uniform ivec4 clipRegion[%d];\n",
+        mstring_append_fmt(preflight, "uniform ivec4 clipRegion[%d];\n",
                            ps->state.window_clip_count);
-        qstring_append_fmt(clip, "/*  Window-clip (%s) */\n",
+        mstring_append_fmt(clip, "/*  Window-clip (%s) */\n",
                            ps->state.window_clip_exclusive ?
                                "Exclusive" : "Inclusive");
         if (!ps->state.window_clip_exclusive) {
-            qstring_append(clip, "bool clipContained = false;\n");
+            mstring_append(clip, "bool clipContained = false;\n");
         }
-        qstring_append_fmt(clip, "for (int i = 0; i < %d; i++) {\n",
+        mstring_append_fmt(clip, "for (int i = 0; i < %d; i++) {\n",
                            ps->state.window_clip_count);
-        qstring_append(clip, "  bvec4 clipTest = bvec4(lessThan(gl_FragCoord.xy, clipRegion[i].xy),\n"
+        mstring_append(clip, "  bvec4 clipTest = bvec4(lessThan(gl_FragCoord.xy, clipRegion[i].xy),\n"
                              "                         greaterThan(gl_FragCoord.xy, clipRegion[i].zw));\n"
                              "  if (!any(clipTest)) {\n");
         if (ps->state.window_clip_exclusive) {
             /* Pixel in clip region = exclude by discarding */
-            qstring_append(clip, "    discard;\n");
+            mstring_append(clip, "    discard;\n");
             assert(false); /* Untested */
         } else {
             /* Pixel in clip region = mark pixel as contained and leave */
-            qstring_append(clip, "    clipContained = true;\n"
+            mstring_append(clip, "    clipContained = true;\n"
                                  "    break;\n");
         }
-        qstring_append(clip, "  }\n"
+        mstring_append(clip, "  }\n"
                              "}\n");
         /* Check for inclusive window clip */
         if (!ps->state.window_clip_exclusive) {
-            qstring_append(clip, "if (!clipContained) { discard; }\n");
+            mstring_append(clip, "if (!clipContained) { discard; }\n");
         }
     } else if (ps->state.window_clip_exclusive) {
         /* Clip everything */
-        qstring_append(clip, "discard;\n");
+        mstring_append(clip, "discard;\n");
     }
 
     /* calculate perspective-correct inputs */
-    QString *vars = qstring_new();
-    qstring_append(vars, "vec4 pD0 = vtx.D0 / vtx.inv_w;\n");
-    qstring_append(vars, "vec4 pD1 = vtx.D1 / vtx.inv_w;\n");
-    qstring_append(vars, "vec4 pB0 = vtx.B0 / vtx.inv_w;\n");
-    qstring_append(vars, "vec4 pB1 = vtx.B1 / vtx.inv_w;\n");
-    qstring_append(vars, "vec4 pFog = vec4(fogColor.rgb, clamp(vtx.Fog / vtx.inv_w, 0.0, 1.0));\n");
-    qstring_append(vars, "vec4 pT0 = vtx.T0 / vtx.inv_w;\n");
-    qstring_append(vars, "vec4 pT1 = vtx.T1 / vtx.inv_w;\n");
-    qstring_append(vars, "vec4 pT2 = vtx.T2 / vtx.inv_w;\n");
-    qstring_append(vars, "vec4 pT3 = vtx.T3 / vtx.inv_w;\n");
-    qstring_append(vars, "\n");
-    qstring_append(vars, "vec4 v0 = pD0;\n");
-    qstring_append(vars, "vec4 v1 = pD1;\n");
-
-    ps->code = qstring_new();
+    MString *vars = mstring_new();
+    mstring_append(vars, "vec4 pD0 = vtx.D0 / vtx.inv_w;\n");
+    mstring_append(vars, "vec4 pD1 = vtx.D1 / vtx.inv_w;\n");
+    mstring_append(vars, "vec4 pB0 = vtx.B0 / vtx.inv_w;\n");
+    mstring_append(vars, "vec4 pB1 = vtx.B1 / vtx.inv_w;\n");
+    mstring_append(vars, "vec4 pFog = vec4(fogColor.rgb, clamp(vtx.Fog / vtx.inv_w, 0.0, 1.0));\n");
+    mstring_append(vars, "vec4 pT0 = vtx.T0 / vtx.inv_w;\n");
+    mstring_append(vars, "vec4 pT1 = vtx.T1 / vtx.inv_w;\n");
+    mstring_append(vars, "vec4 pT2 = vtx.T2 / vtx.inv_w;\n");
+    mstring_append(vars, "vec4 pT3 = vtx.T3 / vtx.inv_w;\n");
+    mstring_append(vars, "\n");
+    mstring_append(vars, "vec4 v0 = pD0;\n");
+    mstring_append(vars, "vec4 v1 = pD1;\n");
+
+    ps->code = mstring_new();
 
     for (i = 0; i < 4; i++) {
 
@@ -586,7 +557,7 @@ static QString* psh_convert(struct PixelShader *ps)
 
         switch (ps->tex_modes[i]) {
         case PS_TEXTUREMODES_NONE:
-            qstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_NONE */\n",
+            mstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_NONE */\n",
                                i);
             break;
         case PS_TEXTUREMODES_PROJECT2D:
@@ -595,28 +566,28 @@ static QString* psh_convert(struct PixelShader *ps)
             } else {
                 sampler_type = "sampler2D";
             }
-            qstring_append_fmt(vars, "vec4 t%d = textureProj(texSamp%d, pT%d.xyw);\n",
+            mstring_append_fmt(vars, "vec4 t%d = textureProj(texSamp%d, pT%d.xyw);\n",
                                i, i, i);
             break;
         case PS_TEXTUREMODES_PROJECT3D:
             sampler_type = "sampler3D";
-            qstring_append_fmt(vars, "vec4 t%d = textureProj(texSamp%d, pT%d.xyzw);\n",
+            mstring_append_fmt(vars, "vec4 t%d = textureProj(texSamp%d, pT%d.xyzw);\n",
                                i, i, i);
             break;
         case PS_TEXTUREMODES_CUBEMAP:
             sampler_type = "samplerCube";
-            qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, pT%d.xyz / pT%d.w);\n",
+            mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, pT%d.xyz / pT%d.w);\n",
                                i, i, i, i);
             break;
         case PS_TEXTUREMODES_PASSTHRU:
-            qstring_append_fmt(vars, "vec4 t%d = pT%d;\n", i, i);
+            mstring_append_fmt(vars, "vec4 t%d = pT%d;\n", i, i);
             break;
         case PS_TEXTUREMODES_CLIPPLANE: {
             int j;
-            qstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_CLIPPLANE */\n",
+            mstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_CLIPPLANE */\n",
                                i);
             for (j = 0; j < 4; j++) {
-                qstring_append_fmt(vars, "  if(pT%d.%c %s 0.0) { discard; };\n",
+                mstring_append_fmt(vars, "  if(pT%d.%c %s 0.0) { discard; };\n",
                                    i, "xyzw"[j],
                                    ps->state.compare_mode[i][j] ? ">=" : "<");
             }
@@ -625,78 +596,78 @@ static QString* psh_convert(struct PixelShader *ps)
         case PS_TEXTUREMODES_BUMPENVMAP:
             assert(!ps->state.rect_tex[i]);
             sampler_type = "sampler2D";
-            qstring_append_fmt(preflight, "uniform mat2 bumpMat%d;\n", i);
+            mstring_append_fmt(preflight, "uniform mat2 bumpMat%d;\n", i);
             /* FIXME: Do bumpMat swizzle on CPU before upload */
-            qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, pT%d.xy + t%d.rg * mat2(bumpMat%d[0].xy,bumpMat%d[1].yx));\n",
+            mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, pT%d.xy + t%d.rg * mat2(bumpMat%d[0].xy,bumpMat%d[1].yx));\n",
                                i, i, i, ps->input_tex[i], i, i);
             break;
         case PS_TEXTUREMODES_BUMPENVMAP_LUM:
-            qstring_append_fmt(preflight, "uniform float bumpScale%d;\n", i);
-            qstring_append_fmt(preflight, "uniform float bumpOffset%d;\n", i);
-            qstring_append_fmt(ps->code, "/* BUMPENVMAP_LUM for stage %d */\n", i);
-            qstring_append_fmt(ps->code, "t%d = t%d * (bumpScale%d * t%d.b + bumpOffset%d);\n",
+            mstring_append_fmt(preflight, "uniform float bumpScale%d;\n", i);
+            mstring_append_fmt(preflight, "uniform float bumpOffset%d;\n", i);
+            mstring_append_fmt(ps->code, "/* BUMPENVMAP_LUM for stage %d */\n", i);
+            mstring_append_fmt(ps->code, "t%d = t%d * (bumpScale%d * t%d.b + bumpOffset%d);\n",
                                i, i, i, ps->input_tex[i], i);
             /* Now the same as BUMPENVMAP */
             assert(!ps->state.rect_tex[i]);
             sampler_type = "sampler2D";
-            qstring_append_fmt(preflight, "uniform mat2 bumpMat%d;\n", i);
+            mstring_append_fmt(preflight, "uniform mat2 bumpMat%d;\n", i);
             /* FIXME: Do bumpMat swizzle on CPU before upload */
-            qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, pT%d.xy + t%d.rg * mat2(bumpMat%d[0].xy,bumpMat%d[1].yx));\n",
+            mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, pT%d.xy + t%d.rg * mat2(bumpMat%d[0].xy,bumpMat%d[1].yx));\n",
                                i, i, i, ps->input_tex[i], i, i);
             break;
         case PS_TEXTUREMODES_BRDF:
-            qstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_BRDF */\n",
+            mstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_BRDF */\n",
                                i);
             assert(false); /* Unimplemented */
             break;
         case PS_TEXTUREMODES_DOT_ST:
-            qstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_ST */\n",
+            mstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_ST */\n",
                                i);
             assert(false); /* Unimplemented */
             break;
         case PS_TEXTUREMODES_DOT_ZW:
-            qstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_ZW */\n",
+            mstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_ZW */\n",
                                i);
             assert(false); /* Unimplemented */
             break;
         case PS_TEXTUREMODES_DOT_RFLCT_DIFF:
-            qstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_RFLCT_DIFF */\n",
+            mstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_RFLCT_DIFF */\n",
                                i);
             assert(false); /* Unimplemented */
             break;
         case PS_TEXTUREMODES_DOT_RFLCT_SPEC:
-            qstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_RFLCT_SPEC */\n",
+            mstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_RFLCT_SPEC */\n",
                                i);
             assert(false); /* Unimplemented */
             break;
         case PS_TEXTUREMODES_DOT_STR_3D:
-            qstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_STR_3D */\n",
+            mstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_STR_3D */\n",
                                i);
             assert(false); /* Unimplemented */
             break;
         case PS_TEXTUREMODES_DOT_STR_CUBE:
-            qstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_STR_CUBE */\n",
+            mstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_STR_CUBE */\n",
                                i);
             assert(false); /* Unimplemented */
             break;
         case PS_TEXTUREMODES_DPNDNT_AR:
             assert(!ps->state.rect_tex[i]);
             sampler_type = "sampler2D";
-            qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, t%d.ar);\n",
+            mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, t%d.ar);\n",
                                i, i, ps->input_tex[i]);
             break;
         case PS_TEXTUREMODES_DPNDNT_GB:
             assert(!ps->state.rect_tex[i]);
             sampler_type = "sampler2D";
-            qstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, t%d.gb);\n",
+            mstring_append_fmt(vars, "vec4 t%d = texture(texSamp%d, t%d.gb);\n",
                                i, i, ps->input_tex[i]);
             break;
         case PS_TEXTUREMODES_DOTPRODUCT:
-            qstring_append_fmt(vars, "vec4 t%d = vec4(dot(pT%d.xyz, t%d.rgb));\n",
+            mstring_append_fmt(vars, "vec4 t%d = vec4(dot(pT%d.xyz, t%d.rgb));\n",
                                i, i, ps->input_tex[i]);
             break;
         case PS_TEXTUREMODES_DOT_RFLCT_SPEC_CONST:
-            qstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_RFLCT_SPEC_CONST */\n",
+            mstring_append_fmt(vars, "vec4 t%d = vec4(0.0); /* PS_TEXTUREMODES_DOT_RFLCT_SPEC_CONST */\n",
                                i);
             assert(false); /* Unimplemented */
             break;
@@ -707,11 +678,11 @@ static QString* psh_convert(struct PixelShader *ps)
         }
         
         if (sampler_type != NULL) {
-            qstring_append_fmt(preflight, "uniform %s texSamp%d;\n", sampler_type, i);
+            mstring_append_fmt(preflight, "uniform %s texSamp%d;\n", sampler_type, i);
 
             /* As this means a texture fetch does happen, do alphakill */
             if (ps->state.alphakill[i]) {
-                qstring_append_fmt(vars, "if (t%d.a == 0.0) { discard; };\n",
+                mstring_append_fmt(vars, "if (t%d.a == 0.0) { discard; };\n",
                                    i);
             }
         }
@@ -719,21 +690,21 @@ static QString* psh_convert(struct PixelShader *ps)
 
     for (i = 0; i < ps->num_stages; i++) {
         ps->cur_stage = i;
-        qstring_append_fmt(ps->code, "// Stage %d\n", i);
+        mstring_append_fmt(ps->code, "// Stage %d\n", i);
         add_stage_code(ps, ps->stage[i].rgb_input, ps->stage[i].rgb_output, "rgb", false);
         add_stage_code(ps, ps->stage[i].alpha_input, ps->stage[i].alpha_output, "a", true);
     }
 
     if (ps->final_input.enabled) {
         ps->cur_stage = 8;
-        qstring_append(ps->code, "// Final Combiner\n");
+        mstring_append(ps->code, "// Final Combiner\n");
         add_final_stage_code(ps, ps->final_input);
     }
 
     if (ps->state.alpha_test && ps->state.alpha_func != ALPHA_FUNC_ALWAYS) {
-        qstring_append_fmt(preflight, "uniform float alphaRef;\n");
+        mstring_append_fmt(preflight, "uniform float alphaRef;\n");
         if (ps->state.alpha_func == ALPHA_FUNC_NEVER) {
-            qstring_append(ps->code, "discard;\n");
+            mstring_append(ps->code, "discard;\n");
         } else {
             const char* alpha_op;
             switch (ps->state.alpha_func) {
@@ -747,38 +718,38 @@ static QString* psh_convert(struct PixelShader *ps)
                 assert(false);
                 break;
             }
-            qstring_append_fmt(ps->code, "if (!(fragColor.a %s alphaRef)) discard;\n",
+            mstring_append_fmt(ps->code, "if (!(fragColor.a %s alphaRef)) discard;\n",
                                alpha_op);
         }
     }
 
     for (i = 0; i < ps->num_const_refs; i++) {
-        qstring_append_fmt(preflight, "uniform vec4 %s;\n", ps->const_refs[i]);
+        mstring_append_fmt(preflight, "uniform vec4 %s;\n", ps->const_refs[i]);
     }
 
     for (i = 0; i < ps->num_var_refs; i++) {
-        qstring_append_fmt(vars, "vec4 %s;\n", ps->var_refs[i]);
+        mstring_append_fmt(vars, "vec4 %s;\n", ps->var_refs[i]);
         if (strcmp(ps->var_refs[i], "r0") == 0) {
             if (ps->tex_modes[0] != PS_TEXTUREMODES_NONE) {
-                qstring_append(vars, "r0.a = t0.a;\n");
+                mstring_append(vars, "r0.a = t0.a;\n");
             } else {
-                qstring_append(vars, "r0.a = 1.0;\n");
+                mstring_append(vars, "r0.a = 1.0;\n");
             }
         }
     }
 
-    QString *final = qstring_new();
-    qstring_append(final, "#version 330\n\n");
-    qstring_append(final, qstring_get_str(preflight));
-    qstring_append(final, "void main() {\n");
-    qstring_append(final, qstring_get_str(clip));
-    qstring_append(final, qstring_get_str(vars));
-    qstring_append(final, qstring_get_str(ps->code));
-    qstring_append(final, "}\n");
-
-    qobject_unref(preflight);
-    qobject_unref(vars);
-    qobject_unref(ps->code);
+    MString *final = mstring_new_sized(mstring_get_length(preflight)
+                                       + mstring_get_length(clip)
+                                       + mstring_get_length(vars)
+                                       + mstring_get_length(ps->code)
+                                       + 64);
+    mstring_append(final, "#version 330\n\n");
+    mstring_append(final, mstring_get_str(preflight));
+    mstring_append(final, "void main() {\n");
+    mstring_append(final, mstring_get_str(clip));
+    mstring_append(final, mstring_get_str(vars));
+    mstring_append(final, mstring_get_str(ps->code));
+    mstring_append(final, "}\n");
 
     return final;
 }
@@ -815,7 +786,7 @@ static void parse_combiner_output(uint32_t value, struct OutputInfo *out)
     out->cd_alphablue = flags & 0x40;
 }
 
-QString *psh_translate(const PshState state)
+MString *psh_translate(const PshState state)
 {
     int i;
     struct PixelShader ps;
@@ -34,6 +34,17 @@ uint64_t ptimer_read(void *opaque, hwaddr addr, unsigned int size)
     NV2AState *d = opaque;
 
     uint64_t r = 0;
+    switch (addr) {
+    case NV_PTIMER_TIME_0:
+    case NV_PTIMER_TIME_1:
+        qemu_mutex_lock(&d->pfifo.lock);
+        pfifo_poll_wait(d, NV_PTIMER, addr);
+        qemu_mutex_unlock(&d->pfifo.lock);
+        break;
+    default:
+        break;
+    }
+
     switch (addr) {
     case NV_PTIMER_INTR_0:
         r = d->ptimer.pending_interrupts;
@@ -20,56 +20,75 @@
 
 #include "qemu/osdep.h"
 #include "qemu-common.h"
+#include "qemu/units.h"
 #include "nv2a_debug.h"
 #include "nv2a_shaders_common.h"
 #include "nv2a_shaders.h"
+#include "xxhash.h"
 
-void qstring_append_fmt(QString *qstring, const char *fmt, ...)
-{
-    va_list ap;
-    va_start(ap, fmt);
-    qstring_append_va(qstring, fmt, ap);
-    va_end(ap);
-}
+/* Cache keys for the individual shader stages. Each stage only depends on a
+ * subset of ShaderState, so many pipeline states share the same objects. */
 
-QString *qstring_from_fmt(const char *fmt, ...)
-{
-    QString *ret = qstring_new();
-    va_list ap;
-    va_start(ap, fmt);
-    qstring_append_va(ret, fmt, ap);
-    va_end(ap);
+typedef struct VertexProgramKey {
+    uint32_t program_data[NV2A_MAX_TRANSFORM_PROGRAM_LENGTH][VSH_TOKEN_SIZE];
+    int program_length;
+    bool z_perspective;
+} VertexProgramKey;
 
-    return ret;
-}
+typedef struct VertexProgramCode {
+    char *header;
+    char *body;
+} VertexProgramCode;
 
-void qstring_append_va(QString *qstring, const char *fmt, va_list va)
-{
-    char scratch[256];
+typedef struct VertexShaderKey {
+    /* ShaderState with the pixel shader and primitive state cleared */
+    ShaderState state;
+    char vtx_prefix;
+} VertexShaderKey;
 
-    va_list ap;
-    va_copy(ap, va);
-    const int len = vsnprintf(scratch, sizeof(scratch), fmt, ap);
-    va_end(ap);
+typedef struct GeometryShaderKey {
+    enum ShaderPolygonMode polygon_front_mode;
+    enum ShaderPolygonMode polygon_back_mode;
+    enum ShaderPrimitiveMode primitive_mode;
+} GeometryShaderKey;
 
-    if (len == 0) {
-        return;
-    } else if (len < sizeof(scratch)) {
-        qstring_append(qstring, scratch);
-        return;
+typedef struct GeometryShader {
+    GLuint gl_shader; /* 0 if no geometry shader is required */
+    GLenum gl_primitive_mode;
+} GeometryShader;
+
+#define SHADER_KEY_HASH_FUNCS(name, type)                                 \
+    static guint name##_hash(gconstpointer key)                           \
+    {                                                                     \
+        return XXH64(key, sizeof(type), 0);                               \
+    }                                                                     \
+    static gboolean name##_equal(gconstpointer a, gconstpointer b)        \
+    {                                                                     \
+        return memcmp(a, b, sizeof(type)) == 0;                           \
     }
 
-    /* overflowed out scratch buffer, alloc and try again */
-    char *buf = g_malloc(len + 1);
-    va_copy(ap, va);
-    vsnprintf(buf, len + 1, fmt, ap);
-    va_end(ap);
+/* Typical generated sizes, so shader generation rarely has to grow them */
+#define VSH_HEADER_CAPACITY (16 * KiB)
+#define VSH_BODY_CAPACITY   (32 * KiB)
 
-    qstring_append(qstring, buf);
-    g_free(buf);
+SHADER_KEY_HASH_FUNCS(vertex_program, VertexProgramKey)
+SHADER_KEY_HASH_FUNCS(vertex_shader, VertexShaderKey)
+SHADER_KEY_HASH_FUNCS(fragment_shader, PshState)
+SHADER_KEY_HASH_FUNCS(geometry_shader, GeometryShaderKey)
+
+void shader_object_cache_init(ShaderObjectCache *cache)
+{
+    cache->vertex_programs = g_hash_table_new(vertex_program_hash,
+                                              vertex_program_equal);
+    cache->vertex_shaders = g_hash_table_new(vertex_shader_hash,
+                                             vertex_shader_equal);
+    cache->fragment_shaders = g_hash_table_new(fragment_shader_hash,
+                                               fragment_shader_equal);
+    cache->geometry_shaders = g_hash_table_new(geometry_shader_hash,
+                                               geometry_shader_equal);
 }
 
-static QString* generate_geometry_shader(
+static MString* generate_geometry_shader(
                                       enum ShaderPolygonMode polygon_front_mode,
                                       enum ShaderPolygonMode polygon_back_mode,
                                       enum ShaderPrimitiveMode primitive_mode,
@@ -211,11 +230,11 @@ static QString* generate_geometry_shader(
     assert(layout_in);
     assert(layout_out);
     assert(body);
-    QString* s = qstring_from_str("#version 330\n"
+    MString* s = mstring_from_str("#version 330\n"
                                   "\n");
-    qstring_append(s, layout_in);
-    qstring_append(s, layout_out);
-    qstring_append(s, "\n"
+    mstring_append(s, layout_in);
+    mstring_append(s, layout_out);
+    mstring_append(s, "\n"
                       STRUCT_VERTEX_DATA
                       "noperspective in VertexData v_vtx[];\n"
                       "noperspective out VertexData g_vtx;\n"
@@ -228,48 +247,48 @@ static QString* generate_geometry_shader(
                       "}\n"
                       "\n"
                       "void main() {\n");
-    qstring_append(s, body);
-    qstring_append(s, "}\n");
+    mstring_append(s, body);
+    mstring_append(s, "}\n");
 
     return s;
 }
 
-static void append_skinning_code(QString* str, bool mix,
+static void append_skinning_code(MString* str, bool mix,
                                  unsigned int count, const char* type,
                                  const char* output, const char* input,
                                  const char* matrix, const char* swizzle)
 {
 
     if (count == 0) {
-        qstring_append_fmt(str, "%s %s = (%s * %s0).%s;\n",
+        mstring_append_fmt(str, "%s %s = (%s * %s0).%s;\n",
                            type, output, input, matrix, swizzle);
     } else {
-        qstring_append_fmt(str, "%s %s = %s(0.0);\n", type, output, type);
+        mstring_append_fmt(str, "%s %s = %s(0.0);\n", type, output, type);
         if (mix) {
             /* Generated final weight (like GL_WEIGHT_SUM_UNITY_ARB) */
-            qstring_append(str, "{\n"
+            mstring_append(str, "{\n"
                                 "  float weight_i;\n"
                                 "  float weight_n = 1.0;\n");
             int i;
             for (i = 0; i < count; i++) {
                 if (i < (count - 1)) {
                     char c = "xyzw"[i];
-                    qstring_append_fmt(str, "  weight_i = weight.%c;\n"
+                    mstring_append_fmt(str, "  weight_i = weight.%c;\n"
                                             "  weight_n -= weight_i;\n",
                                        c);
                 } else {
-                    qstring_append(str, "  weight_i = weight_n;\n");
+                    mstring_append(str, "  weight_i = weight_n;\n");
                 }
-                qstring_append_fmt(str, "  %s += (%s * %s%d).%s * weight_i;\n",
+                mstring_append_fmt(str, "  %s += (%s * %s%d).%s * weight_i;\n",
                                    output, input, matrix, i, swizzle);
             }
-            qstring_append(str, "}\n");
+            mstring_append(str, "}\n");
         } else {
             /* Individual weights */
             int i;
             for (i = 0; i < count; i++) {
                 char c = "xyzw"[i];
-                qstring_append_fmt(str, "%s += (%s * %s%d).%s * weight.%c;\n",
+                mstring_append_fmt(str, "%s += (%s * %s%d).%s * weight.%c;\n",
                                    output, input, matrix, i, swizzle, c);
             }
             assert(false); /* FIXME: Untested */
@@ -287,12 +306,12 @@ static void append_skinning_code(QString* str, bool mix,
 #define GLSL_DEFINE(a, b) "#define " stringify(a) " " b "\n"
 
 static void generate_fixed_function(const ShaderState state,
-                                    QString *header, QString *body)
+                                    MString *header, MString *body)
 {
     int i, j;
 
     /* generate vertex shader mimicking fixed function */
-    qstring_append(header,
+    mstring_append(header,
 "#define position      v0\n"
 "#define weight        v1\n"
 "#define normal        v2.xyz\n"
@@ -391,7 +410,7 @@ GLSL_DEFINE(sceneAmbientColor, GLSL_LTCTXA(NV_IGRAPH_XF_LTCTXA_FR_AMB) ".xyz")
         assert(false);
         break;
     }
-    qstring_append_fmt(body, "/* Skinning mode %d */\n",
+    mstring_append_fmt(body, "/* Skinning mode %d */\n",
                        state.skinning);
 
     append_skinning_code(body, mix, count, "vec4",
@@ -403,12 +422,12 @@ GLSL_DEFINE(sceneAmbientColor, GLSL_LTCTXA(NV_IGRAPH_XF_LTCTXA_FR_AMB) ".xyz")
 
     /* Normalization */
     if (state.normalization) {
-        qstring_append(body, "tNormal = normalize(tNormal);\n");
+        mstring_append(body, "tNormal = normalize(tNormal);\n");
     }
 
     /* Texgen */
     for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
-        qstring_append_fmt(body, "/* Texgen for stage %d */\n",
+        mstring_append_fmt(body, "/* Texgen for stage %d */\n",
                            i);
         /* Set each component individually */
         /* FIXME: could be nicer if some channels share the same texgen */
@@ -418,25 +437,25 @@ GLSL_DEFINE(sceneAmbientColor, GLSL_LTCTXA(NV_IGRAPH_XF_LTCTXA_FR_AMB) ".xyz")
             char cSuffix = "STRQ"[j];
             switch (state.texgen[i][j]) {
             case TEXGEN_DISABLE:
-                qstring_append_fmt(body, "oT%d.%c = texture%d.%c;\n",
+                mstring_append_fmt(body, "oT%d.%c = texture%d.%c;\n",
                                    i, c, i, c);
                 break;
             case TEXGEN_EYE_LINEAR:
-                qstring_append_fmt(body, "oT%d.%c = dot(texPlane%c%d, tPosition);\n",
+                mstring_append_fmt(body, "oT%d.%c = dot(texPlane%c%d, tPosition);\n",
                                    i, c, cSuffix, i);
                 break;
             case TEXGEN_OBJECT_LINEAR:
-                qstring_append_fmt(body, "oT%d.%c = dot(texPlane%c%d, position);\n",
+                mstring_append_fmt(body, "oT%d.%c = dot(texPlane%c%d, position);\n",
                                    i, c, cSuffix, i);
                 assert(false); /* Untested */
                 break;
             case TEXGEN_SPHERE_MAP:
                 assert(i < 2);  /* Channels S,T only! */
-                qstring_append(body, "{\n");
+                mstring_append(body, "{\n");
                 /* FIXME: u, r and m only have to be calculated once */
-                qstring_append(body, "  vec3 u = normalize(tPosition.xyz);\n");
+                mstring_append(body, "  vec3 u = normalize(tPosition.xyz);\n");
                 //FIXME: tNormal before or after normalization? Always normalize?
-                qstring_append(body, "  vec3 r = reflect(u, tNormal);\n");
+                mstring_append(body, "  vec3 r = reflect(u, tNormal);\n");
 
                 /* FIXME: This would consume 1 division fewer and *might* be
                  *        faster than length:
@@ -445,25 +464,25 @@ GLSL_DEFINE(sceneAmbientColor, GLSL_LTCTXA(NV_IGRAPH_XF_LTCTXA_FR_AMB) ".xyz")
                  *   float m = inversesqrt(dot(ro,ro))*0.5;
                  */
 
-                qstring_append(body, "  float invM = 1.0 / (2.0 * length(r + vec3(0.0, 0.0, 1.0)));\n");
-                qstring_append_fmt(body, "  oT%d.%c = r.%c * invM + 0.5;\n",
+                mstring_append(body, "  float invM = 1.0 / (2.0 * length(r + vec3(0.0, 0.0, 1.0)));\n");
+                mstring_append_fmt(body, "  oT%d.%c = r.%c * invM + 0.5;\n",
                                    i, c, c);
-                qstring_append(body, "}\n");
+                mstring_append(body, "}\n");
                 assert(false); /* Untested */
                 break;
             case TEXGEN_REFLECTION_MAP:
                 assert(i < 3); /* Channels S,T,R only! */
-                qstring_append(body, "{\n");
+                mstring_append(body, "{\n");
                 /* FIXME: u and r only have to be calculated once, can share the one from SPHERE_MAP */
-                qstring_append(body, "  vec3 u = normalize(tPosition.xyz);\n");
-                qstring_append(body, "  vec3 r = reflect(u, tNormal);\n");
-                qstring_append_fmt(body, "  oT%d.%c = r.%c;\n",
+                mstring_append(body, "  vec3 u = normalize(tPosition.xyz);\n");
+                mstring_append(body, "  vec3 r = reflect(u, tNormal);\n");
+                mstring_append_fmt(body, "  oT%d.%c = r.%c;\n",
                                    i, c, c);
-                qstring_append(body, "}\n");
+                mstring_append(body, "}\n");
                 break;
             case TEXGEN_NORMAL_MAP:
                 assert(i < 3); /* Channels S,T,R only! */
-                qstring_append_fmt(body, "oT%d.%c = tNormal.%c;\n",
+                mstring_append_fmt(body, "oT%d.%c = tNormal.%c;\n",
                                    i, c, c);
                 break;
             default:
@@ -476,7 +495,7 @@ GLSL_DEFINE(sceneAmbientColor, GLSL_LTCTXA(NV_IGRAPH_XF_LTCTXA_FR_AMB) ".xyz")
     /* Apply texture matrices */
     for (i = 0; i < NV2A_MAX_TEXTURES; i++) {
         if (state.texture_matrix_enable[i]) {
-            qstring_append_fmt(body,
+            mstring_append_fmt(body,
                                "oT%d = oT%d * texMat%d;\n",
                                i, i, i);
         }
@@ -486,8 +505,8 @@ GLSL_DEFINE(sceneAmbientColor, GLSL_LTCTXA(NV_IGRAPH_XF_LTCTXA_FR_AMB) ".xyz")
     if (state.lighting) {
 
         //FIXME: Do 2 passes if we want 2 sided-lighting?
-        qstring_append(body, "oD0 = vec4(sceneAmbientColor, diffuse.a);\n");
-        qstring_append(body, "oD1 = vec4(0.0, 0.0, 0.0, specular.a);\n");
+        mstring_append(body, "oD0 = vec4(sceneAmbientColor, diffuse.a);\n");
+        mstring_append(body, "oD1 = vec4(0.0, 0.0, 0.0, specular.a);\n");
 
         for (i = 0; i < NV2A_MAX_LIGHTS; i++) {
             if (state.light[i] == LIGHT_OFF) {
@@ -500,16 +519,16 @@ GLSL_DEFINE(sceneAmbientColor, GLSL_LTCTXA(NV_IGRAPH_XF_LTCTXA_FR_AMB) ".xyz")
              *        colors
              */
 
-            qstring_append_fmt(body, "/* Light %d */ {\n", i);
+            mstring_append_fmt(body, "/* Light %d */ {\n", i);
 
             if (state.light[i] == LIGHT_LOCAL
                     || state.light[i] == LIGHT_SPOT) {
 
-                qstring_append_fmt(header,
+                mstring_append_fmt(header,
                     "uniform vec3 lightLocalPosition%d;\n"
                     "uniform vec3 lightLocalAttenuation%d;\n",
                     i, i);
-                qstring_append_fmt(body,
+                mstring_append_fmt(body,
                     "  vec3 VP = lightLocalPosition%d - tPosition.xyz/tPosition.w;\n"
                     "  float d = length(VP);\n"
 //FIXME: if (d > lightLocalRange) { .. don't process this light .. } /* inclusive?! */ - what about directional lights?
@@ -529,11 +548,11 @@ GLSL_DEFINE(sceneAmbientColor, GLSL_LTCTXA(NV_IGRAPH_XF_LTCTXA_FR_AMB) ".xyz")
 
                 /* lightLocalRange will be 1e+30 here */
 
-                qstring_append_fmt(header,
+                mstring_append_fmt(header,
                     "uniform vec3 lightInfiniteHalfVector%d;\n"
                     "uniform vec3 lightInfiniteDirection%d;\n",
                     i, i);
-                qstring_append_fmt(body,
+                mstring_append_fmt(body,
                     "  float attenuation = 1.0;\n"
                     "  float nDotVP = max(0.0, dot(tNormal, normalize(vec3(lightInfiniteDirection%d))));\n"
                     "  float nDotHV = max(0.0, dot(tNormal, vec3(lightInfiniteHalfVector%d)));\n",
@@ -556,7 +575,7 @@ GLSL_DEFINE(sceneAmbientColor, GLSL_LTCTXA(NV_IGRAPH_XF_LTCTXA_FR_AMB) ".xyz")
                 break;
             }
 
-            qstring_append_fmt(body,
+            mstring_append_fmt(body,
                 "  float pf;\n"
                 "  if (nDotVP == 0.0) {\n"
                 "    pf = 0.0;\n"
@@ -568,23 +587,23 @@ GLSL_DEFINE(sceneAmbientColor, GLSL_LTCTXA(NV_IGRAPH_XF_LTCTXA_FR_AMB) ".xyz")
                 "  vec3 lightSpecular = lightSpecularColor(%d) * pf;\n",
                 i, i, i);
 
-            qstring_append(body,
+            mstring_append(body,
                 "  oD0.xyz += lightAmbient;\n");
 
-            qstring_append(body,
+            mstring_append(body,
                 "  oD0.xyz += diffuse.xyz * lightDiffuse;\n");
 
-            qstring_append(body,
+            mstring_append(body,
                 "  oD1.xyz += specular.xyz * lightSpecular;\n");
 
-            qstring_append(body, "}\n");
+            mstring_append(body, "}\n");
         }
     } else {
-        qstring_append(body, "  oD0 = diffuse;\n");
-        qstring_append(body, "  oD1 = specular;\n");
+        mstring_append(body, "  oD0 = diffuse;\n");
+        mstring_append(body, "  oD1 = specular;\n");
     }
-    qstring_append(body, "  oB0 = backDiffuse;\n");
-    qstring_append(body, "  oB1 = backSpecular;\n");
+    mstring_append(body, "  oB0 = backDiffuse;\n");
+    mstring_append(body, "  oB1 = backSpecular;\n");
 
     /* Fog */
     if (state.fog_enable) {
@@ -593,20 +612,20 @@ GLSL_DEFINE(sceneAmbientColor, GLSL_LTCTXA(NV_IGRAPH_XF_LTCTXA_FR_AMB) ".xyz")
         switch(state.foggen) {
         case FOGGEN_SPEC_ALPHA:
             /* FIXME: Do we have to clamp here? */
-            qstring_append(body, "  float fogDistance = clamp(specular.a, 0.0, 1.0);\n");
+            mstring_append(body, "  float fogDistance = clamp(specular.a, 0.0, 1.0);\n");
             break;
         case FOGGEN_RADIAL:
-            qstring_append(body, "  float fogDistance = length(tPosition.xyz);\n");
+            mstring_append(body, "  float fogDistance = length(tPosition.xyz);\n");
             break;
         case FOGGEN_PLANAR:
         case FOGGEN_ABS_PLANAR:
-            qstring_append(body, "  float fogDistance = dot(fogPlane.xyz, tPosition.xyz) + fogPlane.w;\n");
+            mstring_append(body, "  float fogDistance = dot(fogPlane.xyz, tPosition.xyz) + fogPlane.w;\n");
             if (state.foggen == FOGGEN_ABS_PLANAR) {
-                qstring_append(body, "  fogDistance = abs(fogDistance);\n");
+                mstring_append(body, "  fogDistance = abs(fogDistance);\n");
             }
             break;
         case FOGGEN_FOG_X:
-            qstring_append(body, "  float fogDistance = fogCoord;\n");
+            mstring_append(body, "  float fogDistance = fogCoord;\n");
             break;
         default:
             assert(false);
@@ -617,22 +636,59 @@ GLSL_DEFINE(sceneAmbientColor, GLSL_LTCTXA(NV_IGRAPH_XF_LTCTXA_FR_AMB) ".xyz")
 
     /* If skinning is off the composite matrix already includes the MV matrix */
     if (state.skinning == SKINNING_OFF) {
-        qstring_append(body, "  tPosition = position;\n");
+        mstring_append(body, "  tPosition = position;\n");
     }
 
-    qstring_append(body,
+    mstring_append(body,
     "   oPos = invViewport * (tPosition * compositeMat);\n"
     "   oPos.z = oPos.z * 2.0 - oPos.w;\n");
 
-    qstring_append(body, "  vtx.inv_w = 1.0 / oPos.w;\n");
+    mstring_append(body, "  vtx.inv_w = 1.0 / oPos.w;\n");
+
+}
+
+/* Translating a vertex program only depends on its tokens, so the resulting
+ * GLSL is shared by every vertex shader variant using the same program */
+static const VertexProgramCode *get_vertex_program_code(
+                                                    ShaderObjectCache *cache,
+                                                    const ShaderState *state)
+{
+    VertexProgramKey *key = g_malloc0(sizeof(VertexProgramKey));
+    memcpy(key->program_data, state->program_data,
+           state->program_length * VSH_TOKEN_SIZE * sizeof(uint32_t));
+    key->program_length = state->program_length;
+    key->z_perspective = state->z_perspective;
+
+    VertexProgramCode *code = g_hash_table_lookup(cache->vertex_programs, key);
+    if (code) {
+        g_free(key);
+        return code;
+    }
 
+    /* Translate into the arena, but keep a heap copy in the cache */
+    MString *header = mstring_new_sized(VSH_HEADER_CAPACITY);
+    MString *body = mstring_new_sized(VSH_BODY_CAPACITY);
+    vsh_translate(VSH_VERSION_XVS,
+                  (uint32_t*)key->program_data,
+                  key->program_length,
+                  key->z_perspective,
+                  header, body);
+
+    code = g_malloc(sizeof(VertexProgramCode));
+    code->header = g_strdup(mstring_get_str(header));
+    code->body = g_strdup(mstring_get_str(body));
+    g_hash_table_insert(cache->vertex_programs, key, code);
+
+    return code;
 }
 
-static QString *generate_vertex_shader(const ShaderState state,
+static MString *generate_vertex_shader(ShaderObjectCache *cache,
+                                       const ShaderState state,
                                        char vtx_prefix)
 {
     int i;
-    QString *header = qstring_from_str(
+    MString *header = mstring_new_sized(VSH_HEADER_CAPACITY);
+    mstring_append(header,
 "#version 330\n"
 "\n"
 "uniform vec2 clipRange;\n"
@@ -680,21 +736,26 @@ GLSL_DEFINE(texMat3, GLSL_C_MAT4(NV_IGRAPH_XF_XFCTX_T3MAT))
 "\n"
 STRUCT_VERTEX_DATA);
 
-    qstring_append_fmt(header, "noperspective out VertexData %c_vtx;\n",
+    mstring_append_fmt(header, "noperspective out VertexData %c_vtx;\n",
                        vtx_prefix);
-    qstring_append_fmt(header, "#define vtx %c_vtx\n",
+    mstring_append_fmt(header, "#define vtx %c_vtx\n",
                        vtx_prefix);
-    qstring_append(header, "\n");
+    mstring_append(header, "\n");
     for(i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
-        qstring_append_fmt(header, "in vec4 v%d;\n", i);
+        mstring_append_fmt(header, "in vec4 v%d;\n", i);
     }
-    qstring_append(header, "\n");
+    mstring_append(header, "\n");
 
-    QString *body = qstring_from_str("void main() {\n");
+    MString *body = mstring_new_sized(VSH_BODY_CAPACITY);
+    mstring_append(body, "void main() {\n");
 
     if (state.fixed_function) {
         generate_fixed_function(state, header, body);
 
+    } else if (state.vertex_program && cache) {
+        const VertexProgramCode *code = get_vertex_program_code(cache, &state);
+        mstring_append(header, code->header);
+        mstring_append(body, code->body);
     } else if (state.vertex_program) {
         vsh_translate(VSH_VERSION_XVS,
                       (uint32_t*)state.program_data,
@@ -717,7 +778,7 @@ STRUCT_VERTEX_DATA);
              *      state.vertex_program = true; state.foggen == FOGGEN_PLANAR
              *      but expects oFog.x as fogdistance?! Writes oFog.xyzw = v0.z
              */
-            qstring_append(body, "  float fogDistance = oFog.x;\n");
+            mstring_append(body, "  float fogDistance = oFog.x;\n");
         }
 
         /* FIXME: Do this per pixel? */
@@ -731,8 +792,8 @@ STRUCT_VERTEX_DATA);
              *    fogParam[0] = 1 + end * fogParam[1];
              */
 
-            qstring_append(body, "  float fogFactor = fogParam[0] + fogDistance * fogParam[1];\n");
-            qstring_append(body, "  fogFactor -= 1.0;\n"); /* FIXME: WHHYYY?!! */
+            mstring_append(body, "  float fogFactor = fogParam[0] + fogDistance * fogParam[1];\n");
+            mstring_append(body, "  fogFactor -= 1.0;\n"); /* FIXME: WHHYYY?!! */
             break;
         case FOG_MODE_EXP:
         case FOG_MODE_EXP_ABS:
@@ -742,8 +803,8 @@ STRUCT_VERTEX_DATA);
              *    fogParam[0] = 1.5
              */
 
-            qstring_append(body, "  float fogFactor = fogParam[0] + exp2(fogDistance * fogParam[1] * 16.0);\n");
-            qstring_append(body, "  fogFactor -= 1.5;\n"); /* FIXME: WHHYYY?!! */
+            mstring_append(body, "  float fogFactor = fogParam[0] + exp2(fogDistance * fogParam[1] * 16.0);\n");
+            mstring_append(body, "  fogFactor -= 1.5;\n"); /* FIXME: WHHYYY?!! */
             break;
         case FOG_MODE_EXP2:
         case FOG_MODE_EXP2_ABS:
@@ -753,8 +814,8 @@ STRUCT_VERTEX_DATA);
              *    fogParam[0] = 1.5
              */
 
-            qstring_append(body, "  float fogFactor = fogParam[0] + exp2(-fogDistance * fogDistance * fogParam[1] * fogParam[1] * 32.0);\n");
-            qstring_append(body, "  fogFactor -= 1.5;\n"); /* FIXME: WHHYYY?!! */
+            mstring_append(body, "  float fogFactor = fogParam[0] + exp2(-fogDistance * fogDistance * fogParam[1] * fogParam[1] * 32.0);\n");
+            mstring_append(body, "  fogFactor -= 1.5;\n"); /* FIXME: WHHYYY?!! */
             break;
         default:
             assert(false);
@@ -765,21 +826,21 @@ STRUCT_VERTEX_DATA);
         case FOG_MODE_LINEAR_ABS:
         case FOG_MODE_EXP_ABS:
         case FOG_MODE_EXP2_ABS:
-            qstring_append(body, "  fogFactor = abs(fogFactor);\n");
+            mstring_append(body, "  fogFactor = abs(fogFactor);\n");
             break;
         default:
             break;
         }
         /* FIXME: What about fog alpha?! */
-        qstring_append(body, "  oFog.xyzw = vec4(fogFactor);\n");
+        mstring_append(body, "  oFog.xyzw = vec4(fogFactor);\n");
     } else {
         /* FIXME: Is the fog still calculated / passed somehow?!
          */
-        qstring_append(body, "  oFog.xyzw = vec4(1.0);\n");
+        mstring_append(body, "  oFog.xyzw = vec4(1.0);\n");
     }
 
     /* Set outputs */
-    qstring_append(body, "\n"
+    mstring_append(body, "\n"
                       "  vtx.D0 = clamp(oD0, 0.0, 1.0) * vtx.inv_w;\n"
                       "  vtx.D1 = clamp(oD1, 0.0, 1.0) * vtx.inv_w;\n"
                       "  vtx.B0 = clamp(oB0, 0.0, 1.0) * vtx.inv_w;\n"
@@ -796,12 +857,28 @@ STRUCT_VERTEX_DATA);
 
 
     /* Return combined header + source */
-    qstring_append(header, qstring_get_str(body));
-    qobject_unref(body);
+    mstring_append(header, mstring_get_str(body));
     return header;
 
 }
 
+void generate_shader_code(const ShaderState *state,
+                          MString **vertex_shader_code,
+                          MString **fragment_shader_code,
+                          MString **geometry_shader_code)
+{
+    GLenum gl_primitive_mode;
+    *geometry_shader_code =
+        generate_geometry_shader(state->polygon_front_mode,
+                                 state->polygon_back_mode,
+                                 state->primitive_mode,
+                                 &gl_primitive_mode);
+    *vertex_shader_code = generate_vertex_shader(NULL, *state,
+                                                 *geometry_shader_code ? 'v'
+                                                                       : 'g');
+    *fragment_shader_code = psh_translate(state->psh);
+}
+
 static GLuint create_gl_shader(GLenum gl_shader_type,
                                const char *code,
                                const char *name)
@@ -837,7 +914,90 @@ static GLuint create_gl_shader(GLenum gl_shader_type,
     return shader;
 }
 
-ShaderBinding* generate_shaders(const ShaderState state)
+static GeometryShader *get_geometry_shader(ShaderObjectCache *cache,
+                                           const ShaderState *state)
+{
+    GeometryShaderKey key;
+    memset(&key, 0, sizeof(key));
+    key.polygon_front_mode = state->polygon_front_mode;
+    key.polygon_back_mode = state->polygon_back_mode;
+    key.primitive_mode = state->primitive_mode;
+
+    GeometryShader *shader = g_hash_table_lookup(cache->geometry_shaders,
+                                                 &key);
+    if (shader) {
+        return shader;
+    }
+
+    shader = g_malloc0(sizeof(GeometryShader));
+    MString* geometry_shader_code =
+        generate_geometry_shader(key.polygon_front_mode,
+                                 key.polygon_back_mode,
+                                 key.primitive_mode,
+                                 &shader->gl_primitive_mode);
+    if (geometry_shader_code) {
+        shader->gl_shader = create_gl_shader(GL_GEOMETRY_SHADER,
+                                             mstring_get_str(geometry_shader_code),
+                                             "geometry shader");
+    }
+
+    g_hash_table_insert(cache->geometry_shaders,
+                        g_memdup(&key, sizeof(key)), shader);
+    return shader;
+}
+
+static GLuint get_vertex_shader(ShaderObjectCache *cache,
+                                const ShaderState *state,
+                                char vtx_prefix)
+{
+    VertexShaderKey *key = g_malloc0(sizeof(VertexShaderKey));
+    memcpy(&key->state, state, sizeof(ShaderState));
+    memset(&key->state.psh, 0, sizeof(key->state.psh));
+    key->state.polygon_front_mode = (enum ShaderPolygonMode)0;
+    key->state.polygon_back_mode = (enum ShaderPolygonMode)0;
+    key->state.primitive_mode = (enum ShaderPrimitiveMode)0;
+    key->vtx_prefix = vtx_prefix;
+
+    gpointer shader = g_hash_table_lookup(cache->vertex_shaders, key);
+    if (shader) {
+        g_free(key);
+        return GPOINTER_TO_UINT(shader);
+    }
+
+    MString *vertex_shader_code = generate_vertex_shader(cache, *state,
+                                                         vtx_prefix);
+    GLuint vertex_shader = create_gl_shader(GL_VERTEX_SHADER,
+                                            mstring_get_str(vertex_shader_code),
+                                            "vertex shader");
+
+    g_hash_table_insert(cache->vertex_shaders, key,
+                        GUINT_TO_POINTER(vertex_shader));
+    return vertex_shader;
+}
+
+static GLuint get_fragment_shader(ShaderObjectCache *cache,
+                                  const ShaderState *state)
+{
+    gpointer shader = g_hash_table_lookup(cache->fragment_shaders,
+                                          &state->psh);
+    if (shader) {
+        return GPOINTER_TO_UINT(shader);
+    }
+
+    /* generate a fragment shader from register combiners */
+    MString *fragment_shader_code = psh_translate(state->psh);
+    GLuint fragment_shader = create_gl_shader(GL_FRAGMENT_SHADER,
+                                              mstring_get_str(fragment_shader_code),
+                                              "fragment shader");
+
+    g_hash_table_insert(cache->fragment_shaders,
+                        g_memdup(&state->psh, sizeof(PshState)),
+                        GUINT_TO_POINTER(fragment_shader));
+    return fragment_shader;
+}
+
+ShaderBinding* generate_shaders(ShaderObjectCache *cache,
+                                const ShaderState state)
 {
     int i, j;
     char tmp[64];
@@ -845,39 +1005,19 @@ ShaderBinding* generate_shaders(const ShaderState state)
     char vtx_prefix;
     GLuint program = glCreateProgram();
 
-    /* Create an option geometry shader and find primitive type */
-
-    GLenum gl_primitive_mode;
-    QString* geometry_shader_code =
-        generate_geometry_shader(state.polygon_front_mode,
-                                 state.polygon_back_mode,
-                                 state.primitive_mode,
-                                 &gl_primitive_mode);
-    if (geometry_shader_code) {
-        const char* geometry_shader_code_str =
-             qstring_get_str(geometry_shader_code);
-
-        GLuint geometry_shader = create_gl_shader(GL_GEOMETRY_SHADER,
-                                                  geometry_shader_code_str,
-                                                  "geometry shader");
-        glAttachShader(program, geometry_shader);
-
-        qobject_unref(geometry_shader_code);
+    /* Find an optional geometry shader and the primitive type. Shader
+     * objects are shared between programs, only the link is per-state. */
 
+    GeometryShader *geometry_shader = get_geometry_shader(cache, &state);
+    GLenum gl_primitive_mode = geometry_shader->gl_primitive_mode;
+    if (geometry_shader->gl_shader) {
+        glAttachShader(program, geometry_shader->gl_shader);
         vtx_prefix = 'v';
     } else {
         vtx_prefix = 'g';
     }
 
-    /* create the vertex shader */
-
-    QString *vertex_shader_code = generate_vertex_shader(state, vtx_prefix);
-    GLuint vertex_shader = create_gl_shader(GL_VERTEX_SHADER,
-                                            qstring_get_str(vertex_shader_code),
-                                            "vertex shader");
-    glAttachShader(program, vertex_shader);
-    qobject_unref(vertex_shader_code);
-
+    glAttachShader(program, get_vertex_shader(cache, &state, vtx_prefix));
 
     /* Bind attributes for vertices */
     for(i = 0; i < NV2A_VERTEXSHADER_ATTRIBUTES; i++) {
@@ -885,20 +1025,10 @@ ShaderBinding* generate_shaders(const ShaderState state)
         glBindAttribLocation(program, i, tmp);
     }
 
+    glAttachShader(program, get_fragment_shader(cache, &state));
 
-    /* generate a fragment shader from register combiners */
-
-    QString *fragment_shader_code = psh_translate(state.psh);
-
-    const char *fragment_shader_code_str = qstring_get_str(fragment_shader_code);
-
-    GLuint fragment_shader = create_gl_shader(GL_FRAGMENT_SHADER,
-                                              fragment_shader_code_str,
-                                              "fragment shader");
-    glAttachShader(program, fragment_shader);
-
-    qobject_unref(fragment_shader_code);
-
+    /* All generated code has been compiled, release it */
+    mstring_arena_reset();
 
     /* link the program */
     glLinkProgram(program);
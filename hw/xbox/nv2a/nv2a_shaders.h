@@ -21,7 +21,7 @@
 #ifndef HW_NV2A_SHADERS_H
 #define HW_NV2A_SHADERS_H
 
-#include "qapi/qmp/qstring.h"
+#include "mstring.h"
 #include "gl/gloffscreen.h"
 
 #include "nv2a_vsh.h"
@@ -110,6 +110,24 @@ typedef struct ShaderBinding {
     GLint clip_region_loc[8];
 } ShaderBinding;
 
-ShaderBinding* generate_shaders(const ShaderState state);
+/* Translated GLSL and compiled shader objects for each pipeline stage, keyed
+ * by the subset of ShaderState the stage depends on */
+typedef struct ShaderObjectCache {
+    GHashTable *vertex_programs;
+    GHashTable *vertex_shaders;
+    GHashTable *fragment_shaders;
+    GHashTable *geometry_shaders;
+} ShaderObjectCache;
+
+void shader_object_cache_init(ShaderObjectCache *cache);
+
+/* Generate the GLSL for every stage without compiling it. The geometry
+ * shader is NULL if none is needed. Valid until mstring_arena_reset(). */
+void generate_shader_code(const ShaderState *state,
+                          MString **vertex_shader_code,
+                          MString **fragment_shader_code,
+                          MString **geometry_shader_code);
+ShaderBinding* generate_shaders(ShaderObjectCache *cache,
+                                const ShaderState state);
 
 #endif
@@ -40,6 +40,15 @@ uint64_t user_read(void *opaque, hwaddr addr, unsigned int size)
                      NV_PFIFO_CACHE1_PUSH1_CHID);
 
         if (channel_id == cur_channel_id) {
+            switch (addr & 0xFFFF) {
+            case NV_USER_DMA_GET:
+            case NV_USER_REF:
+                pfifo_poll_wait(d, NV_USER, addr);
+                break;
+            default:
+                break;
+            }
+
             switch (addr & 0xFFFF) {
             case NV_USER_DMA_PUT:
                 r = d->pfifo.regs[NV_PFIFO_CACHE1_DMA_PUT];
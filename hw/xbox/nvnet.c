@@ -24,10 +24,28 @@
 #include "hw/pci/pci.h"
 #include "net/net.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 
 #define IOPORT_SIZE 0x8
 #define MMIO_SIZE   0x400
 
+/*
+ * How long to wait before looking at the RX ring again when packets are held
+ * back because the guest had no free descriptor. Normally the queue is
+ * flushed as soon as the guest touches the ring registers, this only covers
+ * drivers that refill descriptors without doing so.
+ */
+#define RX_RETRY_INTERVAL_NS (1 * SCALE_MS)
+
+/* Most TX descriptors a single frame may span */
+#define TX_MAX_FRAGMENTS 16
+
+/* Most sent TX descriptors held back before writing them to the guest */
+#define TX_DONE_BATCH 64
+
+/* NvRegPollingInterval counts in units of 1/97 ms */
+#define POLL_INTERVAL_NS(val) ((int64_t)(val) * SCALE_MS / 97)
+
 // #define DEBUG
 #ifdef DEBUG
 #   define NVNET_DPRINTF(format, ...) printf(format, ## __VA_ARGS__)
@@ -269,27 +287,54 @@ enum {
  * Primary State Structure
  ******************************************************************************/
 
+struct RingDesc {
+    uint32_t packet_buffer;
+    uint16_t length;
+    uint16_t flags;
+};
+
 typedef struct NvNetState {
     PCIDevice    dev;
     NICState     *nic;
     NICConf      conf;
     MemoryRegion mmio, io;
-    uint8_t      regs[MMIO_SIZE / 4];
+    uint8_t      regs[MMIO_SIZE];
     uint32_t     phy_regs[6];
-    uint8_t      tx_ring_index;
-    uint8_t      tx_ring_size;
-    uint8_t      rx_ring_index;
-    uint8_t      rx_ring_size;
+    uint32_t     tx_ring_index;
+    uint32_t     tx_ring_size;
+    uint32_t     rx_ring_index;
+    uint32_t     rx_ring_size;
+    QEMUTimer    *rx_retry_timer;
+    bool         rx_held;
     uint8_t      txrx_dma_buf[RX_ALLOC_BUFSIZE];
     FILE         *packet_dump_file;
     char         *packet_dump_path;
-} NvNetState;
 
-struct RingDesc {
-    uint32_t packet_buffer;
-    uint16_t length;
-    uint16_t flags;
-};
+    /* Frame at the TX cursor, its buffers stay mapped while it is sent */
+    struct RingDesc tx_frame[TX_MAX_FRAGMENTS];
+    struct iovec    tx_iov[TX_MAX_FRAGMENTS];
+    uint32_t        tx_frame_index;
+    unsigned int    tx_frame_len;
+    bool            tx_in_flight;
+
+    /* Sent descriptors waiting to be written back, from tx_done_index on */
+    struct RingDesc tx_done[TX_DONE_BATCH];
+    uint32_t        tx_done_index;
+    unsigned int    tx_done_len;
+
+    /*
+     * Interrupt moderation. RX/TX events are held back for up to
+     * irq_coalesce_usecs, or until irq_coalesce_frames of them happened.
+     */
+    uint32_t        irq_coalesce_usecs;
+    uint32_t        irq_coalesce_frames;
+    uint32_t        irq_held;
+    uint32_t        irq_held_events;
+    QEMUTimer       *irq_coalesce_timer;
+
+    /* Source of NVREG_IRQ_TIMER, runs every NvRegPollingInterval */
+    QEMUTimer       *poll_timer;
+} NvNetState;
 
 /*******************************************************************************
  * Helper Macros
@@ -334,13 +379,29 @@ static void nvnet_set_link_status(NetClientState *nc);
 
 /* Interrupts */
 static void nvnet_update_irq(NvNetState *s);
+static void nvnet_irq_event(NvNetState *s, uint32_t status);
+static void nvnet_irq_deliver(NvNetState *s);
+static void nvnet_irq_coalesce_timer(void *opaque);
+static void nvnet_update_poll_timer(NvNetState *s);
+static void nvnet_poll_timer(void *opaque);
 
 /* Packet Tx / Rx */
 static void nvnet_send_packet(NvNetState *s,
     const uint8_t *buf, int size);
 static ssize_t nvnet_dma_packet_to_guest(NvNetState *s,
     const uint8_t *buf, size_t size);
-static ssize_t nvnet_dma_packet_from_guest(NvNetState *s);
+static void nvnet_dma_packet_from_guest(NvNetState *s);
+static bool nvnet_tx_gather_frame(NvNetState *s);
+static bool nvnet_tx_send_frame(NvNetState *s);
+static void nvnet_tx_bounce_frame(NvNetState *s);
+static void nvnet_tx_finish_frame(NvNetState *s);
+static void nvnet_tx_writeback(NvNetState *s);
+static void nvnet_tx_complete(NetClientState *nc, ssize_t len);
+static dma_addr_t nvnet_rx_desc_addr(NvNetState *s);
+static bool nvnet_rx_desc_avail(NvNetState *s);
+static void nvnet_rx_stalled(NvNetState *s);
+static void nvnet_rx_retry(void *opaque);
+static void nvnet_flush_rx(NvNetState *s);
 static int nvnet_can_receive(NetClientState *nc);
 static ssize_t nvnet_receive(NetClientState *nc,
     const uint8_t *buf, size_t size);
@@ -373,6 +434,76 @@ static void nvnet_update_irq(NvNetState *s)
     }
 }
 
+/*
+ * Flag an RX/TX event in the interrupt status. Unless interrupt moderation
+ * is enabled the guest sees it right away, otherwise events are gathered
+ * until the packet count or the time limit is reached.
+ */
+static void nvnet_irq_event(NvNetState *s, uint32_t status)
+{
+    s->irq_held |= status;
+    s->irq_held_events += 1;
+
+    if (s->irq_coalesce_usecs == 0 ||
+        (s->irq_coalesce_frames &&
+         s->irq_held_events >= s->irq_coalesce_frames)) {
+        nvnet_irq_deliver(s);
+    } else if (!timer_pending(s->irq_coalesce_timer)) {
+        timer_mod(s->irq_coalesce_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                  + (int64_t)s->irq_coalesce_usecs * SCALE_US);
+    }
+}
+
+/*
+ * Show held events to the guest
+ */
+static void nvnet_irq_deliver(NvNetState *s)
+{
+    timer_del(s->irq_coalesce_timer);
+
+    if (s->irq_held) {
+        NVNET_DPRINTF("Triggering interrupt\n");
+        nvnet_set_reg(s, NvRegIrqStatus,
+                      nvnet_get_reg(s, NvRegIrqStatus, 4) | s->irq_held, 4);
+        s->irq_held = 0;
+        s->irq_held_events = 0;
+        nvnet_update_irq(s);
+    }
+}
+
+static void nvnet_irq_coalesce_timer(void *opaque)
+{
+    NvNetState *s = opaque;
+    nvnet_irq_deliver(s);
+}
+
+/*
+ * Run the timer interrupt while the guest has it unmasked
+ */
+static void nvnet_update_poll_timer(NvNetState *s)
+{
+    uint32_t interval = nvnet_get_reg(s, NvRegPollingInterval, 4) & 0xffff;
+
+    if (!(nvnet_get_reg(s, NvRegIrqMask, 4) & NVREG_IRQ_TIMER) ||
+        interval == 0) {
+        timer_del(s->poll_timer);
+    } else if (!timer_pending(s->poll_timer)) {
+        timer_mod(s->poll_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL)
+                                 + POLL_INTERVAL_NS(interval));
+    }
+}
+
+static void nvnet_poll_timer(void *opaque)
+{
+    NvNetState *s = opaque;
+
+    nvnet_set_reg(s, NvRegIrqStatus,
+                  nvnet_get_reg(s, NvRegIrqStatus, 4) | NVREG_IRQ_TIMER, 4);
+    nvnet_update_irq(s);
+    nvnet_update_poll_timer(s);
+}
+
 /*******************************************************************************
  * Register Control
  ******************************************************************************/
@@ -535,6 +666,23 @@ static void nvnet_mmio_write(void *opaque, hwaddr addr,
         nvnet_set_reg(s, addr, val, size);
         s->rx_ring_size = ((val >> NVREG_RINGSZ_RXSHIFT) & 0xffff) + 1;
         s->tx_ring_size = ((val >> NVREG_RINGSZ_TXSHIFT) & 0xffff) + 1;
+        nvnet_flush_rx(s);
+        break;
+
+    case NvRegTxRingPhysAddr:
+        nvnet_set_reg(s, addr, val, size);
+        s->tx_ring_index = 0;
+        break;
+
+    case NvRegRxRingPhysAddr:
+        nvnet_set_reg(s, addr, val, size);
+        s->rx_ring_index = 0;
+        nvnet_flush_rx(s);
+        break;
+
+    case NvRegReceiverControl:
+        nvnet_set_reg(s, addr, val, size);
+        nvnet_flush_rx(s);
         break;
 
     case NvRegMIIData:
@@ -545,6 +693,7 @@ static void nvnet_mmio_write(void *opaque, hwaddr addr,
         if (val == NVREG_TXRXCTL_KICK) {
             NVNET_DPRINTF("NvRegTxRxControl = NVREG_TXRXCTL_KICK!\n");
             nvnet_dma_packet_from_guest(s);
+            nvnet_flush_rx(s);
         }
 
         if (val & NVREG_TXRXCTL_BIT2) {
@@ -571,11 +720,20 @@ static void nvnet_mmio_write(void *opaque, hwaddr addr,
     case NvRegIrqMask:
         nvnet_set_reg(s, addr, val, size);
         nvnet_update_irq(s);
+        nvnet_update_poll_timer(s);
+        break;
+
+    case NvRegPollingInterval:
+        nvnet_set_reg(s, addr, val, size);
+        timer_del(s->poll_timer);
+        nvnet_update_poll_timer(s);
         break;
 
     case NvRegIrqStatus:
         nvnet_set_reg(s, addr, nvnet_get_reg(s, addr, size) & ~val, size);
         nvnet_update_irq(s);
+        /* The guest acks RX after handing the descriptors back */
+        nvnet_flush_rx(s);
         break;
 
     default:
@@ -602,10 +760,87 @@ static void nvnet_send_packet(NvNetState *s, const uint8_t *buf, int size)
     qemu_send_packet(nc, buf, size);
 }
 
+/*
+ * Address of the RX descriptor the next packet will be written to. The
+ * hardware fills the ring in order, so only this descriptor ever needs to
+ * be looked at.
+ */
+static dma_addr_t nvnet_rx_desc_addr(NvNetState *s)
+{
+    s->rx_ring_index %= s->rx_ring_size;
+    return nvnet_get_reg(s, NvRegRxRingPhysAddr, 4)
+           + s->rx_ring_index * sizeof(struct RingDesc);
+}
+
+/*
+ * Check whether the guest has handed the next RX descriptor to the device
+ */
+static bool nvnet_rx_desc_avail(NvNetState *s)
+{
+    struct RingDesc desc;
+
+    if (s->rx_ring_size == 0 || !nvnet_get_reg(s, NvRegRxRingPhysAddr, 4)) {
+        return false;
+    }
+
+    pci_dma_read(&s->dev, nvnet_rx_desc_addr(s), &desc, sizeof(desc));
+    return desc.flags & NV_RX_AVAIL;
+}
+
+/*
+ * A packet was held back for lack of RX descriptors, look again later
+ * in case the guest refills the ring without touching any register.
+ */
+static void nvnet_rx_stalled(NvNetState *s)
+{
+    s->rx_held = true;
+    if (!timer_pending(s->rx_retry_timer)) {
+        timer_mod(s->rx_retry_timer,
+                  qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + RX_RETRY_INTERVAL_NS);
+    }
+}
+
+static void nvnet_rx_retry(void *opaque)
+{
+    NvNetState *s = opaque;
+
+    if (!s->rx_held) {
+        return;
+    }
+
+    if (nvnet_rx_desc_avail(s)) {
+        /* Re-armed from nvnet_dma_packet_to_guest if the ring fills again */
+        s->rx_held = false;
+        qemu_flush_queued_packets(qemu_get_queue(s->nic));
+    } else {
+        nvnet_rx_stalled(s);
+    }
+}
+
+/*
+ * Deliver packets that were queued while the RX ring was full
+ */
+static void nvnet_flush_rx(NvNetState *s)
+{
+    if (nvnet_rx_desc_avail(s)) {
+        timer_del(s->rx_retry_timer);
+        s->rx_held = false;
+        qemu_flush_queued_packets(qemu_get_queue(s->nic));
+    }
+}
+
 static int nvnet_can_receive(NetClientState *nc)
 {
+    NvNetState *s = qemu_get_nic_opaque(nc);
+
     NVNET_DPRINTF("nvnet_can_receive called\n");
-    return 1;
+
+    /*
+     * Refuse only while the receiver is not set up, the ring setup writes
+     * flush the queue. A full ring is detected in nvnet_dma_packet_to_guest
+     * so that the retry timer only runs while a packet is actually held.
+     */
+    return s->rx_ring_size != 0 && nvnet_get_reg(s, NvRegRxRingPhysAddr, 4);
 }
 
 static ssize_t nvnet_receive(NetClientState *nc,
@@ -643,105 +878,294 @@ static ssize_t nvnet_dma_packet_to_guest(NvNetState *s,
                                          const uint8_t *buf, size_t size)
 {
     struct RingDesc desc;
-    int i;
-
-    for (i = 0; i < s->rx_ring_size; i++) {
-        /* Read current ring descriptor */
-        s->rx_ring_index %= s->rx_ring_size;
-        dma_addr_t rx_ring_addr = nvnet_get_reg(s, NvRegRxRingPhysAddr, 4);
-        rx_ring_addr += s->rx_ring_index * sizeof(desc);
-        pci_dma_read(&s->dev, rx_ring_addr, &desc, sizeof(desc));
-        NVNET_DPRINTF("Looking at ring descriptor %d (0x%llx): ",
-                      s->rx_ring_index, rx_ring_addr);
-        NVNET_DPRINTF("Buffer: 0x%x, ", desc.packet_buffer);
-        NVNET_DPRINTF("Length: 0x%x, ", desc.length);
-        NVNET_DPRINTF("Flags: 0x%x\n", desc.flags);
-
-        s->rx_ring_index += 1;
-
-        if (!(desc.flags & NV_RX_AVAIL) || !(desc.length >= size)) {
-            continue;
-        }
+    dma_addr_t rx_ring_addr;
 
-        /* Transfer packet from device to memory */
-        NVNET_DPRINTF("Transferring packet, size 0x%zx, to memory at 0x%x\n",
-                      size, desc.packet_buffer);
-        pci_dma_write(&s->dev, desc.packet_buffer, buf, size);
+    if (s->rx_ring_size == 0) {
+        /* Receiver not set up yet, hold the packet back until it is */
+        return 0;
+    }
 
-        /* Update descriptor indicating the packet is waiting */
-        desc.length = size;
-        desc.flags  = NV_RX_BIT4 | NV_RX_DESCRIPTORVALID;
-        pci_dma_write(&s->dev, rx_ring_addr, &desc, sizeof(desc));
-        NVNET_DPRINTF("Updated ring descriptor: ");
-        NVNET_DPRINTF("Length: 0x%x, ", desc.length);
-        NVNET_DPRINTF("Flags: 0x%x\n", desc.flags);
+    /* Read current ring descriptor */
+    rx_ring_addr = nvnet_rx_desc_addr(s);
+    pci_dma_read(&s->dev, rx_ring_addr, &desc, sizeof(desc));
+    NVNET_DPRINTF("Looking at ring descriptor %d (0x%llx): ",
+                  s->rx_ring_index, rx_ring_addr);
+    NVNET_DPRINTF("Buffer: 0x%x, ", desc.packet_buffer);
+    NVNET_DPRINTF("Length: 0x%x, ", desc.length);
+    NVNET_DPRINTF("Flags: 0x%x\n", desc.flags);
+
+    if (!(desc.flags & NV_RX_AVAIL)) {
+        /* Ring is full, let the net layer queue the packet until refill */
+        NVNET_DPRINTF("Could not find free buffer!\n");
+        nvnet_rx_stalled(s);
+        return 0;
+    }
 
-        /* Trigger interrupt */
-        NVNET_DPRINTF("Triggering interrupt\n");
-        nvnet_set_reg(s, NvRegIrqStatus, NVREG_IRQSTAT_BIT1, 4);
-        nvnet_update_irq(s);
+    if (desc.length < size) {
+        /* Packet does not fit the guest buffer, drop it */
+        NVNET_DPRINTF("Packet too large for buffer!\n");
         return size;
     }
 
-    /* Could not find free buffer, or packet too large. */
-    NVNET_DPRINTF("Could not find free buffer!\n");
-    return -1;
+    s->rx_ring_index += 1;
+
+    /* Transfer packet from device to memory */
+    NVNET_DPRINTF("Transferring packet, size 0x%zx, to memory at 0x%x\n",
+                  size, desc.packet_buffer);
+    pci_dma_write(&s->dev, desc.packet_buffer, buf, size);
+
+    /* Update descriptor indicating the packet is waiting */
+    desc.length = size;
+    desc.flags  = NV_RX_BIT4 | NV_RX_DESCRIPTORVALID;
+    pci_dma_write(&s->dev, rx_ring_addr, &desc, sizeof(desc));
+    NVNET_DPRINTF("Updated ring descriptor: ");
+    NVNET_DPRINTF("Length: 0x%x, ", desc.length);
+    NVNET_DPRINTF("Flags: 0x%x\n", desc.flags);
+
+    /* Trigger interrupt */
+    nvnet_irq_event(s, NVREG_IRQSTAT_BIT1);
+    return size;
 }
 
-static ssize_t nvnet_dma_packet_from_guest(NvNetState *s)
+/*
+ * Send every complete frame the guest has queued on the TX ring. Sent
+ * descriptors are written back in batches with one interrupt per batch.
+ */
+static void nvnet_dma_packet_from_guest(NvNetState *s)
 {
-    struct RingDesc desc;
-    bool is_last_packet;
-    int i;
-    bool packet_sent = false;
-
-    for (i = 0; i < s->tx_ring_size; i++) {
-        /* Read ring descriptor */
-        s->tx_ring_index %= s->tx_ring_size;
-        dma_addr_t tx_ring_addr = nvnet_get_reg(s, NvRegTxRingPhysAddr, 4);
-        tx_ring_addr += s->tx_ring_index * sizeof(desc);
-        pci_dma_read(&s->dev, tx_ring_addr, &desc, sizeof(desc));
+    if (s->tx_in_flight || s->tx_ring_size == 0) {
+        return;
+    }
+
+    for (;;) {
+        if (!nvnet_tx_gather_frame(s)) {
+            if (s->tx_done_len == 0) {
+                break;
+            }
+            /* Make room on the ring for a frame that did not fit */
+            nvnet_tx_writeback(s);
+            if (!nvnet_tx_gather_frame(s)) {
+                break;
+            }
+        }
+
+        if (nvnet_tx_send_frame(s)) {
+            /* The peer is busy, continue from nvnet_tx_complete */
+            break;
+        }
+        nvnet_tx_finish_frame(s);
+    }
+
+    nvnet_tx_writeback(s);
+}
+
+/*
+ * Read the descriptors of the frame at the TX cursor into tx_frame. Returns
+ * false if the guest has not queued a complete frame.
+ */
+static bool nvnet_tx_gather_frame(NvNetState *s)
+{
+    dma_addr_t tx_ring_addr = nvnet_get_reg(s, NvRegTxRingPhysAddr, 4);
+    /* Descriptors waiting for write back must not be read again */
+    unsigned int max_len = MIN(TX_MAX_FRAGMENTS,
+                               s->tx_ring_size - s->tx_done_len);
+    struct RingDesc *desc = NULL;
+    uint32_t index;
+
+    s->tx_ring_index %= s->tx_ring_size;
+    s->tx_frame_index = s->tx_ring_index;
+    s->tx_frame_len = 0;
+    index = s->tx_ring_index;
+
+    while (s->tx_frame_len < max_len) {
+        desc = &s->tx_frame[s->tx_frame_len];
+        pci_dma_read(&s->dev, tx_ring_addr + index * sizeof(*desc),
+                     desc, sizeof(*desc));
         NVNET_DPRINTF("Looking at ring desc %d (%llx): ",
-                      s->tx_ring_index, tx_ring_addr);
-        NVNET_DPRINTF("Buffer: 0x%x, ", desc.packet_buffer);
-        NVNET_DPRINTF("Length: 0x%x, ", desc.length);
-        NVNET_DPRINTF("Flags: 0x%x\n", desc.flags);
+                      index, tx_ring_addr + index * sizeof(*desc));
+        NVNET_DPRINTF("Buffer: 0x%x, ", desc->packet_buffer);
+        NVNET_DPRINTF("Length: 0x%x, ", desc->length);
+        NVNET_DPRINTF("Flags: 0x%x\n", desc->flags);
+
+        if (!(desc->flags & NV_TX_VALID)) {
+            return false;
+        }
 
-        s->tx_ring_index += 1;
+        s->tx_frame_len += 1;
+        index = (index + 1) % s->tx_ring_size;
 
-        if (!(desc.flags & NV_TX_VALID)) {
-            continue;
+        if (desc->flags & NV_TX_LASTPACKET) {
+            break;
         }
+    }
 
-        /* Transfer packet from guest memory */
-        NVNET_DPRINTF("Sending packet...\n");
-        pci_dma_read(&s->dev, desc.packet_buffer,
-                              s->txrx_dma_buf, desc.length + 1);
-        nvnet_send_packet(s, s->txrx_dma_buf, desc.length + 1);
-        packet_sent = true;
+    if (desc == NULL) {
+        return false;
+    }
 
-        /* Update descriptor */
-        is_last_packet = desc.flags & NV_TX_LASTPACKET;
-        desc.flags &= ~(NV_TX_VALID | NV_TX_RETRYERROR | NV_TX_DEFERRED |
-            NV_TX_CARRIERLOST | NV_TX_LATECOLLISION | NV_TX_UNDERFLOW |
-            NV_TX_ERROR);
-        desc.length = desc.length + 5;
-        pci_dma_write(&s->dev, tx_ring_addr, &desc, sizeof(desc));
+    if (!(desc->flags & NV_TX_LASTPACKET)) {
+        if (s->tx_done_len) {
+            return false;
+        }
+        /* No end in sight, send what we have rather than stalling */
+        NVNET_DPRINTF("TX frame spans too many descriptors!\n");
+    }
+
+    s->tx_ring_index = index;
+    return true;
+}
+
+/*
+ * Hand the gathered frame to the net layer straight from guest memory.
+ * Returns true if the frame is still in flight once this returns.
+ */
+static bool nvnet_tx_send_frame(NvNetState *s)
+{
+    NetClientState *nc = qemu_get_queue(s->nic);
+    bool bounce = s->packet_dump_file != NULL;
+    unsigned int i;
 
-        if (is_last_packet) {
-            NVNET_DPRINTF("  -- Last packet\n");
+#ifdef NVNET_DUMP_PACKETS_TO_SCREEN
+    bounce = true;
+#endif
+
+    for (i = 0; i < s->tx_frame_len && !bounce; i++) {
+        dma_addr_t len = s->tx_frame[i].length + 1;
+        dma_addr_t mapped_len = len;
+        void *buf = pci_dma_map(&s->dev, s->tx_frame[i].packet_buffer,
+                                &mapped_len, DMA_DIRECTION_TO_DEVICE);
+
+        if (buf && mapped_len < len) {
+            pci_dma_unmap(&s->dev, buf, mapped_len, DMA_DIRECTION_TO_DEVICE,
+                          0);
+            buf = NULL;
+        }
+        if (!buf) {
+            /* Not plain RAM, copy the whole frame instead */
+            bounce = true;
             break;
         }
+
+        s->tx_iov[i].iov_base = buf;
+        s->tx_iov[i].iov_len = len;
+    }
+
+    if (bounce) {
+        while (i > 0) {
+            i--;
+            pci_dma_unmap(&s->dev, s->tx_iov[i].iov_base, s->tx_iov[i].iov_len,
+                          DMA_DIRECTION_TO_DEVICE, 0);
+        }
+        nvnet_tx_bounce_frame(s);
+        return false;
+    }
+
+    NVNET_DPRINTF("Sending packet...\n");
+    if (qemu_sendv_packet_async(nc, s->tx_iov, s->tx_frame_len,
+                                nvnet_tx_complete) == 0) {
+        s->tx_in_flight = true;
+        return true;
     }
 
+    for (i = 0; i < s->tx_frame_len; i++) {
+        pci_dma_unmap(&s->dev, s->tx_iov[i].iov_base, s->tx_iov[i].iov_len,
+                      DMA_DIRECTION_TO_DEVICE, s->tx_iov[i].iov_len);
+    }
+    return false;
+}
+
+/*
+ * Send the gathered frame through the DMA buffer
+ */
+static void nvnet_tx_bounce_frame(NvNetState *s)
+{
+    size_t size = 0;
+    unsigned int i;
+
+    for (i = 0; i < s->tx_frame_len; i++) {
+        size_t len = s->tx_frame[i].length + 1;
+
+        if (size + len > sizeof(s->txrx_dma_buf)) {
+            NVNET_DPRINTF("nvnet: TX frame too large!\n");
+            return;
+        }
+        pci_dma_read(&s->dev, s->tx_frame[i].packet_buffer,
+                     &s->txrx_dma_buf[size], len);
+        size += len;
+    }
+
+    nvnet_send_packet(s, s->txrx_dma_buf, size);
+}
+
+/*
+ * Queue the descriptors of the sent frame for write back
+ */
+static void nvnet_tx_finish_frame(NvNetState *s)
+{
+    unsigned int i;
+
+    if (s->tx_done_len + s->tx_frame_len > TX_DONE_BATCH) {
+        nvnet_tx_writeback(s);
+    }
+    if (s->tx_done_len == 0) {
+        s->tx_done_index = s->tx_frame_index;
+    }
+
+    for (i = 0; i < s->tx_frame_len; i++) {
+        struct RingDesc *desc = &s->tx_done[s->tx_done_len++];
+
+        *desc = s->tx_frame[i];
+        desc->flags &= ~(NV_TX_VALID | NV_TX_RETRYERROR | NV_TX_DEFERRED |
+            NV_TX_CARRIERLOST | NV_TX_LATECOLLISION | NV_TX_UNDERFLOW |
+            NV_TX_ERROR);
+        desc->length = desc->length + 5;
+    }
+    s->tx_frame_len = 0;
+}
+
+/*
+ * Hand the sent descriptors back to the guest, at most two writes since
+ * they are consecutive on the ring
+ */
+static void nvnet_tx_writeback(NvNetState *s)
+{
+    dma_addr_t tx_ring_addr = nvnet_get_reg(s, NvRegTxRingPhysAddr, 4);
+    unsigned int len;
+
+    if (s->tx_done_len == 0) {
+        return;
+    }
+
+    len = MIN(s->tx_done_len, s->tx_ring_size - s->tx_done_index);
+    pci_dma_write(&s->dev,
+                  tx_ring_addr + s->tx_done_index * sizeof(struct RingDesc),
+                  s->tx_done, len * sizeof(struct RingDesc));
+    if (len < s->tx_done_len) {
+        pci_dma_write(&s->dev, tx_ring_addr, &s->tx_done[len],
+                      (s->tx_done_len - len) * sizeof(struct RingDesc));
+    }
+    s->tx_done_len = 0;
+
     /* Trigger interrupt */
-    if (packet_sent) {
-        NVNET_DPRINTF("Triggering interrupt\n");
-        nvnet_set_reg(s, NvRegIrqStatus, NVREG_IRQSTAT_BIT4, 4);
-        nvnet_update_irq(s);
+    nvnet_irq_event(s, NVREG_IRQSTAT_BIT4);
+}
+
+/*
+ * The peer took the frame that was in flight
+ */
+static void nvnet_tx_complete(NetClientState *nc, ssize_t len)
+{
+    NvNetState *s = qemu_get_nic_opaque(nc);
+    unsigned int i;
+
+    for (i = 0; i < s->tx_frame_len; i++) {
+        pci_dma_unmap(&s->dev, s->tx_iov[i].iov_base, s->tx_iov[i].iov_len,
+                      DMA_DIRECTION_TO_DEVICE, s->tx_iov[i].iov_len);
     }
+    nvnet_tx_finish_frame(s);
+    s->tx_in_flight = false;
 
-    return 0;
+    nvnet_dma_packet_from_guest(s);
 }
 
 /*******************************************************************************
@@ -816,6 +1240,16 @@ static void nvnet_realize(PCIDevice *pci_dev, Error **errp)
     s->rx_ring_size  = 0;
     s->tx_ring_index = 0;
     s->tx_ring_size  = 0;
+    s->tx_frame_len  = 0;
+    s->tx_done_len   = 0;
+    s->tx_in_flight  = false;
+
+    s->rx_retry_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvnet_rx_retry, s);
+    s->irq_coalesce_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                         nvnet_irq_coalesce_timer, s);
+    s->poll_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL, nvnet_poll_timer, s);
+    s->irq_held = 0;
+    s->irq_held_events = 0;
 
     memory_region_init_io(&s->mmio, OBJECT(dev), &nvnet_mmio_ops, s,
         "nvnet-mmio", MMIO_SIZE);
@@ -839,6 +1273,13 @@ static void nvnet_uninit(PCIDevice *dev)
         fclose(s->packet_dump_file);
     }
 
+    timer_del(s->rx_retry_timer);
+    timer_free(s->rx_retry_timer);
+    timer_del(s->irq_coalesce_timer);
+    timer_free(s->irq_coalesce_timer);
+    timer_del(s->poll_timer);
+    timer_free(s->poll_timer);
+
     // memory_region_destroy(&s->mmio);
     // memory_region_destroy(&s->io);
     qemu_del_nic(s->nic);
@@ -852,6 +1293,29 @@ static void nvnet_reset(void *opaque)
 {
     NvNetState *s = opaque;
 
+    timer_del(s->rx_retry_timer);
+    timer_del(s->irq_coalesce_timer);
+    timer_del(s->poll_timer);
+    s->rx_held = false;
+    s->irq_held = 0;
+    s->irq_held_events = 0;
+
+    /*
+     * Drop a frame still queued by the peer, nvnet_tx_complete unmaps its
+     * buffers. With the TX ring torn down first it neither writes back
+     * descriptors nor sends anything further.
+     */
+    s->tx_ring_size = 0;
+    s->tx_done_len = 0;
+    qemu_purge_queued_packets(qemu_get_queue(s->nic));
+
+    s->rx_ring_index = 0;
+    s->rx_ring_size  = 0;
+    s->tx_ring_index = 0;
+    s->tx_frame_len  = 0;
+    s->tx_done_len   = 0;
+    s->tx_in_flight  = false;
+
     if (qemu_get_queue(s->nic)->link_down) {
         nvnet_link_down(s);
     }
@@ -1002,6 +1466,10 @@ static void nvnet_class_init(ObjectClass *klass, void *data)
 static Property nvnet_properties[] = {
     DEFINE_NIC_PROPERTIES(NvNetState, conf),
     DEFINE_PROP_STRING("dump", NvNetState, packet_dump_path),
+    DEFINE_PROP_UINT32("irq-coalesce-usecs", NvNetState, irq_coalesce_usecs,
+                       0),
+    DEFINE_PROP_UINT32("irq-coalesce-frames", NvNetState,
+                       irq_coalesce_frames, 0),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -390,10 +390,12 @@ void xbox_init_common(MachineState *machine,
     /* USB */
     PCIDevice *usb1 = pci_create(pci_bus, PCI_DEVFN(3, 0), "pci-ohci");
     qdev_prop_set_uint32(&usb1->qdev, "num-ports", 4);
+    qdev_prop_set_uint32(&usb1->qdev, "idle-coalesce-frames", 8);
     qdev_init_nofail(&usb1->qdev);
 
     PCIDevice *usb0 = pci_create(pci_bus, PCI_DEVFN(2, 0), "pci-ohci");
     qdev_prop_set_uint32(&usb0->qdev, "num-ports", 4);
+    qdev_prop_set_uint32(&usb0->qdev, "idle-coalesce-frames", 8);
     qdev_init_nofail(&usb0->qdev);
 
     /* Ethernet! */
@@ -425,6 +427,10 @@ void xbox_init_common(MachineState *machine,
 
 static void xbox_machine_options(MachineClass *m)
 {
+    static GlobalProperty compat[] = {
+        /* Games stream from the DVD in small sequential reads */
+        { "ide-cd", "readahead", "1024" },
+    };
     PCMachineClass *pcmc = PC_MACHINE_CLASS(m);
     m->desc              = "Microsoft Xbox";
     m->max_cpus          = 1;
@@ -442,6 +448,8 @@ static void xbox_machine_options(MachineClass *m)
     pcmc->smbios_legacy_mode  = true;
     pcmc->has_reserved_memory = false;
     pcmc->default_nic_model   = "nvnet";
+
+    compat_props_add(m->compat_props, compat, G_N_ELEMENTS(compat));
 }
 
 static char *machine_get_bootrom(Object *obj, Error **errp)
@@ -25,6 +25,11 @@
 #include "hw/usb.h"
 #include "hw/usb/desc.h"
 #include "ui/input.h"
+#include "qemu/thread.h"
+#include "qemu/main-loop.h"
+#include "qapi/error.h"
+#include "sysemu/sysemu.h"
+#include "trace.h"
 
 #include <SDL2/SDL.h>
 
@@ -109,6 +114,29 @@ typedef struct USBXIDState {
     XIDGamepadOutputReport out_state_capabilities;
 
     uint8_t device_index;
+    uint32_t poll_interval_us;
+
+    /*
+     * Controller state as last sampled by the input thread, and the time
+     * (QEMU_CLOCK_REALTIME ns) the first change the guest has not read yet
+     * was sampled, or -1. The thread sleeps while the VM is stopped
+     */
+    QemuThread input_thread;
+    QemuMutex input_lock;
+    QemuCond input_cond;
+    QEMUBH *input_bh;
+    VMChangeStateEntry *vmstate;
+    bool input_running;
+    bool input_stop;
+    bool input_dirty;
+    XIDGamepadReport input_report;
+    int64_t input_timestamp;
+
+    /* Time from sampling a state change to the guest reading it */
+    uint64_t input_reports;
+    uint64_t input_latency_last_us;
+    uint64_t input_latency_max_us;
+    uint64_t input_latency_total_us;
 
     SDL_GameController *sdl_gamepad;
     SDL_Haptic *sdl_haptic;
@@ -243,10 +271,14 @@ static void update_output(USBXIDState *s)
     SDL_HapticUpdateEffect(s->sdl_haptic, s->sdl_haptic_effect_id, &effect);
 }
 
-static void update_input(USBXIDState *s)
+static void read_input(USBXIDState *s, XIDGamepadReport *report)
 {
     int i, state;
 
+#if SDL_VERSION_ATLEAST(2, 0, 7)
+    /* The UI thread updates the joysticks too when it pumps events */
+    SDL_LockJoysticks();
+#endif
 #ifdef UPDATE
     SDL_GameControllerUpdate();
 #endif
@@ -275,44 +307,143 @@ static void update_input(USBXIDState *s)
     for (i = 0; i < 6; i++) {
         state = SDL_GameControllerGetButton(s->sdl_gamepad,
                                             button_map_analog[i][1]);
-        s->in_state.bAnalogButtons[button_map_analog[i][0]] = state ? 0xff : 0;
+        report->bAnalogButtons[button_map_analog[i][0]] = state ? 0xff : 0;
     }
 
-    s->in_state.wButtons = 0;
+    report->wButtons = 0;
     for (i = 0; i < 8; i++) {
         state = SDL_GameControllerGetButton(s->sdl_gamepad,
                                             button_map_binary[i][1]);
         if (state) {
-            s->in_state.wButtons |= BUTTON_MASK(button_map_binary[i][0]);
+            report->wButtons |= BUTTON_MASK(button_map_binary[i][0]);
         }
     }
 
     /* Triggers */
     state = SDL_GameControllerGetAxis(s->sdl_gamepad,
                                       SDL_CONTROLLER_AXIS_TRIGGERLEFT);
-    s->in_state.bAnalogButtons[GAMEPAD_LEFT_TRIGGER] = state >> 7;
+    report->bAnalogButtons[GAMEPAD_LEFT_TRIGGER] = state >> 7;
 
     state = SDL_GameControllerGetAxis(s->sdl_gamepad,
                                       SDL_CONTROLLER_AXIS_TRIGGERRIGHT);
-    s->in_state.bAnalogButtons[GAMEPAD_RIGHT_TRIGGER] = state >> 7;
+    report->bAnalogButtons[GAMEPAD_RIGHT_TRIGGER] = state >> 7;
 
     /* Analog sticks */
-    s->in_state.sThumbLX = SDL_GameControllerGetAxis(s->sdl_gamepad,
+    report->sThumbLX = SDL_GameControllerGetAxis(s->sdl_gamepad,
                                 SDL_CONTROLLER_AXIS_LEFTX);
 
-    s->in_state.sThumbLY = -SDL_GameControllerGetAxis(s->sdl_gamepad,
+    report->sThumbLY = -SDL_GameControllerGetAxis(s->sdl_gamepad,
                                 SDL_CONTROLLER_AXIS_LEFTY) - 1;
 
-    s->in_state.sThumbRX = SDL_GameControllerGetAxis(s->sdl_gamepad,
+    report->sThumbRX = SDL_GameControllerGetAxis(s->sdl_gamepad,
                                 SDL_CONTROLLER_AXIS_RIGHTX);
 
-    s->in_state.sThumbRY = -SDL_GameControllerGetAxis(s->sdl_gamepad,
+    report->sThumbRY = -SDL_GameControllerGetAxis(s->sdl_gamepad,
                                 SDL_CONTROLLER_AXIS_RIGHTY) - 1;
+
+#if SDL_VERSION_ATLEAST(2, 0, 7)
+    SDL_UnlockJoysticks();
+#endif
+}
+
+/*
+ * Polls the controller and publishes its state as soon as it changes, so
+ * the guest never waits on SDL. SDL's event queue belongs to the UI, so
+ * the joysticks are updated and sampled here rather than taken from
+ * events. Changes are timestamped when sampled.
+ */
+static void *xid_input_thread(void *opaque)
+{
+    USBXIDState *s = opaque;
+    XIDGamepadReport report = s->input_report;
+
+    for (;;) {
+        qemu_mutex_lock(&s->input_lock);
+        while (!s->input_running && !s->input_stop) {
+            qemu_cond_wait(&s->input_cond, &s->input_lock);
+        }
+        qemu_mutex_unlock(&s->input_lock);
+        if (atomic_read(&s->input_stop)) {
+            break;
+        }
+
+        read_input(s, &report);
+
+        qemu_mutex_lock(&s->input_lock);
+        if (memcmp(&report, &s->input_report, sizeof(report))) {
+            s->input_report = report;
+            if (!s->input_dirty) {
+                s->input_dirty = true;
+                s->input_timestamp = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+                qemu_bh_schedule(s->input_bh);
+            }
+        }
+        qemu_mutex_unlock(&s->input_lock);
+
+        g_usleep(s->poll_interval_us);
+    }
+
+    return NULL;
+}
+
+static void xid_vm_state_change(void *opaque, int running, RunState state)
+{
+    USBXIDState *s = opaque;
+
+    qemu_mutex_lock(&s->input_lock);
+    s->input_running = running;
+    qemu_cond_signal(&s->input_cond);
+    qemu_mutex_unlock(&s->input_lock);
+}
+
+/* Have the host controller poll the interrupt endpoint right away */
+static void xid_input_bh(void *opaque)
+{
+    USBXIDState *s = opaque;
+
+    usb_wakeup(s->intr, 0);
+}
+
+/*
+ * Take the latest controller state into in_state. Returns false if it has
+ * not changed since the guest last read it.
+ */
+static bool update_input(USBXIDState *s)
+{
+    int64_t timestamp;
+    bool dirty;
+
+    qemu_mutex_lock(&s->input_lock);
+    dirty = s->input_dirty;
+    timestamp = s->input_timestamp;
+    s->in_state = s->input_report;
+    s->input_dirty = false;
+    qemu_mutex_unlock(&s->input_lock);
+
+    if (dirty && timestamp >= 0) {
+        uint64_t latency = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME)
+                            - timestamp) / SCALE_US;
+        s->input_reports++;
+        s->input_latency_last_us = latency;
+        s->input_latency_max_us = MAX(s->input_latency_max_us, latency);
+        s->input_latency_total_us += latency;
+        trace_xid_input_latency(s->device_index, latency);
+    }
+
+    return dirty;
 }
 
 static void usb_xid_handle_reset(USBDevice *dev)
 {
+    USBXIDState *s = (USBXIDState *)dev;
+
     DPRINTF("xid reset\n");
+
+    /* The guest gets the current state with its first read */
+    qemu_mutex_lock(&s->input_lock);
+    s->input_dirty = true;
+    s->input_timestamp = -1;
+    qemu_mutex_unlock(&s->input_lock);
 }
 
 static void usb_xid_handle_control(USBDevice *dev, USBPacket *p,
@@ -431,8 +562,11 @@ static void usb_xid_handle_data(USBDevice *dev, USBPacket *p)
     switch (p->pid) {
     case USB_TOKEN_IN:
         if (p->ep->nr == 2) {
-            update_input(s);
-            usb_packet_copy(p, &s->in_state, s->in_state.bLength);
+            if (update_input(s)) {
+                usb_packet_copy(p, &s->in_state, s->in_state.bLength);
+            } else {
+                p->status = USB_RET_NAK;
+            }
         } else {
             assert(false);
         }
@@ -466,6 +600,17 @@ static void usb_xid_handle_destroy(USBDevice *dev)
 
 static void usb_xbox_gamepad_unrealize(USBDevice *dev, Error **errp)
 {
+    USBXIDState *s = USB_XID(dev);
+
+    qemu_del_vm_change_state_handler(s->vmstate);
+    qemu_mutex_lock(&s->input_lock);
+    atomic_set(&s->input_stop, true);
+    qemu_cond_signal(&s->input_cond);
+    qemu_mutex_unlock(&s->input_lock);
+    qemu_thread_join(&s->input_thread);
+    qemu_bh_delete(s->input_bh);
+    qemu_cond_destroy(&s->input_cond);
+    qemu_mutex_destroy(&s->input_lock);
 }
 
 static void usb_xid_class_initfn(ObjectClass *klass, void *data)
@@ -591,10 +736,32 @@ static void usb_xbox_gamepad_realize(USBDevice *dev, Error **errp)
     } else {
         fprintf(stderr, "SDL failed to initialize haptic feedback subsystem\n");
     }
+
+    /* The guest gets the state at attach time with its first read */
+    s->input_report = s->in_state;
+    s->input_dirty = true;
+    s->input_timestamp = -1;
+    qemu_mutex_init(&s->input_lock);
+    qemu_cond_init(&s->input_cond);
+    s->input_bh = qemu_bh_new(xid_input_bh, s);
+    s->input_running = runstate_is_running();
+    s->vmstate = qemu_add_vm_change_state_handler(xid_vm_state_change, s);
+    qemu_thread_create(&s->input_thread, "xid.input", xid_input_thread, s,
+                       QEMU_THREAD_JOINABLE);
+
+    object_property_add_uint64_ptr(OBJECT(dev), "input-reports",
+                                   &s->input_reports, &error_abort);
+    object_property_add_uint64_ptr(OBJECT(dev), "input-latency-last-us",
+                                   &s->input_latency_last_us, &error_abort);
+    object_property_add_uint64_ptr(OBJECT(dev), "input-latency-max-us",
+                                   &s->input_latency_max_us, &error_abort);
+    object_property_add_uint64_ptr(OBJECT(dev), "input-latency-total-us",
+                                   &s->input_latency_total_us, &error_abort);
 }
 
 static Property xid_sdl_properties[] = {
     DEFINE_PROP_UINT8("index", USBXIDState, device_index, 0),
+    DEFINE_PROP_UINT32("poll-interval-us", USBXIDState, poll_interval_us, 1000),
     DEFINE_PROP_END_OF_LIST(),
 };
 
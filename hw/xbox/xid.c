@@ -297,6 +297,7 @@ static void xbox_gamepad_keyboard_event(DeviceState *dev, QemuConsole *src,
     }
 
     s->in_dirty = true;
+    usb_wakeup(s->intr, 0);
 }
 
 static QemuInputHandler xboxkbd_handler = {
@@ -344,6 +344,8 @@ extern const char *IDE_DMA_CMD_lookup[IDE_DMA__COUNT];
 #define ide_cmd_is_read(s) \
         ((s)->dma_cmd == IDE_DMA_READ)
 
+typedef struct ATAPIReadahead ATAPIReadahead;
+
 typedef struct IDEBufferedRequest {
     QLIST_ENTRY(IDEBufferedRequest) list;
     QEMUIOVector qiov;
@@ -406,6 +408,7 @@ struct IDEState {
     BlockAIOCB *pio_aiocb;
     QEMUIOVector qiov;
     QLIST_HEAD(, IDEBufferedRequest) buffered_requests;
+    ATAPIReadahead *readahead;
     /* ATA DMA state */
     uint64_t io_buffer_offset;
     int32_t io_buffer_size;
@@ -513,6 +516,11 @@ struct IDEDevice {
      * 0xffff        - reserved
      */
     uint16_t rotation_rate;
+    /* ATAPI readahead cache size in KiB, 0 to disable */
+    uint32_t readahead;
+    /* Emulated seek time and media read rate, 0 to disable */
+    uint32_t seek_latency_us;
+    uint32_t read_rate_kib;
 };
 
 /* These are used for the error_status field of IDEBus */
@@ -636,6 +644,12 @@ void ide_cancel_dma_sync(IDEState *s);
 /* hw/ide/atapi.c */
 void ide_atapi_cmd(IDEState *s);
 void ide_atapi_cmd_reply_end(IDEState *s);
+void ide_atapi_readahead_init(IDEState *s, uint32_t size_kib,
+                              uint32_t seek_latency_us,
+                              uint32_t read_rate_kib);
+void ide_atapi_readahead_cancel_dma(IDEState *s);
+void ide_atapi_readahead_invalidate(IDEState *s);
+void ide_atapi_readahead_exit(IDEState *s);
 
 /* hw/ide/qdev.c */
 void ide_bus_new(IDEBus *idebus, size_t idebus_size, DeviceState *dev,
@@ -30,6 +30,7 @@
 #include "monitor/qdev.h"
 #include "hw/usb.h"
 #include "hw/pci/pci.h"
+#include "hw/xbox/mcpx_apu.h"
 #include "sysemu/watchdog.h"
 #include "hw/loader.h"
 #include "exec/gdbstub.h"
@@ -1651,6 +1651,118 @@ static void test_atapi_tray(void)
     remove_iso(fd, iso);
 }
 
+/* Sectors of the images read through the drive's readahead cache */
+#define CDROM_RA_SECTORS 640
+/* Sectors per guest read, so that reads straddle readahead segments */
+#define CDROM_RA_CHUNK 24
+
+/* Read sectors with DMA and compare them against the image */
+static void ahci_cdrom_read(AHCIQState *ahci, uint8_t port, uint8_t cmd,
+                            unsigned char *tx, uint64_t lba, int nsectors)
+{
+    AHCIOpts opts = {
+        .size = ATAPI_SECTOR_SIZE * nsectors,
+        .lba = lba,
+        .atapi = true,
+        .atapi_dma = true,
+        .post_cb = ahci_cb_cmp_buff,
+        .opaque = tx + lba * ATAPI_SECTOR_SIZE,
+    };
+
+    ahci_exec(ahci, port, cmd, &opts);
+}
+
+/* Sequential READ(10)/READ(12) reads, returns the sector after them */
+static uint64_t ahci_cdrom_read_seq(AHCIQState *ahci, uint8_t port,
+                                    unsigned char *tx, uint64_t lba,
+                                    int nreads)
+{
+    int i;
+
+    for (i = 0; i < nreads; i++) {
+        ahci_cdrom_read(ahci, port,
+                        i & 1 ? CMD_ATAPI_READ_12 : CMD_ATAPI_READ_10,
+                        tx, lba, CDROM_RA_CHUNK);
+        lba += CDROM_RA_CHUNK;
+    }
+    return lba;
+}
+
+static void test_cdrom_readahead(void)
+{
+    AHCIQState *ahci;
+    unsigned char *tx;
+    char *iso;
+    int fd;
+    uint8_t port;
+    uint64_t lba;
+
+    fd = prepare_iso(ATAPI_SECTOR_SIZE * CDROM_RA_SECTORS, &tx, &iso);
+    ahci = ahci_boot_and_enable("-drive if=none,id=drive0,file=%s,format=raw "
+                                "-M q35 "
+                                "-device ide-cd,drive=drive0,readahead=512 ",
+                                iso);
+    port = ahci_port_select(ahci);
+
+    /* Well past the four segments of the cache, up to the end of the disc */
+    lba = ahci_cdrom_read_seq(ahci, port, tx, 0,
+                              CDROM_RA_SECTORS / CDROM_RA_CHUNK);
+    ahci_cdrom_read(ahci, port, CMD_ATAPI_READ_10, tx, lba,
+                    CDROM_RA_SECTORS - lba);
+
+    /* Seek back to sectors that were evicted, then stream from there */
+    ahci_cdrom_read(ahci, port, CMD_ATAPI_READ_12, tx, 100, 40);
+    ahci_cdrom_read_seq(ahci, port, tx, 140, 8);
+
+    g_free(tx);
+    ahci_shutdown(ahci);
+    remove_iso(fd, iso);
+}
+
+static void test_cdrom_readahead_change(void)
+{
+    AHCIQState *ahci;
+    unsigned char *tx, *tx2;
+    char *iso, *iso2;
+    int fd, fd2;
+    uint8_t port, sense, asc;
+    QDict *rsp;
+
+    fd = prepare_iso(ATAPI_SECTOR_SIZE * CDROM_RA_SECTORS, &tx, &iso);
+    fd2 = prepare_iso(ATAPI_SECTOR_SIZE * CDROM_RA_SECTORS, &tx2, &iso2);
+    ahci = ahci_boot_and_enable("-drive if=none,id=drive0,file=%s,format=raw "
+                                "-M q35 "
+                                "-device ide-cd,id=cd0,drive=drive0,"
+                                "readahead=512 ", iso);
+    port = ahci_port_select(ahci);
+
+    /* Fill the cache with the first disc and get more of it loading */
+    ahci_cdrom_read_seq(ahci, port, tx, 0, 4);
+
+    qtest_qmp_send(ahci->parent->qts, "{'execute': 'blockdev-change-medium', "
+                   "'arguments': {'id': 'cd0', 'filename': %s, "
+                                 "'format': 'raw'}}", iso2);
+    rsp = qtest_qmp_receive_success(ahci->parent->qts, NULL, NULL);
+    qobject_unref(rsp);
+
+    ahci_atapi_test_ready(ahci, port, false, SENSE_NOT_READY);
+    ahci_atapi_get_sense(ahci, port, &sense, &asc);
+    g_assert_cmpuint(sense, ==, SENSE_NOT_READY);
+    ahci_atapi_test_ready(ahci, port, false, SENSE_UNIT_ATTENTION);
+    ahci_atapi_get_sense(ahci, port, &sense, &asc);
+    g_assert_cmpuint(sense, ==, SENSE_UNIT_ATTENTION);
+
+    /* Sectors cached or prefetched from the first disc must not be used */
+    ahci_cdrom_read_seq(ahci, port, tx2, 4 * CDROM_RA_CHUNK, 4);
+    ahci_cdrom_read_seq(ahci, port, tx2, 0, 4);
+
+    g_free(tx);
+    g_free(tx2);
+    ahci_shutdown(ahci);
+    remove_iso(fd, iso);
+    remove_iso(fd2, iso2);
+}
+
 /******************************************************************************/
 /* AHCI I/O Test Matrix Definitions                                           */
 
@@ -1943,6 +2055,9 @@ int main(int argc, char **argv)
 
     qtest_add_func("/ahci/cdrom/pio/bcl", test_atapi_bcl);
     qtest_add_func("/ahci/cdrom/eject", test_atapi_tray);
+    qtest_add_func("/ahci/cdrom/readahead", test_cdrom_readahead);
+    qtest_add_func("/ahci/cdrom/readahead/change",
+                   test_cdrom_readahead_change);
 
     ret = g_test_run();
 
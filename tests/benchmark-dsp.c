@@ -0,0 +1,320 @@
+/*
+ * QEMU MCPX APU DSP56300 speed benchmark and conformance test
+ *
+ * Runs frames of a DSP image through dsp_run like the APU does. An image
+ * captured with CAPTURE_DSP_FRAMES in mcpx_apu.c can be passed in the
+ * MCPX_DSP_IMAGE environment variable, otherwise a small synthetic GP
+ * program is used. The output of every frame is hashed and checked against
+ * the hashes in MCPX_DSP_GOLDEN, or against the known result of the
+ * synthetic program. MCPX_DSP_GOLDEN_OUT writes the hashes of this run.
+ * The conformance run also checks every block the DSP replays against the
+ * interpreter.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "hw/xbox/dsp/dsp.h"
+#include "hw/xbox/dsp/dsp_image.h"
+#include "hw/xbox/nv2a/xxhash.h"
+
+/* As run by mcpx_apu.c, 160 MHz at 1500 frames per second */
+#define DSP_CYCLES_PER_FRAME (160000000 / 1500)
+#define FRAME_RATE 1500
+
+#define SYNTHETIC_FRAMES 64
+#define SYNTHETIC_SCRATCH_SIZE 4096
+#define SYNTHETIC_DMA_NODE 0x800
+/* Combined hash of all frames of the synthetic program */
+#define SYNTHETIC_HASH 0x5a9e204fb613a0c1ULL
+
+static struct {
+    /* Loaded image */
+    gchar *data;
+    const DSPImageHeader *image;
+    const uint8_t *scratch_image;
+    const uint32_t (*mixbuffers)[DSP_MIXBUFFER_SIZE];
+    unsigned int num_frames;
+    bool synthetic;
+
+    /* State of the current run */
+    DSPState *dsp;
+    uint8_t *scratch;
+    GByteArray *fifo_out;
+} bench;
+
+/*
+ * Squares the mixbuffer into Y memory, then DMAs the first 64 words of it
+ * to output FIFO 0, over and over:
+ *
+ *     move #$1400,r0
+ *     move #0,r4
+ *     do #$400,p:$0008
+ *     move x:(r0)+,x0
+ *     mpy +x0,x0,a
+ *     move a,y:(r4)+
+ *     move #$800,x0
+ *     move x0,x:$ffffd4    ; DMA next block
+ *     move #1,x0
+ *     move x0,x:$ffffd6    ; DMA control, start
+ *     jmp p:$0000
+ */
+static const uint32_t synthetic_program[] = {
+    0x60f400, 0x001400,
+    0x64f400, 0x000000,
+    0x060084, 0x000008,
+    0x44d800,
+    0x200080,
+    0x5e5c00,
+    0x44f400, 0x000800,
+    0x447000, 0xffffd4,
+    0x44f400, 0x000001,
+    0x447000, 0xffffd6,
+    0x0c0000,
+};
+
+static const uint32_t synthetic_dma_node[] = {
+    0x004000,   /* next block: end of list */
+    0x001802,   /* 24 bit lsb, FIFO 0, DSP to buffer */
+    0x000040,   /* count */
+    0x001800,   /* y:$0000 */
+    0, 0, 0,
+};
+
+static void build_synthetic_image(void)
+{
+    size_t size = sizeof(DSPImageHeader) + SYNTHETIC_SCRATCH_SIZE
+                  + SYNTHETIC_FRAMES * sizeof(bench.mixbuffers[0]);
+    DSPImageHeader *image;
+    uint32_t (*mixbuffers)[DSP_MIXBUFFER_SIZE];
+    unsigned int frame, i;
+
+    bench.data = g_malloc0(size);
+    image = (DSPImageHeader *)bench.data;
+    image->magic = DSP_IMAGE_MAGIC;
+    image->num_frames = SYNTHETIC_FRAMES;
+    image->scratch_size = SYNTHETIC_SCRATCH_SIZE;
+    memcpy(image->pram, synthetic_program, sizeof(synthetic_program));
+    memcpy(&image->xram[SYNTHETIC_DMA_NODE], synthetic_dma_node,
+           sizeof(synthetic_dma_node));
+
+    mixbuffers = (void *)(bench.data + sizeof(DSPImageHeader)
+                          + SYNTHETIC_SCRATCH_SIZE);
+    for (frame = 0; frame < SYNTHETIC_FRAMES; frame++) {
+        for (i = 0; i < DSP_MIXBUFFER_SIZE; i++) {
+            mixbuffers[frame][i] = ((frame * DSP_MIXBUFFER_SIZE + i) * 0x1234)
+                                   & 0xffffff;
+        }
+    }
+
+    bench.synthetic = true;
+}
+
+static void load_image(void)
+{
+    const char *path = getenv("MCPX_DSP_IMAGE");
+    gsize length;
+
+    if (path) {
+        GError *err = NULL;
+        if (!g_file_get_contents(path, &bench.data, &length, &err)) {
+            g_printerr("%s\n", err->message);
+            exit(1);
+        }
+    } else {
+        build_synthetic_image();
+        length = sizeof(DSPImageHeader) + SYNTHETIC_SCRATCH_SIZE
+                 + SYNTHETIC_FRAMES * sizeof(bench.mixbuffers[0]);
+    }
+
+    bench.image = (const DSPImageHeader *)bench.data;
+    g_assert(length >= sizeof(DSPImageHeader));
+    g_assert(bench.image->magic == DSP_IMAGE_MAGIC);
+    g_assert(length >= sizeof(DSPImageHeader) + bench.image->scratch_size);
+
+    bench.scratch_image = (const uint8_t *)bench.data + sizeof(DSPImageHeader);
+    bench.mixbuffers = (const void *)(bench.scratch_image
+                                      + bench.image->scratch_size);
+
+    /* Images of unfinished captures have no frame count */
+    bench.num_frames = (length - sizeof(DSPImageHeader)
+                        - bench.image->scratch_size)
+                       / sizeof(bench.mixbuffers[0]);
+    if (bench.image->num_frames) {
+        bench.num_frames = MIN(bench.num_frames, bench.image->num_frames);
+    }
+    g_assert(bench.num_frames > 0);
+
+    bench.scratch = g_malloc(bench.image->scratch_size);
+    bench.fifo_out = g_byte_array_new();
+}
+
+static void scratch_rw(void *opaque, uint8_t *ptr, uint32_t addr, size_t len,
+                       bool dir)
+{
+    g_assert(addr + len <= bench.image->scratch_size);
+    if (dir) {
+        memcpy(&bench.scratch[addr], ptr, len);
+    } else {
+        memcpy(ptr, &bench.scratch[addr], len);
+    }
+}
+
+static void fifo_rw(void *opaque, uint8_t *ptr, unsigned int index,
+                    size_t len, bool dir)
+{
+    if (dir) {
+        g_byte_array_append(bench.fifo_out, ptr, len);
+    } else {
+        /* Input FIFOs are not part of the image */
+        memset(ptr, 0, len);
+    }
+}
+
+/* Put a fresh DSP in the state of the image */
+static void bench_start(void)
+{
+    unsigned int i;
+
+    bench.dsp = dsp_init(NULL, scratch_rw, fifo_rw);
+    for (i = 0; i < DSP_PRAM_SIZE; i++) {
+        dsp_write_memory(bench.dsp, 'P', i, bench.image->pram[i]);
+    }
+    for (i = 0; i < DSP_XRAM_SIZE; i++) {
+        dsp_write_memory(bench.dsp, 'X', i, bench.image->xram[i]);
+    }
+    for (i = 0; i < DSP_YRAM_SIZE; i++) {
+        dsp_write_memory(bench.dsp, 'Y', i, bench.image->yram[i]);
+    }
+    memcpy(bench.scratch, bench.scratch_image, bench.image->scratch_size);
+    g_byte_array_set_size(bench.fifo_out, 0);
+}
+
+static void bench_stop(void)
+{
+    dsp_destroy(bench.dsp);
+    bench.dsp = NULL;
+}
+
+static void run_frame(unsigned int frame)
+{
+    unsigned int i;
+
+    for (i = 0; i < DSP_MIXBUFFER_SIZE; i++) {
+        dsp_write_memory(bench.dsp, 'X', DSP_MIXBUFFER_BASE + i,
+                         bench.mixbuffers[frame][i]);
+    }
+    dsp_start_frame(bench.dsp);
+    dsp_run(bench.dsp, DSP_CYCLES_PER_FRAME);
+}
+
+/* Hash of the FIFO output of a frame and the memory it left behind */
+static uint64_t frame_hash(unsigned int frame)
+{
+    uint32_t mem[DSP_XRAM_SIZE + DSP_YRAM_SIZE];
+    uint64_t hash;
+    unsigned int i;
+
+    for (i = 0; i < DSP_XRAM_SIZE; i++) {
+        mem[i] = dsp_read_memory(bench.dsp, 'X', i);
+    }
+    for (i = 0; i < DSP_YRAM_SIZE; i++) {
+        mem[DSP_XRAM_SIZE + i] = dsp_read_memory(bench.dsp, 'Y', i);
+    }
+
+    hash = XXH64(mem, sizeof(mem), frame);
+    hash = XXH64(bench.scratch, bench.image->scratch_size, hash);
+    return XXH64(bench.fifo_out->data, bench.fifo_out->len, hash);
+}
+
+static void test_dsp_conformance(void)
+{
+    const char *golden_path = getenv("MCPX_DSP_GOLDEN");
+    const char *golden_out_path = getenv("MCPX_DSP_GOLDEN_OUT");
+    uint64_t *hashes = g_new(uint64_t, bench.num_frames);
+    unsigned int frame;
+
+    bench_start();
+    dsp_set_block_verify(bench.dsp, true);
+    for (frame = 0; frame < bench.num_frames; frame++) {
+        run_frame(frame);
+        hashes[frame] = frame_hash(frame);
+        g_byte_array_set_size(bench.fifo_out, 0);
+    }
+    bench_stop();
+
+    if (golden_out_path) {
+        GError *err = NULL;
+        if (!g_file_set_contents(golden_out_path, (gchar *)hashes,
+                                 bench.num_frames * sizeof(uint64_t), &err)) {
+            g_printerr("%s\n", err->message);
+            exit(1);
+        }
+    }
+
+    if (golden_path) {
+        gchar *data;
+        gsize length;
+        GError *err = NULL;
+        if (!g_file_get_contents(golden_path, &data, &length, &err)) {
+            g_printerr("%s\n", err->message);
+            exit(1);
+        }
+        g_assert_cmpuint(length, ==, bench.num_frames * sizeof(uint64_t));
+        for (frame = 0; frame < bench.num_frames; frame++) {
+            uint64_t golden = ((uint64_t *)data)[frame];
+            if (hashes[frame] != golden) {
+                g_printerr("Frame %u differs from %s\n", frame, golden_path);
+            }
+            g_assert_cmphex(hashes[frame], ==, golden);
+        }
+        g_free(data);
+    } else if (bench.synthetic) {
+        g_assert_cmphex(XXH64(hashes, bench.num_frames * sizeof(uint64_t), 0),
+                        ==, SYNTHETIC_HASH);
+    }
+
+    g_free(hashes);
+}
+
+static void test_dsp_speed(void)
+{
+    uint64_t frames = 0, instructions = 0, cycles = 0;
+    unsigned int frame;
+
+    g_test_timer_start();
+    do {
+        uint64_t run_instructions, run_cycles;
+
+        bench_start();
+        for (frame = 0; frame < bench.num_frames; frame++) {
+            run_frame(frame);
+            g_byte_array_set_size(bench.fifo_out, 0);
+        }
+        dsp_get_counters(bench.dsp, &run_instructions, &run_cycles);
+        bench_stop();
+
+        frames += bench.num_frames;
+        instructions += run_instructions;
+        cycles += run_cycles;
+    } while (g_test_timer_elapsed() < 5.0);
+
+    g_print("Ran %" PRIu64 " frames (%" PRIu64 " instructions, %" PRIu64
+            " cycles) in %.2f secs: ", frames, instructions, cycles,
+            g_test_timer_last());
+    g_print("%.2f MIPS, %.2fx real time\n",
+            instructions / g_test_timer_last() / 1000000.0,
+            frames / g_test_timer_last() / FRAME_RATE);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    load_image();
+
+    g_test_add_func("/mcpx/dsp/conformance", test_dsp_conformance);
+    g_test_add_func("/mcpx/dsp/run-speed", test_dsp_speed);
+
+    return g_test_run();
+}
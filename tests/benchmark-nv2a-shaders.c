@@ -0,0 +1,140 @@
+/*
+ * QEMU Geforce NV2A shader generation speed benchmark
+ *
+ * Generates GLSL for a corpus of ShaderStates without compiling it. A corpus
+ * captured with DEBUG_NV2A_SHADER_CAPTURE can be passed in the
+ * NV2A_SHADER_CORPUS environment variable, otherwise a small set of
+ * synthetic states is used.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * (at your option) any later version.  See the COPYING file in the
+ * top-level directory.
+ */
+#include "qemu/osdep.h"
+#include "hw/xbox/nv2a/nv2a_shaders.h"
+
+static GArray *corpus;
+
+static void vp_token(uint32_t *token, int mac, int out_address, int out_mask,
+                     int v, int c, bool final)
+{
+    /* A = v[v], B = c[c], C = R0, all with .xyzw swizzles */
+    token[0] = 0;
+    token[1] = (mac << 21) | (c << 13) | (v << 9) | 0x1B;
+    token[2] = (2 << 26) | (0x1B << 17) | (3 << 11) | (0x1B << 2);
+    token[3] = (1 << 28) | (out_mask << 12) | (1 << 11) | (out_address << 3)
+               | final;
+}
+
+static void add_synthetic_states(void)
+{
+    int i;
+    ShaderState state;
+
+    memset(&state, 0, sizeof(state));
+
+    /* Modulate texture 0 with diffuse */
+    state.psh.combiner_control = 1;
+    state.psh.shader_stage_program = 0x1;
+    state.psh.rgb_inputs[0] = 0x08040000;
+    state.psh.rgb_outputs[0] = 0x000000C0;
+    state.psh.alpha_inputs[0] = 0x18140000;
+    state.psh.alpha_outputs[0] = 0x000000C0;
+    state.polygon_front_mode = POLY_MODE_FILL;
+    state.polygon_back_mode = POLY_MODE_FILL;
+    state.primitive_mode = PRIM_TYPE_TRIANGLES;
+
+    /* Fixed function variants */
+    state.fixed_function = true;
+    g_array_append_val(corpus, state);
+
+    state.lighting = true;
+    state.light[0] = LIGHT_INFINITE;
+    state.light[1] = LIGHT_LOCAL;
+    g_array_append_val(corpus, state);
+
+    state.fog_enable = true;
+    state.fog_mode = FOG_MODE_EXP;
+    state.foggen = FOGGEN_RADIAL;
+    state.texgen[0][0] = TEXGEN_SPHERE_MAP;
+    state.texgen[0][1] = TEXGEN_SPHERE_MAP;
+    state.primitive_mode = PRIM_TYPE_QUADS;
+    g_array_append_val(corpus, state);
+
+    /* Vertex program transforming position, passing diffuse and T0 */
+    memset(&state, 0, sizeof(state));
+    state.psh.combiner_control = 1;
+    state.psh.rgb_inputs[0] = 0x04000000;
+    state.psh.rgb_outputs[0] = 0x000000C0;
+    state.polygon_front_mode = POLY_MODE_FILL;
+    state.polygon_back_mode = POLY_MODE_FILL;
+    state.primitive_mode = PRIM_TYPE_TRIANGLE_STRIP;
+    state.vertex_program = true;
+    for (i = 0; i < 4; i++) {
+        vp_token(state.program_data[i], 7 /* DP4 */, 0, 8 >> i, 0, 96 + i,
+                 false);
+    }
+    vp_token(state.program_data[4], 1 /* MOV */, 3, 0xF, 3, 0, false);
+    vp_token(state.program_data[5], 1 /* MOV */, 9, 0xF, 9, 0, true);
+    state.program_length = 6;
+    g_array_append_val(corpus, state);
+}
+
+static void load_corpus(void)
+{
+    const char *path = getenv("NV2A_SHADER_CORPUS");
+    corpus = g_array_new(false, false, sizeof(ShaderState));
+
+    if (path) {
+        gchar *data;
+        gsize length;
+        GError *err = NULL;
+        if (!g_file_get_contents(path, &data, &length, &err)) {
+            g_printerr("%s\n", err->message);
+            exit(1);
+        }
+        g_assert(length % sizeof(ShaderState) == 0);
+        g_array_append_vals(corpus, data, length / sizeof(ShaderState));
+        g_free(data);
+    }
+
+    if (corpus->len == 0) {
+        add_synthetic_states();
+    }
+}
+
+static void test_shader_generation_speed(void)
+{
+    size_t bytes = 0, states = 0;
+    int i;
+
+    g_test_timer_start();
+    do {
+        for (i = 0; i < corpus->len; i++) {
+            MString *vsh, *psh, *gsh;
+            generate_shader_code(&g_array_index(corpus, ShaderState, i),
+                                 &vsh, &psh, &gsh);
+            bytes += mstring_get_length(vsh) + mstring_get_length(psh);
+            if (gsh) {
+                bytes += mstring_get_length(gsh);
+            }
+            mstring_arena_reset();
+        }
+        states += corpus->len;
+    } while (g_test_timer_elapsed() < 5.0);
+
+    g_print("Generated %zu shader states (%zu bytes of GLSL) in %.2f secs: ",
+            states, bytes, g_test_timer_last());
+    g_print("%.2f states/sec\n", states / g_test_timer_last());
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    load_corpus();
+
+    g_test_add_func("/nv2a/shaders/generate-speed",
+                    test_shader_generation_speed);
+
+    return g_test_run();
+}
@@ -984,6 +984,7 @@ static void ahci_atapi_command_set_offset(AHCICommand *cmd, uint64_t lba)
 
     switch (cbd[0]) {
     case CMD_ATAPI_READ_10:
+    case CMD_ATAPI_READ_12:
     case CMD_ATAPI_READ_CD:
         g_assert_cmpuint(lba, <=, UINT32_MAX);
         stl_be_p(&cbd[2], lba);
@@ -1052,6 +1053,10 @@ static void ahci_atapi_set_size(AHCICommand *cmd, uint64_t xbytes)
         g_assert_cmpuint(nsectors, <=, UINT16_MAX);
         stw_be_p(&cbd[7], nsectors);
         break;
+    case CMD_ATAPI_READ_12:
+        g_assert_cmpuint(nsectors, <=, UINT32_MAX);
+        stl_be_p(&cbd[6], nsectors);
+        break;
     case CMD_ATAPI_READ_CD:
         /* 24bit BE store */
         g_assert_cmpuint(nsectors, <, 1ULL << 24);
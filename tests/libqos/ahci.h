@@ -291,6 +291,7 @@ enum {
     CMD_ATAPI_REQUEST_SENSE   = 0x03,
     CMD_ATAPI_START_STOP_UNIT = 0x1b,
     CMD_ATAPI_READ_10         = 0x28,
+    CMD_ATAPI_READ_12         = 0xa8,
     CMD_ATAPI_READ_CD         = 0xbe,
 };
 
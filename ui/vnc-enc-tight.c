@@ -817,6 +817,23 @@ static int tight_init_stream(VncState *vs, int stream_id,
     return 0;
 }
 
+/*
+ * Compression control bits to reset a stream before it is used for a
+ * rectangle, if rectangles must be decodable on their own
+ */
+static uint8_t tight_reset_stream(VncState *vs, int stream_id)
+{
+    z_streamp zstream = &vs->tight.stream[stream_id];
+
+    if (!vs->tight.reset_streams) {
+        return 0;
+    }
+    if (zstream->opaque != NULL) {
+        deflateReset(zstream);
+    }
+    return 1 << stream_id;
+}
+
 static void tight_send_compact_size(VncState *vs, size_t len)
 {
     int lpc = 0;
@@ -926,7 +943,8 @@ static int send_full_color_rect(VncState *vs, int x, int y, int w, int h)
     }
 #endif
 
-    vnc_write_u8(vs, stream << 4); /* no flushing, no filter */
+    /* no filter */
+    vnc_write_u8(vs, (stream << 4) | tight_reset_stream(vs, stream));
 
     if (vs->tight.pixel24) {
         tight_pack24(vs, vs->tight.tight.buffer, w * h, &vs->tight.tight.offset);
@@ -982,7 +1000,8 @@ static int send_mono_rect(VncState *vs, int x, int y,
 
     bytes = DIV_ROUND_UP(w, 8) * h;
 
-    vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
+    vnc_write_u8(vs, ((stream | VNC_TIGHT_EXPLICIT_FILTER) << 4) |
+                 tight_reset_stream(vs, stream));
     vnc_write_u8(vs, VNC_TIGHT_FILTER_PALETTE);
     vnc_write_u8(vs, 1);
 
@@ -1048,7 +1067,8 @@ static bool send_gradient_rect(VncState *vs, int x, int y, int w, int h)
         return send_full_color_rect(vs, x, y, w, h);
     }
 
-    vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
+    vnc_write_u8(vs, ((stream | VNC_TIGHT_EXPLICIT_FILTER) << 4) |
+                 tight_reset_stream(vs, stream));
     vnc_write_u8(vs, VNC_TIGHT_FILTER_GRADIENT);
 
     buffer_reserve(&vs->tight.gradient, w * 3 * sizeof (int));
@@ -1090,7 +1110,8 @@ static int send_palette_rect(VncState *vs, int x, int y,
 
     colors = palette_size(palette);
 
-    vnc_write_u8(vs, (stream | VNC_TIGHT_EXPLICIT_FILTER) << 4);
+    vnc_write_u8(vs, ((stream | VNC_TIGHT_EXPLICIT_FILTER) << 4) |
+                 tight_reset_stream(vs, stream));
     vnc_write_u8(vs, VNC_TIGHT_FILTER_PALETTE);
     vnc_write_u8(vs, colors - 1);
 
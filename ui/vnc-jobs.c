@@ -50,17 +50,58 @@
  * its own output buffer.
  * When the encoding job is done, the worker thread will hold the output lock
  * and copy its output buffer in vs->output.
+ *
+ * Jobs are still taken one at a time, which keeps the updates of a client in
+ * order, but the worker splits the rectangles of a job into bands and has a
+ * pool of encoder threads encode them in parallel while it holds the display
+ * lock. Each encoder has its own encoding state and output buffer, and the
+ * bands are sent in their original order. This is only done for encodings
+ * whose rectangles can be decoded on their own: tight resets its zlib
+ * streams for every rectangle then, zlib and ZRLE are encoded in sequence.
  */
 
+/* Encoders, including the worker thread */
+#define VNC_MAX_ENCODERS 8
+
+/* Height of the bands, matching the lossy rectangle grid */
+#define VNC_TILE_LINES VNC_STAT_RECT
+
+typedef struct VncTile {
+    int x, y, w, h;
+    int n_rectangles;
+    /* Kept allocated across jobs, reset once written to the client */
+    Buffer output;
+} VncTile;
+
+typedef struct VncJobQueue VncJobQueue;
+
+typedef struct VncEncoder {
+    VncJobQueue *queue;
+    QemuThread thread;
+    QemuSemaphore start;
+    VncState vs;
+} VncEncoder;
+
 struct VncJobQueue {
     QemuCond cond;
     QemuMutex mutex;
     QemuThread thread;
     bool exit;
     QTAILQ_HEAD(, VncJob) jobs;
-};
 
-typedef struct VncJobQueue VncJobQueue;
+    /* encoders[0] is the worker thread itself */
+    VncEncoder encoders[VNC_MAX_ENCODERS];
+    int num_encoders;
+    QemuSemaphore tiles_done;
+
+    /* The job being encoded in tiles */
+    VncJob *tile_job;
+    VncState *tile_vs;
+    VncTile *tiles;
+    int num_tiles;
+    int max_tiles;
+    int next_tile;
+};
 
 /*
  * We use a single global queue, but most of the functions are
@@ -201,6 +242,164 @@ static void vnc_async_encoding_end(VncState *orig, VncState *local)
     orig->lossy_rect = local->lossy_rect;
 }
 
+static bool vnc_job_can_tile(VncJobQueue *queue, VncState *vs)
+{
+    if (queue->num_encoders < 2) {
+        return false;
+    }
+
+    switch (vs->vnc_encoding) {
+    case VNC_ENCODING_ZLIB:
+    case VNC_ENCODING_ZRLE:
+    case VNC_ENCODING_ZYWRLE:
+        /* One zlib stream spans all the rectangles */
+        return false;
+    default:
+        return true;
+    }
+}
+
+static void vnc_job_add_tile(VncJobQueue *queue, int x, int y, int w, int h)
+{
+    VncTile *tile;
+
+    if (queue->num_tiles == queue->max_tiles) {
+        int i = queue->max_tiles;
+
+        queue->max_tiles = MAX(queue->max_tiles * 2, 64);
+        queue->tiles = g_renew(VncTile, queue->tiles, queue->max_tiles);
+        for (; i < queue->max_tiles; i++) {
+            buffer_init(&queue->tiles[i].output, "vnc-tile-output");
+        }
+    }
+
+    tile = &queue->tiles[queue->num_tiles++];
+    tile->x = x;
+    tile->y = y;
+    tile->w = w;
+    tile->h = h;
+    tile->n_rectangles = 0;
+}
+
+/* Split the rectangles of a job into bands along the lossy grid */
+static void vnc_job_split(VncJobQueue *queue, VncJob *job)
+{
+    VncRectEntry *entry;
+
+    queue->num_tiles = 0;
+    QLIST_FOREACH(entry, &job->rectangles, next) {
+        int y = entry->rect.y;
+        int end = entry->rect.y + entry->rect.h;
+
+        while (y < end) {
+            int next = MIN(QEMU_ALIGN_DOWN(y, VNC_TILE_LINES) + VNC_TILE_LINES,
+                           end);
+            vnc_job_add_tile(queue, entry->rect.x, y, entry->rect.w,
+                             next - y);
+            y = next;
+        }
+    }
+}
+
+/* Encode tiles of the current job until there are none left */
+static void vnc_encode_tiles(VncEncoder *enc)
+{
+    VncJobQueue *queue = enc->queue;
+    VncState *orig = queue->tile_vs;
+    VncState *vs = &enc->vs;
+    int i;
+
+    vs->vnc_encoding = orig->vnc_encoding;
+    vs->features = orig->features;
+    vs->vd = orig->vd;
+    vs->lossy_rect = orig->lossy_rect;
+    vs->write_pixels = orig->write_pixels;
+    vs->client_pf = orig->client_pf;
+    vs->client_be = orig->client_be;
+    vs->hextile = orig->hextile;
+    vs->tight.type = orig->tight.type;
+    vs->tight.quality = orig->tight.quality;
+    vs->tight.compression = orig->tight.compression;
+    vs->tight.pixel24 = orig->tight.pixel24;
+    vs->tight.reset_streams = true;
+
+    while ((i = atomic_fetch_inc(&queue->next_tile)) < queue->num_tiles) {
+        VncTile *tile = &queue->tiles[i];
+        int n;
+
+        if (queue->tile_job->vs->ioc == NULL) {
+            /* Client is gone, the job will be dropped */
+            break;
+        }
+
+        n = vnc_send_framebuffer_update(vs, tile->x, tile->y,
+                                        tile->w, tile->h);
+        tile->n_rectangles = MAX(n, 0);
+        buffer_reserve(&tile->output, vs->output.offset);
+        buffer_append(&tile->output, vs->output.buffer, vs->output.offset);
+        buffer_reset(&vs->output);
+    }
+}
+
+static void *vnc_encoder_thread(void *arg)
+{
+    VncEncoder *enc = arg;
+
+    for (;;) {
+        qemu_sem_wait(&enc->start);
+        if (atomic_read(&enc->queue->exit)) {
+            break;
+        }
+        vnc_encode_tiles(enc);
+        qemu_sem_post(&enc->queue->tiles_done);
+    }
+    return NULL;
+}
+
+/*
+ * Encode the rectangles of a job with all encoders, and append them to the
+ * output of vs in order. Returns the number of rectangles sent, or -1 if the
+ * client disconnected meanwhile.
+ */
+static int vnc_job_encode_tiles(VncJobQueue *queue, VncJob *job,
+                                VncState *vs)
+{
+    VncRectEntry *entry, *tmp;
+    int n_rectangles = 0;
+    int i;
+
+    vnc_job_split(queue, job);
+    QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
+        g_free(entry);
+    }
+    QLIST_INIT(&job->rectangles);
+
+    queue->tile_job = job;
+    queue->tile_vs = vs;
+    atomic_set(&queue->next_tile, 0);
+    for (i = 1; i < queue->num_encoders; i++) {
+        qemu_sem_post(&queue->encoders[i].start);
+    }
+    vnc_encode_tiles(&queue->encoders[0]);
+    for (i = 1; i < queue->num_encoders; i++) {
+        qemu_sem_wait(&queue->tiles_done);
+    }
+
+    if (job->vs->ioc == NULL) {
+        n_rectangles = -1;
+    }
+    for (i = 0; i < queue->num_tiles; i++) {
+        VncTile *tile = &queue->tiles[i];
+
+        if (n_rectangles >= 0) {
+            vnc_write(vs, tile->output.buffer, tile->output.offset);
+            n_rectangles += tile->n_rectangles;
+        }
+        buffer_reset(&tile->output);
+    }
+    return n_rectangles;
+}
+
 static int vnc_worker_thread_loop(VncJobQueue *queue)
 {
     VncJob *job;
@@ -249,6 +448,15 @@ static int vnc_worker_thread_loop(VncJobQueue *queue)
     vnc_write_u16(&vs, 0);
 
     vnc_lock_display(job->vs->vd);
+    if (vnc_job_can_tile(queue, &vs)) {
+        n_rectangles = vnc_job_encode_tiles(queue, job, &vs);
+        if (n_rectangles < 0) {
+            vnc_unlock_display(job->vs->vd);
+            /* Copy persistent encoding data */
+            vnc_async_encoding_end(job->vs, &vs);
+            goto disconnected;
+        }
+    }
     QLIST_FOREACH_SAFE(entry, &job->rectangles, next, tmp) {
         int n;
 
@@ -300,15 +508,61 @@ disconnected:
 static VncJobQueue *vnc_queue_init(void)
 {
     VncJobQueue *queue = g_new0(VncJobQueue, 1);
+    int i;
 
     qemu_cond_init(&queue->cond);
     qemu_mutex_init(&queue->mutex);
     QTAILQ_INIT(&queue->jobs);
+
+    queue->num_encoders = MIN(g_get_num_processors(), VNC_MAX_ENCODERS);
+    qemu_sem_init(&queue->tiles_done, 0);
+    for (i = 0; i < queue->num_encoders; i++) {
+        VncEncoder *enc = &queue->encoders[i];
+
+        enc->queue = queue;
+        enc->vs.magic = VNC_MAGIC;
+        buffer_init(&enc->vs.output, "vnc-encoder-output");
+        buffer_init(&enc->vs.tight.tight, "vnc-encoder-tight");
+        buffer_init(&enc->vs.tight.zlib, "vnc-encoder-tight-zlib");
+        buffer_init(&enc->vs.tight.gradient, "vnc-encoder-tight-gradient");
+#ifdef CONFIG_VNC_JPEG
+        buffer_init(&enc->vs.tight.jpeg, "vnc-encoder-tight-jpeg");
+#endif
+#ifdef CONFIG_VNC_PNG
+        buffer_init(&enc->vs.tight.png, "vnc-encoder-tight-png");
+#endif
+        if (i > 0) {
+            qemu_sem_init(&enc->start, 0);
+            qemu_thread_create(&enc->thread, "vnc_encoder", vnc_encoder_thread,
+                               enc, QEMU_THREAD_JOINABLE);
+        }
+    }
     return queue;
 }
 
 static void vnc_queue_clear(VncJobQueue *q)
 {
+    int i;
+
+    for (i = 1; i < q->num_encoders; i++) {
+        qemu_sem_post(&q->encoders[i].start);
+    }
+    for (i = 0; i < q->num_encoders; i++) {
+        VncEncoder *enc = &q->encoders[i];
+
+        if (i > 0) {
+            qemu_thread_join(&enc->thread);
+            qemu_sem_destroy(&enc->start);
+        }
+        vnc_tight_clear(&enc->vs);
+        buffer_free(&enc->vs.output);
+    }
+    qemu_sem_destroy(&q->tiles_done);
+    for (i = 0; i < q->max_tiles; i++) {
+        buffer_free(&q->tiles[i].output);
+    }
+    g_free(q->tiles);
+
     qemu_cond_destroy(&queue->cond);
     qemu_mutex_destroy(&queue->mutex);
     g_free(q);
@@ -50,6 +50,10 @@
 #define VNC_REFRESH_INTERVAL_BASE GUI_REFRESH_INTERVAL_DEFAULT
 #define VNC_REFRESH_INTERVAL_INC  50
 #define VNC_REFRESH_INTERVAL_MAX  GUI_REFRESH_INTERVAL_IDLE
+
+/* Full repaints copied without comparing before checking for changes again */
+#define VNC_FULL_COPY_MAX 8
+
 static const struct timeval VNC_REFRESH_STATS = { 0, 500000 };
 static const struct timeval VNC_REFRESH_LOSSY = { 2, 0 };
 
@@ -645,6 +649,10 @@ static void vnc_dpy_update(DisplayChangeListener *dcl,
     VncDisplay *vd = container_of(dcl, VncDisplay, dcl);
     struct VncSurface *s = &vd->guest;
 
+    if (x <= 0 && y <= 0 &&
+        x + w >= vnc_width(vd) && y + h >= vnc_height(vd)) {
+        s->full_dirty = true;
+    }
     vnc_set_area_dirty(s->dirty, vd, x, y, w, h);
 }
 
@@ -788,6 +796,7 @@ static void vnc_dpy_switch(DisplayChangeListener *dcl,
         vnc_set_area_dirty(vd->guest.dirty, vd, 0, 0,
                            surface_width(surface),
                            surface_height(surface));
+        vd->guest.full_dirty = true;
         return;
     }
 
@@ -2895,16 +2904,102 @@ static void vnc_rect_updated(VncDisplay *vd, int x, int y, struct timeval * tv)
     rect->updated = true;
 }
 
+/* Bytes of a server surface line covered by one dirty bit */
+#define VNC_DIRTY_CHUNK_BYTES (VNC_DIRTY_PIXELS_PER_BIT * VNC_SERVER_FB_BYTES)
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+/* Copy a whole chunk from guest to server if any byte of it differs */
+static bool vnc_sync_chunk(uint8_t *server, const uint8_t *guest)
+{
+    __m128i g0 = _mm_loadu_si128((const __m128i *)guest);
+    __m128i g1 = _mm_loadu_si128((const __m128i *)guest + 1);
+    __m128i g2 = _mm_loadu_si128((const __m128i *)guest + 2);
+    __m128i g3 = _mm_loadu_si128((const __m128i *)guest + 3);
+    __m128i t;
+
+    t = _mm_xor_si128(g0, _mm_loadu_si128((const __m128i *)server));
+    t = _mm_or_si128(t, _mm_xor_si128(g1, _mm_loadu_si128(
+                                          (const __m128i *)server + 1)));
+    t = _mm_or_si128(t, _mm_xor_si128(g2, _mm_loadu_si128(
+                                          (const __m128i *)server + 2)));
+    t = _mm_or_si128(t, _mm_xor_si128(g3, _mm_loadu_si128(
+                                          (const __m128i *)server + 3)));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(t, _mm_setzero_si128())) == 0xFFFF) {
+        return false;
+    }
+
+    _mm_storeu_si128((__m128i *)server, g0);
+    _mm_storeu_si128((__m128i *)server + 1, g1);
+    _mm_storeu_si128((__m128i *)server + 2, g2);
+    _mm_storeu_si128((__m128i *)server + 3, g3);
+    return true;
+}
+#else
+static bool vnc_sync_chunk(uint8_t *server, const uint8_t *guest)
+{
+    uint64_t t = 0;
+    int i;
+
+    for (i = 0; i < VNC_DIRTY_CHUNK_BYTES; i += 8) {
+        t |= ldq_he_p(guest + i) ^ ldq_he_p(server + i);
+    }
+    if (t == 0) {
+        return false;
+    }
+    memcpy(server, guest, VNC_DIRTY_CHUNK_BYTES);
+    return true;
+}
+#endif
+
+/*
+ * Compare the chunks flagged in @dirty, one word of a line's dirty bitmap,
+ * and copy those that differ from @guest to @server in the same pass.
+ * @bytes is what is left of the line from the first chunk of the word.
+ * Returns the flags of the chunks that changed.
+ */
+static unsigned long vnc_sync_chunks(uint8_t *server, const uint8_t *guest,
+                                     unsigned long dirty, int bytes)
+{
+    unsigned long changed = 0;
+
+    QEMU_BUILD_BUG_ON(VNC_DIRTY_CHUNK_BYTES != 64);
+
+    while (dirty) {
+        int bit = ctzl(dirty);
+        int offset = bit * VNC_DIRTY_CHUNK_BYTES;
+        int len = MIN(VNC_DIRTY_CHUNK_BYTES, bytes - offset);
+
+        dirty &= dirty - 1;
+        assert(len > 0);
+        if (len == VNC_DIRTY_CHUNK_BYTES) {
+            if (!vnc_sync_chunk(server + offset, guest + offset)) {
+                continue;
+            }
+        } else {
+            if (memcmp(server + offset, guest + offset, len) == 0) {
+                continue;
+            }
+            memcpy(server + offset, guest + offset, len);
+        }
+        changed |= 1UL << bit;
+    }
+    return changed;
+}
+
 static int vnc_refresh_server_surface(VncDisplay *vd)
 {
     int width = MIN(pixman_image_get_width(vd->guest.fb),
                     pixman_image_get_width(vd->server));
     int height = MIN(pixman_image_get_height(vd->guest.fb),
                      pixman_image_get_height(vd->server));
-    int cmp_bytes, server_stride, line_bytes, guest_ll, guest_stride, y = 0;
+    int chunks = DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
+    int server_stride, line_bytes, guest_ll, guest_stride, y = 0;
     uint8_t *guest_row0 = NULL, *server_row0;
     VncState *vs;
-    int has_dirty = 0;
+    int has_dirty = 0, compared = 0, changed = 0;
+    bool copy_only;
     pixman_image_t *tmpbuf = NULL;
 
     struct timeval tv = { 0, 0 };
@@ -2914,6 +3009,15 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         has_dirty = vnc_update_stats(vd, &tv);
     }
 
+    /*
+     * When the display repainted the whole frame and the last compare of
+     * such a repaint found it all changed, comparing again only costs time:
+     * copy it over. Every VNC_FULL_COPY_MAX repaints we still compare, so
+     * a picture that settles is no longer sent in full.
+     */
+    copy_only = vd->guest.full_dirty && vd->full_change &&
+                vd->full_copies < VNC_FULL_COPY_MAX;
+
     /*
      * Walk through the guest dirty map.
      * Check and copy modified bits from guest to server surface.
@@ -2922,8 +3026,6 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     server_row0 = (uint8_t *)pixman_image_get_data(vd->server);
     server_stride = guest_stride = guest_ll =
         pixman_image_get_stride(vd->server);
-    cmp_bytes = MIN(VNC_DIRTY_PIXELS_PER_BIT * VNC_SERVER_FB_BYTES,
-                    server_stride);
     if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
         int width = pixman_image_get_width(vd->server);
         tmpbuf = qemu_pixman_linebuf_create(VNC_SERVER_FB_FORMAT, width);
@@ -2938,7 +3040,7 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
     line_bytes = MIN(server_stride, guest_ll);
 
     for (;;) {
-        int x;
+        int w;
         uint8_t *guest_ptr, *server_ptr;
         unsigned long offset = find_next_bit((unsigned long *) &vd->guest.dirty,
                                              height * VNC_DIRTY_BPL(&vd->guest),
@@ -2948,9 +3050,8 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
             break;
         }
         y = offset / VNC_DIRTY_BPL(&vd->guest);
-        x = offset % VNC_DIRTY_BPL(&vd->guest);
 
-        server_ptr = server_row0 + y * server_stride + x * cmp_bytes;
+        server_ptr = server_row0 + y * server_stride;
 
         if (vd->guest.format != VNC_SERVER_FB_FORMAT) {
             qemu_pixman_linebuf_fill(tmpbuf, vd->guest.fb, width, 0, y);
@@ -2958,36 +3059,72 @@ static int vnc_refresh_server_surface(VncDisplay *vd)
         } else {
             guest_ptr = guest_row0 + y * guest_stride;
         }
-        guest_ptr += x * cmp_bytes;
 
-        for (; x < DIV_ROUND_UP(width, VNC_DIRTY_PIXELS_PER_BIT);
-             x++, guest_ptr += cmp_bytes, server_ptr += cmp_bytes) {
-            int _cmp_bytes = cmp_bytes;
-            if (!test_and_clear_bit(x, vd->guest.dirty[y])) {
-                continue;
+        if (copy_only) {
+            memcpy(server_ptr, guest_ptr, line_bytes);
+            bitmap_clear(vd->guest.dirty[y], 0, chunks);
+            QTAILQ_FOREACH(vs, &vd->clients, next) {
+                bitmap_set(vs->dirty[y], 0, chunks);
             }
-            if ((x + 1) * cmp_bytes > line_bytes) {
-                _cmp_bytes = line_bytes - x * cmp_bytes;
+            has_dirty += chunks;
+            y++;
+            continue;
+        }
+
+        for (w = 0; w < BITS_TO_LONGS(chunks); w++) {
+            int start = w * BITS_PER_LONG * VNC_DIRTY_CHUNK_BYTES;
+            unsigned long dirty = vd->guest.dirty[y][w];
+            unsigned long updated;
+
+            if (w == BIT_WORD(chunks - 1)) {
+                dirty &= BITMAP_LAST_WORD_MASK(chunks);
             }
-            assert(_cmp_bytes >= 0);
-            if (memcmp(server_ptr, guest_ptr, _cmp_bytes) == 0) {
+            if (!dirty) {
                 continue;
             }
-            memcpy(server_ptr, guest_ptr, _cmp_bytes);
-            if (!vd->non_adaptive) {
-                vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
-                                 y, &tv);
+            vd->guest.dirty[y][w] &= ~dirty;
+            compared += ctpopl(dirty);
+
+            updated = vnc_sync_chunks(server_ptr + start, guest_ptr + start,
+                                      dirty, line_bytes - start);
+            if (!updated) {
+                continue;
             }
+            changed += ctpopl(updated);
             QTAILQ_FOREACH(vs, &vd->clients, next) {
-                set_bit(x, vs->dirty[y]);
+                vs->dirty[y][w] |= updated;
+            }
+            if (!vd->non_adaptive) {
+                while (updated) {
+                    int x = w * BITS_PER_LONG + ctzl(updated);
+                    vnc_rect_updated(vd, x * VNC_DIRTY_PIXELS_PER_BIT,
+                                     y, &tv);
+                    updated &= updated - 1;
+                }
             }
-            has_dirty++;
         }
 
         y++;
     }
     qemu_pixman_image_unref(tmpbuf);
-    return has_dirty;
+
+    if (copy_only) {
+        vd->full_copies++;
+        if (!vd->non_adaptive) {
+            int x;
+            for (y = 0; y < height; y += VNC_STAT_RECT) {
+                for (x = 0; x < width; x += VNC_STAT_RECT) {
+                    vnc_rect_updated(vd, x, y, &tv);
+                }
+            }
+        }
+    } else if (vd->guest.full_dirty) {
+        vd->full_change = compared && changed >= compared - compared / 8;
+        vd->full_copies = 0;
+    }
+    vd->guest.full_dirty = false;
+
+    return has_dirty + changed;
 }
 
 static void vnc_refresh(DisplayChangeListener *dcl)
@@ -126,6 +126,8 @@ struct VncSurface
     VncRectStat stats[VNC_STAT_ROWS][VNC_STAT_COLS];
     pixman_image_t *fb;
     pixman_format_code_t format;
+    /* The display reported the whole surface as changed */
+    bool full_dirty;
 };
 
 typedef enum VncShareMode {
@@ -166,6 +168,9 @@ struct VncDisplay
 
     struct VncSurface guest;   /* guest visible surface (aka ds->surface) */
     pixman_image_t *server;    /* vnc server surface */
+    /* The last compare of a full repaint found nearly every chunk changed */
+    bool full_change;
+    int full_copies;           /* full repaints copied since that compare */
 
     const char *id;
     QTAILQ_ENTRY(VncDisplay) next;
@@ -203,6 +208,8 @@ typedef struct VncTight {
 #endif
     int levels[4];
     z_stream stream[4];
+    /* Reset the zlib streams for every rectangle, to encode them apart */
+    bool reset_streams;
 } VncTight;
 
 typedef struct VncHextile {